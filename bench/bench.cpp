@@ -1,5 +1,7 @@
 #include <benchmark/benchmark.h>
+#include <algorithm>
 #include <docudb.hpp>
+#include <filesystem>
 #include <random>
 #include <string>
 
@@ -113,7 +115,7 @@ void BM_SearchNoIndex(benchmark::State &state)
     for(auto _ : state)
     {
         benchmark::DoNotOptimize(
-            collection.where("$.user", docudb::ops::eq("wario")));
+            collection.find(docudb::query::eq("$.user", "wario")));
     }
 }
 
@@ -131,11 +133,395 @@ void BM_SearchWithIndex(benchmark::State &state)
     for(auto _ : state)
     {
         benchmark::DoNotOptimize(
-            collection.where("user", docudb::ops::eq("wario")));
+            collection.find(docudb::query::eq("user", "wario")));
     }
 }
 
 BENCHMARK(BM_SearchWithIndex)->Arg(10)->Arg(100)->Arg(1000)->Arg(10000)->Threads(4);
 
-BENCHMARK_MAIN();
+struct bench_item
+{
+    std::string name;
+    std::int64_t quantity{0};
+    double price{0};
+    bool available{false};
+};
+
+template <>
+struct docudb::mapping<bench_item>
+{
+    static constexpr auto fields = std::make_tuple(
+        DOCUDB_FIELD(bench_item, name),
+        DOCUDB_FIELD(bench_item, quantity),
+        DOCUDB_FIELD(bench_item, price),
+        DOCUDB_FIELD(bench_item, available));
+};
+
+bench_item MakeItem(std::int64_t i)
+{
+    return bench_item{"item " + std::to_string(i), i, i * 0.5, i % 2 == 0};
+}
+
+// serialize to a json string and store it with body()
+void BM_InsertStructString(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+
+    std::int64_t i{0};
+    for (auto _ : state)
+    {
+        auto item = MakeItem(i++);
+        auto json = std::format(R"({{"name":"{}","quantity":{},"price":{},"available":{}}})",
+                                item.name, item.quantity, item.price, item.available ? "true" : "false");
+        benchmark::DoNotOptimize(collection.doc().body(json));
+    }
+
+    state.SetItemsProcessed(i);
+}
+
+BENCHMARK(BM_InsertStructString);
+
+// serialize straight into the reused buffer with the mapping
+void BM_InsertStructMapped(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+
+    std::int64_t i{0};
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(collection.insert(MakeItem(i++)));
+    }
+
+    state.SetItemsProcessed(i);
+}
+
+BENCHMARK(BM_InsertStructMapped);
+
+// read back each field with the string getters
+void BM_ReadStructString(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+    auto doc = collection.insert(MakeItem(42));
+
+    for (auto _ : state)
+    {
+        bench_item item;
+        item.name = doc.get_string("$.name");
+        item.quantity = doc.get_number("$.quantity");
+        item.price = doc.get_real("$.price");
+        item.available = doc.get_number("$.available") != 0;
+        benchmark::DoNotOptimize(item);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_ReadStructString);
+
+// read all fields with a single statement
+void BM_ReadStructMapped(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+    auto doc = collection.insert(MakeItem(42));
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(doc.as<bench_item>());
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_ReadStructMapped);
+
+// scan a collection while doing some work per document; Arg(1) prefetches on a background thread
+void BM_ScanCursor(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+    for (std::int64_t i = 0; i < 20000; i++)
+        collection.insert(MakeItem(i));
+
+    docudb::cursor_options options;
+    options.prefetch = state.range(0) != 0;
+
+    std::int64_t documents{0};
+    for (auto _ : state)
+    {
+        auto cursor = collection.cursor(docudb::query::gte("$.quantity", 0), options);
+        while (cursor.next())
+        {
+            // stand-in for parsing/transforming the document
+            std::uint64_t h = 1469598103934665603ull;
+            for (int round = 0; round < 8; round++)
+                for (auto c : cursor.body())
+                    h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            benchmark::DoNotOptimize(h);
+            documents++;
+        }
+    }
+
+    state.SetItemsProcessed(documents);
+}
+
+BENCHMARK(BM_ScanCursor)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+struct bench_text
+{
+    std::string text;
+};
+
+template <>
+struct docudb::mapping<bench_text>
+{
+    static constexpr auto fields = std::make_tuple(
+        DOCUDB_FIELD(bench_text, text));
+};
+
+// '%needle%' over every row; Arg(1) uses the SIMD LIKE from use_fast_like, Arg(0) SQLite's
+void BM_LikeContains(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    if (state.range(1))
+        db.use_fast_like();
+    auto collection = db.collection("test");
+
+    std::mt19937 rng{42};
+    std::uniform_int_distribution<int> letter{'a', 'z'};
+    for (std::int64_t i = 0; i < state.range(0); i++)
+    {
+        bench_text item;
+        item.text.resize(200);
+        for (auto &c : item.text)
+            c = static_cast<char>(letter(rng));
+        // 1% of the rows contain the needle
+        if (i % 100 == 0)
+            item.text.replace(150, 6, "Needle");
+        collection.insert(item);
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(collection.count(docudb::query::like("$.text", "%needle%")));
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_LikeContains)->Args({1000000, 0})->Args({1000000, 1})->Unit(benchmark::kMillisecond);
+
+// 100 random documents out of 100000; Arg(1) uses sample(), Arg(0) ORDER BY random() on a second connection
+void BM_Sample(benchmark::State &state)
+{
+    const char *path = "bench_sample.db";
+    std::filesystem::remove(path);
+    {
+        docudb::database db{path};
+        auto collection = db.collection("test");
+        std::vector<std::string> bodies;
+        for (std::int64_t i = 0; i < 100000; i++)
+            bodies.push_back(std::format(R"({{"name":"item{0}","quantity":{0}}})", i));
+        collection.insert_many(bodies);
+    }
+
+    docudb::database db{path};
+    auto collection = db.collection("test");
+    sqlite3 *raw;
+    sqlite3_open(path, &raw);
 
+    for (auto _ : state)
+    {
+        if (state.range(0))
+        {
+            benchmark::DoNotOptimize(collection.sample(100));
+        }
+        else
+        {
+            sqlite3_stmt *stmt;
+            sqlite3_prepare_v2(raw, "SELECT docid FROM [test] ORDER BY random() LIMIT 100;", -1, &stmt, nullptr);
+            std::vector<std::string> ids;
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+                ids.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+            sqlite3_finalize(stmt);
+            benchmark::DoNotOptimize(ids);
+        }
+    }
+
+    sqlite3_close(raw);
+}
+
+BENCHMARK(BM_Sample)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// distinct values of a field over 200000 documents; Arg(1) sketches them, Arg(0) counts them exactly
+void BM_ApproxDistinct(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto collection = db.collection("test");
+    std::vector<std::string> bodies;
+    for (std::int64_t i = 0; i < 200000; i++)
+        bodies.push_back(std::format(R"({{"user":"user{}"}})", i % 50000));
+    collection.insert_many(bodies);
+
+    for (auto _ : state)
+    {
+        if (state.range(0))
+            benchmark::DoNotOptimize(collection.approx_distinct("$.user").estimate());
+        else
+            benchmark::DoNotOptimize(collection.distinct("$.user").size());
+    }
+}
+
+BENCHMARK(BM_ApproxDistinct)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// unindexed range filter over 100000 documents; Arg(1) reads a promoted column, Arg(0) parses the bodies
+void BM_FilterPromoted(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+    std::vector<std::string> bodies;
+    for (std::int64_t i = 0; i < 100000; i++)
+        bodies.push_back(std::format(R"({{"name":"item{0}","tags":["a","b","c"],"quantity":{0},"price":{1}}})", i, i * 0.5));
+    collection.insert_many(bodies);
+    if (state.range(0))
+        collection.promote("quantity", "$.quantity", docudb::column_type::integer, false);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(collection.count(docudb::query::gte("$.quantity", 50000)));
+    }
+}
+
+BENCHMARK(BM_FilterPromoted)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// point lookup by ID among 100000 documents; Arg(1) reads a mirror, Arg(0) runs a prepared query
+void BM_PointLookup(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+    std::vector<std::string> bodies, ids;
+    for (std::int64_t i = 0; i < 100000; i++)
+        bodies.push_back(std::format(R"({{"name":"item{0}","quantity":{0}}})", i));
+    collection.insert_many(bodies);
+    for (auto &&[id] : collection.prepare("SELECT docid FROM test").rows<std::string>())
+        ids.push_back(id);
+
+    auto mirror = db.mirror("test");
+    auto lookup = collection.prepare("SELECT body FROM test WHERE docid = ?1");
+    std::size_t i = 0;
+    for (auto _ : state)
+    {
+        auto const &id = ids[i++ % ids.size()];
+        if (state.range(0))
+        {
+            benchmark::DoNotOptimize(mirror.get(id));
+        }
+        else
+        {
+            lookup.bind(id).step();
+            benchmark::DoNotOptimize(lookup.column<std::string>(0));
+        }
+    }
+}
+
+BENCHMARK(BM_PointLookup)->Arg(0)->Arg(1);
+
+// insert, read and update of a small document; compare runs with and without --pool_allocator
+void BM_SmallDocuments(benchmark::State &state)
+{
+    docudb::database db{":memory:"};
+    auto collection = db.collection("test");
+
+    std::int64_t i{0};
+    for (auto _ : state)
+    {
+        auto doc = collection.doc().body(std::format(R"({{"n":{},"tag":"t{}"}})", i, i % 16));
+        benchmark::DoNotOptimize(collection.doc(doc.id()).body());
+        doc.set("$.n", i + 1);
+        i++;
+    }
+
+    state.SetItemsProcessed(i);
+}
+
+BENCHMARK(BM_SmallDocuments)->Threads(1)->Threads(4);
+
+// point lookups of 200 hot documents on one connection, with a scan of half the table
+// on another; compare --shared_page_cache (2Q) and --shared_page_cache_lru, both with a 4MB budget
+void BM_MixedPageCache(benchmark::State &state)
+{
+    const char *path = "bench_pages.db";
+    std::filesystem::remove(path);
+    docudb::database db{path};
+    auto collection = db.collection("test");
+    std::vector<std::string> bodies;
+    for (std::int64_t i = 0; i < 20000; i++)
+        bodies.push_back(std::format(R"({{"n":{},"text":"{}"}})", i, std::string(200, 'a' + i % 26)));
+    collection.insert_many(bodies);
+
+    std::vector<std::string> hot;
+    for (auto &&[id] : collection.prepare("SELECT docid FROM test ORDER BY random() LIMIT 200").rows<std::string>())
+        hot.push_back(id);
+
+    docudb::database scanner{path};
+    auto scan = scanner.prepare("SELECT count(*) FROM test WHERE rowid BETWEEN ?1 AND ?2 AND body ->> '$.n' >= 0");
+    auto lookup = db.prepare("SELECT body FROM test WHERE docid = ?1");
+
+    auto before = docudb::database::page_cache_statistics();
+    std::int64_t from = 0;
+    std::size_t i = 0;
+    for (auto _ : state)
+    {
+        for (int k = 0; k < 200; ++k)
+        {
+            lookup.bind(hot[i++ % hot.size()]).step();
+            benchmark::DoNotOptimize(lookup.column<std::string>(0));
+        }
+        scan.bind(from, from + 10000).step();
+        benchmark::DoNotOptimize(scan.column<std::int64_t>(0));
+        from = (from + 10000) % 20000;
+    }
+
+    auto after = docudb::database::page_cache_statistics();
+    auto hits = static_cast<double>(after.hits - before.hits);
+    auto misses = static_cast<double>(after.misses - before.misses);
+    if (hits + misses > 0)
+        state.counters["hit_rate"] = hits / (hits + misses);
+    std::filesystem::remove(path);
+}
+
+BENCHMARK(BM_MixedPageCache)->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv)
+{
+    // process-wide, before the first connection
+    auto take_flag = [&](std::string_view flag)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            if (std::string_view{argv[i]} == flag)
+            {
+                std::copy(argv + i + 1, argv + argc, argv + i);
+                --argc;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    if (take_flag("--pool_allocator"))
+        docudb::database::use_pool_allocator();
+    if (take_flag("--shared_page_cache"))
+        docudb::database::use_shared_page_cache({.max_bytes = 4 * 1024 * 1024});
+    if (take_flag("--shared_page_cache_lru"))
+        docudb::database::use_shared_page_cache({.max_bytes = 4 * 1024 * 1024, .scan_resistant = false});
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
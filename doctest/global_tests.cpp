@@ -0,0 +1,107 @@
+// tests installing process-wide SQLite configuration, which cannot be undone: they run in
+// their own executable so that the main suite keeps SQLite's defaults
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+#include <docudb.hpp>
+#include <filesystem>
+#include <random>
+#include <thread>
+
+// a fresh directory under the system temporary directory, removed with its files even when a test fails
+struct temp_directory
+{
+    std::filesystem::path path;
+
+    temp_directory() : path(std::filesystem::temp_directory_path() / std::format("docudb_test_{}", std::random_device{}()))
+    {
+        std::filesystem::create_directories(path);
+    }
+
+    ~temp_directory()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    }
+};
+
+TEST_CASE("database::use_pool_allocator serves SQLite's small allocations from thread caches")
+{
+    // the allocator is process-wide, and can only be replaced while SQLite is not initialized
+    REQUIRE(sqlite3_shutdown() == SQLITE_OK);
+    REQUIRE_THROWS_AS(docudb::database::use_pool_allocator({.max_pooled_size = 1 << 20}), std::invalid_argument);
+    docudb::database::use_pool_allocator();
+    REQUIRE_THROWS_AS(docudb::database::use_pool_allocator(), std::logic_error);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([]
+                             {
+            docudb::database db{":memory:"};
+            auto coll = db.collection("alloc_test");
+            auto insert = coll.prepare("INSERT INTO alloc_test (body) VALUES (json_object('docid', ?1, 'n', ?2))");
+            for (int i = 0; i < 500; ++i)
+                insert.bind(std::format("d{}", i), i).execute();
+            coll.count(docudb::query::gt("$.n", 250)); });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    {
+        docudb::database db{":memory:"};
+        db.lookaside(128, 64);
+        auto coll = db.collection("alloc_test");
+        for (int i = 0; i < 50; ++i)
+            coll.doc().id();
+        // some distributions build SQLite without lookaside, the configuration is then ignored
+        if (!sqlite3_compileoption_used("OMIT_LOOKASIDE"))
+            REQUIRE(db.lookaside_statistics().hits > 0);
+    }
+
+    auto stats = docudb::database::allocator_statistics();
+    REQUIRE(stats.allocations > 0);
+    REQUIRE(stats.frees > 0);
+    REQUIRE(stats.cache_hits > 0);
+    REQUIRE(stats.cache_hits <= stats.allocations);
+    REQUIRE(stats.memory_highwater >= stats.memory_used);
+}
+
+TEST_CASE("database::use_shared_page_cache bounds the pages of every connection together")
+{
+    // process-wide like the allocator, installed while SQLite is not initialized
+    REQUIRE(sqlite3_shutdown() == SQLITE_OK);
+    REQUIRE_THROWS_AS(docudb::database::use_shared_page_cache({.fifo_ratio = 2}), std::invalid_argument);
+    constexpr std::size_t budget = 256 * 1024;
+    docudb::database::use_shared_page_cache({.max_bytes = budget});
+    REQUIRE_THROWS_AS(docudb::database::use_shared_page_cache(), std::logic_error);
+
+    temp_directory dir;
+    auto path = (dir.path / "page_cache_test.db").string();
+    {
+        docudb::database writer{path};
+        auto coll = writer.collection("pages");
+        std::vector<std::string> bodies;
+        for (int i = 0; i < 5000; ++i)
+            bodies.push_back(std::format(R"({{"n":{},"text":"{}"}})", i, std::string(200, 'a' + i % 26)));
+        coll.insert_many(bodies);
+        auto hot = coll.prepare("SELECT docid FROM pages LIMIT 20").rows<std::string>();
+
+        // one connection keeps reading a few documents while another scans the whole table
+        docudb::database reader{path};
+        docudb::database scanner{path};
+        auto lookups = reader.collection("pages");
+        auto scans = scanner.collection("pages");
+        for (int round = 0; round < 5; ++round)
+        {
+            for (auto &&[id] : hot)
+                REQUIRE_FALSE(lookups.doc(id).body().empty());
+            REQUIRE(scans.count(docudb::query::gte("$.n", 0)) == 5000);
+            REQUIRE(docudb::database::page_cache_statistics().bytes <= budget);
+        }
+
+        auto stats = docudb::database::page_cache_statistics();
+        REQUIRE(stats.evictions > 0);
+        REQUIRE(stats.hits > stats.misses);
+    }
+    REQUIRE(docudb::database::page_cache_statistics().bytes == 0);
+}
@@ -1,9 +1,97 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 #include <docudb.hpp>
-
+#ifndef _WIN32
+#include <docudb_remote.hpp>
+#endif
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include <sstream>
+#include <set>
+#include <thread>
+
+using namespace std::string_literals;
 using namespace std::string_view_literals;
 
+struct test_address
+{
+    std::string city;
+    std::optional<std::int32_t> zip;
+};
+
+struct test_person
+{
+    std::string name;
+    std::int64_t age{0};
+    double score{0};
+    bool active{false};
+    test_address address;
+};
+
+template <>
+struct docudb::mapping<test_address>
+{
+    static constexpr auto fields = std::make_tuple(
+        DOCUDB_FIELD(test_address, city),
+        DOCUDB_FIELD(test_address, zip));
+};
+
+template <>
+struct docudb::mapping<test_person>
+{
+    static constexpr auto fields = std::make_tuple(
+        DOCUDB_FIELD(test_person, name),
+        docudb::field("years", &test_person::age),
+        DOCUDB_FIELD(test_person, score),
+        DOCUDB_FIELD(test_person, active),
+        DOCUDB_FIELD(test_person, address));
+};
+
+// the document ID cannot be a mapped field of an inserted struct, nested structs may have one
+static_assert(!docudb::details::json::has_field<test_person>("docid"));
+static_assert(docudb::details::json::has_field<test_person>("years"));
+
+// records the statements reading a table on a connection opened by the test, to check their query plans
+struct query_plans
+{
+    sqlite3 *db;
+    std::string from;
+    std::vector<std::string> statements;
+
+    query_plans(sqlite3 *db, std::string_view table) : db(db), from(std::format("FROM [{}]", table))
+    {
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT, trace, this);
+    }
+
+    ~query_plans()
+    {
+        sqlite3_trace_v2(db, 0, nullptr, nullptr);
+    }
+
+    static int trace(unsigned, void *self, void *stmt, void *)
+    {
+        auto plans = static_cast<query_plans *>(self);
+        auto sql = sqlite3_expanded_sql(static_cast<sqlite3_stmt *>(stmt));
+        if (sql && !std::string_view{sql}.starts_with("EXPLAIN") && std::string_view{sql}.find(plans->from) != std::string_view::npos)
+            plans->statements.emplace_back(sql);
+        sqlite3_free(sql);
+        return 0;
+    }
+
+    // the query plan of the last statement recorded
+    std::string last() const
+    {
+        std::string plan;
+        sqlite3_stmt *stmt;
+        REQUIRE(sqlite3_prepare_v2(db, ("EXPLAIN QUERY PLAN " + statements.back()).c_str(), -1, &stmt, nullptr) == SQLITE_OK);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            plan += reinterpret_cast<char const *>(sqlite3_column_text(stmt, 3)) + "\n"s;
+        sqlite3_finalize(stmt);
+        return plan;
+    }
+};
+
 TEST_CASE("Create a collection and insert a new item")
 {
     docudb::database db{":memory:"};
@@ -492,4 +580,1152 @@ TEST_CASE("db_document::get_object_keys returns all keys of an object at the giv
 
     // Not an object: should throw
     REQUIRE_THROWS_AS(doc.get_object_keys("$.obj.a"), docudb::db_exception);
-}
\ No newline at end of file
+}
+TEST_CASE("db_collection::distinct returns the distinct values of a field")
+{
+    sqlite3 *db;
+    REQUIRE(sqlite3_open(":memory:", &db) == SQLITE_OK);
+    auto coll = docudb::details::open_collection(db, "distinct_test");
+    coll.doc().set("$.type", "fruit"sv).set("$.price", 1);
+    coll.doc().set("$.type", "fruit"sv).set("$.price", 2);
+    coll.doc().set("$.type", "vegetable"sv).set("$.price", 2);
+    coll.doc().set("$.price", 3.5);
+
+    auto types = coll.distinct("$.type");
+    REQUIRE(types.size() == 3);
+    REQUIRE(std::count(types.begin(), types.end(), docudb::db_value{"fruit"}) == 1);
+    REQUIRE(std::count(types.begin(), types.end(), docudb::db_value{nullptr}) == 1);
+
+    // typed values
+    auto prices = coll.distinct("$.price", docudb::query::gt("$.price", 1));
+    REQUIRE(prices.size() == 2);
+    REQUIRE(std::count(prices.begin(), prices.end(), docudb::db_value{std::int64_t{2}}) == 1);
+    REQUIRE(std::count(prices.begin(), prices.end(), docudb::db_value{3.5}) == 1);
+
+    // the generated column is used when the field is indexed
+    coll.index("type", "$.type");
+    query_plans plans{db, "distinct_test"};
+    REQUIRE(coll.distinct("$.type", docudb::query::eq("$.price", 2)).size() == 2);
+    REQUIRE(coll.distinct("$.type", std::nullopt, 1).size() == 1);
+    REQUIRE(plans.last().find("USING INDEX Idx_distinct_test_type") != std::string::npos);
+    coll = {};
+    sqlite3_close(db);
+}
+
+TEST_CASE("db_collection::value_counts returns the most frequent values first")
+{
+    sqlite3 *db;
+    REQUIRE(sqlite3_open(":memory:", &db) == SQLITE_OK);
+    auto coll = docudb::details::open_collection(db, "value_counts_test");
+    coll.doc().set("$.type", "fruit"sv);
+    coll.doc().set("$.type", "vegetable"sv);
+    coll.doc().set("$.type", "fruit"sv);
+    coll.doc().set("$.type", "fruit"sv);
+
+    auto counts = coll.value_counts("$.type");
+    REQUIRE(counts.size() == 2);
+    REQUIRE(counts[0].first == docudb::db_value{"fruit"});
+    REQUIRE(counts[0].second == 3);
+    REQUIRE(counts[1].second == 1);
+
+    coll.index("type", "$.type");
+    query_plans plans{db, "value_counts_test"};
+    auto top = coll.value_counts("$.type", docudb::query::neq("$.type", "fruit"), 1);
+    REQUIRE(top.size() == 1);
+    REQUIRE(top[0].first == docudb::db_value{"vegetable"});
+    REQUIRE(plans.last().find("USING INDEX Idx_value_counts_test_type") != std::string::npos);
+    coll = {};
+    sqlite3_close(db);
+}
+
+TEST_CASE("db_collection::find supports ordering by multiple fields")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("find_order_multi");
+    coll.doc().set("$.name", "bob"sv).set("$.age", 30);
+    coll.doc().set("$.name", "Alice"sv).set("$.age", 20);
+    coll.doc().set("$.name", "alice"sv).set("$.age", 40);
+    coll.doc().set("$.age", 50);
+
+    auto all = docudb::query::gt("$.age", 0);
+
+    // case-insensitive name, then age descending, missing names last
+    auto ordered = coll.find(std::move(all), docudb::query::order_by("$.name", true, docudb::query::nulls::last, docudb::query::collation::nocase).then("$.age", false));
+    REQUIRE(ordered.size() == 4);
+    REQUIRE(ordered[0].doc().get_number("$.age") == 40);
+    REQUIRE(ordered[1].doc().get_number("$.age") == 20);
+    REQUIRE(ordered[2].doc().get_number("$.age") == 30);
+    REQUIRE(ordered[3].doc().get_number("$.age") == 50);
+}
+
+TEST_CASE("db_collection::requires_sort detects when a composite index satisfies the order")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("order_index");
+    coll.doc().set("$.a", 1).set("$.b", 2);
+
+    auto order = docudb::query::order_by("$.a").then("$.b");
+    REQUIRE(coll.requires_sort(docudb::query::gt("$.b", 0), order));
+
+    std::vector<std::pair<std::string, std::string>> columns = {{"a", "$.a"}, {"b", "$.b"}};
+    coll.index("a_b_idx", columns, false);
+    REQUIRE_FALSE(coll.requires_sort(docudb::query::gt("$.b", 0), order));
+
+    // mixed directions cannot be read from an ascending index
+    REQUIRE(coll.requires_sort(docudb::query::gt("$.b", 0), docudb::query::order_by("$.a").then("$.b", false)));
+    REQUIRE(coll.find(docudb::query::gt("$.b", 0), order).size() == 1);
+}
+
+TEST_CASE("db_collection::insert and db_document::as map structs to documents")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("mapping_test");
+
+    test_person p{"Jane \"JD\" Doe", 42, 3.5, true, {"Rome", std::nullopt}};
+    auto doc = coll.insert(p);
+
+    // the document is plain json
+    REQUIRE(doc.get_string("$.name") == "Jane \"JD\" Doe");
+    REQUIRE(doc.get_number("$.years") == 42);
+    REQUIRE(doc.get_string("$.address.city") == "Rome");
+    REQUIRE(doc.get_type("$.address.zip") == docudb::json_type::null);
+    REQUIRE(doc.get_type("$.active") == docudb::json_type::boolean_true);
+    REQUIRE(coll.find(docudb::query::eq("$.years", 42)).size() == 1);
+
+    auto read = coll.doc(doc.id()).as<test_person>();
+    REQUIRE(read.name == p.name);
+    REQUIRE(read.age == 42);
+    REQUIRE(read.score == doctest::Approx(3.5));
+    REQUIRE(read.active);
+    REQUIRE(read.address.city == "Rome");
+    REQUIRE_FALSE(read.address.zip.has_value());
+
+    // missing fields keep their default value
+    doc.set("$.address.zip", 100).patch(R"({"score": null})");
+    auto updated = doc.as<test_person>();
+    REQUIRE(updated.address.zip == 100);
+    REQUIRE(updated.score == 0);
+}
+
+TEST_CASE("db_document::apply_patch applies RFC 6902 operations")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("json_patch_test");
+    auto doc = coll.doc().patch(R"({"name": "x", "tags": ["a", "c"], "meta": {"n": 1}, "old": true})");
+
+    doc.apply_patch(R"([
+        {"op": "test", "path": "/name", "value": "x"},
+        {"op": "add", "path": "/tags/1", "value": "b"},
+        {"op": "add", "path": "/tags/-", "value": {"d": [1]}},
+        {"op": "remove", "path": "/tags/0"},
+        {"op": "replace", "path": "/name", "value": "y"},
+        {"op": "move", "from": "/meta", "path": "/info"},
+        {"op": "copy", "from": "/info/n", "path": "/count"},
+        {"op": "remove", "path": "/old"}
+    ])");
+
+    REQUIRE(doc.get_array_length("$.tags") == 3);
+    REQUIRE(doc.get_string("$.tags[0]") == "b");
+    REQUIRE(doc.get_string("$.tags[1]") == "c");
+    REQUIRE(doc.get_number("$.tags[2].d[0]") == 1);
+    REQUIRE(doc.get_string("$.name") == "y");
+    REQUIRE(doc.get_number("$.info.n") == 1);
+    REQUIRE(doc.get_number("$.count") == 1);
+    REQUIRE(doc.get_type("$.meta") == docudb::json_type::not_found);
+    REQUIRE(doc.get_type("$.old") == docudb::json_type::not_found);
+
+    // a failed test leaves the document untouched
+    auto body = doc.body();
+    REQUIRE_THROWS_AS(doc.apply_patch(R"([{"op": "replace", "path": "/name", "value": "z"}, {"op": "test", "path": "/name", "value": "x"}])"), std::invalid_argument);
+    REQUIRE_THROWS_AS(doc.apply_patch(R"([{"op": "remove", "path": "/missing"}])"), std::invalid_argument);
+    REQUIRE(doc.body() == body);
+
+    // values are tested structurally, numeric tokens follow the type of their parent
+    doc.apply_patch(R"([{"op": "test", "path": "/info", "value": {"n": 1.0}}, {"op": "add", "path": "/info/1", "value": "one"}, {"op": "add", "path": "$.tags[#]", "value": 2}])");
+    REQUIRE(doc.get_string("$.info.\"1\"") == "one");
+    REQUIRE(doc.get_number("$.tags[3]") == 2);
+    doc.body(R"({"a": {"1": 1, "b": 2}})");
+    doc.apply_patch(docudb::json_patch::diff(doc.body(), R"({"a": {"1": 5, "b": 2}})"));
+    REQUIRE(doc.get_number("$.a.\"1\"") == 5);
+    doc.apply_patch(R"([{"op": "test", "path": "/a", "value": {"b": 2, "1": 5}}])");
+    REQUIRE_THROWS_AS(doc.apply_patch(R"([{"op": "test", "path": "/a", "value": {"b": 2}}])"), std::invalid_argument);
+    // the type of the parent is the one it has at that point of the patch
+    doc.apply_patch(R"([{"op": "add", "path": "/o", "value": {}}, {"op": "add", "path": "/o/0", "value": 1}, {"op": "replace", "path": "/a", "value": []}, {"op": "add", "path": "/a/0", "value": 1}])");
+    REQUIRE(doc.get_number("$.o.\"0\"") == 1);
+    REQUIRE(doc.get_number("$.a[0]") == 1);
+
+    // the docid cannot be patched away
+    doc.apply_patch(R"([{"op": "remove", "path": "/docid"}])");
+    REQUIRE(doc.get_string("$.docid") == doc.id());
+}
+
+TEST_CASE("json_patch::diff generates patches that transform the document")
+{
+    auto from = R"({"a": 1, "b": {"c": [1, 2, 3], "d": "x"}, "e": null})"sv;
+    auto to = R"({"a": 1, "b": {"c": [1, 5], "d": "x", "f": {"g": true}}, "h": "a/b~"})"sv;
+
+    auto ops = docudb::json_patch::diff(from, to);
+    // b.c[1] replaced, b.c[2] removed, b.f added, e removed, h added
+    REQUIRE(ops.size() == 5);
+    REQUIRE(docudb::json_patch::diff(to, to).empty());
+
+    auto serialized = docudb::json_patch::to_string(ops);
+    REQUIRE(docudb::json_patch::parse(serialized).size() == ops.size());
+
+    docudb::database db{":memory:"};
+    auto coll = db.collection("json_diff_test");
+    auto doc = coll.doc().body(from);
+    doc.apply_patch(serialized);
+
+    REQUIRE(doc.get_array_length("$.b.c") == 2);
+    REQUIRE(doc.get_number("$.b.c[1]") == 5);
+    REQUIRE(doc.get_type("$.b.f.g") == docudb::json_type::boolean_true);
+    REQUIRE(doc.get_type("$.e") == docudb::json_type::not_found);
+    REQUIRE(doc.get_string("$.h") == "a/b~");
+    REQUIRE(docudb::json_patch::diff(doc.body(), to).size() == 1); // only the docid differs
+
+    // an insertion at the front of an array is a single operation
+    auto inserted = docudb::json_patch::diff(R"({"c": [1, 2, 3]})", R"({"c": [0, 1, 2, 3]})");
+    REQUIRE(inserted.size() == 1);
+    REQUIRE(inserted[0].path == "/c/0");
+
+    REQUIRE_THROWS_AS(docudb::json_patch::parse(R"([{"op": "jump", "path": "/a"}])"), std::invalid_argument);
+}
+
+TEST_CASE("database::start_checkpoints checkpoints the WAL in the background")
+{
+    auto filename = "checkpoint_test.db"s;
+    std::filesystem::remove(filename);
+    {
+        docudb::database db{filename};
+        REQUIRE(db.checkpoint_statistics().checkpoints == 0);
+
+        docudb::checkpoint_options options;
+        options.interval = std::chrono::milliseconds{10};
+        // escalate right away to shrink the WAL
+        options.truncate_wal_size = 0;
+        db.start_checkpoints(options);
+
+        auto coll = db.collection("checkpoint_test");
+        for (int i = 0; i < 100; i++)
+            coll.doc().set("$.value", i);
+
+        auto wait_until = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+        while (db.checkpoint_statistics().truncate_checkpoints == 0 && std::chrono::steady_clock::now() < wait_until)
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+        auto stats = db.checkpoint_statistics();
+        REQUIRE(stats.truncate_checkpoints > 0);
+        REQUIRE(stats.checkpoints >= stats.truncate_checkpoints);
+        REQUIRE(stats.max_duration >= stats.last_duration);
+
+        db.stop_checkpoints();
+        REQUIRE(coll.count() == 100);
+    }
+    std::filesystem::remove(filename);
+    std::filesystem::remove(filename + "-wal");
+    std::filesystem::remove(filename + "-shm");
+
+    docudb::database memory_db{":memory:"};
+    REQUIRE_THROWS_AS(memory_db.start_checkpoints(), docudb::db_exception);
+}
+
+TEST_CASE("database::start_incremental_vacuum reclaims free pages while idle")
+{
+    auto filename = "vacuum_test.db"s;
+    std::filesystem::remove(filename);
+    {
+        docudb::database db{filename};
+        db.auto_vacuum(docudb::auto_vacuum_mode::incremental);
+        REQUIRE(db.auto_vacuum() == docudb::auto_vacuum_mode::incremental);
+
+        auto coll = db.collection("vacuum_test");
+        auto payload = std::string(2000, 'x');
+        for (int i = 0; i < 200; i++)
+            coll.doc().set("$.payload", payload);
+        for (auto &ref : coll.docs())
+            ref.erase();
+        REQUIRE(db.space_statistics().freelist_count > 0);
+
+        docudb::vacuum_options options;
+        options.interval = std::chrono::milliseconds{10};
+        options.idle_time = std::chrono::milliseconds{0};
+        options.pages_per_step = 16;
+        db.start_incremental_vacuum(options);
+
+        auto wait_until = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+        while (db.space_statistics().freelist_count > 0 && std::chrono::steady_clock::now() < wait_until)
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+        REQUIRE(db.space_statistics().freelist_count == 0);
+        auto stats = db.vacuum_statistics();
+        REQUIRE(stats.reclaimed_pages > 0);
+        REQUIRE(stats.steps > 1);
+        db.stop_incremental_vacuum();
+
+        db.auto_vacuum(docudb::auto_vacuum_mode::none);
+        REQUIRE_THROWS_AS(db.start_incremental_vacuum(), docudb::db_exception);
+    }
+    std::filesystem::remove(filename);
+    std::filesystem::remove(filename + "-wal");
+    std::filesystem::remove(filename + "-shm");
+}
+
+TEST_CASE("database::compact rebuilds the file without free pages")
+{
+    auto filename = "compact_test.db"s;
+    std::filesystem::remove(filename);
+    {
+        docudb::database db{filename};
+        auto coll = db.collection("compact_test");
+        auto payload = std::string(2000, 'x');
+        for (int i = 0; i < 200; i++)
+            coll.doc().set("$.payload", payload).set("$.keep", i % 10 == 0);
+        for (auto &ref : coll.find(docudb::query::eq("$.keep", false)))
+            ref.erase();
+
+        auto before = db.space_statistics();
+        REQUIRE(before.freelist_count > 0);
+
+        db.compact();
+
+        auto after = db.space_statistics();
+        REQUIRE(after.freelist_count == 0);
+        REQUIRE(after.page_count < before.page_count);
+        REQUIRE(coll.count() == 20);
+        REQUIRE(std::filesystem::file_size(filename) == static_cast<std::uintmax_t>(after.page_count * after.page_size));
+    }
+    std::filesystem::remove(filename);
+}
+
+TEST_CASE("tiered_collection keeps recent documents hot and demotes the others")
+{
+    docudb::database db{":memory:"};
+
+    docudb::tiered_options options;
+    options.max_hot_documents = 4;
+    options.batch_size = 3;
+    auto coll = db.tiered("tiered_test", options);
+
+    std::vector<std::string> ids;
+    for (int i = 0; i < 10; i++)
+        ids.push_back(coll.insert(std::format(R"({{"value": {}, "even": {}}})", i, i % 2 == 0)));
+    REQUIRE(coll.hot_count() == 10);
+    REQUIRE(coll.cold_count() == 0);
+
+    // the oldest documents leave the hot tier
+    REQUIRE(coll.demote() == 6);
+    REQUIRE(coll.hot_count() == 4);
+    REQUIRE(coll.cold_count() == 6);
+    REQUIRE(coll.count() == 10);
+    REQUIRE(coll.count(docudb::query::eq("$.even", true)) == 5);
+    REQUIRE(coll.find(docudb::query::gte("$.value", 2)).size() == 8);
+    REQUIRE(coll.find(docudb::query::gte("$.value", 2), 3).size() == 3);
+
+    // reading a cold document promotes it
+    auto body = coll.get(ids.front());
+    REQUIRE(body.has_value());
+    REQUIRE(body->find("\"value\":0") != std::string::npos);
+    REQUIRE(coll.hot_count() == 5);
+    REQUIRE(coll.get(ids.front()).has_value());
+    auto stats = coll.statistics();
+    REQUIRE(stats.cold_reads == 1);
+    REQUIRE(stats.hot_reads == 1);
+    REQUIRE(stats.promotions == 1);
+
+    coll.remove(ids.back());
+    REQUIRE_FALSE(coll.get(ids.back()).has_value());
+
+    coll.flush();
+    REQUIRE(coll.hot_count() == 0);
+    REQUIRE(db.collection("tiered_test").count() == 9);
+}
+
+TEST_CASE("tiered_collection promotes copies and demotes in place")
+{
+    docudb::database db{":memory:"};
+    auto cold = db.collection("tiered_copy_test");
+    auto id = cold.doc().body(R"({"value": 1})").id();
+    std::istringstream in{"data"};
+    cold.attach(id, "file.txt", in, 4);
+
+    {
+        auto coll = db.tiered("tiered_copy_test");
+        REQUIRE(coll.get(id).has_value());
+        REQUIRE(coll.hot_count() == 1);
+        // the cold row stays while its copy is hot
+        REQUIRE(cold.count() == 1);
+        REQUIRE(coll.count() == 1);
+        REQUIRE(coll.find(docudb::query::eq("$.value", 1)).size() == 1);
+
+        coll.put(id, R"({"value": 2})");
+        REQUIRE(coll.count() == 1);
+        REQUIRE(coll.count(docudb::query::eq("$.value", 2)) == 1);
+        REQUIRE(cold.doc(id).get_number("$.value") == 1);
+    }
+
+    // the flush updated the row, which kept its attachment
+    REQUIRE(cold.count() == 1);
+    REQUIRE(cold.doc(id).get_number("$.value") == 2);
+    REQUIRE(cold.attachments(id).size() == 1);
+}
+
+TEST_CASE("tiered_collection demotes documents in the background")
+{
+    docudb::database db{":memory:"};
+
+    docudb::tiered_options options;
+    options.max_age = std::chrono::milliseconds{0};
+    options.demote_interval = std::chrono::milliseconds{10};
+    auto coll = db.tiered("tiered_background_test", options);
+
+    for (int i = 0; i < 20; i++)
+        coll.insert(R"({"value": 1})");
+
+    auto wait_until = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+    // the statistics are updated once the batch is committed
+    while ((coll.hot_count() > 0 || coll.statistics().demotions < 20) && std::chrono::steady_clock::now() < wait_until)
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+    REQUIRE(coll.hot_count() == 0);
+    REQUIRE(coll.cold_count() == 20);
+    REQUIRE(coll.statistics().demotions == 20);
+}
+
+TEST_CASE("db_collection::cursor reads documents with and without prefetching")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("cursor_test");
+    for (int i = 0; i < 1000; i++)
+        coll.doc().set("$.value", i);
+
+    for (auto prefetch : {false, true})
+    {
+        docudb::cursor_options options;
+        options.prefetch = prefetch;
+        options.batch_size = 64;
+        options.max_batches = 2;
+
+        auto cursor = coll.cursor(docudb::query::gte("$.value", 500), options);
+        std::int64_t count = 0;
+        std::int64_t sum = 0;
+        while (cursor.next())
+        {
+            REQUIRE_FALSE(cursor.id().empty());
+            sum += std::stoll(cursor.body().substr(cursor.body().find("\"value\":") + 8));
+            count++;
+        }
+        REQUIRE(count == 500);
+        REQUIRE(sum == (500 + 999) * 500 / 2);
+        REQUIRE_FALSE(cursor.next());
+    }
+
+    // a cursor destroyed before the end stops its background thread
+    docudb::cursor_options options;
+    options.prefetch = true;
+    options.batch_size = 8;
+    options.max_batches = 1;
+    auto cursor = coll.cursor(std::nullopt, options);
+    REQUIRE(cursor.next());
+
+    auto empty = coll.cursor(docudb::query::eq("$.value", -1), options);
+    REQUIRE_FALSE(empty.next());
+}
+
+TEST_CASE("use_fast_like LIKE matches the built-in LIKE")
+{
+    sqlite3 *builtin;
+    sqlite3 *extended;
+    REQUIRE(sqlite3_open(":memory:", &builtin) == SQLITE_OK);
+    REQUIRE(sqlite3_open(":memory:", &extended) == SQLITE_OK);
+    docudb::details::use_fast_like(extended);
+
+    auto long_text = std::string(100, 'x') + "needle" + std::string(50, 'Y');
+    std::vector<std::string> texts{"", "hello world", "Hello World", "h\xc3\xa9llo w\xc3\xb6rld", "50% off", "a_b", "axb",
+                                   "abcabcabd", "AbC", long_text, std::string(64, 'a') + "B"};
+    std::vector<std::pair<std::string, std::string>> patterns{
+        {"%", ""}, {"", ""}, {"hello%", ""}, {"%WORLD", ""}, {"%lo wo%", ""}, {"h_llo%", ""}, {"%h_llo%", ""},
+        {"%50\\%%", "\\"}, {"a\\_b", "\\"}, {"a_b", ""}, {"%abd", ""}, {"%abc%abd", ""}, {"abc", ""},
+        {"%\xc3\xa9%", ""}, {"%\xc3\x89%", ""}, {"_\xc3\xa9%", ""}, {"h_llo w_rld", ""}, {"%%", ""}, {"%x%", ""},
+        {"%NEEDLE%", ""}, {"%xneedley%", ""}, {"%a%b", ""}, {"%_b", ""}, {"a%", "a"}, {"%yyy", ""}};
+
+    auto like = [](sqlite3 *db, std::string const &text, std::string const &pattern, std::string const &escape)
+    {
+        sqlite3_stmt *stmt;
+        auto sql = escape.empty() ? "SELECT ?1 LIKE ?2;" : "SELECT ?1 LIKE ?2 ESCAPE ?3;";
+        sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        sqlite3_bind_text(stmt, 1, text.data(), static_cast<int>(text.size()), SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, pattern.data(), static_cast<int>(pattern.size()), SQLITE_TRANSIENT);
+        if (!escape.empty())
+            sqlite3_bind_text(stmt, 3, escape.data(), static_cast<int>(escape.size()), SQLITE_TRANSIENT);
+        auto rc = sqlite3_step(stmt);
+        auto result = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+        sqlite3_finalize(stmt);
+        return result;
+    };
+
+    for (auto const &text : texts)
+        for (auto const &[pattern, escape] : patterns)
+        {
+            INFO(text, " LIKE ", pattern);
+            REQUIRE(like(extended, text, pattern, escape) == like(builtin, text, pattern, escape));
+        }
+
+    // the escape must be a single character
+    REQUIRE(like(extended, "a", "a", "ab") == -1);
+
+    sqlite3_close(builtin);
+    sqlite3_close(extended);
+}
+
+TEST_CASE("query::contains searches case-sensitive substrings")
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto coll = db.collection("contains_test");
+    coll.doc().set("$.text", "The quick brown fox jumps over the lazy dog, the quick brown fox."s);
+    coll.doc().set("$.text", "THE QUICK BROWN FOX"s);
+    coll.doc().set("$.text", "nothing here"s);
+
+    REQUIRE(coll.count(docudb::query::contains("$.text", "quick brown")) == 1);
+    REQUIRE(coll.count(docudb::query::contains("$.text", "QUICK")) == 1);
+    REQUIRE(coll.count(docudb::query::like("$.text", "%quick brown%")) == 2);
+    REQUIRE(coll.count(docudb::query::contains("$.text", "")) == 3);
+}
+
+TEST_CASE("db_collection::insert_if_new skips documents with the same content")
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto coll = db.collection("dedup_test");
+
+    REQUIRE_THROWS_AS(coll.insert_if_new(R"({"a":1})"), std::logic_error);
+    coll.enable_content_hash();
+    REQUIRE(coll.has_content_hash());
+
+    auto [first, inserted] = coll.insert_if_new(R"({"a":1,"b":{"y":2,"x":[1,2]}})");
+    REQUIRE(inserted);
+    // same content, different key order
+    auto [second, inserted_again] = coll.insert_if_new(R"({"b":{"x":[1,2],"y":2},"a":1})");
+    REQUIRE_FALSE(inserted_again);
+    REQUIRE(second.id() == first.id());
+    REQUIRE(coll.count() == 1);
+
+    // the hash follows updates
+    first.set("$.a", 2);
+    REQUIRE(coll.insert_if_new(R"({"a":1,"b":{"y":2,"x":[1,2]}})").second);
+    REQUIRE(coll.count() == 2);
+
+    REQUIRE_THROWS_AS(coll.insert_if_new("[1,2]"), std::invalid_argument);
+    REQUIRE_THROWS_AS(coll.insert_if_new(R"({"a":--})"), std::invalid_argument);
+    REQUIRE_THROWS_AS(coll.insert_if_new(R"({"a":01})"), std::invalid_argument);
+    REQUIRE_THROWS_AS(coll.insert_if_new(std::string(2000000, '[')), std::invalid_argument);
+    REQUIRE(coll.insert_if_new(R"({"a":-0.5e+3})").second);
+}
+
+TEST_CASE("db_collection::insert_many skips duplicates in the batch and in the collection")
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto coll = db.collection("insert_many_test");
+    coll.enable_content_hash();
+    coll.insert_if_new(R"({"n":1})");
+
+    std::vector<std::string> bodies{R"({"n":1})", R"({"n":2})", R"({ "n" : 2 })", R"({"n":3})"};
+    auto ids = coll.insert_many(bodies, docudb::dedup_mode::skip_duplicates);
+    REQUIRE(ids.size() == 2);
+    REQUIRE(coll.count() == 3);
+    REQUIRE(coll.doc(ids[0]).body().find("\"n\":2") != std::string::npos);
+
+    REQUIRE(coll.insert_many(bodies).size() == 4);
+    REQUIRE(coll.count() == 7);
+
+    // a malformed body aborts the whole batch
+    REQUIRE_THROWS(coll.insert_many({R"({"n":4})", "{"}));
+    REQUIRE(coll.count() == 7);
+}
+
+TEST_CASE("db_collection::sample picks distinct documents uniformly")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("sample_test");
+    REQUIRE(coll.sample(3).empty());
+
+    for (int i = 0; i < 100; ++i)
+        coll.doc().set("$.value", i);
+
+    auto ids = [](std::vector<docudb::db_document_ref> const &refs)
+    {
+        std::set<std::string> out;
+        for (auto const &ref : refs)
+            out.insert(ref.id());
+        return out;
+    };
+
+    REQUIRE(ids(coll.sample(10)).size() == 10);
+    REQUIRE(ids(coll.sample(500)).size() == 100);
+
+    auto even = coll.sample(20, docudb::query::lt("$.value", 10));
+    REQUIRE(ids(even).size() == 10);
+
+    // every document is equally likely
+    std::map<std::string, int> hits;
+    for (int i = 0; i < 4000; ++i)
+        ++hits[coll.sample(1).at(0).id()];
+    REQUIRE(hits.size() == 100);
+    for (auto const &[id, count] : hits)
+        REQUIRE((count > 10 && count < 80));
+
+    // sparse rowids fall back to a single pass
+    auto refs = coll.docs();
+    for (std::size_t i = 0; i + 1 < refs.size(); ++i)
+        if (i % 25 != 0)
+            coll.remove(refs[i].id());
+    REQUIRE(coll.count() == 5);
+    REQUIRE(ids(coll.sample(4)).size() == 4);
+}
+
+TEST_CASE("db_collection::approx_distinct and approx_quantiles sketch field values")
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto coll = db.collection("sketch_test");
+
+    REQUIRE(coll.approx_distinct("$.user").estimate() == 0);
+    REQUIRE(std::isnan(coll.approx_quantiles("$.latency").quantile(0.5)));
+
+    std::vector<std::string> bodies;
+    for (int i = 0; i < 20000; ++i)
+        bodies.push_back(std::format(R"({{"user":"u{}","latency":{},"day":{}}})", i % 5000, i % 10000 + 1, i < 10000 ? 1 : 2));
+    coll.insert_many(bodies);
+
+    auto users = coll.approx_distinct("$.user");
+    REQUIRE(users.estimate() == doctest::Approx(5000).epsilon(0.03));
+
+    auto latency = coll.approx_quantiles("$.latency");
+    REQUIRE(latency.count() == 20000);
+    REQUIRE(latency.quantile(0) == 1);
+    REQUIRE(latency.quantile(1) == 10000);
+    REQUIRE(latency.quantile(0.5) == doctest::Approx(5000).epsilon(0.01));
+    REQUIRE(latency.quantile(0.99) == doctest::Approx(9900).epsilon(0.005));
+
+    // rollups: sketches of each day merge into the sketch of both
+    auto day1 = coll.approx_distinct("$.user", docudb::query::eq("$.day", 1));
+    auto day2 = coll.approx_distinct("$.user", docudb::query::eq("$.day", 2));
+    REQUIRE(day1.merge(day2).estimate() == users.estimate());
+
+    auto latency1 = coll.approx_quantiles("$.latency", docudb::query::eq("$.day", 1));
+    auto latency2 = coll.approx_quantiles("$.latency", docudb::query::eq("$.day", 2));
+    latency1.merge(latency2);
+    REQUIRE(latency1.count() == 20000);
+    REQUIRE(latency1.quantile(0.5) == doctest::Approx(5000).epsilon(0.01));
+
+    REQUIRE_THROWS_AS(docudb::distinct_sketch{"garbage"}.estimate(), std::invalid_argument);
+}
+
+TEST_CASE("query::optimize merges ranges and equalities and detects contradictions")
+{
+    using namespace docudb::query;
+    auto occurrences = [](std::string const &text, std::string const &word)
+    {
+        std::size_t n = 0;
+        for (auto pos = text.find(word); pos != std::string::npos; pos = text.find(word, pos + 1))
+            ++n;
+        return n;
+    };
+
+    queryable_type_eraser between{gte("$.x", 5) && lte("$.x", 10) && gte("$.x", 2)};
+    REQUIRE(occurrences(between.to_query_string(), "BETWEEN") == 1);
+    REQUIRE(occurrences(between.to_query_string(), "json_extract") == 1);
+    REQUIRE(between.get_binder().get_parameters().size() == 2);
+
+    queryable_type_eraser in{eq("$.c", "a"s) || eq("$.c", "b"s) || eq("$.c", "a"s) || eq("$.d", 1)};
+    REQUIRE(occurrences(in.to_query_string(), " IN (") == 1);
+    REQUIRE(in.get_binder().get_parameters().size() == 3);
+
+    queryable_type_eraser tight{gt("$.x", 1) && gt("$.x", 4) && lt("$.x", 10) && neq("$.x", 20)};
+    REQUIRE(occurrences(tight.to_query_string(), "json_extract") == 2);
+
+    queryable_type_eraser decided{eq("$.x", 7) && gt("$.x", 4) && neq("$.x", 3)};
+    REQUIRE(occurrences(decided.to_query_string(), "json_extract") == 1);
+
+    REQUIRE(queryable_type_eraser{gt("$.x", 5) && lt("$.x", 3)}.never_matches());
+    REQUIRE(queryable_type_eraser{gte("$.x", 5) && lt("$.x", 5)}.never_matches());
+    REQUIRE(queryable_type_eraser{eq("$.x", 1) && eq("$.x", 2) && eq("$.y", 1)}.never_matches());
+    REQUIRE(queryable_type_eraser{(eq("$.x", 1) && eq("$.x", 2)) || eq("$.y", 1)}.tree().type == expression::kind::predicate);
+    // values of different kinds are not compared
+    REQUIRE_FALSE(queryable_type_eraser{gt("$.x", 5) && lt("$.x", "a"s)}.never_matches());
+
+    docudb::database db{":memory:"};
+    auto coll = db.collection("optimize_test");
+    for (int i = 0; i < 20; ++i)
+        coll.doc().set("$.x", i).set("$.c", std::string(1, static_cast<char>('a' + i % 4)));
+    coll.doc().set("$.x", "text"s);
+
+    REQUIRE(coll.count(gte("$.x", 5) && lte("$.x", 10)) == 6);
+    REQUIRE(coll.count(gt("$.x", 5) && lt("$.x", 3)) == 0);
+    REQUIRE(coll.count(eq("$.c", "a"s) || eq("$.c", "b"s)) == 10);
+    REQUIRE(coll.count(gt("$.x", 5) && lt("$.x", "a"s)) == 14);
+    // gates are parenthesized
+    REQUIRE(coll.count(eq("$.c", "a"s) && (eq("$.x", 4) || eq("$.x", 5))) == 1);
+    REQUIRE(coll.find(gt("$.x", 5) && lt("$.x", 3)).empty());
+}
+
+TEST_CASE("database::read_session reads one version across queries")
+{
+    auto filename = "test_read_session.db"s;
+    for (auto suffix : {"", "-wal", "-shm"})
+        std::filesystem::remove(filename + suffix);
+
+    {
+        sqlite3 *raw;
+        REQUIRE(sqlite3_open(filename.c_str(), &raw) == SQLITE_OK);
+        sqlite3_exec(raw, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+        sqlite3_close(raw);
+    }
+
+    {
+        docudb::database reader{filename};
+        docudb::database writer{filename};
+        auto reader_coll = reader.collection("session_test");
+        auto writer_coll = writer.collection("session_test");
+        writer_coll.doc().set("$.n", 1);
+
+        {
+            auto session = reader.read_session();
+            REQUIRE_THROWS_AS(reader.read_session(), std::logic_error);
+            REQUIRE(reader_coll.count() == 1);
+
+            writer_coll.doc().set("$.n", 2);
+            REQUIRE(reader_coll.count() == 1);
+            REQUIRE(reader_coll.count(docudb::query::eq("$.n", 2)) == 0);
+
+            if (docudb::db_read_session::snapshots_supported())
+            {
+                // another connection reads the same version
+                docudb::database other{filename};
+                auto other_coll = other.collection("session_test");
+                auto shared = other.read_session(session.snapshot());
+                REQUIRE(other_coll.count() == 1);
+            }
+            else
+            {
+                REQUIRE_THROWS_AS(session.snapshot(), std::runtime_error);
+            }
+        }
+
+        REQUIRE(reader_coll.count() == 2);
+
+        auto session = reader.read_session();
+        session.end();
+        writer_coll.doc().set("$.n", 3);
+        REQUIRE(reader_coll.count() == 3);
+
+        // writes joining a session are committed by end() only
+        {
+            auto discarded = reader.read_session();
+            reader_coll.doc().set("$.n", 4);
+        }
+        REQUIRE(reader_coll.count() == 3);
+        {
+            auto kept = reader.read_session();
+            reader_coll.doc().set("$.n", 4);
+            kept.end();
+        }
+        REQUIRE(writer_coll.count() == 4);
+    }
+
+    for (auto suffix : {"", "-wal", "-shm"})
+        std::filesystem::remove(filename + suffix);
+}
+
+TEST_CASE("db_collection::truncate and database::drop_collection keep or drop the schema")
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto coll = db.collection("truncate_test");
+    coll.index("age", "$.age");
+    coll.enable_content_hash();
+
+    std::vector<std::string> bodies;
+    for (int i = 0; i < 1000; ++i)
+        bodies.push_back(std::format(R"({{"age":{}}})", i));
+    coll.insert_many(bodies);
+    db.collection("other").doc();
+
+    coll.truncate();
+    REQUIRE(coll.count() == 0);
+    REQUIRE(db.collection("other").count() == 1);
+
+    // generated columns and indexes are back
+    REQUIRE(coll.has_content_hash());
+    REQUIRE(coll.insert_if_new(R"({"age":30})").second);
+    REQUIRE_FALSE(coll.insert_if_new(R"({"age":30})").second);
+    REQUIRE(coll.count(docudb::query::gte("$.age", 18)) == 1);
+
+    auto names = [&]
+    {
+        std::set<std::string> out;
+        for (auto const &c : db.collections())
+            out.insert(c.name());
+        return out;
+    };
+    REQUIRE(names() == std::set<std::string>{"truncate_test", "other"});
+
+    REQUIRE(db.drop_collection("truncate_test"));
+    REQUIRE_FALSE(db.drop_collection("truncate_test"));
+    REQUIRE(names() == std::set<std::string>{"other"});
+    REQUIRE(db.collection("truncate_test").count() == 0);
+}
+
+TEST_CASE("db_collection::promote stores json fields in typed columns")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("promote_test");
+    coll.index("city", "$.city");
+
+    std::vector<std::string> bodies;
+    for (int i = 0; i < 100; ++i)
+        bodies.push_back(std::format(R"({{"age":{},"score":{}.5,"city":"c{}"}})", i, i, i % 10));
+    auto ids = coll.insert_many(bodies);
+
+    coll.promote("age", "$.age", docudb::column_type::integer)
+        .promote("score", "$.score", docudb::column_type::real, false);
+
+    // the rebuild keeps the documents, their rowids and the existing indexes
+    REQUIRE(coll.count() == 100);
+    REQUIRE(coll.doc(ids[42]).get_number("$.age") == 42);
+    REQUIRE(coll.count(docudb::query::eq("$.city", "c3"s)) == 10);
+
+    REQUIRE(coll.count(docudb::query::gte("$.age", 90)) == 10);
+    REQUIRE(coll.count(docudb::query::gt("$.score", 99.0)) == 1);
+    REQUIRE_FALSE(coll.requires_sort(docudb::query::gt("$.age", 10), docudb::query::order_by("$.age")));
+
+    auto oldest = coll.find(docudb::query::lt("$.age", 1000), docudb::query::order_by("$.age", false), 1);
+    REQUIRE(oldest.front().id() == ids[99]);
+
+    // the columns follow the documents
+    coll.doc(ids[0]).set("$.age", 500);
+    REQUIRE(coll.count(docudb::query::gte("$.age", 90)) == 11);
+    coll.doc().body(R"({"age":7})");
+    REQUIRE(coll.count(docudb::query::eq("$.age", 7)) == 2);
+
+    REQUIRE(coll.distinct("$.age", docudb::query::lt("$.age", 3)).size() == 2);
+
+    coll.truncate();
+    coll.doc().body(R"({"age":1})");
+    REQUIRE(coll.count(docudb::query::eq("$.age", 1)) == 1);
+
+    // a field of another type is rejected instead of converted
+    REQUIRE_THROWS_AS(coll.doc().body(R"({"age":"12"})"), docudb::db_exception);
+    auto mixed = db.collection("promote_mixed");
+    mixed.insert_many({R"({"n":"12"})", R"({"n":12})"});
+    REQUIRE_THROWS_AS(mixed.promote("n", "$.n", docudb::column_type::integer), docudb::db_exception);
+    REQUIRE(mixed.count(docudb::query::eq("$.n", 12)) == 1);
+
+    // comparisons are the same as on the document
+    auto text = db.collection("promote_text");
+    text.insert_many({R"({"s":"10"})", R"({"s":"abc"})"});
+    REQUIRE(text.count(docudb::query::gt("$.s", 9)) == 2);
+    REQUIRE(text.count(docudb::query::eq("$.s", 10)) == 0);
+    text.promote("s", "$.s", docudb::column_type::text);
+    REQUIRE(text.count(docudb::query::gt("$.s", 9)) == 2);
+    REQUIRE(text.count(docudb::query::eq("$.s", 10)) == 0);
+    REQUIRE(text.count(docudb::query::eq("$.s", "10"s)) == 1);
+}
+
+TEST_CASE("json_patch::apply patches documents outside of the database")
+{
+    auto doc = R"({"a":1,"tags":["x","y"],"o":{"k":"v"}})";
+
+    auto patched = docudb::json_patch::apply(doc, docudb::json_patch::parse(
+        R"([{"op":"add","path":"/tags/1","value":"z"},{"op":"remove","path":"/a"},{"op":"move","from":"/o/k","path":"/k"},{"op":"copy","from":"/tags/0","path":"/first"},{"op":"test","path":"/k","value":"v"}])"));
+    REQUIRE(patched == R"({"tags":["x","z","y"],"o":{},"k":"v","first":"x"})");
+
+    // diff then apply gives the target back
+    auto to = R"({"a":2,"tags":["x"],"o":{"k":"w","l":[1,2]},"n":null})";
+    REQUIRE(docudb::json_patch::apply(doc, docudb::json_patch::diff(doc, to)) == to);
+
+    REQUIRE_THROWS_AS(docudb::json_patch::apply(doc, docudb::json_patch::parse(R"([{"op":"remove","path":"/missing"}])")), std::invalid_argument);
+    REQUIRE_THROWS_AS(docudb::json_patch::apply(doc, docudb::json_patch::parse(R"([{"op":"test","path":"/a","value":2}])")), std::invalid_argument);
+}
+
+TEST_CASE("db_collection::enable_history replays versions from keyframes and patches")
+{
+    docudb::database db{":memory:"};
+    db.load_extensions();
+    auto coll = db.collection("history_test");
+    auto existing = coll.doc().id();
+
+    docudb::history_options options;
+    options.keyframe_interval = 4;
+    coll.enable_history(options);
+    REQUIRE(coll.has_history());
+    REQUIRE(coll.history(existing).size() == 1);
+
+    auto doc = coll.doc();
+    auto id = doc.id();
+    for (int i = 1; i <= 10; ++i)
+        doc.set("$.n", i);
+    doc.set("$.n", 10); // unchanged bodies are not versions
+    coll.remove(id);
+
+    auto versions = coll.history(id);
+    REQUIRE(versions.size() == 12);
+    REQUIRE(versions.front().version == 1);
+    REQUIRE(versions.back().deleted);
+
+    REQUIRE(coll.body_at(id, 1) == std::format(R"({{"docid":"{}"}})", id));
+    for (int i = 1; i <= 10; ++i)
+        REQUIRE(coll.body_at(id, i + 1) == std::format(R"({{"docid":"{}","n":{}}})", id, i));
+    REQUIRE_FALSE(coll.body_at(id, 12));
+    REQUIRE_FALSE(coll.body_at(id, 13));
+
+    REQUIRE_FALSE(coll.body_at(id, std::chrono::system_clock::time_point{}));
+    REQUIRE_FALSE(coll.body_at(id, std::chrono::system_clock::now() + std::chrono::hours{1}));
+    REQUIRE(coll.body_at(existing, std::chrono::system_clock::now() + std::chrono::hours{1}));
+
+    // the oldest kept version becomes a keyframe
+    REQUIRE(coll.compact_history(3) == 9);
+    REQUIRE(coll.history(id).size() == 3);
+    REQUIRE_FALSE(coll.body_at(id, 5));
+    REQUIRE(coll.body_at(id, 10) == std::format(R"({{"docid":"{}","n":9}})", id));
+    REQUIRE(coll.body_at(id, 11) == std::format(R"({{"docid":"{}","n":10}})", id));
+
+    // truncate records the removals and keeps the history triggers, drop_collection drops the history
+    coll.truncate();
+    REQUIRE(coll.history(existing).back().deleted);
+    REQUIRE_FALSE(coll.body_at(existing, std::chrono::system_clock::now() + std::chrono::hours{1}));
+    auto again = coll.doc().id();
+    REQUIRE(coll.history(again).size() == 1);
+    REQUIRE(db.collections().size() == 1);
+    db.drop_collection("history_test");
+    REQUIRE_FALSE(db.collection("history_test").has_history());
+}
+
+TEST_CASE("db_statement runs hand-written SQL with reusable bindings")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("stmt_test");
+
+    auto insert = coll.prepare("INSERT INTO stmt_test (body) VALUES (json_object('docid', ?1, 'n', ?2, 'name', ?3, 'flag', ?4))");
+    for (int i = 0; i < 10; ++i)
+        REQUIRE(insert.bind(std::format("d{}", i), i, i % 2 ? std::optional<std::string>{"odd"} : std::nullopt, i == 3).execute() == 1);
+    REQUIRE(coll.count() == 10);
+
+    // statements move, e.g. into containers
+    std::vector<docudb::db_statement> statements;
+    statements.push_back(coll.prepare("SELECT docid, body FROM stmt_test WHERE body ->> '$.n' BETWEEN ?1 AND ?2 ORDER BY body ->> '$.n'"));
+    auto &range = statements.front();
+
+    auto docs = range.bind(2, 4).documents();
+    REQUIRE(docs.size() == 3);
+    REQUIRE(docs.front().id() == "d2");
+    REQUIRE(docs.front().get_number("$.n") == 2);
+    REQUIRE(range.bind(8, 100).documents().size() == 2);
+
+    auto rows = db.prepare("SELECT body ->> '$.n', body ->> '$.name', body ->> '$.flag' FROM stmt_test ORDER BY 1 LIMIT 4");
+    REQUIRE(rows.column_count() == 3);
+    auto typed = rows.rows<std::int64_t, std::optional<std::string>, bool>();
+    REQUIRE(typed.size() == 4);
+    REQUIRE(typed[1] == std::tuple<std::int64_t, std::optional<std::string>, bool>{1, "odd"s, false});
+    REQUIRE_FALSE(std::get<1>(typed[2]));
+    REQUIRE(std::get<2>(typed[3]));
+
+    auto sum = db.prepare("SELECT sum(body ->> '$.n') FROM stmt_test WHERE body ->> '$.n' < ?1");
+    REQUIRE(sum.bind(docudb::db_value{std::int64_t{5}}).step());
+    REQUIRE(sum.column<std::int64_t>(0) == 10);
+
+    REQUIRE_THROWS_AS(rows.documents(), std::logic_error);
+    REQUIRE_THROWS_AS(db.prepare("SELEC nothing"), docudb::stmt_exception);
+}
+
+TEST_CASE("db_collection attachments stream binary payloads in chunks")
+{
+    const char *path = "attachments_test.db";
+    std::filesystem::remove(path);
+    {
+        docudb::database db{path};
+        auto coll = db.collection("attach_test");
+        auto id = coll.doc().id();
+        REQUIRE(coll.attachments(id).empty());
+        REQUIRE_THROWS_AS(coll.create_attachment("missing", "a", 1), docudb::db_exception);
+
+        // 3MB written and read back 64KB at a time, with no full copy in memory
+        constexpr std::size_t size = 3 * 1024 * 1024 + 17;
+        auto byte_at = [](std::size_t i)
+        { return static_cast<std::byte>((i * 31 + 7) % 251); };
+        {
+            auto attachment = coll.create_attachment(id, "image.png", size);
+            std::vector<std::byte> chunk(64 * 1024);
+            for (std::size_t offset = 0; offset < size; offset += chunk.size())
+            {
+                auto n = std::min(chunk.size(), size - offset);
+                for (std::size_t i = 0; i < n; ++i)
+                    chunk[i] = byte_at(offset + i);
+                attachment.write(std::span{chunk}.first(n), offset);
+            }
+            REQUIRE_THROWS_AS(attachment.write(chunk, size - 1), std::out_of_range);
+        }
+
+        auto reader = coll.open_attachment(id, "image.png");
+        REQUIRE(reader.size() == size);
+        std::vector<std::byte> chunk(100000);
+        bool same = true;
+        for (std::size_t offset = 0, n = 0; (n = reader.read(chunk, offset)) > 0; offset += n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                same = same && chunk[i] == byte_at(offset + i);
+        }
+        REQUIRE(same);
+        REQUIRE_THROWS_AS(reader.write(std::span{chunk}.first(1), 0), docudb::db_exception);
+
+        std::istringstream in{"hello attachment"};
+        coll.attach(id, "note.txt", in, 5);
+        std::ostringstream out;
+        coll.open_attachment(id, "note.txt").read_to(out);
+        REQUIRE(out.str() == "hello");
+
+        std::istringstream shorter{"abc"};
+        REQUIRE_THROWS_AS(coll.attach(id, "short.bin", shorter, 10), std::runtime_error);
+
+        auto infos = coll.attachments(id);
+        REQUIRE(infos.size() == 2);
+        REQUIRE(infos[0].name == "image.png");
+        REQUIRE(infos[0].size == size);
+        REQUIRE(infos[1].size == 5);
+
+        REQUIRE(coll.remove_attachment(id, "note.txt"));
+        REQUIRE_FALSE(coll.remove_attachment(id, "note.txt"));
+        REQUIRE_THROWS_AS(coll.open_attachment(id, "note.txt"), docudb::db_exception);
+
+        // attachments are removed with their document, and the side table is not a collection
+        coll.remove(id);
+        REQUIRE(coll.attachments(id).empty());
+        REQUIRE(db.collections().size() == 1);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("collection_mirror answers lookups from memory and follows the connection's writes")
+{
+    docudb::database db{":memory:"};
+    auto coll = db.collection("mirror_test");
+    auto insert = coll.prepare("INSERT OR REPLACE INTO mirror_test (body) VALUES (json_object('docid', ?1, 'age', ?2, 'name', ?3))");
+    for (int i = 0; i < 100; ++i)
+        insert.bind(std::format("u{}", i), i, std::format("user{}", i)).execute();
+
+    auto users = db.mirror("mirror_test", {.ordered = {"$.age", "$.name"}});
+    auto names = db.mirror("mirror_test", {.fields = {"$.name"}});
+    REQUIRE(users.size() == 100);
+    REQUIRE(users.contains("u42"));
+    REQUIRE_FALSE(users.contains("nobody"));
+    REQUIRE(users.get("u42") == coll.doc("u42").body());
+    REQUIRE(names.get("u42") == R"({"name":"user42"})");
+
+    auto ids = users.range("$.age", 10, 12);
+    REQUIRE(ids == std::vector<std::string>{"u10", "u11", "u12"});
+    REQUIRE(users.range("$.age", 95, std::nullopt).size() == 5);
+    REQUIRE(users.range("$.age", std::nullopt, std::nullopt, 3).size() == 3);
+    REQUIRE(users.range("$.name", "user98"s, std::nullopt) == std::vector<std::string>{"u98", "u99"});
+    REQUIRE_THROWS_AS(users.range("$.missing", 1, 2), std::invalid_argument);
+
+    // writes on the connection are applied on the next lookup
+    insert.bind("u100", 1000, "late").execute();
+    insert.bind("u5", 500, "moved").execute();
+    coll.remove("u7");
+    REQUIRE(users.size() == 100);
+    REQUIRE(users.range("$.age", 500, std::nullopt) == std::vector<std::string>{"u5", "u100"});
+    REQUIRE_FALSE(users.contains("u7"));
+    REQUIRE(names.get("u5") == R"({"name":"moved"})");
+
+    // rolled back writes are never mirrored, uncommitted ones wait for the commit
+    db.prepare("BEGIN").execute();
+    insert.bind("u200", 1, "rolled back").execute();
+    REQUIRE_FALSE(users.contains("u200"));
+    db.prepare("ROLLBACK").execute();
+    REQUIRE_FALSE(users.contains("u200"));
+
+    db.prepare("SAVEPOINT outer_sp").execute();
+    coll.remove("u8");
+    db.prepare("ROLLBACK TO outer_sp").execute();
+    db.prepare("RELEASE outer_sp").execute();
+    REQUIRE(users.contains("u8"));
+
+    db.prepare("BEGIN").execute();
+    insert.bind("u300", 300, "committed").execute();
+    REQUIRE_FALSE(users.contains("u300"));
+    db.prepare("COMMIT").execute();
+    REQUIRE(users.contains("u300"));
+
+    // truncate is not reported by the update hook, nor are writes from other connections
+    coll.truncate();
+    REQUIRE(users.size() == 101);
+    users.reload();
+    REQUIRE(users.size() == 0);
+}
+
+#ifndef _WIN32
+TEST_CASE("remote::server serves collections to clients over a Unix socket")
+{
+    auto filename = "remote_test.db"s;
+    auto socket_path = "remote_test.sock"s;
+    std::filesystem::remove(filename);
+    {
+        docudb::remote::server srv{{filename, socket_path, 2, 64}};
+        std::thread server_thread{[&]
+                                  { srv.run(); }};
+        {
+            docudb::remote::client cli{socket_path};
+            cli.ping();
+
+            auto coll = cli.collection("remote_test");
+            auto id = coll.insert(R"({"name": "first", "value": 1})");
+            REQUIRE(coll.get(id).has_value());
+            REQUIRE_FALSE(coll.get("missing").has_value());
+
+            coll.put("fixed", R"({"name": "second", "value": 2})");
+            coll.put("fixed", R"({"name": "second", "value": 3})");
+            REQUIRE(coll.count() == 2);
+
+            // pipelined: all the inserts are sent before any response is read
+            std::vector<std::future<std::string>> pending;
+            for (int i = 0; i < 200; i++)
+                pending.push_back(coll.insert_async(std::format(R"({{"name": "bulk", "value": {}}})", i)));
+            for (auto &f : pending)
+                REQUIRE_FALSE(f.get().empty());
+
+            REQUIRE(coll.count(docudb::query::eq("$.name", "bulk"s)) == 200);
+            auto found = coll.find(docudb::query::eq("$.name", "second"s));
+            REQUIRE(found.size() == 1);
+            REQUIRE(found.front().id == "fixed");
+            REQUIRE(found.front().body.find("\"value\":3") != std::string::npos);
+            REQUIRE(coll.find(docudb::query::eq("$.name", "bulk"s), 5).size() == 5);
+
+            coll.remove(id);
+            REQUIRE_FALSE(coll.get(id).has_value());
+
+            auto missing = cli.collection("remote_missing");
+            REQUIRE_THROWS_AS(missing.put("a", "not json"), docudb::remote::remote_exception);
+
+            // names cannot close the [] identifier nor reach the side tables
+            REQUIRE_THROWS_AS(cli.collection("remote_test] WHERE 1; --"), docudb::remote::remote_exception);
+            REQUIRE_THROWS_AS(cli.collection("remote_test$history"), docudb::remote::remote_exception);
+        }
+
+        auto stats = srv.statistics();
+        REQUIRE(stats.batches > 0);
+        REQUIRE(stats.batched_requests > stats.batches);
+
+        srv.stop();
+        server_thread.join();
+    }
+
+    docudb::database db{filename};
+    REQUIRE(db.collection("remote_test").count() == 201);
+
+    std::filesystem::remove(filename);
+    std::filesystem::remove(filename + "-wal");
+    std::filesystem::remove(filename + "-shm");
+}
+#endif
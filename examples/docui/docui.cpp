@@ -6,31 +6,137 @@
 #include <FL/Fl_Text_Buffer.H>
 #include <FL/Fl_File_Chooser.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Input.H>
 
 #include <string>
 #include <memory>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "docudb.hpp"
 
+using namespace std::string_literals;
+
+// documents listed per request: collections are only read when expanded,
+// one page at a time, so that large databases open instantly
+constexpr int page_size = 500;
+
+// paging state of an expanded collection
+struct collection_state_s {
+    std::string last_id;
+    bool loading{false};
+    bool done{false};
+};
 
 struct vm_s {
     std::unique_ptr<docudb::database> db;
-    std::vector<std::unique_ptr<docudb::db_document_ref>> documents;
-    Fl_Tree_Prefs tree;
+    std::map<std::string, collection_state_s> collections;
+    // bumped when another database is opened, pages of the previous one are dropped
+    int generation{0};
 
-    vm_s() : db(std::make_unique<docudb::database>("docui.db")), tree{} {
+    vm_s() : db(std::make_unique<docudb::database>("docui.db")) {
     }
 } vm;
 
 struct ui_s {
     Fl_Tree* tree{nullptr};
+    Fl_Text_Buffer* buffer{nullptr};
 } ui;
 
 struct collection_tag_s {} collection_tag;
+struct document_tag_s {} document_tag;
+struct more_tag_s {} more_tag;
 
 bool is_collection(Fl_Tree_Item* const itm) {
     return itm->user_data() == &collection_tag;
 }
 
+// a page of document ids, read on the loader thread
+struct page_s {
+    int generation;
+    std::string collection;
+    std::vector<std::string> ids;
+    std::string error;
+};
+
+// reads pages of document ids on a background thread, with its own connection,
+// and hands them over to the UI thread with Fl::awake
+struct loader_s {
+    struct request_s {
+        int generation;
+        std::string filename;
+        std::string collection;
+        std::string after;
+    };
+
+    loader_s() : thread([this] { run(); }) {
+    }
+
+    ~loader_s() {
+        {
+            std::lock_guard lock{mutex};
+            stop = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    void request(request_s r) {
+        {
+            std::lock_guard lock{mutex};
+            requests.push_back(std::move(r));
+        }
+        cv.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_ptr<docudb::database> db;
+        std::string filename;
+
+        while (true) {
+            request_s r;
+            {
+                std::unique_lock lock{mutex};
+                cv.wait(lock, [this] { return stop || !requests.empty(); });
+                if (stop)
+                    return;
+                r = std::move(requests.front());
+                requests.pop_front();
+            }
+
+            auto page = new page_s{r.generation, r.collection, {}, {}};
+            try {
+                if (!db || filename != r.filename) {
+                    db = std::make_unique<docudb::database>(r.filename);
+                    filename = r.filename;
+                }
+
+                // keyset paging: the docid index seeks straight past the previous page
+                auto collection = db->collection(r.collection);
+                for (auto&& ref : collection.find(docudb::query::gt("docid", std::string{r.after}), docudb::query::order_by("docid"), page_size)) {
+                    page->ids.push_back(ref.id());
+                }
+            } catch (std::exception const& e) {
+                page->error = e.what();
+            }
+            Fl::awake(page_loaded_cb, page);
+        }
+    }
+
+    static void page_loaded_cb(void* page_ptr);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<request_s> requests;
+    bool stop{false};
+    std::thread thread;
+};
+
+std::unique_ptr<loader_s> loader;
+
 // fw declarations
 void add_document_cb(Fl_Widget*, void* tree_item_ptr);
 void open_file_cb(Fl_Widget*, void* text_display);
@@ -38,6 +144,17 @@ void add_collection_cb(Fl_Widget*, void*);
 void tree_cb(Fl_Widget*, void* text_display);
 //
 
+Fl_Tree_Item* find_collection_item(std::string const& name) {
+    // collections are the children of the (hidden) root, no need to walk their documents
+    auto root = ui.tree->root();
+    for (int i = 0; i < root->children(); ++i) {
+        auto item = root->child(i);
+        if (is_collection(item) && name == item->label())
+            return item;
+    }
+    return nullptr;
+}
+
 void add_add_document_button(Fl_Tree_Item* item) {
     auto button = new Fl_Button(0, 0, 100, 100, "Add Document");
     button->callback(add_document_cb, item);
@@ -45,6 +162,69 @@ void add_add_document_button(Fl_Tree_Item* item) {
     button_item->widget(button);
 }
 
+Fl_Tree_Item* add_collection_item(std::string const& name) {
+    auto item = ui.tree->add(ui.tree->root(), name.c_str());
+    item->user_data(&collection_tag);
+    add_add_document_button(item);
+    // collapsed until the user asks for its documents
+    ui.tree->close(item, 0);
+    return item;
+}
+
+void request_page(std::string const& collection_name) {
+    auto& state = vm.collections[collection_name];
+    if (state.loading || state.done)
+        return;
+
+    state.loading = true;
+    loader->request({vm.generation, vm.db->filename_database(), collection_name, state.last_id});
+}
+
+void loader_s::page_loaded_cb(void* page_ptr) {
+    std::unique_ptr<page_s> page{static_cast<page_s*>(page_ptr)};
+    if (page->generation != vm.generation)
+        return;
+
+    auto& state = vm.collections[page->collection];
+    state.loading = false;
+
+    auto collection_item = find_collection_item(page->collection);
+    if (!collection_item)
+        return;
+
+    // the "Load more" item, if any, is replaced by the new page
+    for (int i = 0; i < collection_item->children(); ++i) {
+        if (collection_item->child(i)->user_data() == &more_tag) {
+            ui.tree->remove(collection_item->child(i));
+            break;
+        }
+    }
+
+    if (!page->error.empty()) {
+        ui.buffer->text(("Failed to load documents: "s + page->error).c_str());
+        ui.tree->redraw();
+        return;
+    }
+
+    // documents go above the "Add Document" button
+    auto button_item = collection_item->child(collection_item->children() - 1);
+    for (auto const& id : page->ids) {
+        auto item = ui.tree->insert_above(button_item, id.c_str());
+        item->user_data(&document_tag);
+    }
+
+    if (!page->ids.empty())
+        state.last_id = page->ids.back();
+
+    if (page->ids.size() < static_cast<std::size_t>(page_size)) {
+        state.done = true;
+    } else {
+        auto more = ui.tree->insert_above(button_item, "Load more...");
+        more->user_data(&more_tag);
+    }
+    ui.tree->redraw();
+}
+
 // Callback for adding a document
 void add_document_cb(Fl_Widget*, void* tree_item_ptr) {
     Fl_Tree_Item* tree_item = static_cast<Fl_Tree_Item*>(tree_item_ptr);
@@ -54,46 +234,33 @@ void add_document_cb(Fl_Widget*, void* tree_item_ptr) {
     auto collection = vm.db->collection(collection_name);
 
     auto doc = collection.doc();
-    // Add the document to the tree view    
-    auto item = ui.tree->insert_above(tree_item->find_clicked({}), doc.id().c_str());
-
-    auto docref = std::make_unique<docudb::db_document_ref>(doc);
-    auto docref_ptr = docref.get();
-    vm.documents.push_back(std::move(docref));
-
-    item->user_data(docref_ptr);
+    // Add the document to the tree view, above the button
+    auto button_item = tree_item->child(tree_item->children() - 1);
+    auto item = ui.tree->insert_above(button_item, doc.id().c_str());
+    item->user_data(&document_tag);
     ui.tree->redraw();
 }
 
 void clear_treeview() {
-    vm.documents.clear();
-    ui.tree->clear();
+    vm.collections.clear();
+    ++vm.generation;
+    ui.tree->clear_children(ui.tree->root());
 }
 
 void load_database() {
-    for(auto&& c: vm.db->collections()) {
-        auto item = ui.tree->add(c.name().c_str());
-        
-        item->user_data(&collection_tag);
-        for(auto&& d: c.docs()) {
-            auto item = ui.tree->add((c.name() + "/" + d.id()).c_str());
-            auto docref = std::make_unique<docudb::db_document_ref>(d);
-            auto docref_ptr = docref.get();
-            vm.documents.push_back(std::move(docref));
-            item->user_data(docref_ptr);
-        }
-
-        add_add_document_button(item);
+    // only the collection names, their documents are listed when expanded
+    for (auto&& c : vm.db->collections()) {
+        add_collection_item(c.name());
     }
     ui.tree->redraw();
 }
 
 // Callback for opening files
 void open_file_cb(Fl_Widget*, void* text_display) {
-    Fl_Text_Display* display = static_cast<Fl_Text_Display*>(text_display);
     const char* filename = fl_file_chooser("Open File", "*.db;*.sqlite;*.docudb", NULL);
     if (filename) {
-
+        clear_treeview();
+        ui.buffer->text("");
         vm.db = std::make_unique<docudb::database>(filename);
         load_database();
     }
@@ -110,14 +277,15 @@ void add_collection_cb(Fl_Widget*, void*) {
     button->callback([](Fl_Widget*, void* name_input) {
         Fl_Input* fl_input = static_cast<Fl_Input*>(name_input);
         std::string collection_name = fl_input->value();
-        if (!collection_name.empty()) {
+        if (!collection_name.empty() && !find_collection_item(collection_name)) {
             Fl_Group::current(ui.tree);
 
             // Add the collection to the database
             vm.db->collection(collection_name);
 
-            auto item = ui.tree->add(collection_name.c_str());
-            add_add_document_button(item);
+            add_collection_item(collection_name);
+            // a new collection has no documents to list
+            vm.collections[collection_name].done = true;
             ui.tree->redraw();
         }
         fl_input->window()->hide();
@@ -128,21 +296,36 @@ void add_collection_cb(Fl_Widget*, void*) {
     input_window->show();
 }
 
-// Callback for tree selection
-void tree_cb(Fl_Widget* widget, void* text_display) {
+// Callback for tree selection and expansion
+void tree_cb(Fl_Widget* widget, void*) {
     Fl_Tree* tree = static_cast<Fl_Tree*>(widget);
-    Fl_Text_Display* display = static_cast<Fl_Text_Display*>(text_display);
-    Fl_Tree_Item* item = tree->item_clicked();
-
-    if (item->label() != "" &&  !is_collection(item) && item->user_data() != nullptr) {
-        auto docref = reinterpret_cast<docudb::db_document_ref*>(item->user_data());
-        Fl_Text_Buffer* buffer = new Fl_Text_Buffer();
-        buffer->text(docref->doc().body().c_str());
-        display->buffer(buffer);
+    Fl_Tree_Item* item = tree->callback_item();
+    if (!item)
+        return;
+
+    switch (tree->callback_reason()) {
+    case FL_TREE_REASON_OPENED:
+        if (is_collection(item))
+            request_page(item->label());
+        break;
+    case FL_TREE_REASON_SELECTED:
+        if (item->user_data() == &more_tag) {
+            request_page(item->parent()->label());
+        } else if (item->user_data() == &document_tag) {
+            // only the selected document body is read
+            auto collection = vm.db->collection(item->parent()->label());
+            ui.buffer->text(collection.doc(item->label()).body().c_str());
+        }
+        break;
+    default:
+        break;
     }
 }
 
 int main(int argc, char** argv) {
+    // enables Fl::awake, used by the loader thread
+    Fl::lock();
+
     Fl_Window* window = new Fl_Window(800, 600, "DocuDB UI");
 
     // Menu bar
@@ -150,15 +333,21 @@ int main(int argc, char** argv) {
     menu->add("File/Open", FL_CTRL + 'o', open_file_cb);
     menu->add("Database/Add Collection", FL_CTRL + 'n', add_collection_cb);
 
-    // Text display
-    Fl_Text_Display* text_display = new Fl_Text_Display(200, 25, 600, 575);    
+    // Text display, reusing one buffer
+    Fl_Text_Display* text_display = new Fl_Text_Display(200, 25, 600, 575);
+    ui.buffer = new Fl_Text_Buffer();
+    text_display->buffer(ui.buffer);
 
     // Sidebar with tree view
     ui.tree = new Fl_Tree(0, 25, 200, 575);
+    ui.tree->showroot(0);
+    loader = std::make_unique<loader_s>();
     load_database();
     ui.tree->callback(tree_cb, text_display);
 
     window->end();
     window->show(argc, argv);
-    return Fl::run();
+    auto ret = Fl::run();
+    loader.reset();
+    return ret;
 }
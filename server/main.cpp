@@ -0,0 +1,95 @@
+#include <docudb_remote.hpp>
+#include <csignal>
+#include <iostream>
+#include <string_view>
+#include <thread>
+
+#include <pthread.h>
+
+namespace
+{
+    void usage()
+    {
+        std::cerr << "usage: docudb_server <database> <socket> [--readers N] [--batch N] [--synchronous normal|full]\n";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        usage();
+        return 1;
+    }
+
+    docudb::remote::server_options options;
+    options.database_path = argv[1];
+    options.socket_path = argv[2];
+
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        if (arg == "--readers")
+            options.readers = std::stoi(argv[++i]);
+        else if (arg == "--batch")
+            options.max_batch = std::stoul(argv[++i]);
+        else if (arg == "--synchronous")
+        {
+            std::string_view mode = argv[++i];
+            if (mode == "normal")
+                options.synchronous = docudb::remote::synchronous_mode::normal;
+            else if (mode == "full")
+                options.synchronous = docudb::remote::synchronous_mode::full;
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    // block the termination signals in every thread, a dedicated thread waits for them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try
+    {
+        docudb::remote::server srv{options};
+
+        std::thread signal_thread{[&]
+                                  {
+                                      int sig;
+                                      sigwait(&signals, &sig);
+                                      srv.stop();
+                                  }};
+
+        std::cerr << "docudb_server: serving " << options.database_path << " on " << options.socket_path << "\n";
+        srv.run();
+
+        auto stats = srv.statistics();
+        std::cerr << "docudb_server: " << stats.requests << " requests, " << stats.batches << " write batches\n";
+
+        // run() only returns once stopped by the signal thread
+        signal_thread.join();
+    }
+    catch (std::exception const &e)
+    {
+        std::cerr << "docudb_server: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
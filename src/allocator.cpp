@@ -0,0 +1,320 @@
+#include "allocator.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace docudb::details::allocator
+{
+    namespace
+    {
+        constexpr std::size_t max_pool_limit = 64 * 1024;
+        constexpr std::uint32_t large_class = 0xFFFFFFFF;
+
+        // SQLite requires 8-byte alignment, which the header keeps
+        struct header
+        {
+            std::uint32_t size_class;
+            std::uint32_t size;
+        };
+        static_assert(sizeof(header) == 8);
+
+        struct free_block
+        {
+            free_block *next;
+        };
+
+        struct free_list
+        {
+            free_block *head{nullptr};
+            std::size_t count{0};
+
+            void push(free_block *block)
+            {
+                block->next = head;
+                head = block;
+                ++count;
+            }
+
+            free_block *pop()
+            {
+                auto block = head;
+                head = block->next;
+                --count;
+                return block;
+            }
+        };
+
+        struct counters
+        {
+            // written by their thread only, read by stats()
+            std::atomic<std::uint64_t> allocations{0};
+            std::atomic<std::uint64_t> frees{0};
+            std::atomic<std::uint64_t> reallocations{0};
+            std::atomic<std::uint64_t> cache_hits{0};
+        };
+
+        void bump(std::atomic<std::uint64_t> &counter)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        struct thread_cache;
+
+        // never destroyed: blocks may be freed by thread_local destructors after static ones ran
+        struct shared_pool
+        {
+            allocator_options options;
+            std::size_t class_count{0};
+            std::vector<std::mutex> mutexes;
+            std::vector<free_list> lists;
+
+            std::mutex registry_mutex;
+            std::vector<thread_cache *> caches;
+            allocator_stats retired;
+        };
+
+        shared_pool *pool = nullptr;
+
+        void *block_alloc(std::uint32_t size_class)
+        {
+            auto h = static_cast<header *>(std::malloc(sizeof(header) + class_size(size_class)));
+            if (!h)
+                return nullptr;
+            *h = {size_class, static_cast<std::uint32_t>(class_size(size_class))};
+            return h + 1;
+        }
+
+        header *header_of(void *p)
+        {
+            return static_cast<header *>(p) - 1;
+        }
+
+        // moves up to count blocks from one list to another
+        void transfer(free_list &from, free_list &to, std::size_t count)
+        {
+            while (count-- > 0 && from.head)
+                to.push(from.pop());
+        }
+
+        struct thread_cache
+        {
+            std::vector<free_list> lists;
+            counters stats;
+
+            thread_cache() : lists(pool->class_count)
+            {
+                std::lock_guard lock{pool->registry_mutex};
+                pool->caches.push_back(this);
+            }
+
+            ~thread_cache();
+
+            void *allocate(std::uint32_t size_class)
+            {
+                auto &list = lists[size_class];
+                if (list.head)
+                {
+                    bump(stats.cache_hits);
+                    return list.pop();
+                }
+
+                // refills half a cache at once from the shared pool
+                {
+                    std::lock_guard lock{pool->mutexes[size_class]};
+                    transfer(pool->lists[size_class], list, std::max<std::size_t>(pool->options.thread_cache_size / 2, 1));
+                }
+                if (list.head)
+                    return list.pop();
+                return block_alloc(size_class);
+            }
+
+            void deallocate(void *p, std::uint32_t size_class)
+            {
+                auto &list = lists[size_class];
+                list.push(static_cast<free_block *>(p));
+                if (list.count <= pool->options.thread_cache_size)
+                    return;
+
+                // spills half the cache, so that a thread freeing what another allocates
+                // does not hold every block
+                std::lock_guard lock{pool->mutexes[size_class]};
+                transfer(list, pool->lists[size_class], list.count / 2);
+            }
+        };
+
+        thread_local bool cache_destroyed = false;
+
+        thread_cache::~thread_cache()
+        {
+            cache_destroyed = true;
+            for (std::size_t c = 0; c < lists.size(); ++c)
+            {
+                std::lock_guard lock{pool->mutexes[c]};
+                transfer(lists[c], pool->lists[c], lists[c].count);
+            }
+
+            std::lock_guard lock{pool->registry_mutex};
+            std::erase(pool->caches, this);
+            pool->retired.allocations += stats.allocations;
+            pool->retired.frees += stats.frees;
+            pool->retired.reallocations += stats.reallocations;
+            pool->retired.cache_hits += stats.cache_hits;
+        }
+
+        // nullptr once the thread's cache was destroyed, at thread exit
+        thread_cache *local_cache()
+        {
+            if (cache_destroyed)
+                return nullptr;
+            thread_local thread_cache cache;
+            return &cache;
+        }
+
+        void *pool_malloc(int n)
+        {
+            auto size = static_cast<std::size_t>(std::max(n, 1));
+            auto cache = local_cache();
+            if (cache)
+                bump(cache->stats.allocations);
+
+            if (size > pool->options.max_pooled_size)
+            {
+                size = (size + 7) & ~std::size_t{7};
+                auto h = static_cast<header *>(std::malloc(sizeof(header) + size));
+                if (!h)
+                    return nullptr;
+                *h = {large_class, static_cast<std::uint32_t>(size)};
+                return h + 1;
+            }
+
+            auto c = static_cast<std::uint32_t>(size_class(size));
+            if (cache)
+                return cache->allocate(c);
+
+            {
+                std::lock_guard lock{pool->mutexes[c]};
+                if (pool->lists[c].head)
+                    return pool->lists[c].pop();
+            }
+            return block_alloc(c);
+        }
+
+        void pool_free(void *p)
+        {
+            if (!p)
+                return;
+
+            auto h = header_of(p);
+            auto cache = local_cache();
+            if (cache)
+                bump(cache->stats.frees);
+
+            if (h->size_class == large_class)
+            {
+                std::free(h);
+            }
+            else if (cache)
+            {
+                cache->deallocate(p, h->size_class);
+            }
+            else
+            {
+                std::lock_guard lock{pool->mutexes[h->size_class]};
+                pool->lists[h->size_class].push(static_cast<free_block *>(p));
+            }
+        }
+
+        int pool_size(void *p)
+        {
+            return p ? static_cast<int>(header_of(p)->size) : 0;
+        }
+
+        void *pool_realloc(void *p, int n)
+        {
+            if (auto cache = local_cache())
+                bump(cache->stats.reallocations);
+
+            // the block already has room, SQLite often grows within a size class
+            if (static_cast<std::size_t>(n) <= header_of(p)->size && header_of(p)->size_class != large_class)
+                return p;
+
+            auto q = pool_malloc(n);
+            if (!q)
+                return nullptr;
+            std::memcpy(q, p, std::min<std::size_t>(header_of(p)->size, static_cast<std::size_t>(n)));
+            pool_free(p);
+            return q;
+        }
+
+        int pool_roundup(int n)
+        {
+            auto size = static_cast<std::size_t>(std::max(n, 1));
+            if (size > pool->options.max_pooled_size)
+                return static_cast<int>((size + 7) & ~std::size_t{7});
+            return static_cast<int>(class_size(size_class(size)));
+        }
+
+        int pool_init(void *)
+        {
+            return SQLITE_OK;
+        }
+
+        void pool_shutdown(void *)
+        {
+        }
+    }
+
+    void install(allocator_options const &options)
+    {
+        if (options.max_pooled_size > max_pool_limit)
+        {
+            throw std::invalid_argument("max_pooled_size must not exceed 64KB");
+        }
+        if (pool)
+        {
+            throw std::logic_error("The pool allocator is already installed");
+        }
+
+        auto p = new shared_pool{};
+        p->options = options;
+        p->class_count = size_class(std::max<std::size_t>(options.max_pooled_size, 1)) + 1;
+        p->mutexes = std::vector<std::mutex>(p->class_count);
+        p->lists.resize(p->class_count);
+
+        static sqlite3_mem_methods methods{pool_malloc, pool_free, pool_realloc, pool_size, pool_roundup, pool_init, pool_shutdown, nullptr};
+        // fails with SQLITE_MISUSE once SQLite is initialized, e.g. by a first connection
+        if (sqlite3_config(SQLITE_CONFIG_MALLOC, &methods) != SQLITE_OK)
+        {
+            delete p;
+            throw std::logic_error("The allocator must be configured before any database is opened");
+        }
+        pool = p;
+    }
+
+    allocator_stats stats()
+    {
+        allocator_stats s;
+        if (pool)
+        {
+            std::lock_guard lock{pool->registry_mutex};
+            s = pool->retired;
+            for (auto cache : pool->caches)
+            {
+                s.allocations += cache->stats.allocations.load(std::memory_order_relaxed);
+                s.frees += cache->stats.frees.load(std::memory_order_relaxed);
+                s.reallocations += cache->stats.reallocations.load(std::memory_order_relaxed);
+                s.cache_hits += cache->stats.cache_hits.load(std::memory_order_relaxed);
+            }
+        }
+
+        sqlite3_int64 used = 0, highwater = 0;
+        sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &used, &highwater, 0);
+        s.memory_used = static_cast<std::uint64_t>(used);
+        s.memory_highwater = static_cast<std::uint64_t>(highwater);
+        return s;
+    }
+}
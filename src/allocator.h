@@ -0,0 +1,54 @@
+#pragma once
+
+#include "docudb.hpp"
+#include <cstddef>
+#include <cstdint>
+
+#ifndef DOCUDB_ALLOCATOR_H
+#define DOCUDB_ALLOCATOR_H
+
+namespace docudb::details::allocator
+{
+    /**
+     * @brief Size classes of the pools: multiples of 16 bytes up to 128, then four classes
+     *        per power of two, e.g. 160, 192, 224, 256, 320...
+     */
+    constexpr std::size_t size_class(std::size_t size)
+    {
+        if (size <= 128)
+            return size == 0 ? 0 : (size - 1) / 16;
+
+        std::size_t lg = 0;
+        for (auto n = size - 1; n > 1; n >>= 1)
+            ++lg;
+        return 8 + (lg - 7) * 4 + (((size - 1) >> (lg - 2)) & 3);
+    }
+
+    constexpr std::size_t class_size(std::size_t size_class)
+    {
+        if (size_class < 8)
+            return (size_class + 1) * 16;
+
+        auto lg = 7 + (size_class - 8) / 4;
+        return (std::size_t{1} << lg) + ((size_class - 8) % 4 + 1) * (std::size_t{1} << (lg - 2));
+    }
+
+    /**
+     * @brief Installs the pooled sqlite3_mem_methods, process-wide.
+     *
+     * Allocations up to max_pooled_size are rounded to their size class and recycled
+     * through a cache per thread, refilled from and spilled to a shared pool per class
+     * in batches; larger ones go straight to malloc. Every block carries an 8-byte header
+     * with its class, so that xSize and xFree need no lookup.
+     *
+     * @throws std::logic_error if SQLite is already initialized.
+     */
+    void install(allocator_options const &options);
+
+    /**
+     * @brief Sums the counters of the live threads and of the exited ones.
+     */
+    allocator_stats stats();
+}
+
+#endif // DOCUDB_ALLOCATOR_H
@@ -8,7 +8,25 @@
 #include <algorithm>
 #include <utility>
 #include <sstream>
+#include <numeric>
+#include <regex>
+#include <filesystem>
+#include <atomic>
+#include <limits>
+#include <cmath>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
 #include "sqlite_extensions.h"
+#include "json.h"
+#include "hash.h"
+#include "sketch.h"
+#include "maintenance.h"
+#include "allocator.h"
+#include "page_cache.h"
+#include "mirror.h"
 #include "docudb_version.h"
 
 using namespace std::string_literals;
@@ -44,8 +62,24 @@ namespace docudb
                 }
             }
 
+            statement::statement(statement &&other) noexcept
+                : db_handle_(other.db_handle_), stmt_(std::exchange(other.stmt_, nullptr)), rc(other.rc) {}
+
+            statement &statement::operator=(statement &&other) noexcept
+            {
+                if (this != &other)
+                {
+                    sqlite3_finalize(stmt_);
+                    db_handle_ = other.db_handle_;
+                    stmt_ = std::exchange(other.stmt_, nullptr);
+                    rc = other.rc;
+                }
+                return *this;
+            }
+
             statement::~statement()
             {
+                // a no-op for moved-from statements
                 sqlite3_finalize(stmt_);
             }
 
@@ -93,7 +127,7 @@ namespace docudb
 
             statement &statement::bind(int index, std::string_view value)
             {
-                rc = sqlite3_bind_text(stmt_, index, value.data(), -1, SQLITE_TRANSIENT);
+                rc = sqlite3_bind_text(stmt_, index, value.data(), static_cast<int>(value.size()), SQLITE_TRANSIENT);
                 if (rc != SQLITE_OK)
                 {
                     throw db_exception{db_handle_, "Failed to bind value"};
@@ -128,6 +162,14 @@ namespace docudb
                 return *this;
             }
 
+            statement &statement::reset() noexcept
+            {
+                sqlite3_reset(stmt_);
+                sqlite3_clear_bindings(stmt_);
+                rc = SQLITE_OK;
+                return *this;
+            }
+
             template <>
             std::string statement::get(int index) const
             {
@@ -180,6 +222,22 @@ namespace docudb
                 return sqlite3_column_int(stmt_, index);
             }  
 
+            template <>
+            db_value statement::get(int index) const
+            {
+                switch (sqlite3_column_type(stmt_, index))
+                {
+                case SQLITE_INTEGER:
+                    return sqlite3_column_int64(stmt_, index);
+                case SQLITE_FLOAT:
+                    return sqlite3_column_double(stmt_, index);
+                case SQLITE_NULL:
+                    return nullptr;
+                default:
+                    return get<std::string>(index);
+                }
+            }
+
             json_type statement::get_type(int index) const noexcept
             {
                 switch(sqlite3_column_type(stmt_, index)) {
@@ -238,6 +296,42 @@ namespace docudb
             private:
                 sqlite3 *db_handle_;
             };
+
+            // like transaction, but nests within a transaction opened by the caller
+            struct savepoint
+            {
+                savepoint(sqlite3 *db_handle, std::string_view name) : db_handle_(db_handle), name_(name)
+                {
+                    auto sql = std::format("SAVEPOINT {};", name_);
+                    if (sqlite3_exec(db_handle_, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+                    {
+                        throw db_exception{db_handle_, "Failed to begin transaction"};
+                    }
+                }
+
+                void release()
+                {
+                    auto sql = std::format("RELEASE {};", name_);
+                    if (sqlite3_exec(db_handle_, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+                    {
+                        throw db_exception{db_handle_, "Failed to commit transaction"};
+                    }
+                    db_handle_ = nullptr;
+                }
+
+                ~savepoint()
+                {
+                    if (db_handle_)
+                    {
+                        auto sql = std::format("ROLLBACK TO {0}; RELEASE {0};", name_);
+                        sqlite3_exec(db_handle_, sql.c_str(), nullptr, nullptr, nullptr);
+                    }
+                }
+
+            private:
+                sqlite3 *db_handle_;
+                std::string_view name_;
+            };
         }
 
         // inspired by https://stackoverflow.com/questions/24365331/how-can-i-generate-uuid-in-c-without-using-boost-library
@@ -286,6 +380,454 @@ namespace docudb
                 return std::string(uuid);
             }
         }
+
+        namespace json
+        {
+            std::string &thread_buffer()
+            {
+                thread_local std::string buffer;
+                return buffer;
+            }
+
+            void write_string(std::string &out, std::string_view value)
+            {
+                const char *hex_chars = "0123456789abcdef";
+
+                out += '"';
+                for (auto c : value)
+                {
+                    switch (c)
+                    {
+                    case '"':
+                        out += "\\\"";
+                        break;
+                    case '\\':
+                        out += "\\\\";
+                        break;
+                    case '\n':
+                        out += "\\n";
+                        break;
+                    case '\r':
+                        out += "\\r";
+                        break;
+                    case '\t':
+                        out += "\\t";
+                        break;
+                    default:
+                        if (static_cast<unsigned char>(c) < 0x20)
+                        {
+                            out += "\\u00";
+                            out += hex_chars[(c >> 4) & 0xf];
+                            out += hex_chars[c & 0xf];
+                        }
+                        else
+                        {
+                            out += c;
+                        }
+                    }
+                }
+                out += '"';
+            }
+        }
+    }
+
+    namespace json_patch
+    {
+        namespace
+        {
+            constexpr std::string_view op_names[] = {"add", "remove", "replace", "move", "copy", "test"};
+
+            std::string pointer_token(std::string_view key)
+            {
+                std::string token;
+                for (auto c : key)
+                {
+                    if (c == '~')
+                        token += "~0";
+                    else if (c == '/')
+                        token += "~1";
+                    else
+                        token += c;
+                }
+                return token;
+            }
+
+            void diff_impl(details::json::value const &a, details::json::value const &b, std::string const &pointer, std::vector<operation> &ops)
+            {
+                using kind = details::json::value::kind;
+
+                if (a.type == kind::object && b.type == kind::object)
+                {
+                    for (auto const &[key, v] : a.members)
+                    {
+                        auto other = b.find(key);
+                        if (!other)
+                            ops.push_back({.op = op_type::remove, .path = pointer + "/" + pointer_token(key)});
+                        else
+                            diff_impl(v, *other, pointer + "/" + pointer_token(key), ops);
+                    }
+                    for (auto const &[key, v] : b.members)
+                    {
+                        if (!a.find(key))
+                            ops.push_back({.op = op_type::add, .path = pointer + "/" + pointer_token(key), .value = details::json::to_string(v)});
+                    }
+                }
+                else if (a.type == kind::array && b.type == kind::array)
+                {
+                    // elements equal at both ends are kept, so that an insertion or removal only costs
+                    // one operation; the rest is compared by position, which is not a minimal edit script
+                    auto prefix = std::size_t{0};
+                    auto suffix = std::size_t{0};
+                    auto shorter = std::min(a.items.size(), b.items.size());
+                    while (prefix < shorter && details::json::equal(a.items[prefix], b.items[prefix]))
+                        ++prefix;
+                    while (suffix < shorter - prefix && details::json::equal(a.items[a.items.size() - 1 - suffix], b.items[b.items.size() - 1 - suffix]))
+                        ++suffix;
+
+                    auto a_end = a.items.size() - suffix;
+                    auto b_end = b.items.size() - suffix;
+                    auto common = std::min(a_end, b_end);
+                    for (auto i = prefix; i < common; ++i)
+                        diff_impl(a.items[i], b.items[i], std::format("{}/{}", pointer, i), ops);
+                    // remove from the back, so that the indices stay valid
+                    for (auto i = a_end; i > common; --i)
+                        ops.push_back({.op = op_type::remove, .path = std::format("{}/{}", pointer, i - 1)});
+                    for (auto i = common; i < b_end; ++i)
+                        ops.push_back({.op = op_type::add, .path = suffix == 0 ? pointer + "/-" : std::format("{}/{}", pointer, i), .value = details::json::to_string(b.items[i])});
+                }
+                else if (!details::json::equal(a, b))
+                {
+                    ops.push_back({.op = op_type::replace, .path = pointer, .value = details::json::to_string(b)});
+                }
+            }
+        }
+
+        std::vector<operation> diff(std::string_view from_json, std::string_view to_json)
+        {
+            std::vector<operation> ops;
+            diff_impl(details::json::parse(from_json), details::json::parse(to_json), "", ops);
+            return ops;
+        }
+
+        std::string to_string(std::vector<operation> const &ops)
+        {
+            std::string out = "[";
+            for (auto const &op : ops)
+            {
+                if (out.size() > 1)
+                    out += ',';
+                out += "{\"op\":\"";
+                out += op_names[static_cast<int>(op.op)];
+                out += "\",\"path\":";
+                details::json::write_string(out, op.path);
+                if (op.op == op_type::move || op.op == op_type::copy)
+                {
+                    out += ",\"from\":";
+                    details::json::write_string(out, op.from);
+                }
+                if (op.op == op_type::add || op.op == op_type::replace || op.op == op_type::test)
+                {
+                    out += ",\"value\":";
+                    out += op.value;
+                }
+                out += '}';
+            }
+            out += ']';
+            return out;
+        }
+
+        std::vector<operation> parse(std::string_view json)
+        {
+            using kind = details::json::value::kind;
+
+            auto patch = details::json::parse(json);
+            if (patch.type != kind::array)
+                throw std::invalid_argument("JSON Patch must be an array");
+
+            std::vector<operation> ops;
+            for (auto const &item : patch.items)
+            {
+                auto op = item.find("op");
+                auto path = item.find("path");
+                if (!op || op->type != kind::string || !path || path->type != kind::string)
+                    throw std::invalid_argument("JSON Patch operation requires op and path");
+
+                auto name = std::find(std::begin(op_names), std::end(op_names), op->text);
+                if (name == std::end(op_names))
+                    throw std::invalid_argument("Unknown JSON Patch operation: " + op->text);
+
+                operation ret{.op = static_cast<op_type>(name - std::begin(op_names)), .path = path->text};
+                if (ret.op == op_type::move || ret.op == op_type::copy)
+                {
+                    auto from = item.find("from");
+                    if (!from || from->type != kind::string)
+                        throw std::invalid_argument("JSON Patch operation requires from");
+                    ret.from = from->text;
+                }
+                if (ret.op == op_type::add || ret.op == op_type::replace || ret.op == op_type::test)
+                {
+                    auto value = item.find("value");
+                    if (!value)
+                        throw std::invalid_argument("JSON Patch operation requires value");
+                    ret.value = details::json::to_string(*value);
+                }
+                ops.push_back(std::move(ret));
+            }
+            return ops;
+        }
+
+        namespace
+        {
+            using details::json::value;
+
+            // segments of a SQLite json path as written, e.g. $.a."b c"[0] -> .a, ."b c", [0]
+            std::vector<std::string_view> json_path_split(std::string_view path)
+            {
+                auto invalid = [&]
+                { return std::invalid_argument(std::format("Invalid json path: {}", path)); };
+
+                std::vector<std::string_view> segments;
+                std::size_t pos = 1;
+                while (pos < path.size())
+                {
+                    std::size_t end;
+                    if (path.substr(pos).starts_with(".\""))
+                    {
+                        end = path.find('"', pos + 2);
+                        if (end == std::string_view::npos)
+                            throw invalid();
+                        ++end;
+                    }
+                    else if (path[pos] == '.')
+                    {
+                        end = std::min(path.find_first_of(".[", pos + 1), path.size());
+                    }
+                    else if (path[pos] == '[')
+                    {
+                        end = path.find(']', pos);
+                        if (end == std::string_view::npos)
+                            throw invalid();
+                        ++end;
+                    }
+                    else
+                    {
+                        throw invalid();
+                    }
+                    segments.push_back(path.substr(pos, end - pos));
+                    pos = end;
+                }
+                return segments;
+            }
+
+            // tokens of a SQLite json path, e.g. $.a."b c"[0] -> a, b c, 0; [#] appends like -
+            std::vector<std::string> json_path_tokens(std::string_view path)
+            {
+                std::vector<std::string> tokens;
+                for (auto segment : json_path_split(path))
+                {
+                    if (segment.starts_with(".\""))
+                        tokens.emplace_back(segment.substr(2, segment.size() - 3));
+                    else if (segment[0] == '.')
+                        tokens.emplace_back(segment.substr(1));
+                    else
+                        tokens.emplace_back(segment == "[#]" ? "-" : segment.substr(1, segment.size() - 2));
+                }
+                return tokens;
+            }
+
+            std::vector<std::string> pointer_tokens(std::string_view pointer)
+            {
+                if (!pointer.empty() && pointer[0] == '$')
+                    return json_path_tokens(pointer);
+                if (!pointer.empty() && pointer[0] != '/')
+                    throw std::invalid_argument(std::format("Invalid JSON Pointer: {}", pointer));
+
+                std::vector<std::string> tokens;
+                std::size_t pos = 0;
+                while (pos < pointer.size())
+                {
+                    auto next = pointer.find('/', pos + 1);
+                    auto raw = pointer.substr(pos + 1, next == std::string_view::npos ? std::string_view::npos : next - pos - 1);
+                    pos = next == std::string_view::npos ? pointer.size() : next;
+
+                    std::string token;
+                    for (std::size_t i = 0; i < raw.size(); ++i)
+                    {
+                        if (raw[i] == '~' && i + 1 < raw.size())
+                            token += raw[++i] == '1' ? '/' : '~';
+                        else
+                            token += raw[i];
+                    }
+                    tokens.push_back(std::move(token));
+                }
+                return tokens;
+            }
+
+            bool is_array_index(std::string_view token)
+            {
+                return !token.empty() && std::all_of(token.begin(), token.end(), [](char c)
+                                                     { return c >= '0' && c <= '9'; }) &&
+                       (token.size() == 1 || token[0] != '0');
+            }
+
+            // SQLite json path segment of a token under an object and under an array parent;
+            // they differ for JSON Pointer tokens such as 1 or -, which depend on the parent's type
+            struct path_segment
+            {
+                std::string object;
+                std::string array;
+            };
+
+            std::vector<path_segment> path_segments(std::string_view pointer)
+            {
+                std::vector<path_segment> segments;
+                if (!pointer.empty() && pointer[0] == '$')
+                {
+                    // SQLite paths already say which one they mean
+                    for (auto segment : json_path_split(pointer))
+                        segments.push_back({std::string{segment}, std::string{segment}});
+                    return segments;
+                }
+
+                for (auto const &token : pointer_tokens(pointer))
+                {
+                    auto member = std::format(".\"{}\"", token);
+                    if (token == "-")
+                        segments.push_back({member, "[#]"});
+                    else if (is_array_index(token))
+                        segments.push_back({member, std::format("[{}]", token)});
+                    else
+                        segments.push_back({member, member});
+                }
+                return segments;
+            }
+
+            // array index of a token, size() for "-" when appending is allowed
+            std::size_t array_index(value const &array, std::string const &token, bool append)
+            {
+                if (append && token == "-")
+                    return array.items.size();
+
+                auto index = is_array_index(token) ? std::stoull(token) : std::numeric_limits<std::size_t>::max();
+                if (index > array.items.size() || (!append && index == array.items.size()))
+                    throw std::invalid_argument(std::format("JSON Patch index out of range: {}", token));
+                return index;
+            }
+
+            value &resolve(value &root, std::vector<std::string> const &tokens, std::size_t count)
+            {
+                auto current = &root;
+                for (std::size_t i = 0; i < count; ++i)
+                {
+                    if (current->type == value::kind::object)
+                        current = current->find(tokens[i]);
+                    else if (current->type == value::kind::array)
+                        current = &current->items[array_index(*current, tokens[i], false)];
+                    else
+                        current = nullptr;
+
+                    if (!current)
+                        throw std::invalid_argument("JSON Patch path not found");
+                }
+                return *current;
+            }
+
+            void add(value &root, std::string_view pointer, value v)
+            {
+                auto tokens = pointer_tokens(pointer);
+                if (tokens.empty())
+                {
+                    root = std::move(v);
+                    return;
+                }
+
+                auto &parent = resolve(root, tokens, tokens.size() - 1);
+                auto const &last = tokens.back();
+                if (parent.type == value::kind::object)
+                {
+                    if (auto existing = parent.find(last))
+                        *existing = std::move(v);
+                    else
+                        parent.members.emplace_back(last, std::move(v));
+                }
+                else if (parent.type == value::kind::array)
+                {
+                    auto index = array_index(parent, last, true);
+                    parent.items.insert(parent.items.begin() + static_cast<std::ptrdiff_t>(index), std::move(v));
+                }
+                else
+                {
+                    throw std::invalid_argument("JSON Patch path not found");
+                }
+            }
+
+            value remove(value &root, std::string_view pointer)
+            {
+                auto tokens = pointer_tokens(pointer);
+                if (tokens.empty())
+                    return std::exchange(root, value{});
+
+                auto &parent = resolve(root, tokens, tokens.size() - 1);
+                if (parent.type == value::kind::object)
+                {
+                    auto it = std::find_if(parent.members.begin(), parent.members.end(), [&](auto const &m)
+                                           { return m.first == tokens.back(); });
+                    if (it == parent.members.end())
+                        throw std::invalid_argument("JSON Patch path not found");
+                    auto removed = std::move(it->second);
+                    parent.members.erase(it);
+                    return removed;
+                }
+                if (parent.type == value::kind::array)
+                {
+                    auto it = parent.items.begin() + static_cast<std::ptrdiff_t>(array_index(parent, tokens.back(), false));
+                    auto removed = std::move(*it);
+                    parent.items.erase(it);
+                    return removed;
+                }
+                throw std::invalid_argument("JSON Patch path not found");
+            }
+        }
+
+        std::string apply(std::string_view json, std::vector<operation> const &ops)
+        {
+            auto root = details::json::parse(json);
+            for (auto const &op : ops)
+            {
+                switch (op.op)
+                {
+                case op_type::add:
+                    add(root, op.path, details::json::parse(op.value));
+                    break;
+                case op_type::remove:
+                    remove(root, op.path);
+                    break;
+                case op_type::replace:
+                {
+                    auto tokens = pointer_tokens(op.path);
+                    resolve(root, tokens, tokens.size()) = details::json::parse(op.value);
+                    break;
+                }
+                case op_type::move:
+                    add(root, op.path, remove(root, op.from));
+                    break;
+                case op_type::copy:
+                {
+                    auto tokens = pointer_tokens(op.from);
+                    add(root, op.path, resolve(root, tokens, tokens.size()));
+                    break;
+                }
+                case op_type::test:
+                {
+                    auto tokens = pointer_tokens(op.path);
+                    if (!details::json::equal(resolve(root, tokens, tokens.size()), details::json::parse(op.value)))
+                        throw std::invalid_argument(std::format("JSON Patch test failed: {}", op.path));
+                    break;
+                }
+                }
+            }
+            return details::json::to_string(root);
+        }
     }
 
     db_exception::db_exception(sqlite3 *db_handle, std::string_view msg) : std::runtime_error(std::string(msg) + ": " + sqlite3_errmsg(db_handle)) {}
@@ -353,17 +895,21 @@ namespace docudb
         db_handle = db;
     }    
 
-    database::database(database&& other) : db_handle(std::exchange(other.db_handle, nullptr)) {}
+    database::database(database&& other) : db_handle(std::exchange(other.db_handle, nullptr)), checkpointer(std::move(other.checkpointer)), vacuum_scheduler(std::move(other.vacuum_scheduler)) {}
     database& database::operator=(database&& other) {
         if (this != &other)
         {
             db_handle = std::exchange(other.db_handle, nullptr);
+            checkpointer = std::move(other.checkpointer);
+            vacuum_scheduler = std::move(other.vacuum_scheduler);
         }
         return *this;
     }
 
     database::~database()
     {
+        checkpointer.reset();
+        vacuum_scheduler.reset();
         if (db_handle)
         {
             sqlite3_close(db_handle);
@@ -371,6 +917,11 @@ namespace docudb
     }
 
     db_collection database::collection(std::string_view name) const
+    {
+        return details::open_collection(db_handle, name);
+    }
+
+    db_collection details::open_collection(sqlite3 *db_handle, std::string_view name)
     {
         // create a statement scope that finalizes the statement when it goes out of scope
         {
@@ -416,10 +967,49 @@ namespace docudb
         return db_collection{name, db_handle};
     }
 
+    bool database::drop_collection(std::string_view name)
+    {
+        details::sqlite::savepoint savepoint{db_handle, "docudb_drop"};
+
+        {
+            details::sqlite::statement stmt{db_handle, "SELECT name FROM sqlite_master WHERE type='table' AND name=?;"};
+            if (stmt.bind(1, name).step().result_code() != SQLITE_ROW)
+            {
+                return false;
+            }
+        }
+
+        // side tables, e.g. the history, are named after the collection
+        std::vector<std::string> tables{std::string{name}};
+        {
+            details::sqlite::statement stmt{db_handle, "SELECT name FROM sqlite_master WHERE type='table' AND substr(name, 1, length(?1) + 1) = ?1 || '$';"};
+            stmt.bind(1, name);
+            while (stmt.step().result_code() == SQLITE_ROW)
+            {
+                tables.push_back(stmt.get<std::string>(0));
+            }
+        }
+
+        // indexes, triggers and generated columns go with the tables
+        for (auto const &table : tables)
+        {
+            details::sqlite::statement stmt{db_handle, std::format("DROP TABLE [{}];", table)};
+            if (stmt.step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to drop collection"};
+            }
+        }
+
+        savepoint.release();
+        return true;
+    }
+
     std::vector<db_collection> database::collections() const
     {
         {
-            auto check_table_query = "SELECT name FROM sqlite_master WHERE type='table';"sv;
+            // SQLite's own tables, e.g. sqlite_stat1 created by ANALYZE, and the side tables
+            // of collections, e.g. their history, are not collections
+            auto check_table_query = "SELECT name FROM sqlite_master WHERE type='table' AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' AND instr(name, '$') = 0;"sv;
             details::sqlite::statement stmt{db_handle, check_table_query};
 
             std::vector<db_collection> collections;
@@ -445,6 +1035,11 @@ namespace docudb
     }
 
     void database::load_extensions() const
+    {
+        details::load_extensions(db_handle);
+    }
+
+    void details::load_extensions(sqlite3 *db_handle)
     {
         sqlite3_create_function_v2(
             db_handle,
@@ -457,6 +1052,36 @@ namespace docudb
             nullptr,              // No final function (not aggregate)
             nullptr               // No destroy function
         );
+
+        sqlite3_create_function_v2(db_handle, "contains", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, ::sqlite_contains_func, nullptr, nullptr, nullptr);
+
+        // used by the generated column of db_collection::enable_content_hash, hence innocuous
+        sqlite3_create_function_v2(db_handle, "content_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, ::sqlite_content_hash_func, nullptr, nullptr, nullptr);
+
+        // used by the history triggers of db_collection::enable_history
+        sqlite3_create_function_v2(db_handle, "json_diff", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, ::sqlite_json_diff_func, nullptr, nullptr, nullptr);
+
+        // approximate aggregates, their sketches can be stored and merged
+        sqlite3_create_function_v2(db_handle, "hll", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, nullptr, ::sqlite_hll_step, ::sqlite_hll_final, nullptr);
+        sqlite3_create_function_v2(db_handle, "hll_merge", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, nullptr, ::sqlite_hll_merge_step, ::sqlite_hll_final, nullptr);
+        sqlite3_create_function_v2(db_handle, "hll_estimate", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, ::sqlite_hll_estimate_func, nullptr, nullptr, nullptr);
+        sqlite3_create_function_v2(db_handle, "tdigest", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, nullptr, ::sqlite_tdigest_step, ::sqlite_tdigest_final, nullptr);
+        sqlite3_create_function_v2(db_handle, "tdigest_merge", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, nullptr, ::sqlite_tdigest_merge_step, ::sqlite_tdigest_final, nullptr);
+        sqlite3_create_function_v2(db_handle, "tdigest_quantile", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, ::sqlite_tdigest_quantile_func, nullptr, nullptr, nullptr);
+    }
+
+    void database::use_fast_like() const
+    {
+        details::use_fast_like(db_handle);
+    }
+
+    void details::use_fast_like(sqlite3 *db_handle)
+    {
+        // overrides the built-in LIKE, with and without ESCAPE
+        for (auto argc : {2, 3})
+        {
+            sqlite3_create_function_v2(db_handle, "like", argc, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, ::sqlite_like_func, nullptr, nullptr, nullptr);
+        }
     }
 
     void database::backup_to(database &dest, std::function<void(int, int)> progress) const
@@ -519,40 +1144,505 @@ namespace docudb
         return {};
     }
 
-    std::string read_doc_body(sqlite3 *db_handle, std::string_view table_name, std::string_view doc_id)
+    void database::start_checkpoints(checkpoint_options const &options)
     {
-        auto get_doc_query = std::format("SELECT body FROM [{}] WHERE docid=?;", table_name);
-        details::sqlite::statement stmt(db_handle, get_doc_query);
+        checkpointer.reset();
 
-        stmt
-            .bind(1, doc_id)
-            .step();
+        auto filename = filename_database();
+        if (filename.empty())
+        {
+            throw db_exception{db_handle, "Checkpoints require a database file"};
+        }
 
-        if (stmt.result_code() != SQLITE_ROW)
+        auto ret = sqlite3_exec(db_handle, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+        if (ret != SQLITE_OK)
         {
-            throw db_exception{db_handle, "Document not found"};
+            throw db_exception{db_handle, "Failed to enable WAL mode"};
         }
 
-        return stmt.get<std::string>(0);
+        sqlite3_wal_autocheckpoint(db_handle, 0);
+        checkpointer = std::make_unique<details::checkpoint_manager>(filename, filename_wal(), options);
     }
 
-    // COLLECTION
-    db_collection::db_collection(std::string_view name, sqlite3 *db_handle) : db_handle(db_handle), table_name(name) {}
-
-    std::string db_collection::name() const noexcept
+    void database::stop_checkpoints()
     {
-        return table_name;
+        if (!checkpointer)
+            return;
+
+        checkpointer.reset();
+        // SQLite's default threshold, in pages
+        sqlite3_wal_autocheckpoint(db_handle, 1000);
     }
 
-    db_document db_collection::doc(std::string_view doc_id) const
+    checkpoint_stats database::checkpoint_statistics() const
     {
-        return db_document{table_name, doc_id, db_handle};
+        return checkpointer ? checkpointer->stats() : checkpoint_stats{};
     }
 
-    db_document db_collection::doc()
+    void database::auto_vacuum(auto_vacuum_mode mode)
     {
-        auto new_doc_id = details::uuid::generate_uuid_v4();
-        return create(new_doc_id);
+        auto sql = std::format("PRAGMA auto_vacuum = {};", static_cast<int>(mode));
+        auto ret = sqlite3_exec(db_handle, sql.c_str(), nullptr, nullptr, nullptr);
+        if (ret != SQLITE_OK)
+        {
+            throw db_exception{db_handle, "Failed to set auto_vacuum"};
+        }
+
+        // once tables exist, the mode only changes when the file is rebuilt
+        if (auto_vacuum() != mode)
+        {
+            ret = sqlite3_exec(db_handle, "VACUUM;", nullptr, nullptr, nullptr);
+            if (ret != SQLITE_OK)
+            {
+                throw db_exception{db_handle, "Failed to vacuum"};
+            }
+        }
+    }
+
+    auto_vacuum_mode database::auto_vacuum() const
+    {
+        return static_cast<auto_vacuum_mode>(details::pragma_value(db_handle, "auto_vacuum"));
+    }
+
+    space_stats database::space_statistics() const
+    {
+        return space_stats{
+            details::pragma_value(db_handle, "page_size"),
+            details::pragma_value(db_handle, "page_count"),
+            details::pragma_value(db_handle, "freelist_count")};
+    }
+
+    void database::start_incremental_vacuum(vacuum_options const &options)
+    {
+        vacuum_scheduler.reset();
+
+        auto filename = filename_database();
+        if (filename.empty())
+        {
+            throw db_exception{db_handle, "Incremental vacuum requires a database file"};
+        }
+
+        if (auto_vacuum() != auto_vacuum_mode::incremental)
+        {
+            throw db_exception{db_handle, "Incremental vacuum requires auto_vacuum = INCREMENTAL"};
+        }
+
+        auto ret = sqlite3_exec(db_handle, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+        if (ret != SQLITE_OK)
+        {
+            throw db_exception{db_handle, "Failed to enable WAL mode"};
+        }
+
+        vacuum_scheduler = std::make_unique<details::vacuum_scheduler>(filename, options);
+    }
+
+    void database::stop_incremental_vacuum()
+    {
+        vacuum_scheduler.reset();
+    }
+
+    vacuum_stats database::vacuum_statistics() const
+    {
+        return vacuum_scheduler ? vacuum_scheduler->stats() : vacuum_stats{};
+    }
+
+    void database::compact()
+    {
+        auto filename = filename_database();
+        if (filename.empty())
+        {
+            throw db_exception{db_handle, "Compaction requires a database file"};
+        }
+
+        auto compact_filename = filename + ".compact";
+        std::filesystem::remove(compact_filename);
+
+        {
+            details::sqlite::statement stmt{db_handle, "VACUUM INTO ?1;"};
+            stmt.bind(1, compact_filename);
+            stmt.step();
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                std::filesystem::remove(compact_filename);
+                throw db_exception{db_handle, "Failed to vacuum into the compacted file"};
+            }
+        }
+
+        // the version of the pager changes with every commit, from this connection or another,
+        // and is read again when a lock is taken: here the vacuumed one, below the locked one
+        unsigned int data_version = 0;
+        sqlite3_file_control(db_handle, "main", SQLITE_FCNTL_DATA_VERSION, &data_version);
+
+        {
+            database compacted{compact_filename, open_mode::read_only, threading_mode::multi_thread};
+            auto bak = sqlite3_backup_init(db_handle, "main", compacted.db_handle, "main");
+            if (!bak)
+            {
+                std::filesystem::remove(compact_filename);
+                throw db_exception{db_handle, "Failed to copy the compacted file"};
+            }
+
+            // a step of no pages takes the write lock, kept until the backup is finished,
+            // so that nothing is committed between the check and the copy
+            auto rc = sqlite3_backup_step(bak, 0);
+            unsigned int locked_version = 0;
+            sqlite3_file_control(db_handle, "main", SQLITE_FCNTL_DATA_VERSION, &locked_version);
+
+            auto modified = rc == SQLITE_OK && locked_version != data_version;
+            auto copied = rc == SQLITE_OK && !modified && sqlite3_backup_step(bak, -1) == SQLITE_DONE;
+
+            // rolls the destination back unless the copy is done
+            sqlite3_backup_finish(bak);
+            if (!copied)
+            {
+                std::filesystem::remove(compact_filename);
+                throw db_exception{db_handle, modified ? "Database modified during compaction" : "Failed to copy the compacted file"};
+            }
+        }
+
+        std::filesystem::remove(compact_filename);
+    }
+
+    tiered_collection database::tiered(std::string_view name, tiered_options const &options)
+    {
+        return tiered_collection{db_handle, name, options};
+    }
+
+    void database::use_pool_allocator(allocator_options const &options)
+    {
+        details::allocator::install(options);
+    }
+
+    allocator_stats database::allocator_statistics()
+    {
+        return details::allocator::stats();
+    }
+
+    void database::use_shared_page_cache(page_cache_options const &options)
+    {
+        details::page_cache::install(options);
+    }
+
+    page_cache_stats database::page_cache_statistics()
+    {
+        return details::page_cache::stats();
+    }
+
+    void database::lookaside(std::size_t slot_size, std::size_t slot_count)
+    {
+        // SQLite allocates the slots itself when given no buffer
+        if (sqlite3_db_config(db_handle, SQLITE_DBCONFIG_LOOKASIDE, nullptr, static_cast<int>(slot_size), static_cast<int>(slot_count)) != SQLITE_OK)
+        {
+            throw db_exception{db_handle, "Failed to configure lookaside memory"};
+        }
+    }
+
+    lookaside_stats database::lookaside_statistics() const
+    {
+        auto status = [this](int op, bool highwater)
+        {
+            int current = 0, high = 0;
+            sqlite3_db_status(db_handle, op, &current, &high, 0);
+            return static_cast<std::uint64_t>(highwater ? high : current);
+        };
+
+        lookaside_stats stats;
+        stats.slots_used = status(SQLITE_DBSTATUS_LOOKASIDE_USED, false);
+        // the counters are reported as highwater values
+        stats.hits = status(SQLITE_DBSTATUS_LOOKASIDE_HIT, true);
+        stats.misses_size = status(SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, true);
+        stats.misses_full = status(SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, true);
+        return stats;
+    }
+
+    collection_mirror database::mirror(std::string_view name, mirror_options const &options) const
+    {
+        return collection_mirror{db_handle, name, options};
+    }
+
+    db_read_session database::read_session() const
+    {
+        return db_read_session{db_handle, nullptr};
+    }
+
+    db_read_session database::read_session(db_snapshot const &at) const
+    {
+        if (!db_read_session::snapshots_supported())
+        {
+            throw std::runtime_error("SQLite was built without SQLITE_ENABLE_SNAPSHOT");
+        }
+        if (!at.handle)
+        {
+            throw std::invalid_argument("Empty snapshot");
+        }
+        return db_read_session{db_handle, at.handle.get()};
+    }
+
+    std::string read_doc_body(sqlite3 *db_handle, std::string_view table_name, std::string_view doc_id)
+    {
+        auto get_doc_query = std::format("SELECT body FROM [{}] WHERE docid=?;", table_name);
+        details::sqlite::statement stmt(db_handle, get_doc_query);
+
+        stmt
+            .bind(1, doc_id)
+            .step();
+
+        if (stmt.result_code() != SQLITE_ROW)
+        {
+            throw db_exception{db_handle, "Document not found"};
+        }
+
+        return stmt.get<std::string>(0);
+    }
+
+    void bind_parameters(details::sqlite::statement &stmt, query::binder const &binder)
+    {
+        for (const auto &[key, value] : binder.get_parameters())
+        {
+            std::visit([&](auto &&val)
+                        { stmt.bind(key, val); }, value);
+        }
+    }
+
+    // maps the json queries mirrored by generated columns (see db_collection::index) to the column names
+    std::unordered_map<std::string, std::string> read_generated_columns(sqlite3 *db_handle, std::string_view table_name)
+    {
+        auto table_sql_query = "SELECT sql FROM sqlite_master WHERE type='table' AND name=?;"sv;
+        details::sqlite::statement stmt{db_handle, table_sql_query};
+
+        stmt
+            .bind(1, table_name)
+            .step();
+
+        if (stmt.result_code() != SQLITE_ROW)
+        {
+            throw db_exception{db_handle, "Collection not found"};
+        }
+
+        // index columns are virtual and promoted columns stored, both untyped: a column with a type
+        // affinity would convert the values compared with it, unlike json_extract
+        static const std::regex column_regex{R"(\[([^\]]+)\]\s+GENERATED ALWAYS AS \(json_extract\(body, '([^']*)'\)\))"};
+
+        auto table_sql = stmt.get<std::string>(0);
+        std::unordered_map<std::string, std::string> columns;
+        for (auto it = std::sregex_iterator(table_sql.begin(), table_sql.end(), column_regex); it != std::sregex_iterator(); ++it)
+        {
+            columns.emplace((*it)[2].str(), (*it)[1].str());
+        }
+        return columns;
+    }
+
+    namespace details
+    {
+        // shared by the collections of a connection, so that the schema is read once rather than by every
+        // db_collection object; the mutex makes it safe to query one connection from several threads
+        struct generated_columns_cache
+        {
+            std::mutex mutex;
+            std::int64_t schema_version{-1};
+            std::unordered_map<std::string, std::shared_ptr<std::unordered_map<std::string, std::string> const>> tables;
+
+            void clear()
+            {
+                std::lock_guard lock{mutex};
+                schema_version = -1;
+                tables.clear();
+            }
+        };
+    }
+
+    namespace
+    {
+        std::mutex columns_caches_mutex;
+        std::unordered_map<sqlite3 *, std::shared_ptr<details::generated_columns_cache>> columns_caches;
+
+        void noop_func(sqlite3_context *, int, sqlite3_value **) {}
+
+        // the cache of a connection; SQLite drops it along with the connection, by destroying the user
+        // data of a function registered for that purpose, so that a reused handle does not inherit it
+        std::shared_ptr<details::generated_columns_cache> columns_cache_of(sqlite3 *db_handle)
+        {
+            if (!db_handle)
+                return nullptr;
+            {
+                std::lock_guard lock{columns_caches_mutex};
+                if (auto it = columns_caches.find(db_handle); it != columns_caches.end())
+                    return it->second;
+            }
+
+            auto cache = std::make_shared<details::generated_columns_cache>();
+            {
+                std::lock_guard lock{columns_caches_mutex};
+                auto [it, inserted] = columns_caches.emplace(db_handle, cache);
+                if (!inserted)
+                    return it->second;
+            }
+            sqlite3_create_function_v2(db_handle, "docudb_columns_cache", 0, SQLITE_UTF8, db_handle, noop_func, nullptr, nullptr, [](void *db)
+                                       {
+                                           std::lock_guard lock{columns_caches_mutex};
+                                           columns_caches.erase(static_cast<sqlite3 *>(db)); });
+            return cache;
+        }
+    }
+
+    std::shared_ptr<std::unordered_map<std::string, std::string> const> db_collection::generated_columns() const
+    {
+        // the schema version changes with every schema change; index(), promote() and truncate() clear the
+        // cache as well, as a rolled back change brings an earlier version back
+        details::sqlite::statement stmt{db_handle, "PRAGMA schema_version;"};
+        if (stmt.step().result_code() != SQLITE_ROW)
+        {
+            throw db_exception{db_handle, "Failed to read the schema version"};
+        }
+        auto schema_version = stmt.get<std::int64_t>(0);
+
+        std::lock_guard lock{columns_cache->mutex};
+        if (schema_version != columns_cache->schema_version)
+        {
+            columns_cache->tables.clear();
+            columns_cache->schema_version = schema_version;
+        }
+        auto &columns = columns_cache->tables[table_name];
+        if (!columns)
+        {
+            columns = std::make_shared<std::unordered_map<std::string, std::string> const>(read_generated_columns(db_handle, table_name));
+        }
+        return columns;
+    }
+
+    // sql expression reading a json query or a column, preferring the generated column when one exists
+    std::string field_expression(std::string_view path, std::unordered_map<std::string, std::string> const &columns)
+    {
+        auto json_query = path.size() > 0 && path[0] == '$';
+        if (!json_query)
+            return std::format("[{}]", path);
+
+        auto column = columns.find(std::string{path});
+        if (column != columns.end())
+            return std::format("[{}]", column->second);
+
+        return std::format("json_extract(body, '{}')", path);
+    }
+
+    // query condition reading the generated columns instead of extracting the json queries they mirror
+    std::string where_clause(query::queryable_type_eraser const &q, std::unordered_map<std::string, std::string> const &columns)
+    {
+        if (columns.empty())
+            return q.to_query_string();
+
+        std::unordered_map<std::string, std::string> targets;
+        for (auto const &[path, column] : columns)
+            targets.emplace(std::format("json_extract(body, '{}')", path), std::format("[{}]", column));
+
+        auto rewrite = [&](auto &self, query::expression &e) -> void
+        {
+            for (auto &child : e.children)
+                self(self, child);
+
+            auto column = targets.find(e.target);
+            if (e.type != query::expression::kind::predicate || column == targets.end())
+                return;
+
+            for (auto pos = e.sql.find(column->first); pos != std::string::npos; pos = e.sql.find(column->first, pos + column->second.size()))
+                e.sql.replace(pos, column->first.size(), column->second);
+        };
+
+        auto tree = q.tree();
+        rewrite(rewrite, tree);
+        return tree.to_query_string();
+    }
+
+    // STATEMENT
+    db_statement::db_statement(sqlite3 *db_handle, std::string_view sql, std::string_view table_name)
+        : stmt(db_handle, std::string{sql}), table_name(table_name) {}
+
+    bool db_statement::step()
+    {
+        stmt.step();
+        if (stmt.result_code() == SQLITE_ROW)
+            return true;
+        if (stmt.result_code() == SQLITE_DONE)
+            return false;
+        throw db_exception{sqlite3_db_handle(stmt.data()), "Failed to run statement"};
+    }
+
+    std::size_t db_statement::execute()
+    {
+        while (step())
+        {
+        }
+        return static_cast<std::size_t>(sqlite3_changes(sqlite3_db_handle(stmt.data())));
+    }
+
+    std::vector<db_document> db_statement::documents()
+    {
+        if (table_name.empty())
+        {
+            throw std::logic_error("documents() requires a statement prepared by a collection");
+        }
+
+        int docid = -1;
+        int body = -1;
+        for (int i = 0; i < column_count(); ++i)
+        {
+            auto name = column_name(i);
+            if (name == "docid")
+                docid = i;
+            else if (name == "body")
+                body = i;
+        }
+        if (docid < 0 || body < 0)
+        {
+            throw std::logic_error("documents() requires docid and body columns");
+        }
+
+        std::vector<db_document> docs;
+        while (step())
+        {
+            docs.push_back(db_document{table_name, stmt.get<std::string>(docid), stmt.get<std::string>(body), sqlite3_db_handle(stmt.data())});
+        }
+        return docs;
+    }
+
+    int db_statement::column_count() const noexcept
+    {
+        return sqlite3_column_count(stmt.data());
+    }
+
+    std::string db_statement::column_name(int index) const
+    {
+        auto name = sqlite3_column_name(stmt.data(), index);
+        return name ? name : "";
+    }
+
+    db_statement database::prepare(std::string_view sql) const
+    {
+        return db_statement{db_handle, sql, {}};
+    }
+
+    db_statement db_collection::prepare(std::string_view sql) const
+    {
+        return db_statement{db_handle, sql, table_name};
+    }
+
+    // COLLECTION
+    db_collection::db_collection(std::string_view name, sqlite3 *db_handle) : db_handle(db_handle), table_name(name), columns_cache(columns_cache_of(db_handle)) {}
+
+    std::string db_collection::name() const noexcept
+    {
+        return table_name;
+    }
+
+    db_document db_collection::doc(std::string_view doc_id) const
+    {
+        return db_document{table_name, doc_id, db_handle};
+    }
+
+    db_document db_collection::doc()
+    {
+        auto new_doc_id = details::uuid::generate_uuid_v4();
+        return create(new_doc_id);
     }
 
     db_document db_collection::create(std::string_view doc_id)
@@ -574,6 +1664,24 @@ namespace docudb
         return db_document{table_name, doc_id, new_doc_body, db_handle};
     }
 
+    db_document db_collection::insert_body(std::string_view doc_id, std::string_view body)
+    {
+        auto insert_doc_query = std::format("INSERT INTO [{}] (body) VALUES (?);", table_name);
+        details::sqlite::statement stmt{db_handle, insert_doc_query};
+
+        stmt
+            .bind(1, body)
+            .step();
+
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to insert document"};
+        }
+
+        // the body is read back lazily, no need to keep a copy
+        return db_document{table_name, doc_id, db_handle};
+    }
+
     // get the count
     std::size_t db_collection::count() const
     {
@@ -592,200 +1700,1399 @@ namespace docudb
 
     std::size_t db_collection::count(query::queryable_type_eraser q) const
     {
-        auto query_string = std::format("SELECT COUNT(*) FROM [{}] WHERE {}", table_name, q.to_query_string());
+        if (q.never_matches())
+            return 0;
+
+        auto query_string = std::format("SELECT COUNT(*) FROM [{}] WHERE {}", table_name, where_clause(q, *generated_columns()));
 
         details::sqlite::statement stmt{db_handle, query_string};
 
-        auto binder = q.get_binder();
+        bind_parameters(stmt, q.get_binder());
 
-        for (const auto &[key, value] : binder.get_parameters())
+        stmt.step();
+
+        if (stmt.result_code() != SQLITE_ROW)
         {
-            std::visit([&](auto &&val)
-                        { stmt.bind(key, val); }, value);
+            throw db_exception{db_handle, "Failed to count collection"};
+        }
+
+        return stmt.get<std::int64_t>(0);
+    }
+
+    // get all documents
+    std::vector<db_document_ref> db_collection::docs() const
+    {
+        std::string get_doc_query = std::format("SELECT docid FROM [{}];", table_name);
+        details::sqlite::statement stmt{db_handle, get_doc_query};
+
+        std::vector<db_document_ref> refs;
+        do
+        {
+            stmt.step();
+            if (stmt.result_code() == SQLITE_ERROR)
+            {
+                throw db_exception{db_handle, "Failed to enumerate documents"};
+            }
+            else if (stmt.result_code() != SQLITE_ROW)
+            {
+                break;
+            }
+            else
+            {
+                refs.push_back(db_document_ref{table_name, stmt.get<std::string>(0), db_handle});
+            }
+        } while (true);
+
+        return refs;
+    }
+
+    // ORDER BY clause; the sort keys are emitted as-is (no alias) so that SQLite can match them with an index
+    std::string order_by_clause(query::order_by const &order_by, std::unordered_map<std::string, std::string> const &columns)
+    {
+        std::vector<std::string> terms;
+        for (auto const &key : order_by.keys())
+        {
+            auto term = field_expression(key.field, columns);
+            if (key.collation == query::collation::nocase)
+                term += " COLLATE NOCASE";
+            term += key.ascending ? " ASC" : " DESC";
+            // only emit NULLS when it differs from SQLite's default
+            if (key.nulls == query::nulls::first && !key.ascending)
+                term += " NULLS FIRST";
+            else if (key.nulls == query::nulls::last && key.ascending)
+                term += " NULLS LAST";
+            terms.push_back(std::move(term));
+        }
+
+        return " ORDER BY " + std::accumulate(
+            std::next(terms.begin()), terms.end(), terms[0],
+            [](std::string const &a, std::string const &b)
+            {
+                return a + ", " + b;
+            });
+    }
+
+    std::vector<db_document_ref> db_collection::find(query::queryable_type_eraser q, std::optional<query::order_by> order_by, std::optional<int> limit) const
+    {
+        if (q.never_matches())
+            return {};
+
+        auto columns = generated_columns();
+        auto query_string = std::format("SELECT docid FROM [{}] WHERE {}", table_name, where_clause(q, *columns));
+        if (order_by)
+            query_string += order_by_clause(*order_by, *columns);
+        if (limit)
+            query_string += std::format(" LIMIT {}", *limit);
+
+        details::sqlite::statement stmt{db_handle, query_string};
+
+        bind_parameters(stmt, q.get_binder());
+        std::vector<db_document_ref> refs;
+        do
+        {
+            stmt.step();
+            if (stmt.result_code() == SQLITE_ERROR)
+            {
+                throw db_exception{db_handle, "Failed to enumerate documents"};
+            }
+            else if (stmt.result_code() != SQLITE_ROW)
+            {
+                break;
+            }
+            else
+            {
+                refs.push_back(db_document_ref{table_name, stmt.get<std::string>(0), db_handle});
+            }
+        } while (true);
+
+        return refs;
+    }
+
+    bool db_collection::requires_sort(query::queryable_type_eraser q, query::order_by const &order_by) const
+    {
+        auto columns = generated_columns();
+        auto query_string = std::format("EXPLAIN QUERY PLAN SELECT docid FROM [{}] WHERE {}{}", table_name, where_clause(q, *columns), order_by_clause(order_by, *columns));
+
+        details::sqlite::statement stmt{db_handle, query_string};
+
+        bind_parameters(stmt, q.get_binder());
+
+        // the plan detail is the 4th column (id, parent, notused, detail)
+        bool sort = false;
+        while (stmt.step().result_code() == SQLITE_ROW)
+        {
+            sort = sort || stmt.get<std::string>(3).find("USE TEMP B-TREE FOR") != std::string::npos;
+        }
+
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to explain query"};
+        }
+
+        return sort;
+    }
+
+    std::vector<db_value> db_collection::distinct(std::string_view path, std::optional<query::queryable_type_eraser> q, std::optional<int> limit) const
+    {
+        auto columns = generated_columns();
+        auto field = field_expression(path, *columns);
+
+        auto query_string = std::format("SELECT DISTINCT {} FROM [{}]", field, table_name);
+        if (q)
+            query_string += std::format(" WHERE {}", where_clause(*q, *columns));
+        if (limit)
+            query_string += std::format(" LIMIT {}", *limit);
+
+        details::sqlite::statement stmt{db_handle, query_string};
+
+        if (q)
+            bind_parameters(stmt, q->get_binder());
+
+        std::vector<db_value> values;
+        do
+        {
+            stmt.step();
+            if (stmt.result_code() == SQLITE_ERROR)
+            {
+                throw db_exception{db_handle, "Failed to enumerate values"};
+            }
+            else if (stmt.result_code() != SQLITE_ROW)
+            {
+                break;
+            }
+            else
+            {
+                values.push_back(stmt.get<db_value>(0));
+            }
+        } while (true);
+
+        return values;
+    }
+
+    namespace details
+    {
+        // runs an aggregate returning a serialized sketch
+        std::string aggregate_sketch(sqlite3 *db_handle, std::string_view table_name, std::unordered_map<std::string, std::string> const &columns, std::string_view aggregate, std::string_view path, std::optional<query::queryable_type_eraser> const &q)
+        {
+            auto field = field_expression(path, columns);
+
+            auto query_string = std::format("SELECT {}({}) FROM [{}]", aggregate, field, table_name);
+            if (q)
+                query_string += std::format(" WHERE {}", where_clause(*q, columns));
+
+            sqlite::statement stmt{db_handle, query_string};
+
+            if (q)
+                bind_parameters(stmt, q->get_binder());
+
+            stmt.step();
+            if (stmt.result_code() != SQLITE_ROW)
+            {
+                throw db_exception{db_handle, "Failed to aggregate values"};
+            }
+
+            auto data = static_cast<const char *>(sqlite3_column_blob(stmt.data(), 0));
+            return std::string(data ? data : "", static_cast<std::size_t>(sqlite3_column_bytes(stmt.data(), 0)));
+        }
+    }
+
+    distinct_sketch db_collection::approx_distinct(std::string_view path, std::optional<query::queryable_type_eraser> q) const
+    {
+        return {details::aggregate_sketch(db_handle, table_name, *generated_columns(), "hll", path, q)};
+    }
+
+    quantile_sketch db_collection::approx_quantiles(std::string_view path, std::optional<query::queryable_type_eraser> q) const
+    {
+        return {details::aggregate_sketch(db_handle, table_name, *generated_columns(), "tdigest", path, q)};
+    }
+
+    // SKETCHES
+
+    std::size_t distinct_sketch::estimate() const
+    {
+        if (data.empty())
+            return 0;
+        return static_cast<std::size_t>(std::llround(details::sketch::hyperloglog::deserialize(data).estimate()));
+    }
+
+    distinct_sketch &distinct_sketch::merge(distinct_sketch const &other)
+    {
+        if (other.data.empty())
+            return *this;
+        if (data.empty())
+        {
+            data = other.data;
+            return *this;
+        }
+
+        auto merged = details::sketch::hyperloglog::deserialize(data);
+        merged.merge(details::sketch::hyperloglog::deserialize(other.data));
+        data = merged.serialize();
+        return *this;
+    }
+
+    double quantile_sketch::quantile(double q) const
+    {
+        if (data.empty())
+            return std::numeric_limits<double>::quiet_NaN();
+        return details::sketch::tdigest::deserialize(data).quantile(q);
+    }
+
+    std::size_t quantile_sketch::count() const
+    {
+        if (data.empty())
+            return 0;
+        return static_cast<std::size_t>(std::llround(details::sketch::tdigest::deserialize(data).count()));
+    }
+
+    quantile_sketch &quantile_sketch::merge(quantile_sketch const &other)
+    {
+        if (other.data.empty())
+            return *this;
+        if (data.empty())
+        {
+            data = other.data;
+            return *this;
+        }
+
+        auto merged = details::sketch::tdigest::deserialize(data);
+        merged.merge(details::sketch::tdigest::deserialize(other.data));
+        data = merged.serialize();
+        return *this;
+    }
+
+    std::vector<std::pair<db_value, std::size_t>> db_collection::value_counts(std::string_view path, std::optional<query::queryable_type_eraser> q, std::optional<int> top_n) const
+    {
+        auto columns = generated_columns();
+        auto field = field_expression(path, *columns);
+
+        auto query_string = std::format("SELECT {0}, COUNT(*) AS __count FROM [{1}]", field, table_name);
+        if (q)
+            query_string += std::format(" WHERE {}", where_clause(*q, *columns));
+        query_string += std::format(" GROUP BY {} ORDER BY __count DESC", field);
+        if (top_n)
+            query_string += std::format(" LIMIT {}", *top_n);
+
+        details::sqlite::statement stmt{db_handle, query_string};
+
+        if (q)
+            bind_parameters(stmt, q->get_binder());
+
+        std::vector<std::pair<db_value, std::size_t>> counts;
+        do
+        {
+            stmt.step();
+            if (stmt.result_code() == SQLITE_ERROR)
+            {
+                throw db_exception{db_handle, "Failed to count values"};
+            }
+            else if (stmt.result_code() != SQLITE_ROW)
+            {
+                break;
+            }
+            else
+            {
+                counts.emplace_back(stmt.get<db_value>(0), stmt.get<std::int64_t>(1));
+            }
+        } while (true);
+
+        return counts;
+    }
+
+    bool column_exists(sqlite3 *db_handle, std::string_view table_name, std::string_view column_name)
+    {
+        auto doc_query = std::format("SELECT COUNT(*) FROM pragma_table_xinfo('{0}') WHERE name=?1", table_name);
+        details::sqlite::statement stmt{db_handle, doc_query};
+
+        stmt.bind(1, column_name)
+            .step();
+
+        if (stmt.result_code() != SQLITE_ROW)
+        {
+            throw db_exception{db_handle, "Failed to count collection"};
+        }
+
+        return stmt.get<std::int64_t>(0) > 0;
+    }
+
+    // CURSOR
+
+    namespace details
+    {
+        struct cursor_row
+        {
+            std::string id;
+            std::string body;
+        };
+
+        struct cursor_state
+        {
+            sqlite3 *db_handle;
+            std::unique_ptr<sqlite::statement> stmt;
+            cursor_options options;
+
+            // consumer side
+            std::vector<cursor_row> current;
+            std::size_t position = 0;
+
+            // prefetching: batches are handed over through a bounded queue, and the
+            // consumed ones come back to keep their string buffers
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<std::vector<cursor_row>> ready;
+            std::vector<std::vector<cursor_row>> spare;
+            bool finished = false;
+            std::atomic<bool> stop{false};
+            std::exception_ptr error;
+            std::thread producer;
+
+            ~cursor_state()
+            {
+                if (producer.joinable())
+                {
+                    {
+                        // set under the mutex, so that the producer cannot miss it between its check and its wait
+                        std::lock_guard lock{mutex};
+                        stop = true;
+                    }
+                    cv.notify_all();
+                    producer.join();
+                }
+            }
+
+            // reads the current row into a reused row; false when the statement is done
+            bool step(cursor_row &row)
+            {
+                stmt->step();
+                if (stmt->result_code() == SQLITE_DONE)
+                    return false;
+                if (stmt->result_code() != SQLITE_ROW)
+                    throw db_exception{db_handle, "Failed to read documents"};
+
+                auto data = stmt->data();
+                row.id.assign(reinterpret_cast<char const *>(sqlite3_column_text(data, 0)), sqlite3_column_bytes(data, 0));
+                row.body.assign(reinterpret_cast<char const *>(sqlite3_column_text(data, 1)), sqlite3_column_bytes(data, 1));
+                return true;
+            }
+
+            void produce()
+            {
+                try
+                {
+                    bool done = false;
+                    while (!done && !stop)
+                    {
+                        std::vector<cursor_row> batch;
+                        {
+                            std::lock_guard lock{mutex};
+                            if (!spare.empty())
+                            {
+                                batch = std::move(spare.back());
+                                spare.pop_back();
+                            }
+                        }
+
+                        std::size_t rows = 0;
+                        while (rows < options.batch_size && !stop)
+                        {
+                            if (rows == batch.size())
+                                batch.emplace_back();
+                            if (!step(batch[rows]))
+                            {
+                                done = true;
+                                break;
+                            }
+                            rows++;
+                        }
+                        batch.resize(rows);
+
+                        std::unique_lock lock{mutex};
+                        cv.wait(lock, [this]
+                                { return stop || ready.size() < options.max_batches; });
+                        if (rows > 0)
+                            ready.push_back(std::move(batch));
+                        lock.unlock();
+                        cv.notify_all();
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard lock{mutex};
+                    error = std::current_exception();
+                }
+
+                {
+                    std::lock_guard lock{mutex};
+                    finished = true;
+                }
+                cv.notify_all();
+            }
+
+            bool fetch()
+            {
+                if (!producer.joinable())
+                {
+                    // stepping again a finished statement would restart it
+                    if (finished)
+                        return false;
+                    current.resize(1);
+                    if (step(current.front()))
+                        return true;
+                    current.clear();
+                    finished = true;
+                    return false;
+                }
+
+                std::unique_lock lock{mutex};
+                if (!current.empty())
+                    spare.push_back(std::move(current));
+                current.clear();
+
+                cv.wait(lock, [this]
+                        { return finished || !ready.empty(); });
+                if (!ready.empty())
+                {
+                    current = std::move(ready.front());
+                    ready.pop_front();
+                    lock.unlock();
+                    // room for another batch
+                    cv.notify_all();
+                    return true;
+                }
+
+                if (error)
+                    std::rethrow_exception(error);
+                return false;
+            }
+        };
+    }
+
+    db_cursor db_collection::cursor(std::optional<query::queryable_type_eraser> q, cursor_options const &options) const
+    {
+        auto query_string = std::format("SELECT docid, body FROM [{}]", table_name);
+        if (q)
+            query_string += std::format(" WHERE {}", where_clause(*q, *generated_columns()));
+
+        auto state = std::make_unique<details::cursor_state>();
+        state->db_handle = db_handle;
+        state->options = options;
+        state->options.batch_size = std::max<std::size_t>(options.batch_size, 1);
+        state->options.max_batches = std::max<std::size_t>(options.max_batches, 1);
+        state->stmt = std::make_unique<details::sqlite::statement>(db_handle, query_string);
+        if (q)
+            bind_parameters(*state->stmt, q->get_binder());
+
+        // the background thread shares the connection, which is only safe when serialized
+        if (options.prefetch && sqlite3_db_mutex(db_handle))
+        {
+            auto s = state.get();
+            state->producer = std::thread{[s]
+                                          { s->produce(); }};
+        }
+
+        return db_cursor{std::move(state)};
+    }
+
+    namespace details::sampling
+    {
+        thread_local std::mt19937_64 gen{std::random_device{}()};
+
+        // uniform sample of the query results in a single pass (reservoir sampling), shuffled
+        std::vector<std::string> reservoir(sqlite3 *db_handle, std::string const &query_string, std::optional<query::queryable_type_eraser> const &q, std::size_t n)
+        {
+            sqlite::statement stmt{db_handle, query_string};
+            if (q)
+                bind_parameters(stmt, q->get_binder());
+
+            std::vector<std::string> ids;
+            std::size_t seen = 0;
+            while (stmt.step().result_code() == SQLITE_ROW)
+            {
+                ++seen;
+                if (ids.size() < n)
+                {
+                    ids.push_back(stmt.get<std::string>(0));
+                    continue;
+                }
+                auto slot = std::uniform_int_distribution<std::size_t>{0, seen - 1}(gen);
+                if (slot < n)
+                    ids[slot] = stmt.get<std::string>(0);
+            }
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to enumerate documents"};
+            }
+
+            std::shuffle(ids.begin(), ids.end(), gen);
+            return ids;
+        }
+    }
+
+    std::vector<db_document_ref> db_collection::sample(std::size_t n, std::optional<query::queryable_type_eraser> q) const
+    {
+        std::vector<db_document_ref> refs;
+        if (n == 0 || (q && q->never_matches()))
+            return refs;
+
+        auto to_refs = [&](std::vector<std::string> const &ids)
+        {
+            for (auto const &id : ids)
+                refs.push_back(db_document_ref{table_name, id, db_handle});
+            return refs;
+        };
+
+        auto where = q ? where_clause(*q, *generated_columns()) : ""s;
+
+        std::int64_t min_rowid = 0;
+        std::int64_t max_rowid = 0;
+        {
+            // separate subqueries, so that each one is a single b-tree seek
+            details::sqlite::statement stmt{db_handle, std::format("SELECT (SELECT min(rowid) FROM [{0}]), (SELECT max(rowid) FROM [{0}]);", table_name)};
+            stmt.step();
+            if (stmt.result_code() != SQLITE_ROW)
+            {
+                throw db_exception{db_handle, "Failed to sample collection"};
+            }
+            if (stmt.is_result_null(0))
+                return refs;
+            min_rowid = stmt.get<std::int64_t>(0);
+            max_rowid = stmt.get<std::int64_t>(1);
+        }
+
+        // probes pick rowids uniformly and keep those that exist, match and were not picked yet,
+        // each matching document being equally likely; past the budget the rowids are too sparse
+        // (deletes, a selective query) and a full pass is cheaper
+        auto span = static_cast<std::uint64_t>(max_rowid - min_rowid) + 1;
+        if (n < span / 2)
+        {
+            auto probe_query = std::format("SELECT docid FROM [{}] WHERE ", table_name);
+            if (q)
+                probe_query += std::format("({}) AND ", where);
+            probe_query += "rowid = :rowid;";
+
+            details::sqlite::statement probe{db_handle, probe_query};
+            auto rowid_index = sqlite3_bind_parameter_index(probe.data(), ":rowid");
+            auto binder = q ? std::optional<query::binder>{q->get_binder()} : std::nullopt;
+
+            std::uniform_int_distribution<std::int64_t> pick{min_rowid, max_rowid};
+            std::unordered_set<std::int64_t> picked;
+            std::vector<std::string> ids;
+            auto budget = 8 * n + 64;
+            for (std::size_t attempt = 0; attempt < budget && ids.size() < n; ++attempt)
+            {
+                auto rowid = pick(details::sampling::gen);
+                if (picked.contains(rowid))
+                    continue;
+
+                probe.reset();
+                if (binder)
+                    bind_parameters(probe, *binder);
+                probe.bind(rowid_index, rowid).step();
+
+                if (probe.result_code() == SQLITE_ROW)
+                {
+                    picked.insert(rowid);
+                    ids.push_back(probe.get<std::string>(0));
+                }
+                else if (probe.result_code() != SQLITE_DONE)
+                {
+                    throw db_exception{db_handle, "Failed to sample collection"};
+                }
+            }
+
+            if (ids.size() == n)
+                return to_refs(ids);
+        }
+
+        auto query_string = std::format("SELECT docid FROM [{}]", table_name);
+        if (q)
+            query_string += std::format(" WHERE {}", where);
+        return to_refs(details::sampling::reservoir(db_handle, query_string, q, n));
+    }
+
+    db_cursor::db_cursor(std::unique_ptr<details::cursor_state> state) : state(std::move(state)) {}
+    db_cursor::db_cursor(db_cursor &&) noexcept = default;
+    db_cursor &db_cursor::operator=(db_cursor &&) noexcept = default;
+    db_cursor::~db_cursor() = default;
+
+    bool db_cursor::next()
+    {
+        if (state->position + 1 < state->current.size())
+        {
+            state->position++;
+            return true;
+        }
+
+        state->position = 0;
+        return state->fetch();
+    }
+
+    std::string const &db_cursor::id() const
+    {
+        return state->current[state->position].id;
+    }
+
+    std::string const &db_cursor::body() const
+    {
+        return state->current[state->position].body;
+    }
+
+    db_collection &db_collection::index(std::string_view column_name, std::string_view query, bool unique)
+    {
+        columns_cache->clear();
+        // create virtual table if not exists
+        if (!column_exists(db_handle, table_name, column_name))
+        {
+            auto alter_table = std::format("ALTER TABLE [{}] ADD COLUMN [{}] GENERATED ALWAYS AS (json_extract(body, '{}')) VIRTUAL;", table_name, column_name, query);
+            details::sqlite::statement stmt{db_handle, alter_table};
+
+            stmt.step();
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to alter table"};
+            }
+        }
+
+        // create index
+        {
+            auto create_index = std::format("CREATE {0} INDEX IF NOT EXISTS [Idx_{1}_{2}] on [{1}]({2});", unique ? "UNIQUE" : "", table_name, column_name);
+            details::sqlite::statement stmt{db_handle, create_index};
+
+            stmt.step();
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to create index"};
+            }
+        }
+
+        return *this;
+    }
+
+    db_collection &db_collection::index(
+        std::string name,
+        std::vector<std::pair<std::string, std::string>> const &columns,
+        bool unique)
+    {
+        columns_cache->clear();
+        details::sqlite::transaction transaction{db_handle};
+
+        // add relevant columns
+        for (auto &&[column_name, query] : columns)
+        {
+            if (!column_exists(db_handle, table_name, column_name))
+            {
+                auto alter_table = std::format("ALTER TABLE [{}] ADD COLUMN [{}] GENERATED ALWAYS AS (json_extract(body, '{}')) VIRTUAL;", table_name, column_name, query);
+                auto ret = sqlite3_exec(db_handle, alter_table.c_str(), nullptr, nullptr, nullptr);
+
+                if (ret != SQLITE_OK)
+                {
+                    throw db_exception{db_handle, "Failed to alter table"};
+                }
+            }
+        }
+
+        // create index
+        {
+            auto columns_joined_comma = std::accumulate(
+                std::next(columns.begin()), columns.end(), columns[0].first,
+                [](std::string const &a, std::pair<std::string, std::string> const &b)
+                {
+                    return a + "," + b.first;
+                });
+            auto create_index = std::format("CREATE {0} INDEX IF NOT EXISTS [{1}] on [{2}]({3});", unique ? "UNIQUE" : "", name, table_name, columns_joined_comma);
+            auto ret = sqlite3_exec(db_handle, create_index.c_str(), nullptr, nullptr, nullptr);
+
+            if (ret != SQLITE_OK)
+            {
+                throw db_exception{db_handle, "Failed to create index"};
+            }
+        }
+
+        transaction.commit();
+
+        return *this;
+    }
+
+    db_collection &db_collection::promote(std::string_view column_name, std::string_view query, column_type type, bool indexed)
+    {
+        columns_cache->clear();
+        details::sqlite::savepoint savepoint{db_handle, "docudb_promote"};
+
+        if (!column_exists(db_handle, table_name, column_name))
+        {
+            // ALTER TABLE cannot add stored columns: the table is rebuilt with the column, keeping the rowids
+            std::string table_sql;
+            std::vector<std::string> indexes;
+            {
+                details::sqlite::statement stmt{db_handle, "SELECT type, sql FROM sqlite_master WHERE tbl_name=? AND sql IS NOT NULL ORDER BY type<>'table', rowid;"};
+                stmt.bind(1, table_name);
+                while (stmt.step().result_code() == SQLITE_ROW)
+                {
+                    if (stmt.get<std::string>(0) == "table")
+                        table_sql = stmt.get<std::string>(1);
+                    else
+                        indexes.push_back(stmt.get<std::string>(1));
+                }
+                if (stmt.result_code() != SQLITE_DONE || table_sql.empty())
+                {
+                    throw db_exception{db_handle, "Failed to read collection schema"};
+                }
+            }
+
+            std::string columns;
+            {
+                details::sqlite::statement stmt{db_handle, "SELECT name FROM pragma_table_xinfo(?) WHERE hidden=0;"};
+                stmt.bind(1, table_name);
+                while (stmt.step().result_code() == SQLITE_ROW)
+                {
+                    columns += std::format("{}[{}]", columns.empty() ? "" : ", ", stmt.get<std::string>(0));
+                }
+            }
+
+            // the column has no type affinity, so that it compares like json_extract; the type is checked instead
+            static constexpr std::string_view type_checks[] = {"'integer'", "'integer','real'", "'text'"};
+            auto definitions = table_sql.substr(table_sql.find('('));
+            definitions.insert(definitions.rfind(')'), std::format(", [{0}] GENERATED ALWAYS AS (json_extract(body, '{1}')) STORED CHECK (typeof([{0}]) IN ('null',{2}))", column_name, query, type_checks[static_cast<int>(type)]));
+
+            auto rebuild = std::vector<std::string>{
+                std::format("CREATE TABLE [{}$promote] {};", table_name, definitions),
+                std::format("INSERT INTO [{0}$promote] (rowid, {1}) SELECT rowid, {1} FROM [{0}];", table_name, columns),
+                std::format("DROP TABLE [{}];", table_name),
+                std::format("ALTER TABLE [{0}$promote] RENAME TO [{0}];", table_name)};
+            rebuild.insert(rebuild.end(), indexes.begin(), indexes.end());
+
+            for (auto const &sql : rebuild)
+            {
+                details::sqlite::statement stmt{db_handle, sql};
+                if (stmt.step().result_code() != SQLITE_DONE)
+                {
+                    throw db_exception{db_handle, "Failed to promote column"};
+                }
+            }
+        }
+
+        if (indexed)
+        {
+            auto create_index = std::format("CREATE INDEX IF NOT EXISTS [Idx_{0}_{1}] on [{0}]({1});", table_name, column_name);
+            details::sqlite::statement stmt{db_handle, create_index};
+
+            if (stmt.step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to create index"};
+            }
+        }
+
+        savepoint.release();
+        return *this;
+    }
+
+    // CONTENT HASH
+
+    namespace details
+    {
+        constexpr auto content_hash_column = "content_hash"sv;
+
+        // looks a canonical body up by hash, comparing the candidates so that collisions are not duplicates
+        std::optional<std::string> find_content(sqlite::statement &lookup, std::string const &canonical)
+        {
+            auto hash = static_cast<std::int64_t>(hash::xxh64(canonical.data(), canonical.size()));
+            lookup.reset().bind(1, hash);
+
+            std::optional<std::string> found;
+            while (lookup.step().result_code() == SQLITE_ROW)
+            {
+                if (json::canonical_body(lookup.get<std::string>(1)) == canonical)
+                {
+                    found = lookup.get<std::string>(0);
+                    break;
+                }
+            }
+
+            auto rc = lookup.result_code();
+            lookup.reset();
+            if (!found && rc != SQLITE_DONE)
+            {
+                throw db_exception{sqlite3_db_handle(lookup.data()), "Failed to look up document"};
+            }
+            return found;
+        }
+
+        std::string insert_document(sqlite::statement &insert, std::string_view body)
+        {
+            auto doc_id = uuid::generate_uuid_v4();
+            insert.reset()
+                .bind(1, body)
+                .bind(2, doc_id)
+                .step();
+
+            if (insert.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{sqlite3_db_handle(insert.data()), "Failed to insert document"};
+            }
+            return doc_id;
+        }
+    }
+
+    db_collection &db_collection::enable_content_hash()
+    {
+        if (!has_content_hash())
+        {
+            auto alter_table = std::format("ALTER TABLE [{}] ADD COLUMN [{}] INTEGER GENERATED ALWAYS AS (content_hash(body)) VIRTUAL;", table_name, details::content_hash_column);
+            details::sqlite::statement stmt{db_handle, alter_table};
+
+            stmt.step();
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to alter table"};
+            }
         }
 
+        auto create_index = std::format("CREATE INDEX IF NOT EXISTS [Idx_{0}_{1}] on [{0}]({1});", table_name, details::content_hash_column);
+        details::sqlite::statement stmt{db_handle, create_index};
+
         stmt.step();
 
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to create index"};
+        }
+
+        return *this;
+    }
+
+    bool db_collection::has_content_hash() const
+    {
+        return column_exists(db_handle, table_name, details::content_hash_column);
+    }
+
+    std::pair<db_document, bool> db_collection::insert_if_new(std::string_view body)
+    {
+        if (!has_content_hash())
+        {
+            throw std::logic_error("Collection has no content hash, see enable_content_hash");
+        }
+
+        auto canonical = details::json::canonical_body(body);
+
+        // the lookup and the insert see the same snapshot, a concurrent insert makes the write fail
+        details::sqlite::savepoint savepoint{db_handle, "docudb_insert"};
+
+        details::sqlite::statement lookup{db_handle, std::format("SELECT docid, body FROM [{}] WHERE [{}]=?1;", table_name, details::content_hash_column)};
+        if (auto existing = details::find_content(lookup, canonical))
+        {
+            savepoint.release();
+            return {doc(*existing), false};
+        }
+
+        details::sqlite::statement insert{db_handle, std::format("INSERT INTO [{}] (body) VALUES (json_set(?1, '$.docid', ?2));", table_name)};
+        auto doc_id = details::insert_document(insert, body);
+        savepoint.release();
+
+        return {doc(doc_id), true};
+    }
+
+    std::vector<std::string> db_collection::insert_many(std::vector<std::string> const &bodies, dedup_mode mode)
+    {
+        auto dedup = mode == dedup_mode::skip_duplicates;
+
+        // validate every body before writing
+        std::vector<std::string> canonical;
+        if (dedup)
+        {
+            if (!has_content_hash())
+            {
+                throw std::logic_error("Collection has no content hash, see enable_content_hash");
+            }
+
+            canonical.reserve(bodies.size());
+            for (auto const &body : bodies)
+                canonical.push_back(details::json::canonical_body(body));
+        }
+
+        details::sqlite::savepoint savepoint{db_handle, "docudb_insert"};
+
+        details::sqlite::statement insert{db_handle, std::format("INSERT INTO [{}] (body) VALUES (json_set(?1, '$.docid', ?2));", table_name)};
+        std::optional<details::sqlite::statement> lookup;
+        if (dedup)
+            lookup.emplace(db_handle, std::format("SELECT docid, body FROM [{}] WHERE [{}]=?1;", table_name, details::content_hash_column));
+
+        std::vector<std::string> ids;
+        for (std::size_t i = 0; i < bodies.size(); ++i)
+        {
+            // earlier documents of the batch are visible to the lookup
+            if (dedup && details::find_content(*lookup, canonical[i]))
+                continue;
+
+            ids.push_back(details::insert_document(insert, bodies[i]));
+        }
+
+        savepoint.release();
+        return ids;
+    }
+
+    // HISTORY
+
+    namespace details
+    {
+        // versions: full body, JSON Patch from the previous version, removal
+        enum class history_kind
+        {
+            keyframe,
+            patch,
+            deleted
+        };
+
+        std::string history_table(std::string_view table_name)
+        {
+            return std::format("{}$history", table_name);
+        }
+
+        // milliseconds since the epoch, constant within a statement
+        constexpr auto history_clock = "CAST((julianday('now') - 2440587.5) * 86400000 AS INTEGER)"sv;
+
+        void exec_history(sqlite3 *db_handle, std::string const &sql)
+        {
+            details::sqlite::statement stmt{db_handle, sql};
+            if (stmt.step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to enable history"};
+            }
+        }
+
+        // the version of a document at or before a point, replayed from the nearest keyframe
+        std::optional<std::string> replay_history(sqlite3 *db_handle, std::string_view table_name, std::string_view doc_id, std::int64_t version)
+        {
+            auto query = std::format(
+                "SELECT version, kind, data FROM [{0}] WHERE docid = ?1 AND version <= ?2 AND version >= "
+                "(SELECT max(version) FROM [{0}] WHERE docid = ?1 AND kind = {1} AND version <= ?2) ORDER BY version;",
+                history_table(table_name), static_cast<int>(history_kind::keyframe));
+            details::sqlite::statement stmt{db_handle, query};
+            stmt.bind(1, doc_id).bind(2, version);
+
+            std::optional<std::string> body;
+            std::int64_t last = 0;
+            while (stmt.step().result_code() == SQLITE_ROW)
+            {
+                last = stmt.get<std::int64_t>(0);
+                auto kind = static_cast<history_kind>(stmt.get<std::int64_t>(1));
+                if (kind == history_kind::keyframe)
+                    body = stmt.get<std::string>(2);
+                else if (kind == history_kind::deleted)
+                    body.reset();
+                else if (body)
+                    body = json_patch::apply(*body, json_patch::parse(stmt.get<std::string>(2)));
+            }
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to read history"};
+            }
+
+            if (last != version)
+                return std::nullopt;
+            return body;
+        }
+    }
+
+    db_collection &db_collection::enable_history(history_options const &options)
+    {
+        auto interval = static_cast<std::int64_t>(std::max<std::size_t>(options.keyframe_interval, 1));
+        auto history = details::history_table(table_name);
+        auto keyframe = static_cast<int>(details::history_kind::keyframe);
+
+        details::sqlite::savepoint savepoint{db_handle, "docudb_history"};
+
+        details::exec_history(db_handle, std::format("CREATE TABLE IF NOT EXISTS [{}] (docid TEXT NOT NULL, version INTEGER NOT NULL, ts INTEGER NOT NULL, kind INTEGER NOT NULL, data TEXT, PRIMARY KEY (docid, version)) WITHOUT ROWID;", history));
+        // finds the latest keyframe of a document with a single seek
+        details::exec_history(db_handle, std::format("CREATE INDEX IF NOT EXISTS [Idx_{0}_kind] ON [{0}](docid, kind, version);", history));
+
+        // the first version of the documents written before
+        details::exec_history(db_handle, std::format(
+            "INSERT INTO [{0}] (docid, version, ts, kind, data) SELECT docid, 1, {2}, {3}, body FROM [{1}] WHERE true "
+            "ON CONFLICT DO NOTHING;",
+            history, table_name, details::history_clock, keyframe));
+
+        // the next version of NEW.docid, as column v of the subquery
+        auto next_version = std::format("(SELECT COALESCE(max(version), 0) + 1 AS v FROM [{}] WHERE docid = NEW.docid)", history);
+        auto latest_keyframe = std::format("(SELECT max(version) FROM [{}] WHERE docid = NEW.docid AND kind = {})", history, keyframe);
+
+        // replaced, so that calling again changes the keyframe interval
+        for (auto trigger : {"insert", "update", "delete"})
+            details::exec_history(db_handle, std::format("DROP TRIGGER IF EXISTS [{}_{}];", history, trigger));
+
+        details::exec_history(db_handle, std::format(
+            "CREATE TRIGGER [{0}_insert] AFTER INSERT ON [{1}] BEGIN "
+            "INSERT INTO [{0}] (docid, version, ts, kind, data) SELECT NEW.docid, v, {2}, {3}, NEW.body FROM {4}; END;",
+            history, table_name, details::history_clock, keyframe, next_version));
+
+        details::exec_history(db_handle, std::format(
+            "CREATE TRIGGER [{0}_update] AFTER UPDATE OF body ON [{1}] WHEN OLD.body IS NOT NEW.body BEGIN "
+            "INSERT INTO [{0}] (docid, version, ts, kind, data) "
+            "SELECT NEW.docid, v, {2}, iif(k IS NULL OR v - k >= {5}, {3}, {6}), iif(k IS NULL OR v - k >= {5}, NEW.body, json_diff(OLD.body, NEW.body)) "
+            "FROM (SELECT v, {7} AS k FROM {4}); END;",
+            history, table_name, details::history_clock, keyframe, next_version, interval,
+            static_cast<int>(details::history_kind::patch), latest_keyframe));
+
+        details::exec_history(db_handle, std::format(
+            "CREATE TRIGGER [{0}_delete] AFTER DELETE ON [{1}] BEGIN "
+            "INSERT INTO [{0}] (docid, version, ts, kind, data) SELECT OLD.docid, COALESCE(max(version), 0) + 1, {2}, {3}, NULL FROM [{0}] WHERE docid = OLD.docid; END;",
+            history, table_name, details::history_clock, static_cast<int>(details::history_kind::deleted)));
+
+        savepoint.release();
+        return *this;
+    }
+
+    bool db_collection::has_history() const
+    {
+        details::sqlite::statement stmt{db_handle, "SELECT 1 FROM sqlite_master WHERE type='trigger' AND name=?;"};
+        stmt.bind(1, details::history_table(table_name) + "_update").step();
+        return stmt.result_code() == SQLITE_ROW;
+    }
+
+    std::vector<document_version> db_collection::history(std::string_view doc_id) const
+    {
+        if (!has_history())
+        {
+            throw std::logic_error("history requires enable_history()");
+        }
+
+        details::sqlite::statement stmt{db_handle, std::format("SELECT version, ts, kind FROM [{}] WHERE docid = ? ORDER BY version;", details::history_table(table_name))};
+        stmt.bind(1, doc_id);
+
+        std::vector<document_version> versions;
+        while (stmt.step().result_code() == SQLITE_ROW)
+        {
+            versions.push_back({stmt.get<std::int64_t>(0),
+                                std::chrono::system_clock::time_point{std::chrono::milliseconds{stmt.get<std::int64_t>(1)}},
+                                static_cast<details::history_kind>(stmt.get<std::int64_t>(2)) == details::history_kind::deleted});
+        }
+
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to read history"};
+        }
+
+        return versions;
+    }
+
+    std::optional<std::string> db_collection::body_at(std::string_view doc_id, std::int64_t version) const
+    {
+        if (!has_history())
+        {
+            throw std::logic_error("body_at requires enable_history()");
+        }
+
+        return details::replay_history(db_handle, table_name, doc_id, version);
+    }
+
+    std::optional<std::string> db_collection::body_at(std::string_view doc_id, std::chrono::system_clock::time_point at) const
+    {
+        if (!has_history())
+        {
+            throw std::logic_error("body_at requires enable_history()");
+        }
+
+        details::sqlite::statement stmt{db_handle, std::format("SELECT max(version) FROM [{}] WHERE docid = ? AND ts <= ?;", details::history_table(table_name))};
+        stmt.bind(1, doc_id)
+            .bind(2, static_cast<std::int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(at.time_since_epoch()).count()))
+            .step();
+
         if (stmt.result_code() != SQLITE_ROW)
         {
-            throw db_exception{db_handle, "Failed to count collection"};
+            throw db_exception{db_handle, "Failed to read history"};
         }
 
-        return stmt.get<std::int64_t>(0);
+        if (stmt.is_result_null(0))
+            return std::nullopt;
+        return details::replay_history(db_handle, table_name, doc_id, stmt.get<std::int64_t>(0));
     }
 
-    // get all documents
-    std::vector<db_document_ref> db_collection::docs() const
+    std::size_t db_collection::compact_history(std::size_t max_versions)
     {
-        std::string get_doc_query = std::format("SELECT docid FROM [{}];", table_name);
-        details::sqlite::statement stmt{db_handle, get_doc_query};
+        if (max_versions == 0)
+        {
+            throw std::invalid_argument("compact_history keeps at least one version");
+        }
+        if (!has_history())
+        {
+            throw std::logic_error("compact_history requires enable_history()");
+        }
 
-        std::vector<db_document_ref> refs;
-        do
+        auto history = details::history_table(table_name);
+        details::sqlite::savepoint savepoint{db_handle, "docudb_history"};
+
+        // the first version kept by each document with too many
+        std::vector<std::pair<std::string, std::int64_t>> cutoffs;
         {
-            stmt.step();
-            if (stmt.result_code() == SQLITE_ERROR)
+            details::sqlite::statement stmt{db_handle, std::format("SELECT docid, max(version) - ?1 + 1 FROM [{}] GROUP BY docid HAVING count(*) > ?1;", history)};
+            stmt.bind(1, static_cast<std::int64_t>(max_versions));
+            while (stmt.step().result_code() == SQLITE_ROW)
             {
-                throw db_exception{db_handle, "Failed to enumerate documents"};
+                cutoffs.emplace_back(stmt.get<std::string>(0), stmt.get<std::int64_t>(1));
             }
-            else if (stmt.result_code() != SQLITE_ROW)
+            if (stmt.result_code() != SQLITE_DONE)
             {
-                break;
+                throw db_exception{db_handle, "Failed to compact history"};
             }
-            else
+        }
+
+        details::sqlite::statement keyframe{db_handle, std::format("UPDATE [{}] SET kind = {}, data = ?3 WHERE docid = ?1 AND version = ?2 AND kind = {};", history,
+                                                                    static_cast<int>(details::history_kind::keyframe), static_cast<int>(details::history_kind::patch))};
+        details::sqlite::statement prune{db_handle, std::format("DELETE FROM [{}] WHERE docid = ?1 AND version < ?2;", history)};
+
+        std::size_t removed = 0;
+        for (auto const &[doc_id, cutoff] : cutoffs)
+        {
+            // a patch cannot be replayed without the versions before it
+            if (auto body = details::replay_history(db_handle, table_name, doc_id, cutoff))
             {
-                refs.push_back(db_document_ref{table_name, stmt.get<std::string>(0), db_handle});
+                keyframe.reset();
+                if (keyframe.bind(1, doc_id).bind(2, cutoff).bind(3, *body).step().result_code() != SQLITE_DONE)
+                {
+                    throw db_exception{db_handle, "Failed to compact history"};
+                }
             }
-        } while (true);
-
-        return refs;
-    }
 
-    std::vector<db_document_ref> db_collection::find(query::queryable_type_eraser q, std::optional<query::order_by> order_by, std::optional<int> limit) const
-    {
-        std::vector<std::string> select_fields = {"docid"};
-        if (order_by) {
-            auto json_query = order_by->field().size() > 0 && order_by->field().at(0) == '$';
-            if (json_query) {
-                select_fields.push_back(std::format("json_extract(body, '{}') AS __order_by", order_by->field()));
-            } else {
-                select_fields.push_back(std::format("{} AS __order_by", order_by->field()));
+            prune.reset();
+            if (prune.bind(1, doc_id).bind(2, cutoff).step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to compact history"};
             }
+            removed += static_cast<std::size_t>(sqlite3_changes(db_handle));
         }
 
-        auto select_fields_str = std::accumulate(
-            std::next(select_fields.begin()), select_fields.end(), select_fields[0],
-            [](std::string const &a, std::string const &b)
-            {
-                return a + "," + b;
-            });
+        savepoint.release();
+        return removed;
+    }
 
-        auto query_string = std::format("SELECT {} FROM [{}] WHERE {}", select_fields_str, table_name, q.to_query_string());
-        if (order_by)
-            query_string += std::format(" ORDER BY __order_by {}", order_by->direction());
-        if (limit)
-            query_string += std::format(" LIMIT {}", *limit);
+    // ATTACHMENTS
 
-        details::sqlite::statement stmt{db_handle, query_string};
+    namespace details
+    {
+        std::string attachments_table(std::string_view table_name)
+        {
+            return std::format("{}$attachments", table_name);
+        }
 
-        auto binder = q.get_binder();
+        bool table_exists(sqlite3 *db_handle, std::string const &name)
+        {
+            details::sqlite::statement stmt{db_handle, "SELECT 1 FROM sqlite_master WHERE type='table' AND name=?;"};
+            return stmt.bind(1, name).step().result_code() == SQLITE_ROW;
+        }
 
-        for (const auto &[key, value] : binder.get_parameters())
+        // rowid of an attachment, nothing if it does not exist
+        std::optional<std::int64_t> attachment_rowid(sqlite3 *db_handle, std::string_view table_name, std::string_view doc_id, std::string_view name)
         {
-            std::visit([&](auto &&val)
-                        { stmt.bind(key, val); }, value);
+            auto attachments = attachments_table(table_name);
+            if (!table_exists(db_handle, attachments))
+                return std::nullopt;
+
+            details::sqlite::statement stmt{db_handle, std::format("SELECT rowid FROM [{}] WHERE docid = ?1 AND name = ?2;", attachments)};
+            if (stmt.bind(1, doc_id).bind(2, name).step().result_code() != SQLITE_ROW)
+                return std::nullopt;
+            return stmt.get<std::int64_t>(0);
         }
-        std::vector<db_document_ref> refs;
-        do
+
+        sqlite3_blob *open_blob(sqlite3 *db_handle, std::string_view table_name, std::int64_t rowid, bool writable)
         {
-            stmt.step();
-            if (stmt.result_code() == SQLITE_ERROR)
-            {
-                throw db_exception{db_handle, "Failed to enumerate documents"};
-            }
-            else if (stmt.result_code() != SQLITE_ROW)
-            {
-                break;
-            }
-            else
+            sqlite3_blob *blob = nullptr;
+            if (sqlite3_blob_open(db_handle, "main", attachments_table(table_name).c_str(), "data", rowid, writable ? 1 : 0, &blob) != SQLITE_OK)
             {
-                refs.push_back(db_document_ref{table_name, stmt.get<std::string>(0), db_handle});
+                sqlite3_blob_close(blob);
+                throw db_exception{db_handle, "Failed to open attachment"};
             }
-        } while (true);
+            return blob;
+        }
 
-        return refs;
+        // sqlite3_blob_read and sqlite3_blob_write take int sizes
+        constexpr std::size_t blob_chunk = 1 << 30;
+        // buffer size of the stream copies
+        constexpr std::size_t stream_chunk = 64 * 1024;
     }
 
-    bool column_exists(sqlite3 *db_handle, std::string_view table_name, std::string_view column_name)
-    {
-        auto doc_query = std::format("SELECT COUNT(*) FROM pragma_table_xinfo('{0}') WHERE name=?1", table_name);
-        details::sqlite::statement stmt{db_handle, doc_query};
-
-        stmt.bind(1, column_name)
-            .step();
+    db_attachment::db_attachment(sqlite3 *db_handle, sqlite3_blob *blob) noexcept : db_handle(db_handle), blob(blob) {}
+    db_attachment::db_attachment(db_attachment &&other) noexcept : db_handle(other.db_handle), blob(std::exchange(other.blob, nullptr)) {}
 
-        if (stmt.result_code() != SQLITE_ROW)
+    db_attachment &db_attachment::operator=(db_attachment &&other) noexcept
+    {
+        if (this != &other)
         {
-            throw db_exception{db_handle, "Failed to count collection"};
+            sqlite3_blob_close(blob);
+            db_handle = other.db_handle;
+            blob = std::exchange(other.blob, nullptr);
         }
+        return *this;
+    }
 
-        return stmt.get<std::int64_t>(0) > 0;
+    db_attachment::~db_attachment()
+    {
+        sqlite3_blob_close(blob);
     }
 
-    db_collection &db_collection::index(std::string_view column_name, std::string_view query, bool unique)
+    std::size_t db_attachment::size() const noexcept
     {
-        // create virtual table if not exists
-        if (!column_exists(db_handle, table_name, column_name))
+        return static_cast<std::size_t>(sqlite3_blob_bytes(blob));
+    }
+
+    std::size_t db_attachment::read(std::span<std::byte> buffer, std::size_t offset) const
+    {
+        auto total = size();
+        if (offset >= total)
+            return 0;
+
+        auto n = std::min(buffer.size(), total - offset);
+        for (std::size_t done = 0; done < n;)
         {
-            auto alter_table = std::format("ALTER TABLE [{}] ADD COLUMN [{}] GENERATED ALWAYS AS (json_extract(body, '{}')) VIRTUAL;", table_name, column_name, query);
-            details::sqlite::statement stmt{db_handle, alter_table};
+            auto chunk = std::min(n - done, details::blob_chunk);
+            if (sqlite3_blob_read(blob, buffer.data() + done, static_cast<int>(chunk), static_cast<int>(offset + done)) != SQLITE_OK)
+            {
+                throw db_exception{db_handle, "Failed to read attachment"};
+            }
+            done += chunk;
+        }
+        return n;
+    }
 
-            stmt.step();
+    void db_attachment::write(std::span<std::byte const> data, std::size_t offset)
+    {
+        if (offset > size() || data.size() > size() - offset)
+        {
+            throw std::out_of_range("write past the end of the attachment");
+        }
 
-            if (stmt.result_code() != SQLITE_DONE)
+        for (std::size_t done = 0; done < data.size();)
+        {
+            auto chunk = std::min(data.size() - done, details::blob_chunk);
+            if (sqlite3_blob_write(blob, data.data() + done, static_cast<int>(chunk), static_cast<int>(offset + done)) != SQLITE_OK)
             {
-                throw db_exception{db_handle, "Failed to alter table"};
+                throw db_exception{db_handle, "Failed to write attachment"};
             }
+            done += chunk;
         }
+    }
 
-        // create index
+    void db_attachment::read_to(std::ostream &out) const
+    {
+        std::vector<std::byte> buffer(std::min(size(), details::stream_chunk));
+        for (std::size_t offset = 0; offset < size();)
         {
-            auto create_index = std::format("CREATE {0} INDEX IF NOT EXISTS [Idx_{1}_{2}] on [{1}]({2});", unique ? "UNIQUE" : "", table_name, column_name);
-            details::sqlite::statement stmt{db_handle, create_index};
+            auto n = read(buffer, offset);
+            out.write(reinterpret_cast<char const *>(buffer.data()), static_cast<std::streamsize>(n));
+            offset += n;
+        }
+    }
 
-            stmt.step();
+    db_attachment db_collection::create_attachment(std::string_view doc_id, std::string_view name, std::size_t size)
+    {
+        {
+            details::sqlite::statement stmt{db_handle, std::format("SELECT 1 FROM [{}] WHERE docid = ?;", table_name)};
+            if (stmt.bind(1, doc_id).step().result_code() != SQLITE_ROW)
+            {
+                throw db_exception{db_handle, "Document not found"};
+            }
+        }
 
-            if (stmt.result_code() != SQLITE_DONE)
+        auto attachments = details::attachments_table(table_name);
+        details::sqlite::savepoint savepoint{db_handle, "docudb_attach"};
+
+        // a rowid table, incremental BLOB I/O addresses rows by rowid
+        for (auto const &sql : {
+                 std::format("CREATE TABLE IF NOT EXISTS [{}] (docid TEXT NOT NULL, name TEXT NOT NULL, data BLOB NOT NULL, UNIQUE (docid, name));", attachments),
+                 std::format("CREATE TRIGGER IF NOT EXISTS [{0}_delete] AFTER DELETE ON [{1}] BEGIN DELETE FROM [{0}] WHERE docid = OLD.docid; END;", attachments, table_name)})
+        {
+            details::sqlite::statement stmt{db_handle, sql};
+            if (stmt.step().result_code() != SQLITE_DONE)
             {
-                throw db_exception{db_handle, "Failed to create index"};
+                throw db_exception{db_handle, "Failed to create attachments"};
             }
         }
 
-        return *this;
+        // zeroblob() allocates the pages without building the payload in memory
+        details::sqlite::statement stmt{db_handle, std::format("INSERT OR REPLACE INTO [{}] (docid, name, data) VALUES (?1, ?2, zeroblob(?3));", attachments)};
+        if (stmt.bind(1, doc_id).bind(2, name).bind(3, static_cast<std::int64_t>(size)).step().result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to create attachment"};
+        }
+        auto rowid = sqlite3_last_insert_rowid(db_handle);
+
+        savepoint.release();
+        return db_attachment{db_handle, details::open_blob(db_handle, table_name, rowid, true)};
     }
 
-    db_collection &db_collection::index(
-        std::string name,
-        std::vector<std::pair<std::string, std::string>> const &columns,
-        bool unique)
+    void db_collection::attach(std::string_view doc_id, std::string_view name, std::istream &in, std::size_t size)
     {
-        details::sqlite::transaction transaction{db_handle};
+        details::sqlite::savepoint savepoint{db_handle, "docudb_attach_stream"};
 
-        // add relevant columns
-        for (auto &&[column_name, query] : columns)
         {
-            if (!column_exists(db_handle, table_name, column_name))
+            auto attachment = create_attachment(doc_id, name, size);
+            std::vector<std::byte> buffer(std::min(size, details::stream_chunk));
+            for (std::size_t offset = 0; offset < size;)
             {
-                auto alter_table = std::format("ALTER TABLE [{}] ADD COLUMN [{}] GENERATED ALWAYS AS (json_extract(body, '{}')) VIRTUAL;", table_name, column_name, query);
-                auto ret = sqlite3_exec(db_handle, alter_table.c_str(), nullptr, nullptr, nullptr);
-
-                if (ret != SQLITE_OK)
+                auto n = std::min(buffer.size(), size - offset);
+                in.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(n));
+                if (static_cast<std::size_t>(in.gcount()) != n)
                 {
-                    throw db_exception{db_handle, "Failed to alter table"};
+                    throw std::runtime_error("attachment stream ended early");
                 }
+                attachment.write(std::span{buffer}.first(n), offset);
+                offset += n;
             }
         }
 
-        // create index
+        savepoint.release();
+    }
+
+    db_attachment db_collection::open_attachment(std::string_view doc_id, std::string_view name, bool writable) const
+    {
+        auto rowid = details::attachment_rowid(db_handle, table_name, doc_id, name);
+        if (!rowid)
         {
-            auto columns_joined_comma = std::accumulate(
-                std::next(columns.begin()), columns.end(), columns[0].first,
-                [](std::string const &a, std::pair<std::string, std::string> const &b)
-                {
-                    return a + "," + b.first;
-                });
-            auto create_index = std::format("CREATE {0} INDEX IF NOT EXISTS [{1}] on [{2}]({3});", unique ? "UNIQUE" : "", name, table_name, columns_joined_comma);
-            auto ret = sqlite3_exec(db_handle, create_index.c_str(), nullptr, nullptr, nullptr);
+            throw db_exception{db_handle, "Attachment not found"};
+        }
+        return db_attachment{db_handle, details::open_blob(db_handle, table_name, *rowid, writable)};
+    }
 
-            if (ret != SQLITE_OK)
-            {
-                throw db_exception{db_handle, "Failed to create index"};
-            }
+    std::vector<attachment_info> db_collection::attachments(std::string_view doc_id) const
+    {
+        auto attachments = details::attachments_table(table_name);
+        if (!details::table_exists(db_handle, attachments))
+            return {};
+
+        // length() of a blob reads its size, not its pages
+        details::sqlite::statement stmt{db_handle, std::format("SELECT name, length(data) FROM [{}] WHERE docid = ? ORDER BY name;", attachments)};
+        stmt.bind(1, doc_id);
+
+        std::vector<attachment_info> infos;
+        while (stmt.step().result_code() == SQLITE_ROW)
+        {
+            infos.push_back({stmt.get<std::string>(0), static_cast<std::size_t>(stmt.get<std::int64_t>(1))});
         }
 
-        transaction.commit();
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to list attachments"};
+        }
 
-        return *this;
+        return infos;
+    }
+
+    bool db_collection::remove_attachment(std::string_view doc_id, std::string_view name)
+    {
+        auto attachments = details::attachments_table(table_name);
+        if (!details::table_exists(db_handle, attachments))
+            return false;
+
+        details::sqlite::statement stmt{db_handle, std::format("DELETE FROM [{}] WHERE docid = ?1 AND name = ?2;", attachments)};
+        if (stmt.bind(1, doc_id).bind(2, name).step().result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to remove attachment"};
+        }
+
+        return sqlite3_changes(db_handle) > 0;
     }
 
     void db_collection::remove(std::string_view doc_id)
@@ -803,6 +3110,67 @@ namespace docudb
         }
     }    
 
+    void db_collection::truncate()
+    {
+        columns_cache->clear();
+        details::sqlite::savepoint savepoint{db_handle, "docudb_truncate"};
+
+        // the tables first, then their indexes and triggers; the unique constraint indexes have no sql
+        // and come back with the tables. Attachments go with the documents
+        std::vector<std::string> tables{table_name, details::attachments_table(table_name)};
+        std::vector<std::string> schema;
+        {
+            details::sqlite::statement stmt{db_handle, "SELECT sql FROM sqlite_master WHERE tbl_name IN (?1, ?2) AND sql IS NOT NULL ORDER BY type<>'table', rowid;"};
+            stmt.bind(1, tables[0]).bind(2, tables[1]);
+            while (stmt.step().result_code() == SQLITE_ROW)
+            {
+                schema.push_back(stmt.get<std::string>(0));
+            }
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to read collection schema"};
+            }
+        }
+
+        if (schema.empty())
+        {
+            throw db_exception{db_handle, "Collection not found"};
+        }
+
+        // dropping the table skips the delete trigger: the removals are recorded in one statement instead
+        if (has_history())
+        {
+            details::sqlite::statement stmt{db_handle, std::format(
+                "INSERT INTO [{0}] (docid, version, ts, kind, data) "
+                "SELECT docid, (SELECT COALESCE(max(version), 0) + 1 FROM [{0}] AS h WHERE h.docid = t.docid), {2}, {3}, NULL FROM [{1}] AS t;",
+                details::history_table(table_name), table_name, details::history_clock, static_cast<int>(details::history_kind::deleted))};
+            if (stmt.step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to truncate collection"};
+            }
+        }
+
+        for (auto const &table : tables)
+        {
+            details::sqlite::statement stmt{db_handle, std::format("DROP TABLE IF EXISTS [{}];", table)};
+            if (stmt.step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to truncate collection"};
+            }
+        }
+
+        for (auto const &sql : schema)
+        {
+            details::sqlite::statement stmt{db_handle, sql};
+            if (stmt.step().result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to truncate collection"};
+            }
+        }
+
+        savepoint.release();
+    }
+
     // DOCUMENT
 
     db_document::db_document(std::string_view table, std::string_view doc_id, std::string_view body, sqlite3 *db_handle) : table_name(table), doc_id(doc_id), body_data(body), invalid_body(false), db_handle(db_handle) {}
@@ -1022,12 +3390,186 @@ namespace docudb
         return *this;
     }
 
-    // patch
-    db_document &db_document::patch(std::string_view json)
+    // patch
+    db_document &db_document::patch(std::string_view json)
+    {
+        db_document_json_patch_impl(db_handle, table_name, doc_id, json);
+        invalid_body = true;
+        return *this;
+    }
+
+    db_document &db_document::apply_patch(std::vector<json_patch::operation> const &ops)
+    {
+        if (ops.empty())
+            return *this;
+
+        // parameters from ?2, ?1 is the docid
+        std::vector<std::string> params;
+        auto param = [&](std::string value)
+        {
+            params.push_back(std::move(value));
+            return std::format("?{}", params.size() + 1);
+        };
+
+        // every operation is a few steps, each a common table expression over the previous one with the
+        // columns b (the body), v (the value moved between steps), p (the json path being worked on) and
+        // ok (all checks passed); materialized, so that the body is not recomputed wherever a step uses it,
+        // and chained rather than nested, so that long patches stay within the depth limits of the parser
+        auto steps = std::format("s0(b, v, p, ok) AS MATERIALIZED (SELECT body, NULL, '$', 1 FROM [{}] WHERE docid = ?1)", table_name);
+        auto step_count = 0;
+        auto step = [&](std::string const &b, std::string const &v, std::string const &p, std::string const &ok)
+        {
+            steps += std::format(",\n s{0}(b, v, p, ok) AS MATERIALIZED (SELECT {2}, {3}, {4}, ok AND {5} FROM s{1})", step_count + 1, step_count, b, v, p, ok);
+            ++step_count;
+        };
+
+        // sets p to the path of the first count segments; a segment that depends on the type of
+        // its parent is resolved against the body as it is at this point of the patch
+        auto locate = [&](std::vector<json_patch::path_segment> const &segments, std::size_t count)
+        {
+            std::string path = "$";
+            auto resolved = false;
+            auto prefix = [&]
+            { return resolved ? std::format("p || {}", param(std::exchange(path, ""))) : param(std::exchange(path, "")); };
+
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (segments[i].object == segments[i].array)
+                {
+                    path += segments[i].object;
+                    continue;
+                }
+                auto parent = prefix();
+                step("b", "v", std::format("{0} || CASE json_type(b, {0}) WHEN 'array' THEN {1} ELSE {2} END", parent, param(segments[i].array), param(segments[i].object)), "1");
+                resolved = true;
+            }
+            if (!resolved || !path.empty())
+                step("b", "v", prefix(), "1");
+        };
+
+        auto exists = "json_type(b, p) IS NOT NULL"s;
+
+        // adds value under the path; json_set replaces array elements, so inserting at an index rebuilds the array
+        auto add = [&](std::string_view pointer, std::string const &value)
+        {
+            auto segments = json_patch::path_segments(pointer);
+            if (segments.empty())
+            {
+                locate(segments, 0);
+                step(std::format("json_set(b, p, {})", value), "v", "p", "1");
+                return;
+            }
+
+            locate(segments, segments.size() - 1);
+            auto const &last = segments.back();
+            auto member = last.object.starts_with('.') ? std::format("json_set(b, p || {}, {})", param(last.object), value) : "b"s;
+            auto member_ok = last.object.starts_with('.') ? "1" : "0";
+
+            auto element = "b"s;
+            auto element_ok = "0"s;
+            auto index = std::string_view{last.array}.substr(1, last.array.size() - 2);
+            if (last.array == "[#]")
+            {
+                element = std::format("json_set(b, p || '[#]', {})", value);
+                element_ok = "1";
+            }
+            else if (json_patch::is_array_index(index))
+            {
+                element = std::format("json_set(b, p, json((SELECT json_group_array(json(e)) FROM (SELECT e FROM (SELECT key AS k, b -> fullkey AS e FROM json_each(b, p) UNION ALL SELECT {0} - 0.5, {1}) ORDER BY k))))", index, value);
+                element_ok = std::format("json_array_length(b, p) >= {}", index);
+            }
+
+            step(std::format("CASE json_type(b, p) WHEN 'array' THEN {} ELSE {} END", element, member),
+                 "v", "p",
+                 std::format("CASE json_type(b, p) WHEN 'object' THEN {} WHEN 'array' THEN {} ELSE 0 END", member_ok, element_ok));
+        };
+
+        for (auto const &op : ops)
+        {
+            switch (op.op)
+            {
+            case json_patch::op_type::add:
+                add(op.path, std::format("json({})", param(op.value)));
+                break;
+            case json_patch::op_type::remove:
+            {
+                auto segments = json_patch::path_segments(op.path);
+                locate(segments, segments.size());
+                step("json_remove(b, p)", "v", "p", exists);
+                break;
+            }
+            case json_patch::op_type::replace:
+            {
+                auto segments = json_patch::path_segments(op.path);
+                locate(segments, segments.size());
+                step(std::format("json_replace(b, p, json({}))", param(op.value)), "v", "p", exists);
+                break;
+            }
+            case json_patch::op_type::move:
+            {
+                auto segments = json_patch::path_segments(op.from);
+                locate(segments, segments.size());
+                step("json_remove(b, p)", "b -> p", "p", exists);
+                add(op.path, "json(v)");
+                break;
+            }
+            case json_patch::op_type::copy:
+            {
+                auto segments = json_patch::path_segments(op.from);
+                locate(segments, segments.size());
+                step("b", "b -> p", "p", exists);
+                add(op.path, "json(v)");
+                break;
+            }
+            case json_patch::op_type::test:
+            {
+                // compared structurally: both sides flattened by json_tree, so that the order
+                // of object members does not matter and 1 equals 1.0
+                auto expected = param(op.value);
+                auto flatten = [](std::string const &json)
+                {
+                    return std::format("SELECT fullkey, CASE type WHEN 'integer' THEN 'real' ELSE type END, atom FROM json_tree({})", json);
+                };
+                auto segments = json_patch::path_segments(op.path);
+                locate(segments, segments.size());
+                step("b", "v", "p",
+                     std::format("{0} AND NOT EXISTS ({1} EXCEPT {2}) AND NOT EXISTS ({2} EXCEPT {1})",
+                                 exists, flatten("b -> p"), flatten(std::format("json({})", expected))));
+                break;
+            }
+            }
+        }
+
+        auto update_doc_query = std::format("WITH {1} UPDATE [{0}] SET body = json_set(patched.b, '$.docid', ?1) FROM s{2} AS patched WHERE [{0}].docid = ?1 AND patched.ok;", table_name, steps, step_count);
+        details::sqlite::statement stmt{db_handle, update_doc_query};
+
+        stmt.bind(1, doc_id);
+        for (std::size_t i = 0; i < params.size(); ++i)
+        {
+            stmt.bind(static_cast<int>(i + 2), params[i]);
+        }
+        stmt.step();
+
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to update document"};
+        }
+
+        invalid_body = true;
+
+        if (sqlite3_changes(db_handle) == 0)
+        {
+            // tells a missing document apart from an operation that failed
+            read_doc_body(db_handle, table_name, doc_id);
+            throw std::invalid_argument("JSON Patch could not be applied: a path was not found or a test failed");
+        }
+
+        return *this;
+    }
+
+    db_document &db_document::apply_patch(std::string_view json)
     {
-        db_document_json_patch_impl(db_handle, table_name, doc_id, json);
-        invalid_body = true;
-        return *this;
+        return apply_patch(json_patch::parse(json));
     }
 
     // remove
@@ -1220,4 +3762,514 @@ namespace docudb
     {
         return db_collection{table_name, db_handle}.remove(doc_id);
     }    
+
+    // TIERED COLLECTION
+
+    namespace details
+    {
+        constexpr auto hot_schema = "docudb_hot"sv;
+
+        struct tiered_state
+        {
+            sqlite3 *db_handle;
+            std::string table_name;
+            tiered_options options;
+            std::atomic<std::uint64_t> hot_reads{0};
+            std::atomic<std::uint64_t> cold_reads{0};
+            std::atomic<std::uint64_t> promotions{0};
+            std::atomic<std::uint64_t> demotions{0};
+            std::unique_ptr<periodic_worker> demoter;
+        };
+
+        std::int64_t tier_clock()
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        void tier_exec(sqlite3 *db_handle, std::string const &sql, std::string_view msg)
+        {
+            if (sqlite3_exec(db_handle, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+            {
+                db_exception e{db_handle, msg};
+                // a failed statement leaves the savepoint open
+                sqlite3_exec(db_handle, "ROLLBACK TO docudb_tier; RELEASE docudb_tier;", nullptr, nullptr, nullptr);
+                throw e;
+            }
+        }
+
+        // moves one batch of hot documents to the cold tier, in a single call so that
+        // other threads sharing a serialized connection cannot interleave statements
+        std::size_t demote_batch(tiered_state &state, std::int64_t cutoff, std::size_t max_hot)
+        {
+            auto victims = std::format(
+                "SELECT rowid FROM {0}.[{1}] WHERE accessed <= {2} "
+                "OR rowid NOT IN (SELECT rowid FROM {0}.[{1}] ORDER BY accessed DESC, rowid DESC LIMIT {3}) "
+                "ORDER BY accessed, rowid LIMIT {4}",
+                hot_schema, state.table_name, cutoff, max_hot, state.options.batch_size);
+
+            // written documents are upserted, so that the cold row and what references it
+            // (attachments, history) stay; promoted copies are dropped
+            tier_exec(state.db_handle, std::format(
+                "SAVEPOINT docudb_tier;"
+                "INSERT INTO main.[{1}] (body) SELECT body FROM {0}.[{1}] WHERE dirty AND rowid IN ({2}) "
+                "ON CONFLICT (docid) DO UPDATE SET body=excluded.body;"
+                "DELETE FROM {0}.[{1}] WHERE rowid IN ({2});"
+                "RELEASE docudb_tier;",
+                hot_schema, state.table_name, victims), "Failed to demote documents");
+
+            return static_cast<std::size_t>(sqlite3_changes(state.db_handle));
+        }
+
+        std::size_t demote(tiered_state &state, std::int64_t cutoff, std::size_t max_hot)
+        {
+            std::size_t total = 0;
+            while (true)
+            {
+                auto demoted = demote_batch(state, cutoff, max_hot);
+                // counted per batch, so that the statistics follow the hot table
+                state.demotions += demoted;
+                total += demoted;
+                if (demoted < state.options.batch_size)
+                    break;
+            }
+            return total;
+        }
+
+        std::size_t tier_count(sqlite3 *db_handle, std::string const &query_string, query::binder const *binder)
+        {
+            details::sqlite::statement stmt{db_handle, query_string};
+            if (binder)
+                bind_parameters(stmt, *binder);
+
+            stmt.step();
+
+            if (stmt.result_code() != SQLITE_ROW)
+            {
+                throw db_exception{db_handle, "Failed to count collection"};
+            }
+
+            return stmt.get<std::int64_t>(0);
+        }
+    }
+
+    tiered_collection::tiered_collection(sqlite3 *db_handle, std::string_view name, tiered_options const &options)
+        : state(std::make_unique<details::tiered_state>())
+    {
+        state->db_handle = db_handle;
+        state->table_name = name;
+        state->options = options;
+        if (state->options.batch_size == 0)
+            state->options.batch_size = 1;
+
+        // the cold tier is the regular collection
+        details::open_collection(db_handle, name);
+
+        bool attached = false;
+        {
+            details::sqlite::statement stmt{db_handle, "SELECT 1 FROM pragma_database_list WHERE name=?1;"};
+            stmt.bind(1, details::hot_schema).step();
+            attached = stmt.result_code() == SQLITE_ROW;
+        }
+
+        if (!attached)
+        {
+            details::tier_exec(db_handle, std::format("ATTACH DATABASE ':memory:' AS {};", details::hot_schema), "Failed to attach the hot tier");
+        }
+
+        details::tier_exec(db_handle, std::format(
+            "CREATE TABLE IF NOT EXISTS {0}.[{1}] (body TEXT, docid TEXT GENERATED ALWAYS AS (json_extract(body, '$.docid')) VIRTUAL NOT NULL UNIQUE, accessed INTEGER NOT NULL, dirty INTEGER NOT NULL);"
+            "CREATE INDEX IF NOT EXISTS {0}.[Idx_{1}_accessed] ON [{1}](accessed);",
+            details::hot_schema, name), "Failed to create the hot tier");
+
+        if (options.demote_interval.count() > 0)
+        {
+            // the worker runs on another thread and shares this connection
+            if (!sqlite3_db_mutex(db_handle))
+            {
+                throw db_exception{db_handle, "Background demotion requires a serialized connection"};
+            }
+
+            auto s = state.get();
+            state->demoter = std::make_unique<details::periodic_worker>(options.demote_interval, [s]
+                                                                        {
+                // never extend a transaction opened by the application
+                if (!sqlite3_get_autocommit(s->db_handle))
+                    return;
+                try
+                {
+                    details::demote(*s, details::tier_clock() - s->options.max_age.count(), s->options.max_hot_documents);
+                }
+                catch (db_exception const &)
+                {
+                    // busy or locked, try again on the next interval
+                } });
+        }
+    }
+
+    tiered_collection::tiered_collection(tiered_collection &&) noexcept = default;
+    tiered_collection &tiered_collection::operator=(tiered_collection &&) noexcept = default;
+
+    tiered_collection::~tiered_collection()
+    {
+        if (!state)
+            return;
+
+        state->demoter.reset();
+        try
+        {
+            flush();
+        }
+        catch (db_exception const &)
+        {
+            // the hot documents stay attached to the connection until it closes
+        }
+    }
+
+    std::string tiered_collection::name() const
+    {
+        return state->table_name;
+    }
+
+    std::string tiered_collection::insert(std::string_view body)
+    {
+        auto doc_id = details::uuid::generate_uuid_v4();
+        put(doc_id, body);
+        return doc_id;
+    }
+
+    void tiered_collection::put(std::string_view doc_id, std::string_view body)
+    {
+        // the cold row, if any, is shadowed until demotion updates it
+        auto insert_query = std::format("INSERT OR REPLACE INTO {}.[{}] (body, accessed, dirty) VALUES (json_set(?1, '$.docid', ?2), ?3, 1);", details::hot_schema, state->table_name);
+        details::sqlite::statement stmt{state->db_handle, insert_query};
+        stmt.bind(1, body).bind(2, doc_id).bind(3, details::tier_clock()).step();
+
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{state->db_handle, "Failed to write document"};
+        }
+    }
+
+    std::optional<std::string> tiered_collection::get(std::string_view doc_id)
+    {
+        auto db_handle = state->db_handle;
+        {
+            auto hot_query = std::format("UPDATE {}.[{}] SET accessed=?2 WHERE docid=?1 RETURNING body;", details::hot_schema, state->table_name);
+            details::sqlite::statement stmt{db_handle, hot_query};
+            stmt.bind(1, doc_id).bind(2, details::tier_clock()).step();
+
+            if (stmt.result_code() == SQLITE_ROW)
+            {
+                state->hot_reads++;
+                return stmt.get<std::string>(0);
+            }
+        }
+
+        std::string body;
+        {
+            auto cold_query = std::format("SELECT body FROM main.[{}] WHERE docid=?1;", state->table_name);
+            details::sqlite::statement stmt{db_handle, cold_query};
+            stmt.bind(1, doc_id).step();
+
+            if (stmt.result_code() != SQLITE_ROW)
+                return std::nullopt;
+            body = stmt.get<std::string>(0);
+        }
+
+        state->cold_reads++;
+        if (state->options.promote_on_read)
+        {
+            // a clean copy: the cold row stays, durable, and demotion just drops the copy
+            auto promote_query = std::format("INSERT OR IGNORE INTO {}.[{}] (body, accessed, dirty) VALUES (?1, ?2, 0);", details::hot_schema, state->table_name);
+            details::sqlite::statement stmt{db_handle, promote_query};
+            stmt.bind(1, body).bind(2, details::tier_clock()).step();
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{db_handle, "Failed to promote document"};
+            }
+            state->promotions++;
+        }
+        return body;
+    }
+
+    void tiered_collection::remove(std::string_view doc_id)
+    {
+        for (auto schema : {details::hot_schema, "main"sv})
+        {
+            auto delete_query = std::format("DELETE FROM {}.[{}] WHERE docid=?1;", schema, state->table_name);
+            details::sqlite::statement stmt{state->db_handle, delete_query};
+            stmt.bind(1, doc_id).step();
+
+            if (stmt.result_code() != SQLITE_DONE)
+            {
+                throw db_exception{state->db_handle, "Failed to delete document"};
+            }
+        }
+    }
+
+    std::size_t tiered_collection::count() const
+    {
+        // cold rows with a hot copy are counted once, in the hot tier
+        auto query_string = std::format("SELECT (SELECT COUNT(*) FROM {0}.[{1}]) + (SELECT COUNT(*) FROM main.[{1}] WHERE docid NOT IN (SELECT docid FROM {0}.[{1}]));", details::hot_schema, state->table_name);
+        return details::tier_count(state->db_handle, query_string, nullptr);
+    }
+
+    std::size_t tiered_collection::count(query::queryable_type_eraser q) const
+    {
+        // the query parameters are numbered, both tiers bind the same values
+        auto where = q.to_query_string();
+        auto query_string = std::format("SELECT (SELECT COUNT(*) FROM {0}.[{1}] WHERE {2}) + (SELECT COUNT(*) FROM main.[{1}] WHERE ({2}) AND docid NOT IN (SELECT docid FROM {0}.[{1}]));", details::hot_schema, state->table_name, where);
+        auto binder = q.get_binder();
+        return details::tier_count(state->db_handle, query_string, &binder);
+    }
+
+    std::vector<std::string> tiered_collection::find(query::queryable_type_eraser q, std::optional<int> limit) const
+    {
+        auto where = q.to_query_string();
+        auto query_string = std::format("SELECT docid FROM {0}.[{1}] WHERE {2} UNION ALL SELECT docid FROM main.[{1}] WHERE ({2}) AND docid NOT IN (SELECT docid FROM {0}.[{1}])", details::hot_schema, state->table_name, where);
+        if (limit)
+            query_string += std::format(" LIMIT {}", *limit);
+
+        details::sqlite::statement stmt{state->db_handle, query_string};
+        bind_parameters(stmt, q.get_binder());
+
+        std::vector<std::string> ids;
+        do
+        {
+            stmt.step();
+            if (stmt.result_code() == SQLITE_ERROR)
+            {
+                throw db_exception{state->db_handle, "Failed to search documents"};
+            }
+            else if (stmt.result_code() != SQLITE_ROW)
+            {
+                break;
+            }
+            else
+            {
+                ids.push_back(stmt.get<std::string>(0));
+            }
+        } while (true);
+
+        return ids;
+    }
+
+    std::size_t tiered_collection::demote()
+    {
+        return details::demote(*state, details::tier_clock() - state->options.max_age.count(), state->options.max_hot_documents);
+    }
+
+    void tiered_collection::flush()
+    {
+        details::demote(*state, std::numeric_limits<std::int64_t>::max(), 0);
+    }
+
+    std::size_t tiered_collection::hot_count() const
+    {
+        return details::tier_count(state->db_handle, std::format("SELECT COUNT(*) FROM {}.[{}];", details::hot_schema, state->table_name), nullptr);
+    }
+
+    std::size_t tiered_collection::cold_count() const
+    {
+        return details::tier_count(state->db_handle, std::format("SELECT COUNT(*) FROM main.[{}];", state->table_name), nullptr);
+    }
+
+    tiered_stats tiered_collection::statistics() const
+    {
+        return tiered_stats{state->hot_reads, state->cold_reads, state->promotions, state->demotions};
+    }
+
+    // MIRROR
+
+    collection_mirror::collection_mirror(sqlite3 *db_handle, std::string_view name, mirror_options const &options)
+    {
+        details::open_collection(db_handle, name);
+        state = std::make_unique<details::mirror::state>(db_handle, name, options);
+    }
+
+    collection_mirror::collection_mirror(collection_mirror &&) noexcept = default;
+    collection_mirror &collection_mirror::operator=(collection_mirror &&) noexcept = default;
+    collection_mirror::~collection_mirror() = default;
+
+    std::string collection_mirror::name() const
+    {
+        return state->table_name;
+    }
+
+    std::size_t collection_mirror::size() const
+    {
+        state->sync();
+        std::shared_lock lock{state->mutex};
+        return state->data.size();
+    }
+
+    bool collection_mirror::contains(std::string_view doc_id) const
+    {
+        state->sync();
+        std::shared_lock lock{state->mutex};
+        return state->data.find(doc_id) != nullptr;
+    }
+
+    std::optional<std::string> collection_mirror::get(std::string_view doc_id) const
+    {
+        state->sync();
+        std::shared_lock lock{state->mutex};
+        auto e = state->data.find(doc_id);
+        if (!e)
+            return std::nullopt;
+        return e->value;
+    }
+
+    std::vector<std::string> collection_mirror::range(std::string_view path, std::optional<db_value> const &lower, std::optional<db_value> const &upper, std::optional<std::size_t> limit) const
+    {
+        auto const &paths = state->ordered_paths;
+        auto index = std::find(paths.begin(), paths.end(), path);
+        if (index == paths.end())
+        {
+            throw std::invalid_argument(std::format("No ordered index on {}", path));
+        }
+
+        auto to_key = [](std::optional<db_value> const &value) -> std::optional<details::mirror::key>
+        {
+            if (!value)
+                return std::nullopt;
+            return std::visit([](auto const &v) -> details::mirror::key
+                              {
+                using T = std::decay_t<decltype(v)>;
+                if constexpr (std::is_same_v<T, std::nullptr_t>)
+                    throw std::invalid_argument("A range bound cannot be null");
+                else if constexpr (std::is_same_v<T, std::string>)
+                    return v;
+                else
+                    return static_cast<double>(v); }, *value);
+        };
+        auto lower_key = to_key(lower);
+        auto upper_key = to_key(upper);
+
+        state->sync();
+        std::shared_lock lock{state->mutex};
+        std::vector<std::string> ids;
+        state->data.range(static_cast<std::size_t>(index - paths.begin()), lower_key, upper_key, [&](details::mirror::entry const &e)
+                          {
+            if (limit && ids.size() >= *limit)
+                return false;
+            ids.push_back(e.docid);
+            return true; });
+        return ids;
+    }
+
+    void collection_mirror::refresh()
+    {
+        state->sync();
+    }
+
+    void collection_mirror::reload()
+    {
+        state->reload();
+    }
+
+    // READ SESSION
+
+    db_read_session::db_read_session(sqlite3 *db_handle, [[maybe_unused]] sqlite3_snapshot *at) : db_handle(db_handle)
+    {
+        if (!sqlite3_get_autocommit(db_handle))
+        {
+            throw std::logic_error("A transaction is already open on this connection");
+        }
+
+        if (sqlite3_exec(db_handle, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            throw db_exception{db_handle, "Failed to begin transaction"};
+        }
+
+        auto fail = [&](std::string_view msg)
+        {
+            db_exception e{db_handle, msg};
+            sqlite3_exec(db_handle, "ROLLBACK;", nullptr, nullptr, nullptr);
+            this->db_handle = nullptr;
+            throw e;
+        };
+
+#ifdef DOCUDB_HAS_SNAPSHOT
+        if (at && sqlite3_snapshot_open(db_handle, "main", at) != SQLITE_OK)
+        {
+            fail("Failed to open snapshot");
+        }
+#endif
+
+        // a deferred transaction takes its snapshot at the first read
+        details::sqlite::statement stmt{db_handle, "SELECT count(*) FROM sqlite_master;"};
+        if (stmt.step().result_code() != SQLITE_ROW)
+        {
+            fail("Failed to begin transaction");
+        }
+    }
+
+    db_read_session::db_read_session(db_read_session &&other) noexcept : db_handle(std::exchange(other.db_handle, nullptr)) {}
+
+    db_read_session &db_read_session::operator=(db_read_session &&other) noexcept
+    {
+        if (this != &other)
+        {
+            rollback();
+            db_handle = std::exchange(other.db_handle, nullptr);
+        }
+        return *this;
+    }
+
+    db_read_session::~db_read_session()
+    {
+        rollback();
+    }
+
+    void db_read_session::end()
+    {
+        if (!db_handle)
+            return;
+
+        if (sqlite3_exec(db_handle, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            throw db_exception{db_handle, "Failed to end read session"};
+        }
+        db_handle = nullptr;
+    }
+
+    void db_read_session::rollback() noexcept
+    {
+        if (!db_handle)
+            return;
+
+        // only reached when end() was not called or failed: the writes are not kept silently
+        sqlite3_exec(db_handle, "ROLLBACK;", nullptr, nullptr, nullptr);
+        db_handle = nullptr;
+    }
+
+    db_snapshot db_read_session::snapshot() const
+    {
+#ifdef DOCUDB_HAS_SNAPSHOT
+        if (!db_handle)
+        {
+            throw std::logic_error("The read session has ended");
+        }
+
+        sqlite3_snapshot *handle = nullptr;
+        if (sqlite3_snapshot_get(db_handle, "main", &handle) != SQLITE_OK)
+        {
+            throw db_exception{db_handle, "Failed to get snapshot"};
+        }
+        return db_snapshot{std::shared_ptr<sqlite3_snapshot>(handle, sqlite3_snapshot_free)};
+#else
+        throw std::runtime_error("SQLite was built without SQLITE_ENABLE_SNAPSHOT");
+#endif
+    }
+
+    bool db_read_session::snapshots_supported() noexcept
+    {
+#ifdef DOCUDB_HAS_SNAPSHOT
+        return true;
+#else
+        return false;
+#endif
+    }
 }
@@ -13,6 +13,13 @@
 #include <unordered_map>
 #include <memory>
 #include <format>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <charconv>
+#include <chrono>
+#include <span>
+#include <iosfwd>
 
 // sqlite3 forward declarations
 struct sqlite3;
@@ -91,6 +98,10 @@ namespace docudb
         struct statement
         {
             statement(sqlite3 *db_handle, std::string_view query);
+            statement(statement &&other) noexcept;
+            statement &operator=(statement &&other) noexcept;
+            statement(statement const &) = delete;
+            statement &operator=(statement const &) = delete;
             ~statement();
             sqlite3_stmt *data() const noexcept;
             statement &bind(int index, std::int16_t value);
@@ -101,6 +112,7 @@ namespace docudb
             statement &bind(int index, std::double_t value);
             statement &bind(int index, std::float_t value);
             statement &step() noexcept;
+            statement &reset() noexcept;
             template <typename T>
             T get(int index) const
             {
@@ -138,6 +150,8 @@ namespace docudb
         std::uint32_t statement::get(int index) const;        
         template <>
         std::uint16_t statement::get(int index) const;   
+        template <>
+        db_value statement::get(int index) const;
     }
 
     namespace query
@@ -175,6 +189,77 @@ namespace docudb
             { x.get_binder() } -> std::same_as<binder &>;
         };
 
+        /**
+         * \brief A query as a tree, the form simplified by optimize() before SQL is emitted.
+         */
+        struct expression
+        {
+            enum class kind
+            {
+                /**
+                 * \brief A condition rendered by sql, usually on a single field.
+                 */
+                predicate,
+                all_of,
+                any_of,
+                constant
+            };
+
+            kind type = kind::constant;
+            /**
+             * \brief Predicates: the SQL of the compared field, empty when opaque to the optimizer.
+             */
+            std::string target;
+            /**
+             * \brief Predicates: the operator, e.g. "<=", "LIKE", "IN" or "BETWEEN".
+             */
+            std::string op;
+            /**
+             * \brief Predicates: the parenthesized SQL condition.
+             */
+            std::string sql;
+            /**
+             * \brief Predicates: the bound parameters, by index, in the order of the operands.
+             */
+            std::vector<std::pair<int, db_value>> parameters;
+            /**
+             * \brief Constants: whether every document matches.
+             */
+            bool value = true;
+            std::vector<expression> children;
+
+            /**
+             * \brief Wraps a condition the optimizer cannot look into.
+             */
+            static expression opaque(std::string const &sql, binder const &b);
+
+            std::string to_query_string() const;
+            binder get_binder() const;
+        };
+
+        /**
+         * \brief Simplifies a query tree without changing the documents it matches.
+         *
+         * Nested gates are flattened and duplicate predicates removed. Within an AND, the
+         * comparisons of a json field against values of the same kind (numbers or text) are merged:
+         * the tightest bounds are kept, >= and <= become BETWEEN, and contradictions such as
+         * x > 5 AND x < 3 fold to a constant false. Within an OR, equalities on the same field
+         * become a single IN. Comparisons against values of different kinds are left untouched.
+         */
+        expression optimize(expression e);
+
+        /**
+         * \brief Gets the tree of a queryable object, an opaque predicate if it has no to_expression().
+         */
+        template <typename T>
+        expression to_expression(T const &q)
+        {
+            if constexpr (requires { { q.to_expression() } -> std::same_as<expression>; })
+                return q.to_expression();
+            else
+                return expression::opaque(q.to_query_string(), q.get_binder());
+        }
+
         /**
          * \brief Represents a logic gate for combining two queryable objects.
          */
@@ -184,8 +269,11 @@ namespace docudb
 
             explicit logic_gate(A &&a, B &&b, std::string const &gate) : a_(std::move(a)), b_(std::move(b)), gate_(gate)
             {
-                binder_.merge(a_.get_binder());
-                binder_.merge(b_.get_binder());
+                // copies, the operands keep their parameters for to_expression()
+                binder a_binder = a_.get_binder();
+                binder b_binder = b_.get_binder();
+                binder_.merge(a_binder);
+                binder_.merge(b_binder);
             }
 
             std::string to_query_string() const
@@ -193,6 +281,15 @@ namespace docudb
                 return std::format("{} {} {}", a_.to_query_string(), gate_, b_.to_query_string());
             }
 
+            expression to_expression() const
+            {
+                expression e;
+                e.type = gate_ == "AND" ? expression::kind::all_of : expression::kind::any_of;
+                e.children.push_back(query::to_expression(a_));
+                e.children.push_back(query::to_expression(b_));
+                return e;
+            }
+
             binder const &get_binder() const
             {
                 return binder_;
@@ -277,6 +374,24 @@ namespace docudb
                     return std::format("([{}] {} ?{})", var_, op_, index_);
             }
 
+            expression to_expression() const
+            {
+                expression e;
+                e.type = expression::kind::predicate;
+                e.target = var_.size() > 0 && var_[0] == '$' ? std::format("json_extract(body, '{}')", var_) : std::format("[{}]", var_);
+                e.op = op_;
+                if (index_ == -1)
+                {
+                    e.sql = std::format("({})", to_query_string());
+                }
+                else
+                {
+                    e.sql = to_query_string();
+                    e.parameters.emplace_back(index_, binder_.get_parameters().at(index_));
+                }
+                return e;
+            }
+
             binder const &get_binder() const
             {
                 return binder_;
@@ -304,6 +419,53 @@ namespace docudb
                 std::string const &val) : binary_op(name, "LIKE", val) {}
         };
 
+        /**
+         * \brief Represents a case-sensitive substring search, requires database::load_extensions.
+         */
+        struct contains
+        {
+            explicit contains(
+                std::string const &name,
+                std::string const &val) : var_(name), index_(1 + (++bind_counter % MAX_VAR_NUM))
+            {
+                binder_.add(index_, db_value{val});
+            }
+
+            std::string to_query_string() const
+            {
+                if (var_.size() > 0 && var_[0] == '$')
+                    return std::format("contains(json_extract(body, '{}'), ?{})", var_, index_);
+                else
+                    return std::format("contains([{}], ?{})", var_, index_);
+            }
+
+            expression to_expression() const
+            {
+                expression e;
+                e.type = expression::kind::predicate;
+                e.target = var_.size() > 0 && var_[0] == '$' ? std::format("json_extract(body, '{}')", var_) : std::format("[{}]", var_);
+                e.op = "contains";
+                e.sql = std::format("({})", to_query_string());
+                e.parameters.emplace_back(index_, binder_.get_parameters().at(index_));
+                return e;
+            }
+
+            binder const &get_binder() const
+            {
+                return binder_;
+            }
+
+            binder &get_binder()
+            {
+                return binder_;
+            }
+
+        private:
+            std::string var_;
+            binder binder_;
+            int index_;
+        };
+
         /**
          * \brief Represents a REGEXP operation for querying.
          */
@@ -395,74 +557,329 @@ namespace docudb
         }
 
         /**
-         * \brief Abstract base class for Queryable objects.
+         * \brief Type-erased Queryable object, simplified by optimize().
          */
-        struct queryable_base
+        struct queryable_type_eraser
         {
-            virtual ~queryable_base() = default;
+            template <Queryable T>
+            queryable_type_eraser(T &&obj)
+                : expr_(optimize(query::to_expression(obj))) {}
 
-            // Pure virtual methods
-            virtual std::string to_query_string() const = 0;
-            virtual binder get_binder() const = 0;
-        };
+            std::string to_query_string() const
+            {
+                return expr_.to_query_string();
+            }
 
-        /**
-         * \brief Concrete wrapper for erasing the type of a Queryable object.
-         */
-        template <Queryable T>
-        struct queryable_wrapper : queryable_base
-        {
-            explicit queryable_wrapper(T &&obj) : obj_(std::forward<T>(obj)) {}
+            binder get_binder() const
+            {
+                return expr_.get_binder();
+            }
 
-            std::string to_query_string() const override
+            /**
+             * \brief Checks whether the query was found to match no document, so that it need not run.
+             */
+            bool never_matches() const
             {
-                return obj_.to_query_string();
+                return expr_.type == expression::kind::constant && !expr_.value;
             }
 
-            binder get_binder() const override
+            /**
+             * \brief Gets the simplified query tree.
+             */
+            expression const &tree() const
             {
-                return obj_.get_binder();
+                return expr_;
             }
 
         private:
-            T obj_;
+            expression expr_;
         };
 
         /**
-         * \brief Type-erased Queryable object.
+         * \brief Specifies where NULL values are placed when sorting.
          */
-        struct queryable_type_eraser
+        enum class nulls
         {
-            template <Queryable T>
-            queryable_type_eraser(T &&obj)
-                : ptr_(std::make_unique<queryable_wrapper<T>>(std::forward<T>(obj))) {}
+            /**
+             * \brief SQLite's default: first when ascending, last when descending.
+             */
+            default_order,
+            first,
+            last
+        };
 
-            std::string to_query_string() const
+        /**
+         * \brief Specifies the collation used to compare text values when sorting.
+         */
+        enum class collation
+        {
+            binary,
+            /**
+             * \brief Case-insensitive for ASCII characters.
+             */
+            nocase
+        };
+
+        /**
+         * \brief Represents the sort order of a query, on one or more fields.
+         *
+         * \code
+         * query::order_by("$.lastname").then("$.age", false)
+         * \endcode
+         */
+        struct order_by
+        {
+            /**
+             * \brief A single sort key.
+             */
+            struct key
+            {
+                std::string field;
+                bool ascending;
+                query::nulls nulls;
+                query::collation collation;
+            };
+
+            explicit order_by(std::string const &field, bool ascending = true, query::nulls nulls = query::nulls::default_order, query::collation collation = query::collation::binary)
+                : keys_{{field, ascending, nulls, collation}} {}
+
+            /**
+             * \brief Adds a sort key, used when the previous keys compare equal.
+             */
+            order_by &then(std::string const &field, bool ascending = true, query::nulls nulls = query::nulls::default_order, query::collation collation = query::collation::binary)
             {
-                return ptr_->to_query_string();
+                keys_.push_back({field, ascending, nulls, collation});
+                return *this;
             }
 
-            binder get_binder() const
+            std::vector<key> const &keys() const { return keys_; }
+
+            std::string const& field() const { return keys_.front().field; }
+            std::string_view direction() const { return keys_.front().ascending ? "ASC" : "DESC"; }
+
+            private:
+                std::vector<key> keys_;
+        };
+    }
+
+    /**
+     * \brief Describes a struct member mapped to a json field.
+     */
+    template <typename T, typename M>
+    struct field_descriptor
+    {
+        std::string_view name;
+        M T::*member;
+    };
+
+    /**
+     * \brief Creates a field descriptor.
+     *
+     * \param name The json field name.
+     * \param member Pointer to the struct member.
+     */
+    template <typename T, typename M>
+    constexpr field_descriptor<T, M> field(std::string_view name, M T::*member)
+    {
+        return {name, member};
+    }
+
+    /**
+     * \brief Maps a struct to a json document.
+     *
+     * Specialize it with a tuple of field descriptors named `fields`:
+     * \code
+     * template <>
+     * struct docudb::mapping<person>
+     * {
+     *     static constexpr auto fields = std::make_tuple(
+     *         DOCUDB_FIELD(person, name),
+     *         docudb::field("years", &person::age));
+     * };
+     * \endcode
+     *
+     * Supported member types are arithmetic types, bool, std::string,
+     * std::optional of those and other mapped structs.
+     */
+    template <typename T>
+    struct mapping;
+
+    /**
+     * \brief A struct with a mapping specialization.
+     */
+    template <typename T>
+    concept Mapped = requires { mapping<T>::fields; };
+
+    #define DOCUDB_FIELD(type, member) ::docudb::field(#member, &type::member)
+
+    namespace details::uuid
+    {
+        std::string generate_uuid_v4();
+    }
+
+    namespace details::json
+    {
+        template <typename T>
+        struct is_optional : std::false_type {};
+
+        template <typename T>
+        struct is_optional<std::optional<T>> : std::true_type {};
+
+        /**
+         * \brief Per-thread buffer reused to serialize documents.
+         */
+        std::string &thread_buffer();
+
+        void write_string(std::string &out, std::string_view value);
+
+        template <typename V>
+        void write_value(std::string &out, V const &value);
+
+        template <Mapped T>
+        void write_members(std::string &out, T const &obj, bool first)
+        {
+            std::apply([&](auto const &...fields)
+                       { ((out += first ? "" : ",", first = false, write_string(out, fields.name), out += ':', write_value(out, obj.*(fields.member))), ...); },
+                       mapping<T>::fields);
+        }
+
+        // whether a top-level field of T has the given json name
+        template <Mapped T>
+        constexpr bool has_field(std::string_view name)
+        {
+            return std::apply([&](auto const &...fields)
+                              { return ((fields.name == name) || ...); },
+                              mapping<T>::fields);
+        }
+
+        template <Mapped T>
+        void write_object(std::string &out, T const &obj)
+        {
+            out += '{';
+            write_members(out, obj, true);
+            out += '}';
+        }
+
+        template <typename V>
+        void write_value(std::string &out, V const &value)
+        {
+            if constexpr (std::is_same_v<V, bool>)
+            {
+                out += value ? "true" : "false";
+            }
+            else if constexpr (std::is_arithmetic_v<V>)
+            {
+                if constexpr (std::is_floating_point_v<V>)
+                {
+                    // json has no representation for nan and infinity
+                    if (!std::isfinite(value))
+                    {
+                        out += "null";
+                        return;
+                    }
+                }
+                char buf[32];
+                auto [end, ec] = std::to_chars(std::begin(buf), std::end(buf), value);
+                out.append(buf, end);
+            }
+            else if constexpr (std::is_convertible_v<V const &, std::string_view>)
+            {
+                write_string(out, value);
+            }
+            else if constexpr (is_optional<V>::value)
+            {
+                if (value)
+                    write_value(out, *value);
+                else
+                    out += "null";
+            }
+            else
             {
-                return ptr_->get_binder();
+                write_object(out, value);
             }
+        }
 
-        private:
-            std::unique_ptr<queryable_base> ptr_;
-        };
+        template <Mapped T>
+        void collect_paths(std::string const &prefix, std::vector<std::string> &paths);
 
-        struct order_by
+        template <typename T, typename M>
+        void collect_field_paths(std::string const &prefix, field_descriptor<T, M> const &field, std::vector<std::string> &paths)
+        {
+            auto path = std::format("{}.\"{}\"", prefix, field.name);
+            if constexpr (Mapped<M>)
+                collect_paths<M>(path, paths);
+            else
+                paths.push_back(std::move(path));
+        }
+
+        // json paths of the mapped leaf fields, in declaration order
+        template <Mapped T>
+        void collect_paths(std::string const &prefix, std::vector<std::string> &paths)
         {
-            explicit order_by(std::string const &field, bool ascending = true)
-                : field_(field), ascending_(ascending) {}
+            std::apply([&](auto const &...fields)
+                       { (collect_field_paths<T>(prefix, fields, paths), ...); },
+                       mapping<T>::fields);
+        }
 
-            std::string const& field() const { return field_; }
-            std::string_view direction() const { return ascending_ ? "ASC" : "DESC"; }
+        template <Mapped T>
+        std::vector<std::string> const &paths()
+        {
+            static const std::vector<std::string> ret = []
+            {
+                std::vector<std::string> p;
+                collect_paths<T>("$", p);
+                return p;
+            }();
+            return ret;
+        }
 
-            private:
-                std::string field_;
-                bool ascending_;
-        };
+        template <typename V>
+        void read_value(sqlite::statement const &stmt, int &column, V &value);
+
+        template <Mapped T>
+        void read_object(sqlite::statement const &stmt, int &column, T &obj)
+        {
+            std::apply([&](auto const &...fields)
+                       { (read_value(stmt, column, obj.*(fields.member)), ...); },
+                       mapping<T>::fields);
+        }
+
+        // missing (null) fields keep their value
+        template <typename V>
+        void read_value(sqlite::statement const &stmt, int &column, V &value)
+        {
+            if constexpr (Mapped<V>)
+            {
+                read_object(stmt, column, value);
+                return;
+            }
+            else
+            {
+                auto index = column++;
+                if (stmt.get_type(index) == json_type::null)
+                {
+                    if constexpr (is_optional<V>::value)
+                        value.reset();
+                    return;
+                }
+
+                if constexpr (is_optional<V>::value)
+                {
+                    typename V::value_type inner{};
+                    --column;
+                    read_value(stmt, column, inner);
+                    value = std::move(inner);
+                }
+                else if constexpr (std::is_same_v<V, bool>)
+                    value = stmt.get<std::int64_t>(index) != 0;
+                else if constexpr (std::is_integral_v<V>)
+                    value = static_cast<V>(stmt.get<std::int64_t>(index));
+                else if constexpr (std::is_floating_point_v<V>)
+                    value = static_cast<V>(stmt.get<std::double_t>(index));
+                else
+                    value = stmt.get<std::string>(index);
+            }
+        }
     }
 
     /**
@@ -507,358 +924,1712 @@ namespace docudb
         stmt_exception(sqlite3 *db_handle, std::string_view sql);
     };    
 
-    struct db_document;
-
     /**
-     * \brief Reference to a database document.
+     * \brief JSON Patch (RFC 6902) support.
      */
-    struct db_document_ref
+    namespace json_patch
     {
         /**
-         * \brief Constructs a new db_document_ref object from a db_document object.
-         *
-         * \param doc The document object.
+         * \brief JSON Patch operation types.
          */
-        db_document_ref(db_document const &doc);
+        enum class op_type
+        {
+            add,
+            remove,
+            replace,
+            move,
+            copy,
+            test
+        };
 
         /**
-         * \brief Constructs a new db_document_ref object.
+         * \brief A JSON Patch operation.
          *
-         * \param table_name The name of the table.
-         * \param doc_id The document ID.
-         * \param db_handle The SQLite database handle.
+         * Paths are JSON Pointers (e.g. /tags/0); SQLite json paths starting with $ are accepted as well.
          */
-        db_document_ref(std::string_view table_name, std::string_view doc_id, sqlite3 *db_handle);
+        struct operation
+        {
+            op_type op;
+            std::string path{};
+            /**
+             * \brief The source path of move and copy operations.
+             */
+            std::string from{};
+            /**
+             * \brief The json value of add, replace and test operations.
+             */
+            std::string value{};
+        };
 
         /**
-         * \brief Gets the document ID.
+         * \brief Generates the operations transforming a json document into another.
          *
-         * \returns std::string The document ID.
+         * Objects are compared member by member, so unchanged parts of the document produce
+         * no operations. Arrays keep the elements they share at either end, and the rest is
+         * compared by position: inserting or removing one element costs one operation, but
+         * moving elements around yields replacements rather than a minimal edit script.
+         *
+         * \param from_json The original document.
+         * \param to_json The updated document.
+         * \returns std::vector<operation> The patch.
          */
-        std::string id() const;
+        std::vector<operation> diff(std::string_view from_json, std::string_view to_json);
 
         /**
-         * \brief Gets the full document object.
-         *
-         * \returns db_document The document object.
+         * \brief Serializes a patch to its RFC 6902 json representation.
          */
-        db_document doc() const;
+        std::string to_string(std::vector<operation> const &ops);
 
         /**
-         * \brief Removes the document from the collection.
-         * \returns void
-         */        
-        void erase();        
+         * \brief Parses the RFC 6902 json representation of a patch.
+         *
+         * \throws std::invalid_argument if the patch is malformed.
+         */
+        std::vector<operation> parse(std::string_view json);
 
-    private:
-        sqlite3 *db_handle;
-        std::string table_name;
-        std::string doc_id;
-    };
+        /**
+         * \brief Applies a patch to a json document outside of the database.
+         *
+         * Paths must be JSON Pointers.
+         *
+         * \param json The document.
+         * \param ops The patch.
+         * \returns std::string The patched document.
+         * \throws std::invalid_argument if the document is not valid json, a path does not exist or a test fails.
+         */
+        std::string apply(std::string_view json, std::vector<operation> const &ops);
+    }
 
     /**
-     * \brief Represents a database document.
+     * \brief Configures the background WAL checkpoints.
      */
-    struct db_document
+    struct checkpoint_options
     {
         /**
-         * \brief Gets the document ID.
-         *
-         * \returns std::string The document ID.
+         * \brief Time between two checkpoints.
          */
-        std::string id() const;
-
+        std::chrono::milliseconds interval{1000};
         /**
-         * \brief Gets the full body of the document.
-         *
-         * \returns std::string The document body.
+         * \brief WAL size above which a RESTART checkpoint is run, waiting for readers
+         *        so that the WAL can be reused from the beginning.
          */
-        std::string body() const;
-
+        std::uint64_t restart_wal_size{64 * 1024 * 1024};
         /**
-         * \brief Sets the full body of the document.
-         *
-         * \param body The new body content.
-         * \returns db_document& Reference to the document.
+         * \brief WAL size above which a TRUNCATE checkpoint is run, shrinking the WAL file.
          */
-        db_document &body(std::string_view body);
-
+        std::uint64_t truncate_wal_size{256 * 1024 * 1024};
         /**
-         * \brief Replace a value in the json body
-         *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * \brief Maximum time RESTART and TRUNCATE checkpoints wait for readers and writers.
          */
-        db_document &replace(std::string_view query, std::float_t value);
+        std::chrono::milliseconds busy_timeout{100};
+    };
 
+    /**
+     * \brief Statistics of the background WAL checkpoints.
+     */
+    struct checkpoint_stats
+    {
         /**
-         * \brief Replace a value in the json body
-         *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * \brief WAL file size in bytes, as of the last checkpoint.
          */
-        db_document &replace(std::string_view query, std::double_t value);
-
+        std::uint64_t wal_size{0};
+        std::uint64_t checkpoints{0};
+        std::uint64_t passive_checkpoints{0};
+        std::uint64_t restart_checkpoints{0};
+        std::uint64_t truncate_checkpoints{0};
         /**
-         * \brief Replace a value in the json body
-         *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * \brief Checkpoints that could not complete because of readers or writers.
          */
-        db_document &replace(std::string_view query, std::int32_t value);
+        std::uint64_t busy_checkpoints{0};
+        /**
+         * \brief Frames in the WAL and frames checkpointed by the last checkpoint.
+         */
+        int log_frames{0};
+        int checkpointed_frames{0};
+        std::chrono::microseconds last_duration{0};
+        std::chrono::microseconds max_duration{0};
+        std::chrono::microseconds total_duration{0};
+    };
+
+    /**
+     * \brief SQLite auto_vacuum modes.
+     */
+    enum class auto_vacuum_mode
+    {
+        none = 0,
+        full = 1,
+        incremental = 2
+    };
+
+    /**
+     * \brief Space usage of the database file.
+     */
+    struct space_stats
+    {
+        std::int64_t page_size{0};
+        std::int64_t page_count{0};
+        /**
+         * \brief Unused pages, reclaimable by a vacuum.
+         */
+        std::int64_t freelist_count{0};
+    };
+
+    /**
+     * \brief Configures the background incremental vacuum.
+     */
+    struct vacuum_options
+    {
+        /**
+         * \brief Time between two idle checks.
+         */
+        std::chrono::milliseconds interval{1000};
+        /**
+         * \brief Time without commits after which the database is considered idle.
+         */
+        std::chrono::milliseconds idle_time{5000};
+        /**
+         * \brief Pages released by each incremental_vacuum step, each step is a short write transaction.
+         */
+        int pages_per_step{256};
+        /**
+         * \brief Maximum pages released while idle, before checking again on the next interval.
+         */
+        int max_pages_per_run{16384};
+        /**
+         * \brief Busy timeout of the vacuum's own connection, so that a step waits for a running write instead of failing.
+         *        Application connections should set their own, see sqlite3_busy_timeout, as a step holds the write lock.
+         */
+        std::chrono::milliseconds busy_timeout{1000};
+    };
+
+    /**
+     * \brief Statistics of the background incremental vacuum.
+     */
+    struct vacuum_stats
+    {
+        /**
+         * \brief Idle periods in which free pages were reclaimed.
+         */
+        std::uint64_t runs{0};
+        std::uint64_t steps{0};
+        std::uint64_t reclaimed_pages{0};
+        std::chrono::microseconds last_duration{0};
+        std::chrono::microseconds total_duration{0};
+    };
+
+    /**
+     * \brief Configures a tiered collection.
+     */
+    struct tiered_options
+    {
+        /**
+         * \brief Hot documents not accessed for this long are demoted to the cold tier.
+         */
+        std::chrono::milliseconds max_age{60000};
+        /**
+         * \brief Hot documents beyond this number are demoted, least recently accessed first.
+         */
+        std::size_t max_hot_documents{100000};
+        /**
+         * \brief Documents moved by each demotion transaction.
+         */
+        std::size_t batch_size{1000};
+        /**
+         * \brief Moves cold documents to the hot tier when they are read.
+         */
+        bool promote_on_read{true};
+        /**
+         * \brief Time between two background demotions, zero disables them.
+         */
+        std::chrono::milliseconds demote_interval{0};
+    };
+
+    /**
+     * \brief Statistics of a tiered collection.
+     */
+    struct tiered_stats
+    {
+        std::uint64_t hot_reads{0};
+        std::uint64_t cold_reads{0};
+        std::uint64_t promotions{0};
+        std::uint64_t demotions{0};
+    };
+
+    /**
+     * \brief Configures the pooled SQLite allocator, see database::use_pool_allocator.
+     */
+    struct allocator_options
+    {
+        /**
+         * \brief Allocations up to this size are pooled, larger ones go to malloc. At most 64KB.
+         */
+        std::size_t max_pooled_size{1024};
+        /**
+         * \brief Free blocks kept by each thread per size class, beyond which half go back to the shared pool.
+         */
+        std::size_t thread_cache_size{256};
+    };
+
+    /**
+     * \brief Statistics of SQLite's memory, process-wide.
+     */
+    struct allocator_stats
+    {
+        std::uint64_t allocations{0};
+        std::uint64_t frees{0};
+        std::uint64_t reallocations{0};
+        /**
+         * \brief Allocations served by a thread cache, without locking nor calling malloc.
+         */
+        std::uint64_t cache_hits{0};
+        std::uint64_t memory_used{0};
+        std::uint64_t memory_highwater{0};
+    };
+
+    /**
+     * \brief Lookaside statistics of a connection.
+     */
+    struct lookaside_stats
+    {
+        std::uint64_t slots_used{0};
+        std::uint64_t hits{0};
+        std::uint64_t misses_size{0};
+        std::uint64_t misses_full{0};
+    };
+
+    /**
+     * \brief Configures the shared page cache, see database::use_shared_page_cache.
+     */
+    struct page_cache_options
+    {
+        /**
+         * \brief Memory for the pages of every connection together, buffers and headers included.
+         */
+        std::size_t max_bytes{64 * 1024 * 1024};
+        /**
+         * \brief Evicts pages read once before pages read again (2Q), instead of the least recently used.
+         */
+        bool scan_resistant{true};
+        /**
+         * \brief Share of the budget kept by the pages read once, when scan resistant.
+         */
+        double fifo_ratio{0.25};
+    };
+
+    /**
+     * \brief Statistics of the shared page cache, process-wide.
+     */
+    struct page_cache_stats
+    {
+        std::uint64_t hits{0};
+        std::uint64_t misses{0};
+        /**
+         * \brief Misses on pages evicted shortly before, which then skip the FIFO queue.
+         */
+        std::uint64_t ghost_hits{0};
+        std::uint64_t evictions{0};
+        std::uint64_t bytes{0};
+    };
+
+    /**
+     * \brief Configures a collection mirror.
+     */
+    struct mirror_options
+    {
+        /**
+         * \brief Json paths kept for each document, as an object keyed by path without its leading "$.".
+         *        Empty keeps the whole body.
+         */
+        std::vector<std::string> fields{};
+        /**
+         * \brief Json paths with an ordered index, answering collection_mirror::range.
+         */
+        std::vector<std::string> ordered{};
+    };
+
+    namespace details
+    {
+        struct checkpoint_manager;
+        struct vacuum_scheduler;
+        struct tiered_state;
+        struct cursor_state;
+        namespace mirror
+        {
+            struct state;
+        }
+    }
+
+    /**
+     * \brief Configures a cursor.
+     */
+    struct cursor_options
+    {
+        /**
+         * \brief Steps the statement on a background thread, ahead of the consumer.
+         *
+         * Prefetching shares the collection's connection with the background thread, so it
+         * requires the serialized threading mode; cursors on other connections step on the
+         * consumer's thread instead.
+         */
+        bool prefetch{false};
+        /**
+         * \brief Rows handed over to the consumer at once.
+         */
+        std::size_t batch_size{256};
+        /**
+         * \brief Batches buffered ahead of the consumer before the background thread waits.
+         */
+        std::size_t max_batches{4};
+    };
+
+    /**
+     * \brief Iterates over the documents of a collection, reading their ID and body.
+     *
+     * \code
+     * auto cursor = collection.cursor(query::eq("$.type", "order"s), {.prefetch = true});
+     * while (cursor.next())
+     *     process(cursor.id(), cursor.body());
+     * \endcode
+     */
+    struct db_cursor
+    {
+        db_cursor(db_cursor &&) noexcept;
+        db_cursor &operator=(db_cursor &&) noexcept;
+        ~db_cursor();
+
+        /**
+         * \brief Moves to the next document.
+         *
+         * \returns bool false once every document was read.
+         * \throws db_exception if reading fails, on the consumer's thread.
+         */
+        bool next();
+
+        /**
+         * \brief Returns the ID of the current document.
+         */
+        std::string const &id() const;
+
+        /**
+         * \brief Returns the body of the current document.
+         */
+        std::string const &body() const;
+
+    private:
+        friend struct db_collection;
+        explicit db_cursor(std::unique_ptr<details::cursor_state> state);
+
+        std::unique_ptr<details::cursor_state> state;
+    };
+
+    /**
+     * \brief Describes an attachment, see db_collection::attachments.
+     */
+    struct attachment_info
+    {
+        std::string name;
+        std::size_t size{0};
+    };
+
+    /**
+     * \brief An open attachment, read and written in place with SQLite's incremental BLOB I/O.
+     *
+     * Reads copy straight into the caller's buffer and writes straight from it, so
+     * large payloads stream in chunks without being held in memory.
+     * The attachment keeps its size: writes cannot extend it, see db_collection::create_attachment.
+     * Writing the attachment's row by other means, e.g. replacing it, invalidates the handle.
+     */
+    struct db_attachment
+    {
+        db_attachment(db_attachment &&other) noexcept;
+        db_attachment &operator=(db_attachment &&other) noexcept;
+        db_attachment(db_attachment const &) = delete;
+        db_attachment &operator=(db_attachment const &) = delete;
+        ~db_attachment();
+
+        /**
+         * \brief Returns the size of the attachment in bytes.
+         */
+        std::size_t size() const noexcept;
+
+        /**
+         * \brief Reads bytes from an offset into a buffer.
+         *
+         * \returns std::size_t The number of bytes read, less than the buffer size at the end.
+         * \throws db_exception if reading fails.
+         */
+        std::size_t read(std::span<std::byte> buffer, std::size_t offset) const;
+
+        /**
+         * \brief Writes bytes at an offset.
+         *
+         * \throws std::out_of_range if the bytes do not fit in the attachment.
+         * \throws db_exception if writing fails, e.g. the attachment was opened read-only.
+         */
+        void write(std::span<std::byte const> data, std::size_t offset);
+
+        /**
+         * \brief Copies the attachment to a stream, one chunk at a time.
+         */
+        void read_to(std::ostream &out) const;
+
+    private:
+        friend struct db_collection;
+        db_attachment(sqlite3 *db_handle, sqlite3_blob *blob) noexcept;
+
+        sqlite3 *db_handle;
+        sqlite3_blob *blob;
+    };
+
+    /**
+     * \brief A HyperLogLog sketch of a set of values, estimating its number of distinct values
+     *        within about 1% in 16KB.
+     *
+     * The serialized data is what the hll() and hll_merge() SQL functions return, so sketches
+     * can be stored, e.g. one per day, and merged later instead of scanning the values again.
+     */
+    struct distinct_sketch
+    {
+        /**
+         * \brief The serialized sketch, empty for a sketch of no values.
+         */
+        std::string data;
+
+        /**
+         * \brief Estimates the number of distinct values.
+         * \throws std::invalid_argument if the data is not a serialized sketch.
+         */
+        std::size_t estimate() const;
+
+        /**
+         * \brief Adds the values of another sketch, as if they had been seen by this one.
+         * \throws std::invalid_argument if either data is not a serialized sketch.
+         */
+        distinct_sketch &merge(distinct_sketch const &other);
+    };
+
+    /**
+     * \brief A t-digest sketch of a set of numbers, estimating their quantiles with an error
+     *        below 1% of the rank, smaller towards the extremes.
+     *
+     * The serialized data is what the tdigest() and tdigest_merge() SQL functions return,
+     * so sketches can be stored and merged like distinct_sketch.
+     */
+    struct quantile_sketch
+    {
+        /**
+         * \brief The serialized sketch, empty for a sketch of no values.
+         */
+        std::string data;
+
+        /**
+         * \brief Estimates the q-quantile, e.g. 0.5 for the median.
+         * \returns double The estimate, NaN if the sketch has no values.
+         * \throws std::invalid_argument if the data is not a serialized sketch.
+         */
+        double quantile(double q) const;
+
+        /**
+         * \brief Gets the number of values in the sketch.
+         * \throws std::invalid_argument if the data is not a serialized sketch.
+         */
+        std::size_t count() const;
+
+        /**
+         * \brief Adds the values of another sketch.
+         * \throws std::invalid_argument if either data is not a serialized sketch.
+         */
+        quantile_sketch &merge(quantile_sketch const &other);
+    };
+
+    struct db_document;
+
+    /**
+     * \brief How db_collection::insert_many handles duplicate documents.
+     */
+    enum class dedup_mode
+    {
+        /**
+         * \brief Every document is inserted.
+         */
+        none,
+        /**
+         * \brief Documents whose content is already stored, or earlier in the batch, are skipped.
+         *        Requires db_collection::enable_content_hash.
+         */
+        skip_duplicates
+    };
+
+    /**
+     * \brief Configures the version history of a collection, see db_collection::enable_history.
+     */
+    struct history_options
+    {
+        /**
+         * \brief Every keyframe_interval versions the full body is stored instead of a patch,
+         *        bounding the number of patches replayed to read a version.
+         */
+        std::size_t keyframe_interval{16};
+    };
+
+    /**
+     * \brief A version of a document, see db_collection::history.
+     */
+    struct document_version
+    {
+        std::int64_t version{0};
+        std::chrono::system_clock::time_point timestamp;
+        /**
+         * \brief Whether this version is the removal of the document.
+         */
+        bool deleted{false};
+    };
+
+    /**
+     * \brief The type of a promoted column, see db_collection::promote.
+     */
+    enum class column_type
+    {
+        integer,
+        real,
+        text
+    };
+
+    /**
+     * \brief Reference to a database document.
+     */
+    struct db_document_ref
+    {
+        /**
+         * \brief Constructs a new db_document_ref object from a db_document object.
+         *
+         * \param doc The document object.
+         */
+        db_document_ref(db_document const &doc);
+
+        /**
+         * \brief Constructs a new db_document_ref object.
+         *
+         * \param table_name The name of the table.
+         * \param doc_id The document ID.
+         * \param db_handle The SQLite database handle.
+         */
+        db_document_ref(std::string_view table_name, std::string_view doc_id, sqlite3 *db_handle);
+
+        /**
+         * \brief Gets the document ID.
+         *
+         * \returns std::string The document ID.
+         */
+        std::string id() const;
+
+        /**
+         * \brief Gets the full document object.
+         *
+         * \returns db_document The document object.
+         */
+        db_document doc() const;
+
+        /**
+         * \brief Removes the document from the collection.
+         * \returns void
+         */        
+        void erase();        
+
+    private:
+        sqlite3 *db_handle;
+        std::string table_name;
+        std::string doc_id;
+    };
+
+    /**
+     * \brief Represents a database document.
+     */
+    struct db_document
+    {
+        /**
+         * \brief Gets the document ID.
+         *
+         * \returns std::string The document ID.
+         */
+        std::string id() const;
+
+        /**
+         * \brief Gets the full body of the document.
+         *
+         * \returns std::string The document body.
+         */
+        std::string body() const;
+
+        /**
+         * \brief Sets the full body of the document.
+         *
+         * \param body The new body content.
+         * \returns db_document& Reference to the document.
+         */
+        db_document &body(std::string_view body);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::float_t value);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::double_t value);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::int32_t value);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::int64_t value);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::nullptr_t value);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::string const &value);
+
+        /**
+         * \brief Replace a value in the json body
+         *
+         * \param query The query that points to the value to replace.
+         * \param value The new value
+         * \returns db_document& Reference to the document.
+         */
+        db_document &replace(std::string_view query, std::string_view value);
+
+        // set value in json body
+        db_document &set(std::string_view query, std::float_t value);
+        db_document &set(std::string_view query, std::double_t value);
+        db_document &set(std::string_view query, std::int32_t value);
+        db_document &set(std::string_view query, std::int64_t value);
+        db_document &set(std::string_view query, std::nullptr_t value);
+        db_document &set(std::string_view query, std::string const &value);
+        db_document &set(std::string_view query, std::string_view value);
+
+        // insert value in json body
+        db_document &insert(std::string_view query, std::float_t value);
+        db_document &insert(std::string_view query, std::double_t value);
+        db_document &insert(std::string_view query, std::int32_t value);
+        db_document &insert(std::string_view query, std::int64_t value);
+        db_document &insert(std::string_view query, std::nullptr_t value);
+        db_document &insert(std::string_view query, std::string const &value);
+        db_document &insert(std::string_view query, std::string_view value);
+
+        /**
+         * \brief Patches the JSON body of the document.
+         *
+         * \param json The JSON patch.
+         * \returns db_document& Reference to the document.
+         */
+        db_document &patch(std::string_view json);
+
+        /**
+         * \brief Applies a JSON Patch (RFC 6902) to the document.
+         *
+         * The operations are compiled into a single UPDATE statement, so the document is never
+         * read into the application. The patch is atomic: if an operation fails (e.g. a test
+         * does not match or a removed path does not exist) the document is left untouched.
+         * Numeric JSON Pointer tokens address array elements or object members, following the
+         * type of their parent at that point of the patch. Values are tested structurally.
+         *
+         * \param ops The patch operations.
+         * \returns db_document& Reference to the document.
+         * \throws std::invalid_argument if an operation fails.
+         * \throws db_exception if the document does not exist.
+         */
+        db_document &apply_patch(std::vector<json_patch::operation> const &ops);
+
+        /**
+         * \brief Applies a JSON Patch (RFC 6902) given in its json representation.
+         *
+         * \param json The patch.
+         * \returns db_document& Reference to the document.
+         */
+        db_document &apply_patch(std::string_view json);
+
+        // get string
+        std::string get_string(std::string_view query) const;
+
+        // get number
+        std::int64_t get_number(std::string_view query) const;
+
+        // get real
+        std::double_t get_real(std::string_view query) const;
+
+        // get json type
+        json_type get_type(std::string_view query) const;
+
+        // get array length
+        std::size_t get_array_length(std::string_view query) const;
+
+        // get object keys
+        std::vector<std::string> get_object_keys(std::string_view query) const;
+
+        // get values
+        template <typename... Types>
+        std::tuple<Types...> get(const std::vector<std::string>& fields) const {
+            if (fields.size() != sizeof...(Types)) {
+                throw std::invalid_argument("Number of fields does not match the number of types.");
+            }
+
+            auto stmt = get_value_stmt_impl(fields);
+            auto ret = get_values_impl<Types...>(stmt, std::index_sequence_for<Types...>{});
+
+            return ret;
+        }
+        
+        /**
+         * \brief Reads the document into a mapped struct.
+         *
+         * Each field is read from its own json_extract column, the body is never
+         * materialized. Missing fields keep their default value.
+         *
+         * \returns T The struct.
+         */
+        template <Mapped T>
+        T as() const
+        {
+            auto stmt = get_value_stmt_impl(details::json::paths<T>());
+
+            T obj{};
+            int column = 0;
+            details::json::read_object(stmt, column, obj);
+            return obj;
+        }
+
+        /**
+         * \brief Removes the document from the collection.
+         * \returns void
+         */        
+        void erase();
+    private:
+        template <typename... Types, std::size_t... Indices>
+        std::tuple<Types...> get_values_impl(details::sqlite::statement const &stmt, std::index_sequence<Indices...>) const
+        {
+            return std::make_tuple(stmt.get<Types>(Indices)...);
+        }   
+        
+        details::sqlite::statement get_value_stmt_impl(const std::vector<std::string>& fields) const;
+
+    private:
+        std::string doc_id;
+        std::string table_name;
+        mutable std::string body_data;
+        bool invalid_body;
+        sqlite3 *db_handle;
+        friend struct db_collection;
+        friend struct db_document_ref;
+        friend struct db_statement;
+
+        /**
+         * \brief Constructs a new db_document object.
+         *
+         * \param table_name The name of the table.
+         * \param doc_id The document ID.
+         * \param body The document body.
+         * \param db_handle The SQLite database handle.
+         */
+        db_document(std::string_view table_name, std::string_view doc_id, std::string_view body, sqlite3 *db_handle);
+        db_document(std::string_view table, std::string_view doc_id, sqlite3 *db_handle);
+    };
+
+    /**
+     * \brief A prepared statement, for the queries the query builder cannot express.
+     *
+     * The statement is prepared once and reused: bind() resets it, so hot loops only
+     * bind and step.
+     *
+     * \code
+     * auto stmt = orders.prepare("SELECT docid, body FROM orders WHERE body ->> '$.total' > ?1 * (body ->> '$.discount')");
+     * for (auto const &doc : stmt.bind(2).documents())
+     *     process(doc.body());
+     *
+     * auto totals = db.prepare("SELECT body ->> '$.customer', sum(body ->> '$.total') FROM orders GROUP BY 1");
+     * while (totals.step())
+     * {
+     *     auto [customer, total] = totals.row<std::string, double>();
+     * }
+     * \endcode
+     */
+    struct db_statement
+    {
+        db_statement(db_statement &&) noexcept = default;
+        db_statement &operator=(db_statement &&) noexcept = default;
+        db_statement(db_statement const &) = delete;
+        db_statement &operator=(db_statement const &) = delete;
+
+        /**
+         * \brief Resets the statement and binds the arguments to the parameters ?1, ?2... in order.
+         *
+         * Integers, booleans, floating point numbers, strings, nullptr, db_value and
+         * std::optional of these (nullopt binds NULL) are supported.
+         */
+        template <typename... Args>
+        db_statement &bind(Args const &...args)
+        {
+            reset();
+            int index = 0;
+            (bind_value(++index, args), ...);
+            return *this;
+        }
+
+        /**
+         * \brief Resets the statement to run it again, clearing the bindings.
+         */
+        db_statement &reset() noexcept
+        {
+            stmt.reset();
+            return *this;
+        }
+
+        /**
+         * \brief Moves to the next row.
+         *
+         * \returns bool false once the statement is done.
+         * \throws db_exception if the statement fails.
+         */
+        bool step();
+
+        /**
+         * \brief Runs the statement to completion, e.g. an INSERT or UPDATE.
+         *
+         * \returns std::size_t The number of rows changed.
+         * \throws db_exception if the statement fails.
+         */
+        std::size_t execute();
+
+        /**
+         * \brief Reads a column of the current row. std::optional types read NULL as nullopt.
+         */
+        template <typename T>
+        T column(int index) const
+        {
+            if constexpr (requires { typename T::value_type; requires std::same_as<T, std::optional<typename T::value_type>>; })
+            {
+                if (sqlite3_column_type(stmt.data(), index) == SQLITE_NULL)
+                    return std::nullopt;
+                return column<typename T::value_type>(index);
+            }
+            else if constexpr (std::same_as<T, bool>)
+            {
+                return stmt.get<std::int64_t>(index) != 0;
+            }
+            else
+            {
+                return stmt.get<T>(index);
+            }
+        }
+
+        /**
+         * \brief Reads the first columns of the current row.
+         */
+        template <typename... Types>
+        std::tuple<Types...> row() const
+        {
+            return row_impl<Types...>(std::index_sequence_for<Types...>{});
+        }
+
+        /**
+         * \brief Reads the remaining rows.
+         */
+        template <typename... Types>
+        std::vector<std::tuple<Types...>> rows()
+        {
+            std::vector<std::tuple<Types...>> out;
+            while (step())
+                out.push_back(row<Types...>());
+            return out;
+        }
+
+        /**
+         * \brief Reads the remaining rows as documents, from their docid and body columns.
+         *
+         * \throws std::logic_error if the statement was not prepared by a collection,
+         *         or its result has no docid and body columns.
+         */
+        std::vector<db_document> documents();
+
+        /**
+         * \brief Returns the number of columns of the result.
+         */
+        int column_count() const noexcept;
+
+        /**
+         * \brief Returns the name of a column of the result.
+         */
+        std::string column_name(int index) const;
+
+        /**
+         * \brief Returns the SQLite statement handle.
+         */
+        sqlite3_stmt *handle() const noexcept
+        {
+            return stmt.data();
+        }
+
+    private:
+        friend struct database;
+        friend struct db_collection;
+        db_statement(sqlite3 *db_handle, std::string_view sql, std::string_view table_name);
+
+        template <typename... Types, std::size_t... Indices>
+        std::tuple<Types...> row_impl(std::index_sequence<Indices...>) const
+        {
+            return std::tuple<Types...>{column<Types>(static_cast<int>(Indices))...};
+        }
+
+        template <typename T>
+        void bind_value(int index, T const &value)
+        {
+            if constexpr (std::same_as<T, db_value>)
+                std::visit([&](auto const &v)
+                           { bind_value(index, v); }, value);
+            else if constexpr (requires { typename T::value_type; requires std::same_as<T, std::optional<typename T::value_type>>; })
+                value ? bind_value(index, *value) : bind_value(index, nullptr);
+            else if constexpr (std::same_as<T, std::nullptr_t>)
+                stmt.bind(index, nullptr);
+            else if constexpr (std::is_integral_v<T>)
+                stmt.bind(index, static_cast<std::int64_t>(value));
+            else if constexpr (std::is_floating_point_v<T>)
+                stmt.bind(index, static_cast<std::double_t>(value));
+            else if constexpr (std::is_convertible_v<T const &, std::string_view>)
+                stmt.bind(index, std::string_view{value});
+            else
+                static_assert(sizeof(T) == 0, "Unsupported type for bind");
+
+            if (stmt.result_code() != SQLITE_OK)
+                throw db_exception{sqlite3_db_handle(stmt.data()), "Failed to bind parameter"};
+        }
+
+        details::sqlite::statement stmt;
+        std::string table_name;
+    };
+
+    namespace details
+    {
+        /**
+         * \brief The generated columns of the collections of a connection by json query, read again when the schema version changes.
+         */
+        struct generated_columns_cache;
+    }
+
+    /**
+     * \brief Represents a collection of documents in the database.
+     */
+    struct db_collection
+    {
+        /**
+         * \brief Constructs an empty db_collection object.
+         *
+         */
+        db_collection() = default;
+        db_collection(db_collection const &) = delete;
+        db_collection &operator=(db_collection const &) = delete;
+        db_collection(db_collection &&) = default;
+        db_collection &operator=(db_collection &&) = default;
+
+        /**
+         * \brief Constructs a new db_collection object.
+         *
+         * \param name The name of the collection.
+         * \param db_handle The SQLite database handle.
+         */
+        db_collection(std::string_view name, sqlite3 *db_handle);
+
+        /**
+         * \brief Gets the collection name
+         *
+         * \returns std::string The collection name.
+         */
+        std::string name() const noexcept;
 
         /**
-         * \brief Replace a value in the json body
+         * \brief Gets a document by ID.
          *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * \param doc_id The document ID.
+         * \returns db_document The document object.
          */
-        db_document &replace(std::string_view query, std::int64_t value);
+        db_document doc(std::string_view doc_id) const;
 
         /**
-         * \brief Replace a value in the json body
+         * \brief Creates a new document with a generated UUID.
          *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * \returns db_document The new document object.
          */
-        db_document &replace(std::string_view query, std::nullptr_t value);
+        db_document doc();
 
         /**
-         * \brief Replace a value in the json body
+         * \brief Creates a new document with the given ID.
          *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * \returns db_document The new document object.
+         */        
+        db_document create(std::string_view doc_id);
+
+        /**
+         * \brief Inserts a mapped struct as a new document with a generated UUID.
+         *
+         * The struct is serialized straight into a per-thread buffer, without
+         * intermediate strings. The struct cannot map a field named docid, which
+         * holds the generated ID.
+         *
+         * \param obj The struct.
+         * \returns db_document The new document object.
          */
-        db_document &replace(std::string_view query, std::string const &value);
+        template <Mapped T>
+        db_document insert(T const &obj)
+        {
+            static_assert(!details::json::has_field<T>("docid"), "The docid field is written by insert, it cannot be mapped");
+
+            auto doc_id = details::uuid::generate_uuid_v4();
+
+            auto &out = details::json::thread_buffer();
+            out.clear();
+            out += "{\"docid\":";
+            details::json::write_string(out, doc_id);
+            details::json::write_members(out, obj, false);
+            out += '}';
+
+            return insert_body(doc_id, out);
+        }
 
         /**
-         * \brief Replace a value in the json body
+         * \brief Adds a content_hash column, the hash of each document's canonical body,
+         *        and an index on it.
          *
-         * \param query The query that points to the value to replace.
-         * \param value The new value
-         * \returns db_document& Reference to the document.
+         * The canonical body has its keys sorted and no docid, so documents with the same
+         * content hash the same regardless of key order and ID. The column is generated by
+         * the content_hash() SQL function: every connection writing the collection must call
+         * database::load_extensions() first.
+         *
+         * \return A reference to the collection.
          */
-        db_document &replace(std::string_view query, std::string_view value);
+        db_collection &enable_content_hash();
 
-        // set value in json body
-        db_document &set(std::string_view query, std::float_t value);
-        db_document &set(std::string_view query, std::double_t value);
-        db_document &set(std::string_view query, std::int32_t value);
-        db_document &set(std::string_view query, std::int64_t value);
-        db_document &set(std::string_view query, std::nullptr_t value);
-        db_document &set(std::string_view query, std::string const &value);
-        db_document &set(std::string_view query, std::string_view value);
+        /**
+         * \brief Checks whether enable_content_hash() was called on the collection.
+         */
+        bool has_content_hash() const;
 
-        // insert value in json body
-        db_document &insert(std::string_view query, std::float_t value);
-        db_document &insert(std::string_view query, std::double_t value);
-        db_document &insert(std::string_view query, std::int32_t value);
-        db_document &insert(std::string_view query, std::int64_t value);
-        db_document &insert(std::string_view query, std::nullptr_t value);
-        db_document &insert(std::string_view query, std::string const &value);
-        db_document &insert(std::string_view query, std::string_view value);
+        /**
+         * \brief Inserts a document with a generated UUID, unless a document with the same
+         *        content exists. Requires enable_content_hash().
+         *
+         * The hash lookup uses the index; matching documents are then compared on their
+         * canonical body, so a hash collision never skips a write.
+         *
+         * \param body The document body, a json object.
+         * \returns std::pair<db_document, bool> The new document and true, or the existing one and false.
+         * \throws std::invalid_argument if the body is not a json object.
+         * \throws std::logic_error if the collection has no content hash.
+         */
+        std::pair<db_document, bool> insert_if_new(std::string_view body);
 
         /**
-         * \brief Patches the JSON body of the document.
+         * \brief Inserts documents with generated UUIDs in a single transaction.
          *
-         * \param json The JSON patch.
-         * \returns db_document& Reference to the document.
+         * \param bodies The document bodies, json objects.
+         * \param mode Whether duplicates are skipped.
+         * \returns std::vector<std::string> The IDs of the inserted documents.
+         * \throws std::invalid_argument if duplicates are skipped and a body is not a json object.
+         * \throws db_exception if a document cannot be inserted. Either way nothing is inserted.
+         * \throws std::logic_error if duplicates are skipped and the collection has no content hash.
          */
-        db_document &patch(std::string_view json);
+        std::vector<std::string> insert_many(std::vector<std::string> const &bodies, dedup_mode mode = dedup_mode::none);
 
-        // get string
-        std::string get_string(std::string_view query) const;
+        /**
+         * \brief Gets the number of documents in the collection.
+         *
+         * \returns std::size_t The number of documents in the collection.
+         */        
+        std::size_t count() const;
 
-        // get number
-        std::int64_t get_number(std::string_view query) const;
+        /**
+         * \brief Gets the number of documents that matches the given query.
+         *
+         * \param q The query object.
+         * \returns std::size_t The number of matching documents.
+         */        
+        std::size_t count(query::queryable_type_eraser q) const;        
 
-        // get real
-        std::double_t get_real(std::string_view query) const;
+        /**
+         * \brief Gets all documents in the collection.
+         *
+         * \returns std::vector<db_document_ref> The list of document references.
+         */
+        std::vector<db_document_ref> docs() const;
 
-        // get json type
-        json_type get_type(std::string_view query) const;
+        /**
+         * \brief Removes a document by ID.
+         *
+         * \param doc_id The document ID.
+         */
+        void remove(std::string_view doc_id);
 
-        // get array length
-        std::size_t get_array_length(std::string_view query) const;
+        /**
+         * \brief Removes every document by dropping the table and recreating it from its schema,
+         *        with its generated columns and indexes, in a single transaction.
+         *
+         * Unlike deleting the documents, the cost does not depend on their number
+         * and no index is updated row by row. With a history (see enable_history()),
+         * the removal of every document is recorded as a new version first.
+         *
+         * \throws db_exception if the table is in use, e.g. by an open cursor on the connection.
+         */
+        void truncate();
 
-        // get object keys
-        std::vector<std::string> get_object_keys(std::string_view query) const;
+        /**
+         * \brief Searches documents by query.
+         *
+         * \param q The query object.
+         * \param order_by The order by object (optional)
+         * \param limit The maximum number of documents to return (optional).
+         * \returns std::vector<db_document_ref> The list of document references.
+         */
+        std::vector<db_document_ref> find(query::queryable_type_eraser q, std::optional<query::order_by> order_by = std::nullopt, std::optional<int> limit = std::nullopt) const;
 
-        // get values
-        template <typename... Types>
-        std::tuple<Types...> get(const std::vector<std::string>& fields) const {
-            if (fields.size() != sizeof...(Types)) {
-                throw std::invalid_argument("Number of fields does not match the number of types.");
-            }
+        /**
+         * \brief Checks whether find() needs a separate sort step for the given order.
+         *
+         * The sort step is avoided when the order matches an index created with index().
+         *
+         * \param q The query object.
+         * \param order_by The order by object.
+         * \returns bool True if SQLite sorts the results in a temporary b-tree.
+         */
+        bool requires_sort(query::queryable_type_eraser q, query::order_by const &order_by) const;
 
-            auto stmt = get_value_stmt_impl(fields);
-            auto ret = get_values_impl<Types...>(stmt, std::index_sequence_for<Types...>{});
+        /**
+         * \brief Gets the distinct values of a field.
+         *
+         * When the field is mirrored by a generated column (see index()) the column
+         * is read directly, so SQLite can answer from the index alone.
+         *
+         * \param path The json query (e.g. $.user) or the column name.
+         * \param q The query object (optional).
+         * \param limit The maximum number of values to return (optional).
+         * \returns std::vector<db_value> The distinct values.
+         */
+        std::vector<db_value> distinct(std::string_view path, std::optional<query::queryable_type_eraser> q = std::nullopt, std::optional<int> limit = std::nullopt) const;
 
-            return ret;
-        }
-        
         /**
-         * \brief Removes the document from the collection.
-         * \returns void
+         * \brief Opens a cursor over the documents, optionally filtered by a query.
+         *
+         * \param q The query object, all the documents when missing.
+         * \param options The cursor options.
+         * \returns db_cursor The cursor, positioned before the first document.
+         */
+        db_cursor cursor(std::optional<query::queryable_type_eraser> q = std::nullopt, cursor_options const &options = {}) const;
+
+        /**
+         * \brief Picks documents uniformly at random, without replacement.
+         *
+         * Random rowids are probed through the primary key, so the cost grows with n rather
+         * than with the collection. When the probes miss too often, because rows were deleted
+         * or the query is selective, the matching documents are sampled in a single pass instead.
+         * Either way no sort is needed, unlike ORDER BY random().
+         *
+         * \param n The number of documents to return, fewer if fewer documents match.
+         * \param q The query object, all the documents when missing.
+         * \returns std::vector<db_document_ref> The sampled documents, in random order.
+         */
+        std::vector<db_document_ref> sample(std::size_t n, std::optional<query::queryable_type_eraser> q = std::nullopt) const;
+
+        /**
+         * \brief Gets the frequency of each value of a field, most frequent first.
+         *
+         * \param path The json query (e.g. $.user) or the column name.
+         * \param q The query object (optional).
+         * \param top_n The maximum number of values to return (optional).
+         * \returns std::vector<std::pair<db_value, std::size_t>> The values and their number of occurrences.
+         */
+        std::vector<std::pair<db_value, std::size_t>> value_counts(std::string_view path, std::optional<query::queryable_type_eraser> q = std::nullopt, std::optional<int> top_n = std::nullopt) const;
+
+        /**
+         * \brief Sketches the distinct values of a field, for an approximate COUNT(DISTINCT)
+         *        in constant memory. Requires database::load_extensions().
+         *
+         * \param path The json query (e.g. $.user) or the column name.
+         * \param q The query object (optional).
+         * \returns distinct_sketch The sketch of the non-null values.
+         */
+        distinct_sketch approx_distinct(std::string_view path, std::optional<query::queryable_type_eraser> q = std::nullopt) const;
+
+        /**
+         * \brief Sketches the numeric values of a field, for approximate percentiles without
+         *        sorting them. Requires database::load_extensions().
+         *
+         * \param path The json query (e.g. $.price) or the column name.
+         * \param q The query object (optional).
+         * \returns quantile_sketch The sketch of the numeric values, others are ignored.
+         */
+        quantile_sketch approx_quantiles(std::string_view path, std::optional<query::queryable_type_eraser> q = std::nullopt) const;
+
+        /**
+         * \brief Indexes the document based on the specified column and query.
+         *
+         * This function creates a new virtual column representing the given json query
+         * and add an index to that column.
+         *
+         * \param column_name The name of the column to be created.
+         * \param query The json query string in SQLite format representing the field to be indexed
+         * \param unique The index should be unique
+         * \return A reference to the document.
+         */
+        db_collection& index(std::string_view column_name, std::string_view query, bool unique = false);
+
+        /**
+         * \brief Indexes the document based on the specified columns and query.
+         *
+         * This function creates a new virtual column representing the given json query
+         * and add an index to that column.
+         * \param name The index name
+         * \param columns A vector of pairs [column_name, query]
+         * \param unique The index should be unique
+         * \return A reference to the document.
          */        
-        void erase();
-    private:
-        template <typename... Types, std::size_t... Indices>
-        std::tuple<Types...> get_values_impl(details::sqlite::statement const &stmt, std::index_sequence<Indices...>) const
-        {
-            return std::make_tuple(stmt.get<Types>(Indices)...);
-        }   
-        
-        details::sqlite::statement get_value_stmt_impl(const std::vector<std::string>& fields) const;
+        db_collection& index(
+            std::string name,
+            std::vector<std::pair<std::string, std::string>> const &columns,
+            bool unique);   
+
+        /**
+         * \brief Promotes a json field to a typed column, stored in each row and written with the document.
+         *
+         * Unlike the virtual columns added by index(), which run json_extract whenever they
+         * are read, a promoted column is computed once per insert or update. Queries,
+         * sorting, distinct values and aggregates on the field then read the column without
+         * parsing the body. The body still holds the field, which stays the source of truth.
+         *
+         * Adding a stored column rebuilds the table, in a single transaction. Values keep their
+         * json type, so queries return the same documents before and after promoting; a
+         * document whose field has another type than the column is rejected, and so the
+         * promotion fails if one exists. Promoting a column that exists only adds the index.
+         *
+         * \param column_name The name of the column.
+         * \param query The json query string in SQLite format, e.g. "$.age".
+         * \param type The column type.
+         * \param indexed Whether the column is indexed.
+         * \return A reference to the collection.
+         */
+        db_collection &promote(std::string_view column_name, std::string_view query, column_type type, bool indexed = true);
+
+        /**
+         * \brief Prepares a statement on the collection's connection, whose
+         *        db_statement::documents() returns documents of this collection.
+         *
+         * \param sql The SQL statement, naming the collection's table, see name().
+         * \throws stmt_exception if the SQL is invalid.
+         */
+        db_statement prepare(std::string_view sql) const;
+
+        /**
+         * \brief Starts keeping every version of the collection's documents.
+         *
+         * Triggers record each insert, update and removal in a side table, whatever the
+         * write path. Updates are stored as the JSON Patch from the previous version, with a
+         * full body every history_options::keyframe_interval versions. Existing documents get
+         * their first version. The patches are computed by the json_diff() SQL function:
+         * every connection writing the collection must call database::load_extensions() first.
+         * Calling it again changes the keyframe interval of the next versions.
+         *
+         * \param options The history options.
+         * \return A reference to the collection.
+         */
+        db_collection &enable_history(history_options const &options = {});
+
+        /**
+         * \brief Checks whether enable_history() was called on the collection.
+         */
+        bool has_history() const;
+
+        /**
+         * \brief Lists the recorded versions of a document, oldest first.
+         *
+         * \throws std::logic_error if the collection has no history.
+         */
+        std::vector<document_version> history(std::string_view doc_id) const;
+
+        /**
+         * \brief Reads a document as of a version, replaying the patches from the nearest keyframe.
+         *
+         * \returns std::optional<std::string> The body, nothing if the version does not exist
+         *          (or was compacted away) or is the removal of the document.
+         * \throws std::logic_error if the collection has no history.
+         */
+        std::optional<std::string> body_at(std::string_view doc_id, std::int64_t version) const;
+
+        /**
+         * \brief Reads a document as it was at a point in time.
+         *
+         * \returns std::optional<std::string> The body, nothing if the document did not exist then.
+         * \throws std::logic_error if the collection has no history.
+         */
+        std::optional<std::string> body_at(std::string_view doc_id, std::chrono::system_clock::time_point at) const;
+
+        /**
+         * \brief Keeps at most max_versions versions of each document, the oldest kept
+         *        version becoming a keyframe.
+         *
+         * \returns std::size_t The number of versions removed.
+         * \throws std::invalid_argument if max_versions is 0.
+         * \throws std::logic_error if the collection has no history.
+         */
+        std::size_t compact_history(std::size_t max_versions);
+
+        /**
+         * \brief Creates or replaces an attachment of a document, zero-filled, and opens it for writing.
+         *
+         * Attachments are binary payloads stored next to the document, in a side table,
+         * instead of base64 strings in its body. They are removed with the document.
+         *
+         * \param doc_id The document ID.
+         * \param name The attachment name, unique per document.
+         * \param size The attachment size in bytes.
+         * \throws db_exception if the document does not exist.
+         */
+        db_attachment create_attachment(std::string_view doc_id, std::string_view name, std::size_t size);
+
+        /**
+         * \brief Creates or replaces an attachment with the content of a stream.
+         *
+         * \param size The number of bytes read from the stream.
+         * \throws std::runtime_error if the stream ends before size bytes.
+         */
+        void attach(std::string_view doc_id, std::string_view name, std::istream &in, std::size_t size);
+
+        /**
+         * \brief Opens an attachment of a document.
+         *
+         * \param writable Whether the attachment is opened for writing.
+         * \throws db_exception if the attachment does not exist.
+         */
+        db_attachment open_attachment(std::string_view doc_id, std::string_view name, bool writable = false) const;
+
+        /**
+         * \brief Lists the attachments of a document, by name.
+         */
+        std::vector<attachment_info> attachments(std::string_view doc_id) const;
+
+        /**
+         * \brief Removes an attachment of a document.
+         *
+         * \returns bool Whether the attachment existed.
+         */
+        bool remove_attachment(std::string_view doc_id, std::string_view name);
 
     private:
-        std::string doc_id;
-        std::string table_name;
-        mutable std::string body_data;
-        bool invalid_body;
+        db_document insert_body(std::string_view doc_id, std::string_view body);
+        std::shared_ptr<std::unordered_map<std::string, std::string> const> generated_columns() const;
+
         sqlite3 *db_handle;
-        friend struct db_collection;
-        friend struct db_document_ref;
+        std::string table_name;
+        std::shared_ptr<details::generated_columns_cache> columns_cache;
+    };
 
+    namespace details
+    {
         /**
-         * \brief Constructs a new db_document object.
-         *
-         * \param table_name The name of the table.
-         * \param doc_id The document ID.
-         * \param body The document body.
-         * \param db_handle The SQLite database handle.
+         * \brief Returns the collection stored in the given connection, creating its table on first use.
          */
-        db_document(std::string_view table_name, std::string_view doc_id, std::string_view body, sqlite3 *db_handle);
-        db_document(std::string_view table, std::string_view doc_id, sqlite3 *db_handle);
-    };
+        db_collection open_collection(sqlite3 *db_handle, std::string_view name);
+
+        /**
+         * \brief Registers docudb's SQL functions on the given connection, see database::load_extensions.
+         */
+        void load_extensions(sqlite3 *db_handle);
+
+        /**
+         * \brief Registers docudb's LIKE on the given connection, see database::use_fast_like.
+         */
+        void use_fast_like(sqlite3 *db_handle);
+    }
 
     /**
-     * \brief Represents a collection of documents in the database.
+     * \brief A collection split between a hot tier, kept in an in-memory database attached
+     *        to the connection, and a cold tier, the regular collection on disk.
+     *
+     * Writes go to the hot tier and reads look there first; documents leave it when
+     * demoted by age or by number, in batches. A document read from the cold tier is copied
+     * to the hot one and its cold row stays; a hot document shadows its cold row until
+     * demotion updates it in place. count() and find() cover both tiers, once per document.
+     *
+     * Writes to the hot tier are not durable: they are lost if the process ends before they
+     * are demoted. flush() demotes every document and runs when the object is destroyed.
+     * Queries can only use json paths, the generated columns of the cold tier do not exist
+     * in the hot one.
      */
-    struct db_collection
+    struct tiered_collection
     {
+        tiered_collection(tiered_collection &&) noexcept;
+        tiered_collection &operator=(tiered_collection &&) noexcept;
+        ~tiered_collection();
+
         /**
-         * \brief Constructs an empty db_collection object.
-         *
+         * \brief Returns the collection name.
          */
-        db_collection() = default;
-        db_collection(db_collection const &) = delete;
-        db_collection &operator=(db_collection const &) = delete;
-        db_collection(db_collection &&) = default;
-        db_collection &operator=(db_collection &&) = default;
+        std::string name() const;
 
         /**
-         * \brief Constructs a new db_collection object.
+         * \brief Inserts a document in the hot tier.
          *
-         * \param name The name of the collection.
-         * \param db_handle The SQLite database handle.
+         * \param body The document body, a json object.
+         * \returns std::string The document ID.
          */
-        db_collection(std::string_view name, sqlite3 *db_handle);
+        std::string insert(std::string_view body);
 
         /**
-         * \brief Gets the collection name
+         * \brief Replaces the body of a document in the hot tier, creating it if missing.
+         *        Its cold row, if any, is updated on demotion.
          *
-         * \returns std::string The collection name.
+         * \param doc_id The document ID.
+         * \param body The document body, a json object.
          */
-        std::string name() const noexcept;
+        void put(std::string_view doc_id, std::string_view body);
 
         /**
-         * \brief Gets a document by ID.
+         * \brief Reads the body of a document, from the hot tier first.
          *
          * \param doc_id The document ID.
-         * \returns db_document The document object.
+         * \returns std::optional<std::string> The body, or nothing if the document does not exist.
          */
-        db_document doc(std::string_view doc_id) const;
+        std::optional<std::string> get(std::string_view doc_id);
 
         /**
-         * \brief Creates a new document with a generated UUID.
+         * \brief Removes a document by ID, from either tier.
          *
-         * \returns db_document The new document object.
+         * \param doc_id The document ID.
          */
-        db_document doc();
+        void remove(std::string_view doc_id);
 
         /**
-         * \brief Creates a new document with the given ID.
-         *
-         * \returns db_document The new document object.
-         */        
-        db_document create(std::string_view doc_id);
+         * \brief Counts the documents of both tiers.
+         */
+        std::size_t count() const;
 
         /**
-         * \brief Gets the number of documents in the collection.
+         * \brief Counts the documents of both tiers matching a query.
          *
-         * \returns std::size_t The number of documents in the collection.
-         */        
-        std::size_t count() const;
+         * \param q The query object.
+         */
+        std::size_t count(query::queryable_type_eraser q) const;
 
         /**
-         * \brief Gets the number of documents that matches the given query.
+         * \brief Searches both tiers by query, hot documents first.
          *
          * \param q The query object.
-         * \returns std::size_t The number of matching documents.
-         */        
-        std::size_t count(query::queryable_type_eraser q) const;        
+         * \param limit Maximum number of documents returned.
+         * \returns std::vector<std::string> The IDs of the matching documents.
+         */
+        std::vector<std::string> find(query::queryable_type_eraser q, std::optional<int> limit = std::nullopt) const;
 
         /**
-         * \brief Gets all documents in the collection.
+         * \brief Demotes the documents exceeding the configured age or number, in batches.
          *
-         * \returns std::vector<db_document_ref> The list of document references.
+         * \returns std::size_t The number of documents demoted.
          */
-        std::vector<db_document_ref> docs() const;
+        std::size_t demote();
 
         /**
-         * \brief Removes a document by ID.
+         * \brief Demotes every hot document.
+         */
+        void flush();
+
+        /**
+         * \brief Returns the number of documents in the hot tier.
+         */
+        std::size_t hot_count() const;
+
+        /**
+         * \brief Returns the number of documents in the cold tier, promoted ones included.
+         */
+        std::size_t cold_count() const;
+
+        /**
+         * \brief Returns the read and demotion statistics.
+         */
+        tiered_stats statistics() const;
+
+    private:
+        friend struct database;
+        tiered_collection(sqlite3 *db_handle, std::string_view name, tiered_options const &options);
+
+        std::unique_ptr<details::tiered_state> state;
+    };
+
+    /**
+     * \brief An in-process copy of a collection, answering point and range queries without SQLite.
+     *
+     * The documents, or the configured fields of each, are read when the mirror is created
+     * and held in memory: a hash index on the document ID, and a sorted array per ordered path.
+     * Writes made through the same connection are tracked with SQLite's update hook and
+     * read back on the next lookup, once no transaction is open on the connection; until then
+     * lookups return the last committed documents. Several mirrors can share a connection,
+     * but the update hook cannot be used for anything else.
+     *
+     * Writes from other connections, and truncate(), are not seen: reload() reads the
+     * collection again. The mirror must not outlive its database.
+     *
+     * \code
+     * auto users = db.mirror("users", {.ordered = {"$.age"}});
+     * auto alice = users.get(id);                      // std::optional<std::string>
+     * auto adults = users.range("$.age", 18, std::nullopt);
+     * \endcode
+     */
+    struct collection_mirror
+    {
+        collection_mirror(collection_mirror &&) noexcept;
+        collection_mirror &operator=(collection_mirror &&) noexcept;
+        ~collection_mirror();
+
+        /**
+         * \brief Returns the collection name.
+         */
+        std::string name() const;
+
+        /**
+         * \brief Returns the number of mirrored documents.
+         */
+        std::size_t size() const;
+
+        /**
+         * \brief Checks whether a document is mirrored.
          *
          * \param doc_id The document ID.
          */
-        void remove(std::string_view doc_id);
+        bool contains(std::string_view doc_id) const;
 
         /**
-         * \brief Searches documents by query.
+         * \brief Reads a document.
          *
-         * \param q The query object.
-         * \param order_by The order by object (optional)
-         * \param limit The maximum number of documents to return (optional).
-         * \returns std::vector<db_document_ref> The list of document references.
+         * \param doc_id The document ID.
+         * \returns std::optional<std::string> The body, or the object of the configured fields,
+         *          nothing if the document does not exist.
          */
-        std::vector<db_document_ref> find(query::queryable_type_eraser q, std::optional<query::order_by> order_by = std::nullopt, std::optional<int> limit = std::nullopt) const;
+        std::optional<std::string> get(std::string_view doc_id) const;
 
         /**
-         * \brief Indexes the document based on the specified column and query.
+         * \brief Returns the IDs of the documents with lower <= value <= upper at an ordered path,
+         *        in value order.
          *
-         * This function creates a new virtual column representing the given json query
-         * and add an index to that column.
+         * Numbers sort before strings; documents without a value at the path are not indexed.
          *
-         * \param column_name The name of the column to be created.
-         * \param query The json query string in SQLite format representing the field to be indexed
-         * \param unique The index should be unique
-         * \return A reference to the document.
+         * \param path One of the ordered paths of the mirror options.
+         * \param lower The lowest value, nothing for no lower bound.
+         * \param upper The highest value, nothing for no upper bound.
+         * \param limit Maximum number of IDs returned.
+         * \throws std::invalid_argument if the path has no ordered index, or a bound is null.
          */
-        db_collection& index(std::string_view column_name, std::string_view query, bool unique = false);
+        std::vector<std::string> range(std::string_view path, std::optional<db_value> const &lower, std::optional<db_value> const &upper, std::optional<std::size_t> limit = std::nullopt) const;
 
         /**
-         * \brief Indexes the document based on the specified columns and query.
+         * \brief Applies the writes recorded since the last lookup now, instead of on the next one.
+         */
+        void refresh();
+
+        /**
+         * \brief Reads the whole collection again, e.g. after writes from another connection.
+         */
+        void reload();
+
+    private:
+        friend struct database;
+        collection_mirror(sqlite3 *db_handle, std::string_view name, mirror_options const &options);
+
+        std::unique_ptr<details::mirror::state> state;
+    };
+
+    /**
+     * \brief A point in the history of a WAL database, from which read sessions can be opened
+     *        on other connections to the same file. Copyable, freed with its last copy.
+     */
+    struct db_snapshot
+    {
+        std::shared_ptr<sqlite3_snapshot> handle;
+    };
+
+    /**
+     * \brief A read transaction spanning several queries, see database::read_session.
+     *
+     * Every query run on the connection while the session is open reads the same version
+     * of the database, and the read lock is taken once instead of once per query.
+     * Writes made through the same connection join the transaction: they are committed
+     * by end(), and rolled back if the session is destroyed while still open.
+     */
+    struct db_read_session
+    {
+        db_read_session(db_read_session &&other) noexcept;
+        db_read_session &operator=(db_read_session &&other) noexcept;
+        db_read_session(db_read_session const &) = delete;
+        db_read_session &operator=(db_read_session const &) = delete;
+
+        /**
+         * \brief Rolls the session back if still open.
+         */
+        ~db_read_session();
+
+        /**
+         * \brief Gets the snapshot read by the session, so that sessions on other connections,
+         *        e.g. one per thread, read the same version. Requires WAL mode.
          *
-         * This function creates a new virtual column representing the given json query
-         * and add an index to that column.
-         * \param name The index name
-         * \param columns A vector of pairs [column_name, query]
-         * \param unique The index should be unique
-         * \return A reference to the document.
-         */        
-        db_collection& index(
-            std::string name,
-            std::vector<std::pair<std::string, std::string>> const &columns,
-            bool unique);   
+         * \throws db_exception if the database is not in WAL mode.
+         * \throws std::runtime_error if SQLite was built without SQLITE_ENABLE_SNAPSHOT.
+         */
+        db_snapshot snapshot() const;
+
+        /**
+         * \brief Ends the session, committing the writes made during it; later queries see the
+         *        latest data again.
+         *
+         * \throws db_exception if the commit fails, the session then stays open.
+         */
+        void end();
+
+        /**
+         * \brief Checks whether the linked SQLite supports snapshots (SQLITE_ENABLE_SNAPSHOT).
+         */
+        static bool snapshots_supported() noexcept;
+
     private:
+        friend struct database;
+        db_read_session(sqlite3 *db_handle, sqlite3_snapshot *at);
+        void rollback() noexcept;
+
         sqlite3 *db_handle;
-        std::string table_name;
     };
 
     /**
@@ -916,12 +2687,42 @@ namespace docudb
          */
         std::vector<db_collection> collections() const;
 
+        /**
+         * \brief Drops a collection with its documents, generated columns and indexes.
+         *
+         * Collection objects of the dropped collection must no longer be used,
+         * unless the collection is created again.
+         *
+         * \param name The name of the collection.
+         * \returns bool Whether the collection existed.
+         * \throws db_exception if the table is in use, e.g. by an open cursor on the connection.
+         */
+        bool drop_collection(std::string_view name);
+
+        /**
+         * \brief Prepares a statement on the connection.
+         *
+         * \param sql The SQL statement.
+         * \throws stmt_exception if the SQL is invalid.
+         */
+        db_statement prepare(std::string_view sql) const;
+
         /**
          * \brief Load docudb's sqlite3 extensions (e.g. regexp)
          *
+         * Also adds contains(text, needle), and the functions used by content hashes,
+         * history and approximate aggregates. The built-in LIKE is kept, see use_fast_like().
          */
         void load_extensions() const;
 
+        /**
+         * \brief Replaces LIKE with a version using a SIMD substring search.
+         *
+         * LIKE keeps its semantics, but SQLite no longer uses indexes for LIKE prefix
+         * patterns on this connection, which is why it is not part of load_extensions().
+         */
+        void use_fast_like() const;
+
         /**
          * \brief Backup the current database into the destination database
          *
@@ -948,7 +2749,185 @@ namespace docudb
          */        
         std::string filename_wal() const noexcept;
 
+        /**
+         * \brief Starts checkpointing the WAL on a background thread.
+         *
+         * The database is switched to WAL mode and SQLite's automatic checkpoint is
+         * disabled on this connection, so that writers never pay for a checkpoint.
+         * The background thread uses its own connection and runs PASSIVE checkpoints,
+         * escalating to RESTART and TRUNCATE when the WAL grows past the configured sizes.
+         * Restarting replaces the running checkpoints.
+         *
+         * \param options The checkpoint options.
+         */
+        void start_checkpoints(checkpoint_options const &options = {});
+
+        /**
+         * \brief Stops the background checkpoints and restores SQLite's automatic checkpoint.
+         */
+        void stop_checkpoints();
+
+        /**
+         * \brief Returns the statistics of the background checkpoints.
+         */
+        checkpoint_stats checkpoint_statistics() const;
+
+        /**
+         * \brief Sets the auto_vacuum mode.
+         *
+         * Switching from or to none on a database that already has tables rebuilds
+         * the file with a full VACUUM.
+         *
+         * \param mode The auto_vacuum mode.
+         */
+        void auto_vacuum(auto_vacuum_mode mode);
+
+        /**
+         * \brief Returns the auto_vacuum mode.
+         */
+        auto_vacuum_mode auto_vacuum() const;
+
+        /**
+         * \brief Returns the page size, page count and free pages of the database file.
+         */
+        space_stats space_statistics() const;
+
+        /**
+         * \brief Starts reclaiming free pages on a background thread.
+         *
+         * The database must be in incremental auto_vacuum mode, and is switched to WAL mode
+         * so that readers are never blocked by a vacuum step. The background thread
+         * uses its own connection and, once no commits were seen for the configured idle time,
+         * releases free pages in bounded incremental_vacuum steps, stopping as soon as
+         * the database is written again.
+         * Restarting replaces the running vacuum.
+         *
+         * \param options The vacuum options.
+         */
+        void start_incremental_vacuum(vacuum_options const &options = {});
+
+        /**
+         * \brief Stops the background incremental vacuum.
+         */
+        void stop_incremental_vacuum();
+
+        /**
+         * \brief Returns the statistics of the background incremental vacuum.
+         */
+        vacuum_stats vacuum_statistics() const;
+
+        /**
+         * \brief Rebuilds the database file without free pages, whatever the auto_vacuum mode.
+         *
+         * The database is vacuumed into a temporary file next to it, which is then
+         * copied back page by page, keeping this connection and its collections valid.
+         * Compaction should run while no other connection writes: it fails if the
+         * database is modified while the copy is built. The write lock is taken before
+         * the check and kept until the copy is written back.
+         */
+        void compact();
+
+        /**
+         * \brief Returns a tiered collection, backed by the collection of the same name.
+         *
+         * Background demotion, enabled by tiered_options::demote_interval, shares this
+         * connection and requires the serialized threading mode.
+         *
+         * \param name The collection name.
+         * \param options The tiering options.
+         */
+        tiered_collection tiered(std::string_view name, tiered_options const &options = {});
+
+        /**
+         * \brief Replaces SQLite's allocator with size-class pools and per-thread caches, process-wide.
+         *
+         * Short statements make many small allocations, which the thread caches serve
+         * without locking nor calling malloc. Must be called before any database is opened.
+         *
+         * \param options The pool options.
+         * \throws std::logic_error if SQLite is already initialized.
+         * \throws std::invalid_argument if max_pooled_size exceeds 64KB.
+         */
+        static void use_pool_allocator(allocator_options const &options = {});
+
+        /**
+         * \brief Returns the allocation counters of the pooled allocator, zero when not installed,
+         *        and the memory used by SQLite.
+         */
+        static allocator_stats allocator_statistics();
+
+        /**
+         * \brief Replaces SQLite's page cache with one whose pages share a memory budget
+         *        and an eviction order across every connection, process-wide.
+         *
+         * Connections keep separate pages, even on the same file, but a busy connection can
+         * use the memory an idle one does not, and with scan resistance a large scan
+         * does not evict the pages other queries keep reading. PRAGMA cache_size is ignored.
+         * Must be called before any database is opened.
+         *
+         * \param options The budget and eviction options.
+         * \throws std::logic_error if SQLite is already initialized.
+         * \throws std::invalid_argument if fifo_ratio is not between 0 and 1.
+         */
+        static void use_shared_page_cache(page_cache_options const &options = {});
+
+        /**
+         * \brief Returns the hit, miss and eviction counters of the shared page cache,
+         *        zero when not installed.
+         */
+        static page_cache_stats page_cache_statistics();
+
+        /**
+         * \brief Sets the lookaside memory of this connection, from which SQLite serves its
+         *        small short-lived allocations before calling the allocator.
+         *
+         * \param slot_size The size of a slot, rounded down to a multiple of 8.
+         * \param slot_count The number of slots, zero disables lookaside.
+         * \throws db_exception if lookaside memory is in use, e.g. by a prepared statement.
+         */
+        void lookaside(std::size_t slot_size, std::size_t slot_count);
+
+        /**
+         * \brief Returns the lookaside statistics of this connection since it was opened.
+         */
+        lookaside_stats lookaside_statistics() const;
+
+        /**
+         * \brief Returns an in-memory mirror of a collection, loaded now and kept current
+         *        with the writes made on this connection.
+         *
+         * \param name The collection name.
+         * \param options The projected fields and ordered paths.
+         */
+        collection_mirror mirror(std::string_view name, mirror_options const &options = {}) const;
+
+        /**
+         * \brief Opens a read transaction shared by the following queries on this connection.
+         *
+         * \code
+         * auto session = db.read_session();
+         * auto total = orders.count();
+         * auto open = orders.count(docudb::query::eq("$.status", "open"s)); // same data as total
+         * \endcode
+         *
+         * \returns db_read_session The session, open until destroyed or ended.
+         * \throws std::logic_error if a transaction is already open on the connection.
+         */
+        db_read_session read_session() const;
+
+        /**
+         * \brief Opens a read session at a snapshot taken on another connection to the same file.
+         *
+         * \param at The snapshot, see db_read_session::snapshot.
+         * \throws db_exception if the snapshot is no longer available, e.g. after a WAL checkpoint
+         *         overwrote its pages, or belongs to another database.
+         * \throws std::runtime_error if SQLite was built without SQLITE_ENABLE_SNAPSHOT.
+         */
+        db_read_session read_session(db_snapshot const &at) const;
+
     private:
-        sqlite3 *db_handle;
+        sqlite3 *db_handle = nullptr;
+        std::unique_ptr<details::checkpoint_manager> checkpointer;
+        std::unique_ptr<details::vacuum_scheduler> vacuum_scheduler;
     };
 }
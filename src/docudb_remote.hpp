@@ -0,0 +1,252 @@
+#pragma once
+
+#include "docudb.hpp"
+#include <future>
+
+namespace docudb::remote
+{
+    /**
+     * \brief Exception class for errors reported by a docudb server.
+     */
+    struct remote_exception : std::runtime_error
+    {
+        using std::runtime_error::runtime_error;
+    };
+
+    /**
+     * \brief How the writer syncs its commits to disk, the SQLite synchronous setting.
+     */
+    enum class synchronous_mode
+    {
+        /**
+         * \brief The WAL is synced at checkpoints only: faster commits, but the last batches
+         *        acknowledged to clients are lost if the machine crashes. The database stays consistent.
+         */
+        normal,
+        /**
+         * \brief The WAL is synced at every commit: an acknowledged write survives a power loss.
+         */
+        full
+    };
+
+    /**
+     * \brief Configures a docudb server.
+     */
+    struct server_options
+    {
+        /**
+         * \brief Database file served, created if missing.
+         */
+        std::string database_path;
+        /**
+         * \brief Path of the Unix domain socket the server listens on.
+         */
+        std::string socket_path;
+        /**
+         * \brief Read-only connections serving reads in parallel with the writer.
+         */
+        int readers{4};
+        /**
+         * \brief Maximum writes committed in a single transaction.
+         */
+        std::size_t max_batch{256};
+        /**
+         * \brief Durability of the commits. Defaults to SQLite's own default, full; batching already
+         *        spreads the cost of a sync over the writes of a batch.
+         */
+        synchronous_mode synchronous{synchronous_mode::full};
+    };
+
+    /**
+     * \brief Statistics of a docudb server.
+     */
+    struct server_stats
+    {
+        std::uint64_t connections{0};
+        std::uint64_t requests{0};
+        /**
+         * \brief Write transactions committed, each one covering a batch of requests.
+         */
+        std::uint64_t batches{0};
+        std::uint64_t batched_requests{0};
+    };
+
+    /**
+     * \brief A document returned by a docudb server.
+     */
+    struct remote_document
+    {
+        std::string id;
+        std::string body;
+    };
+
+    namespace details
+    {
+        struct server_state;
+        struct client_connection;
+    }
+
+    /**
+     * \brief Serves a database file to other processes over a Unix domain socket.
+     *
+     * The server owns the database: a single writer connection commits the pending writes
+     * of all clients in batched transactions, while a pool of read-only connections serves reads.
+     * The database is switched to WAL mode so that reads never wait for the writer.
+     * Requests are pipelined: a client can send many requests before reading the responses,
+     * which are matched by request id. Reads sent by a client after its writes observe them.
+     *
+     * The socket is created with owner-only permissions, which are its only access control.
+     *
+     * \code
+     * docudb::remote::server srv{{"data.db", "/tmp/docudb.sock"}};
+     * srv.run(); // until srv.stop() is called from another thread
+     * \endcode
+     */
+    struct server
+    {
+        /**
+         * \brief Opens the database and binds the socket.
+         *
+         * \param options The server options.
+         * \throws db_exception if the database cannot be opened.
+         * \throws std::system_error if the socket cannot be bound, or another server uses it.
+         */
+        explicit server(server_options const &options);
+        ~server();
+
+        server(server const &) = delete;
+        server &operator=(server const &) = delete;
+
+        /**
+         * \brief Serves clients until stop() is called.
+         */
+        void run();
+
+        /**
+         * \brief Stops a running server, the pending writes are committed first. Thread-safe.
+         */
+        void stop();
+
+        /**
+         * \brief Returns the server statistics.
+         */
+        server_stats statistics() const;
+
+    private:
+        std::unique_ptr<details::server_state> state;
+    };
+
+    struct client;
+
+    /**
+     * \brief A collection served by a docudb server, mirroring db_collection.
+     *
+     * The *_async functions return as soon as the request is sent, so that many requests
+     * can be pipelined on the connection; the others wait for the response.
+     */
+    struct remote_collection
+    {
+        /**
+         * \brief Returns the collection name.
+         */
+        std::string name() const;
+
+        /**
+         * \brief Inserts a document with a new ID.
+         *
+         * \param body The document body, a json object.
+         * \returns std::string The document ID.
+         */
+        std::string insert(std::string_view body);
+        std::future<std::string> insert_async(std::string_view body);
+
+        /**
+         * \brief Replaces the body of a document, creating it if missing.
+         *
+         * \param doc_id The document ID.
+         * \param body The document body, a json object.
+         */
+        void put(std::string_view doc_id, std::string_view body);
+        std::future<void> put_async(std::string_view doc_id, std::string_view body);
+
+        /**
+         * \brief Reads the body of a document.
+         *
+         * \param doc_id The document ID.
+         * \returns std::optional<std::string> The body, or nothing if the document does not exist.
+         */
+        std::optional<std::string> get(std::string_view doc_id);
+        std::future<std::optional<std::string>> get_async(std::string_view doc_id);
+
+        /**
+         * \brief Removes a document by ID.
+         *
+         * \param doc_id The document ID.
+         */
+        void remove(std::string_view doc_id);
+        std::future<void> remove_async(std::string_view doc_id);
+
+        /**
+         * \brief Counts the documents in the collection.
+         */
+        std::size_t count();
+
+        /**
+         * \brief Counts the documents matching a query.
+         *
+         * \param q The query object.
+         */
+        std::size_t count(query::queryable_type_eraser q);
+
+        /**
+         * \brief Searches documents by query.
+         *
+         * \param q The query object.
+         * \param limit Maximum number of documents returned.
+         * \returns std::vector<remote_document> The matching documents, with their bodies.
+         */
+        std::vector<remote_document> find(query::queryable_type_eraser q, std::optional<int> limit = std::nullopt);
+
+    private:
+        friend struct client;
+        remote_collection(std::string_view name, details::client_connection *connection);
+
+        std::string collection_name;
+        details::client_connection *connection;
+    };
+
+    /**
+     * \brief Connects to a docudb server, mirroring database.
+     *
+     * A client can be shared by several threads; its collections must not outlive it.
+     */
+    struct client
+    {
+        /**
+         * \brief Connects to the server.
+         *
+         * \param socket_path Path of the server socket.
+         * \throws std::system_error if the server cannot be reached.
+         */
+        explicit client(std::string_view socket_path);
+        ~client();
+
+        client(client const &) = delete;
+        client &operator=(client const &) = delete;
+
+        /**
+         * \brief Returns a collection, creating it on the server on first use.
+         *
+         * \param name The collection name.
+         */
+        remote_collection collection(std::string_view name);
+
+        /**
+         * \brief Round-trips an empty request.
+         */
+        void ping();
+
+    private:
+        std::unique_ptr<details::client_connection> connection;
+    };
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef DOCUDB_HASH_H
+#define DOCUDB_HASH_H
+
+namespace docudb::details::hash
+{
+    namespace xxh
+    {
+        constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ull;
+        constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+        constexpr std::uint64_t prime3 = 0x165667B19E3779F9ull;
+        constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+        constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+        inline std::uint64_t rotl(std::uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        inline std::uint64_t read64(const unsigned char *p)
+        {
+            std::uint64_t v = 0;
+            for (int i = 7; i >= 0; --i)
+                v = (v << 8) | p[i];
+            return v;
+        }
+
+        inline std::uint32_t read32(const unsigned char *p)
+        {
+            return static_cast<std::uint32_t>(p[0]) | (static_cast<std::uint32_t>(p[1]) << 8) |
+                   (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+        }
+
+        inline std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+        {
+            acc += input * prime2;
+            acc = rotl(acc, 31);
+            return acc * prime1;
+        }
+
+        inline std::uint64_t merge_round(std::uint64_t acc, std::uint64_t val)
+        {
+            acc ^= round(0, val);
+            return acc * prime1 + prime4;
+        }
+    }
+
+    /**
+     * @brief XXH64 hash, as specified by the xxHash project; byte order independent.
+     */
+    inline std::uint64_t xxh64(const void *data, std::size_t size, std::uint64_t seed = 0)
+    {
+        using namespace xxh;
+
+        auto p = static_cast<const unsigned char *>(data);
+        auto end = p + size;
+        std::uint64_t h;
+
+        if (size >= 32)
+        {
+            std::uint64_t v1 = seed + prime1 + prime2;
+            std::uint64_t v2 = seed + prime2;
+            std::uint64_t v3 = seed;
+            std::uint64_t v4 = seed - prime1;
+
+            auto limit = end - 32;
+            do
+            {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+                p += 32;
+            } while (p <= limit);
+
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge_round(h, v1);
+            h = merge_round(h, v2);
+            h = merge_round(h, v3);
+            h = merge_round(h, v4);
+        }
+        else
+        {
+            h = seed + prime5;
+        }
+
+        h += static_cast<std::uint64_t>(size);
+
+        while (p + 8 <= end)
+        {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * prime1 + prime4;
+            p += 8;
+        }
+
+        if (p + 4 <= end)
+        {
+            h ^= static_cast<std::uint64_t>(read32(p)) * prime1;
+            h = rotl(h, 23) * prime2 + prime3;
+            p += 4;
+        }
+
+        while (p < end)
+        {
+            h ^= (*p) * prime5;
+            h = rotl(h, 11) * prime1;
+            ++p;
+        }
+
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        h ^= h >> 32;
+        return h;
+    }
+}
+
+#endif // DOCUDB_HASH_H
@@ -0,0 +1,416 @@
+#include "json.h"
+#include "docudb.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace docudb::details::json
+{
+    namespace
+    {
+        // same nesting limit as SQLite's json functions (JSON_MAX_DEPTH), so that
+        // anything SQLite accepted can be read back, and hostile input cannot exhaust the stack
+        constexpr std::size_t max_depth = 1000;
+
+        struct parser
+        {
+            std::string_view text;
+            std::size_t pos = 0;
+            std::size_t depth = 0;
+
+            [[noreturn]] void fail() const
+            {
+                throw std::invalid_argument("Malformed JSON at offset " + std::to_string(pos));
+            }
+
+            void skip_whitespace()
+            {
+                while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+                    ++pos;
+            }
+
+            char peek()
+            {
+                skip_whitespace();
+                if (pos >= text.size())
+                    fail();
+                return text[pos];
+            }
+
+            void enter()
+            {
+                if (++depth > max_depth)
+                    throw std::invalid_argument("JSON nested too deeply at offset " + std::to_string(pos));
+            }
+
+            void expect(char c)
+            {
+                if (peek() != c)
+                    fail();
+                ++pos;
+            }
+
+            void expect_literal(std::string_view literal)
+            {
+                if (text.substr(pos, literal.size()) != literal)
+                    fail();
+                pos += literal.size();
+            }
+
+            value parse_value()
+            {
+                value v;
+                switch (peek())
+                {
+                case '{':
+                    enter();
+                    parse_object(v);
+                    --depth;
+                    break;
+                case '[':
+                    enter();
+                    parse_array(v);
+                    --depth;
+                    break;
+                case '"':
+                    v.type = value::kind::string;
+                    v.text = parse_string();
+                    break;
+                case 't':
+                    expect_literal("true");
+                    v.type = value::kind::boolean;
+                    v.boolean = true;
+                    break;
+                case 'f':
+                    expect_literal("false");
+                    v.type = value::kind::boolean;
+                    break;
+                case 'n':
+                    expect_literal("null");
+                    break;
+                default:
+                    v.type = value::kind::number;
+                    v.text = parse_number();
+                }
+                return v;
+            }
+
+            void parse_object(value &v)
+            {
+                v.type = value::kind::object;
+                expect('{');
+                if (peek() == '}')
+                {
+                    ++pos;
+                    return;
+                }
+                while (true)
+                {
+                    if (peek() != '"')
+                        fail();
+                    auto key = parse_string();
+                    expect(':');
+                    v.members.emplace_back(std::move(key), parse_value());
+                    if (peek() == ',')
+                    {
+                        ++pos;
+                        continue;
+                    }
+                    expect('}');
+                    return;
+                }
+            }
+
+            void parse_array(value &v)
+            {
+                v.type = value::kind::array;
+                expect('[');
+                if (peek() == ']')
+                {
+                    ++pos;
+                    return;
+                }
+                while (true)
+                {
+                    v.items.push_back(parse_value());
+                    if (peek() == ',')
+                    {
+                        ++pos;
+                        continue;
+                    }
+                    expect(']');
+                    return;
+                }
+            }
+
+            bool accept(char c)
+            {
+                if (pos < text.size() && text[pos] == c)
+                {
+                    ++pos;
+                    return true;
+                }
+                return false;
+            }
+
+            void digits()
+            {
+                if (pos >= text.size() || text[pos] < '0' || text[pos] > '9')
+                    fail();
+                while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9')
+                    ++pos;
+            }
+
+            // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+            std::string parse_number()
+            {
+                auto start = pos;
+                accept('-');
+                if (!accept('0'))
+                    digits();
+                if (accept('.'))
+                    digits();
+                if (accept('e') || accept('E'))
+                {
+                    if (!accept('+'))
+                        accept('-');
+                    digits();
+                }
+                return std::string{text.substr(start, pos - start)};
+            }
+
+            unsigned parse_hex4()
+            {
+                if (pos + 4 > text.size())
+                    fail();
+                unsigned code = 0;
+                for (int i = 0; i < 4; ++i)
+                {
+                    auto c = text[pos++];
+                    code <<= 4;
+                    if (c >= '0' && c <= '9')
+                        code |= c - '0';
+                    else if (c >= 'a' && c <= 'f')
+                        code |= c - 'a' + 10;
+                    else if (c >= 'A' && c <= 'F')
+                        code |= c - 'A' + 10;
+                    else
+                        fail();
+                }
+                return code;
+            }
+
+            static void append_utf8(std::string &out, unsigned code)
+            {
+                if (code < 0x80)
+                {
+                    out += static_cast<char>(code);
+                }
+                else if (code < 0x800)
+                {
+                    out += static_cast<char>(0xc0 | (code >> 6));
+                    out += static_cast<char>(0x80 | (code & 0x3f));
+                }
+                else if (code < 0x10000)
+                {
+                    out += static_cast<char>(0xe0 | (code >> 12));
+                    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                    out += static_cast<char>(0x80 | (code & 0x3f));
+                }
+                else
+                {
+                    out += static_cast<char>(0xf0 | (code >> 18));
+                    out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+                    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                    out += static_cast<char>(0x80 | (code & 0x3f));
+                }
+            }
+
+            std::string parse_string()
+            {
+                expect('"');
+                std::string out;
+                while (true)
+                {
+                    if (pos >= text.size())
+                        fail();
+                    auto c = text[pos++];
+                    if (c == '"')
+                        return out;
+                    if (c != '\\')
+                    {
+                        out += c;
+                        continue;
+                    }
+                    if (pos >= text.size())
+                        fail();
+                    switch (text[pos++])
+                    {
+                    case '"':
+                        out += '"';
+                        break;
+                    case '\\':
+                        out += '\\';
+                        break;
+                    case '/':
+                        out += '/';
+                        break;
+                    case 'b':
+                        out += '\b';
+                        break;
+                    case 'f':
+                        out += '\f';
+                        break;
+                    case 'n':
+                        out += '\n';
+                        break;
+                    case 'r':
+                        out += '\r';
+                        break;
+                    case 't':
+                        out += '\t';
+                        break;
+                    case 'u':
+                    {
+                        auto code = parse_hex4();
+                        // surrogate pair
+                        if (code >= 0xd800 && code < 0xdc00 && text.substr(pos, 2) == "\\u")
+                        {
+                            pos += 2;
+                            auto low = parse_hex4();
+                            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        }
+                        append_utf8(out, code);
+                        break;
+                    }
+                    default:
+                        fail();
+                    }
+                }
+            }
+        };
+    }
+
+    value const *value::find(std::string_view key) const
+    {
+        auto it = std::find_if(members.begin(), members.end(), [&](auto const &m)
+                               { return m.first == key; });
+        return it == members.end() ? nullptr : &it->second;
+    }
+
+    value *value::find(std::string_view key)
+    {
+        return const_cast<value *>(std::as_const(*this).find(key));
+    }
+
+    value parse(std::string_view text)
+    {
+        parser p{text};
+        auto v = p.parse_value();
+        p.skip_whitespace();
+        if (p.pos != text.size())
+            p.fail();
+        return v;
+    }
+
+    void write(std::string &out, value const &v, bool sorted_keys)
+    {
+        switch (v.type)
+        {
+        case value::kind::null:
+            out += "null";
+            break;
+        case value::kind::boolean:
+            out += v.boolean ? "true" : "false";
+            break;
+        case value::kind::number:
+            out += v.text;
+            break;
+        case value::kind::string:
+            write_string(out, v.text);
+            break;
+        case value::kind::array:
+            out += '[';
+            for (std::size_t i = 0; i < v.items.size(); ++i)
+            {
+                if (i > 0)
+                    out += ',';
+                write(out, v.items[i], sorted_keys);
+            }
+            out += ']';
+            break;
+        case value::kind::object:
+        {
+            std::vector<std::pair<std::string, value> const *> members;
+            for (auto const &m : v.members)
+                members.push_back(&m);
+            if (sorted_keys)
+                std::sort(members.begin(), members.end(), [](auto a, auto b)
+                          { return a->first < b->first; });
+
+            out += '{';
+            for (std::size_t i = 0; i < members.size(); ++i)
+            {
+                if (i > 0)
+                    out += ',';
+                write_string(out, members[i]->first);
+                out += ':';
+                write(out, members[i]->second, sorted_keys);
+            }
+            out += '}';
+            break;
+        }
+        }
+    }
+
+    std::string to_string(value const &v, bool sorted_keys)
+    {
+        std::string out;
+        write(out, v, sorted_keys);
+        return out;
+    }
+
+    bool equal(value const &a, value const &b)
+    {
+        if (a.type != b.type)
+            return false;
+
+        switch (a.type)
+        {
+        case value::kind::null:
+            return true;
+        case value::kind::boolean:
+            return a.boolean == b.boolean;
+        case value::kind::number:
+            return a.text == b.text || std::strtod(a.text.c_str(), nullptr) == std::strtod(b.text.c_str(), nullptr);
+        case value::kind::string:
+            return a.text == b.text;
+        case value::kind::array:
+            return a.items.size() == b.items.size() &&
+                   std::equal(a.items.begin(), a.items.end(), b.items.begin(), [](auto const &x, auto const &y)
+                              { return equal(x, y); });
+        case value::kind::object:
+            if (a.members.size() != b.members.size())
+                return false;
+            for (auto const &[key, v] : a.members)
+            {
+                auto other = b.find(key);
+                if (!other || !equal(v, *other))
+                    return false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    std::string canonical_body(std::string_view body)
+    {
+        auto v = parse(body);
+        if (v.type != value::kind::object)
+            throw std::invalid_argument("Document body must be a json object");
+
+        std::erase_if(v.members, [](auto const &m)
+                      { return m.first == "docid"; });
+        return to_string(v, true);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef DOCUDB_JSON_H
+#define DOCUDB_JSON_H
+
+namespace docudb::details::json
+{
+    /**
+     * @brief Minimal json document model, used where documents are handled outside of SQLite.
+     */
+    struct value
+    {
+        enum class kind
+        {
+            null,
+            boolean,
+            number,
+            string,
+            array,
+            object
+        };
+
+        kind type = kind::null;
+        bool boolean = false;
+        // number literal, or decoded string
+        std::string text;
+        std::vector<value> items;
+        std::vector<std::pair<std::string, value>> members;
+
+        value const *find(std::string_view key) const;
+        value *find(std::string_view key);
+    };
+
+    /**
+     * @brief Parses a json text.
+     * @throws std::invalid_argument if the text is not valid json.
+     */
+    value parse(std::string_view text);
+
+    /**
+     * @brief Serializes a value without whitespace.
+     * @param sorted_keys Emit object members sorted by key, giving a canonical form.
+     */
+    void write(std::string &out, value const &v, bool sorted_keys = false);
+
+    std::string to_string(value const &v, bool sorted_keys = false);
+
+    /**
+     * @brief Compares two values, ignoring the order of object members.
+     */
+    bool equal(value const &a, value const &b);
+
+    /**
+     * @brief Canonical form of a document body: keys sorted at every level, no whitespace,
+     *        and no top-level docid, so that copies of a document stored under different IDs match.
+     * @throws std::invalid_argument if the body is not a json object.
+     */
+    std::string canonical_body(std::string_view body);
+}
+
+#endif // DOCUDB_JSON_H
@@ -0,0 +1,220 @@
+#include "maintenance.h"
+#include <filesystem>
+
+namespace docudb::details
+{
+    namespace
+    {
+        std::uint64_t file_size(std::string const &filename)
+        {
+            std::error_code ec;
+            auto size = std::filesystem::file_size(filename, ec);
+            return ec ? 0 : size;
+        }
+    }
+
+    periodic_worker::periodic_worker(std::chrono::milliseconds interval, std::function<void()> task)
+        : interval_(interval), task_(std::move(task)), stop_(false)
+    {
+        thread_ = std::thread{&periodic_worker::run, this};
+    }
+
+    periodic_worker::~periodic_worker()
+    {
+        {
+            std::lock_guard lock{mutex_};
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    void periodic_worker::run()
+    {
+        std::unique_lock lock{mutex_};
+        while (!cv_.wait_for(lock, interval_, [this]
+                             { return stop_; }))
+        {
+            lock.unlock();
+            task_();
+            lock.lock();
+        }
+    }
+
+    sqlite3 *open_maintenance_connection(std::string const &filename, std::chrono::milliseconds busy_timeout)
+    {
+        sqlite3 *db;
+        auto rc = sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, nullptr);
+        if (rc != SQLITE_OK)
+        {
+            db_exception e{db, "Can't open database"};
+            sqlite3_close(db);
+            throw e;
+        }
+
+        sqlite3_busy_timeout(db, static_cast<int>(busy_timeout.count()));
+        return db;
+    }
+
+    std::int64_t pragma_value(sqlite3 *db_handle, std::string_view pragma)
+    {
+        sqlite::statement stmt{db_handle, std::format("PRAGMA {};", pragma)};
+
+        stmt.step();
+
+        if (stmt.result_code() != SQLITE_ROW)
+        {
+            throw db_exception{db_handle, "Failed to read pragma"};
+        }
+
+        return stmt.get<std::int64_t>(0);
+    }
+
+    // CHECKPOINT MANAGER
+
+    checkpoint_manager::checkpoint_manager(std::string const &filename, std::string const &wal_filename, checkpoint_options const &options)
+        : db_handle_(nullptr), wal_filename_(wal_filename), options_(options)
+    {
+        // only RESTART and TRUNCATE wait, PASSIVE never invokes the busy handler
+        db_handle_ = open_maintenance_connection(filename, options_.busy_timeout);
+        worker_ = std::make_unique<periodic_worker>(options_.interval, [this]
+                                                    { checkpoint(); });
+    }
+
+    checkpoint_manager::~checkpoint_manager()
+    {
+        worker_.reset();
+        sqlite3_close(db_handle_);
+    }
+
+    checkpoint_stats checkpoint_manager::stats() const
+    {
+        std::lock_guard lock{mutex_};
+        return stats_;
+    }
+
+    void checkpoint_manager::checkpoint()
+    {
+        auto wal_size = file_size(wal_filename_);
+
+        auto mode = SQLITE_CHECKPOINT_PASSIVE;
+        if (wal_size > options_.truncate_wal_size)
+            mode = SQLITE_CHECKPOINT_TRUNCATE;
+        else if (wal_size > options_.restart_wal_size)
+            mode = SQLITE_CHECKPOINT_RESTART;
+
+        int log_frames = 0;
+        int checkpointed_frames = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        auto rc = sqlite3_wal_checkpoint_v2(db_handle_, nullptr, mode, &log_frames, &checkpointed_frames);
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+        wal_size = file_size(wal_filename_);
+
+        std::lock_guard lock{mutex_};
+        stats_.wal_size = wal_size;
+        stats_.checkpoints++;
+        switch (mode)
+        {
+        case SQLITE_CHECKPOINT_TRUNCATE:
+            stats_.truncate_checkpoints++;
+            break;
+        case SQLITE_CHECKPOINT_RESTART:
+            stats_.restart_checkpoints++;
+            break;
+        default:
+            stats_.passive_checkpoints++;
+        }
+        // a passive checkpoint is busy when it could not copy every frame
+        if (rc == SQLITE_BUSY || (rc == SQLITE_OK && checkpointed_frames < log_frames))
+            stats_.busy_checkpoints++;
+        stats_.log_frames = log_frames;
+        stats_.checkpointed_frames = checkpointed_frames;
+        stats_.last_duration = duration;
+        stats_.max_duration = std::max(stats_.max_duration, duration);
+        stats_.total_duration += duration;
+    }
+
+    // VACUUM SCHEDULER
+
+    vacuum_scheduler::vacuum_scheduler(std::string const &filename, vacuum_options const &options)
+        : db_handle_(nullptr), options_(options), data_version_(0), last_activity_(std::chrono::steady_clock::now())
+    {
+        // the owning connection keeps its own busy timeout, it is set by the application
+        db_handle_ = open_maintenance_connection(filename, options_.busy_timeout);
+        data_version_ = pragma_value(db_handle_, "data_version");
+        worker_ = std::make_unique<periodic_worker>(options_.interval, [this]
+                                                    { vacuum(); });
+    }
+
+    vacuum_scheduler::~vacuum_scheduler()
+    {
+        worker_.reset();
+        sqlite3_close(db_handle_);
+    }
+
+    vacuum_stats vacuum_scheduler::stats() const
+    {
+        std::lock_guard lock{mutex_};
+        return stats_;
+    }
+
+    void vacuum_scheduler::vacuum()
+    {
+        try
+        {
+            // data_version changes when another connection commits
+            auto now = std::chrono::steady_clock::now();
+            auto data_version = pragma_value(db_handle_, "data_version");
+            if (data_version != data_version_)
+            {
+                data_version_ = data_version;
+                last_activity_ = now;
+            }
+
+            if (now - last_activity_ < options_.idle_time)
+                return;
+
+            auto free_pages = pragma_value(db_handle_, "freelist_count");
+            if (free_pages == 0)
+                return;
+
+            auto start = std::chrono::steady_clock::now();
+            std::int64_t reclaimed = 0;
+            std::uint64_t steps = 0;
+
+            // bounded steps, each in its own short write transaction, stopping as soon as the application writes
+            while (free_pages > 0 && reclaimed < options_.max_pages_per_run)
+            {
+                auto sql = std::format("PRAGMA incremental_vacuum({});", std::min<std::int64_t>(options_.pages_per_step, options_.max_pages_per_run - reclaimed));
+                if (sqlite3_exec(db_handle_, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+                    break;
+                steps++;
+
+                auto remaining = pragma_value(db_handle_, "freelist_count");
+                // no progress: the database is not in incremental auto_vacuum mode
+                if (remaining >= free_pages)
+                    break;
+                reclaimed += free_pages - remaining;
+                free_pages = remaining;
+
+                if (pragma_value(db_handle_, "data_version") != data_version_)
+                    break;
+            }
+
+            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+            std::lock_guard lock{mutex_};
+            stats_.runs++;
+            stats_.steps += steps;
+            stats_.reclaimed_pages += reclaimed;
+            stats_.last_duration = duration;
+            stats_.total_duration += duration;
+        }
+        catch (db_exception const &)
+        {
+            // the database is busy or locked, try again on the next interval
+        }
+    }
+}
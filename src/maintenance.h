@@ -0,0 +1,93 @@
+#pragma once
+
+#include "docudb.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef DOCUDB_MAINTENANCE_H
+#define DOCUDB_MAINTENANCE_H
+
+namespace docudb::details
+{
+    /**
+     * @brief Runs a task on a background thread at a fixed interval, until destroyed.
+     */
+    struct periodic_worker
+    {
+        periodic_worker(std::chrono::milliseconds interval, std::function<void()> task);
+        ~periodic_worker();
+
+        periodic_worker(periodic_worker const &) = delete;
+        periodic_worker &operator=(periodic_worker const &) = delete;
+
+    private:
+        void run();
+
+        std::chrono::milliseconds interval_;
+        std::function<void()> task_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool stop_;
+        std::thread thread_;
+    };
+
+    /**
+     * @brief Opens a maintenance connection to a database file.
+     */
+    sqlite3 *open_maintenance_connection(std::string const &filename, std::chrono::milliseconds busy_timeout);
+
+    /**
+     * @brief Checkpoints the WAL of a database file on a background thread, with its own connection.
+     */
+    struct checkpoint_manager
+    {
+        checkpoint_manager(std::string const &filename, std::string const &wal_filename, checkpoint_options const &options);
+        ~checkpoint_manager();
+
+        checkpoint_manager(checkpoint_manager const &) = delete;
+        checkpoint_manager &operator=(checkpoint_manager const &) = delete;
+
+        checkpoint_stats stats() const;
+
+    private:
+        void checkpoint();
+
+        sqlite3 *db_handle_;
+        std::string wal_filename_;
+        checkpoint_options options_;
+        checkpoint_stats stats_;
+        mutable std::mutex mutex_;
+        std::unique_ptr<periodic_worker> worker_;
+    };
+
+    /**
+     * @brief Reclaims free pages with PRAGMA incremental_vacuum when the database file is idle,
+     *        on a background thread with its own connection.
+     */
+    struct vacuum_scheduler
+    {
+        vacuum_scheduler(std::string const &filename, vacuum_options const &options);
+        ~vacuum_scheduler();
+
+        vacuum_scheduler(vacuum_scheduler const &) = delete;
+        vacuum_scheduler &operator=(vacuum_scheduler const &) = delete;
+
+        vacuum_stats stats() const;
+
+    private:
+        void vacuum();
+
+        sqlite3 *db_handle_;
+        vacuum_options options_;
+        vacuum_stats stats_;
+        std::int64_t data_version_;
+        std::chrono::steady_clock::time_point last_activity_;
+        mutable std::mutex mutex_;
+        std::unique_ptr<periodic_worker> worker_;
+    };
+
+    std::int64_t pragma_value(sqlite3 *db_handle, std::string_view pragma);
+}
+
+#endif // DOCUDB_MAINTENANCE_H
@@ -0,0 +1,425 @@
+#include "mirror.h"
+#include "hash.h"
+#include <bit>
+#include <cstring>
+#include <format>
+#include <memory>
+
+namespace docudb::details::mirror
+{
+    namespace
+    {
+        // SQLite keeps a single update hook per connection, shared by its mirrors
+        struct dispatcher
+        {
+            std::mutex mutex;
+            std::vector<state *> mirrors;
+        };
+
+        std::mutex registry_mutex;
+        std::unordered_map<sqlite3 *, std::unique_ptr<dispatcher>> registry;
+
+        void update_hook(void *arg, int, char const *schema, char const *table_name, sqlite3_int64 rowid)
+        {
+            if (std::strcmp(schema, "main") != 0)
+                return;
+
+            auto d = static_cast<dispatcher *>(arg);
+            std::lock_guard lock{d->mutex};
+            for (auto m : d->mirrors)
+            {
+                if (m->table_name == table_name)
+                    m->on_update(rowid);
+            }
+        }
+
+        void subscribe(state *m)
+        {
+            std::lock_guard lock{registry_mutex};
+            auto &d = registry[m->db_handle];
+            if (!d)
+            {
+                d = std::make_unique<dispatcher>();
+                sqlite3_update_hook(m->db_handle, update_hook, d.get());
+            }
+            std::lock_guard mirrors_lock{d->mutex};
+            d->mirrors.push_back(m);
+        }
+
+        void unsubscribe(state *m)
+        {
+            std::lock_guard lock{registry_mutex};
+            auto it = registry.find(m->db_handle);
+            if (it == registry.end())
+                return;
+
+            {
+                std::lock_guard mirrors_lock{it->second->mutex};
+                std::erase(it->second->mirrors, m);
+                if (!it->second->mirrors.empty())
+                    return;
+            }
+            // waits for a hook running on another thread, the connection mutex is held while it runs
+            sqlite3_update_hook(m->db_handle, nullptr, nullptr);
+            registry.erase(it);
+        }
+
+        std::uint64_t docid_hash(std::string_view docid)
+        {
+            return hash::xxh64(docid.data(), docid.size());
+        }
+
+        // holds the mutex of a serialized connection, so that no other thread opens a transaction
+        struct connection_lock
+        {
+            explicit connection_lock(sqlite3 *db_handle) : mutex_(sqlite3_db_mutex(db_handle))
+            {
+                if (mutex_)
+                    sqlite3_mutex_enter(mutex_);
+            }
+
+            ~connection_lock()
+            {
+                if (mutex_)
+                    sqlite3_mutex_leave(mutex_);
+            }
+
+            connection_lock(connection_lock const &) = delete;
+            connection_lock &operator=(connection_lock const &) = delete;
+
+        private:
+            sqlite3_mutex *mutex_;
+        };
+    }
+
+    table::table(std::size_t ordered_count) : ordered_(ordered_count)
+    {
+    }
+
+    std::size_t table::probe(std::string_view docid, std::uint64_t hash) const
+    {
+        if (hash_.empty())
+            return hash_.size();
+
+        auto mask = hash_.size() - 1;
+        for (auto i = static_cast<std::size_t>(hash) & mask;; i = (i + 1) & mask)
+        {
+            auto const &s = hash_[i];
+            if (s.entry == empty_slot)
+                return hash_.size();
+            if (s.entry != deleted_slot && s.hash == hash && entries_[s.entry].docid == docid)
+                return i;
+        }
+    }
+
+    entry const *table::find(std::string_view docid) const
+    {
+        auto i = probe(docid, docid_hash(docid));
+        return i == hash_.size() ? nullptr : &entries_[hash_[i].entry];
+    }
+
+    void table::rehash(std::size_t capacity)
+    {
+        hash_.assign(std::bit_ceil(std::max<std::size_t>(capacity, 16)), hash_slot{});
+        hash_used_ = 0;
+
+        auto mask = hash_.size() - 1;
+        for (std::uint32_t slot = 0; slot < entries_.size(); ++slot)
+        {
+            if (!entries_[slot].live)
+                continue;
+
+            auto hash = docid_hash(entries_[slot].docid);
+            auto i = static_cast<std::size_t>(hash) & mask;
+            while (hash_[i].entry != empty_slot)
+                i = (i + 1) & mask;
+            hash_[i] = {hash, slot};
+            ++hash_used_;
+        }
+    }
+
+    void table::hash_insert(std::uint32_t slot)
+    {
+        // at most 75% of the slots are used, deleted ones included
+        if ((hash_used_ + 1) * 4 > hash_.size() * 3)
+            rehash((size_ + 1) * 2);
+
+        auto hash = docid_hash(entries_[slot].docid);
+        auto mask = hash_.size() - 1;
+        auto i = static_cast<std::size_t>(hash) & mask;
+        while (hash_[i].entry != empty_slot && hash_[i].entry != deleted_slot)
+            i = (i + 1) & mask;
+
+        if (hash_[i].entry == empty_slot)
+            ++hash_used_;
+        hash_[i] = {hash, slot};
+    }
+
+    void table::hash_erase(std::uint32_t slot)
+    {
+        auto const &docid = entries_[slot].docid;
+        auto i = probe(docid, docid_hash(docid));
+        if (i != hash_.size())
+            hash_[i].entry = deleted_slot;
+    }
+
+    std::uint32_t table::allocate(entry e)
+    {
+        e.live = true;
+        ++size_;
+        if (!free_.empty())
+        {
+            auto slot = free_.back();
+            free_.pop_back();
+            entries_[slot] = std::move(e);
+            return slot;
+        }
+
+        entries_.push_back(std::move(e));
+        return static_cast<std::uint32_t>(entries_.size() - 1);
+    }
+
+    void table::erase_slot(std::uint32_t slot)
+    {
+        auto &e = entries_[slot];
+        hash_erase(slot);
+        rowids_.erase(e.rowid);
+        for (std::size_t i = 0; i < ordered_.size(); ++i)
+        {
+            if (!e.keys[i])
+                continue;
+
+            auto &items = ordered_[i];
+            auto item = std::pair{*e.keys[i], slot};
+            auto it = std::lower_bound(items.begin(), items.end(), item);
+            if (it != items.end() && *it == item)
+                items.erase(it);
+        }
+
+        e = entry{};
+        free_.push_back(slot);
+        --size_;
+    }
+
+    void table::erase_rowid(std::int64_t rowid)
+    {
+        auto it = rowids_.find(rowid);
+        if (it != rowids_.end())
+            erase_slot(it->second);
+    }
+
+    void table::upsert(entry e)
+    {
+        erase_rowid(e.rowid);
+        // a replaced document gets a new rowid, SQLite does not report the deletion
+        auto i = probe(e.docid, docid_hash(e.docid));
+        if (i != hash_.size())
+            erase_slot(hash_[i].entry);
+
+        auto slot = allocate(std::move(e));
+        hash_insert(slot);
+        rowids_[entries_[slot].rowid] = slot;
+        for (std::size_t k = 0; k < ordered_.size(); ++k)
+        {
+            if (!entries_[slot].keys[k])
+                continue;
+
+            auto &items = ordered_[k];
+            auto item = std::pair{*entries_[slot].keys[k], slot};
+            items.insert(std::lower_bound(items.begin(), items.end(), item), std::move(item));
+        }
+    }
+
+    void table::append(entry e)
+    {
+        auto slot = allocate(std::move(e));
+        rowids_[entries_[slot].rowid] = slot;
+    }
+
+    void table::build()
+    {
+        rehash(size_ * 2);
+        for (std::size_t k = 0; k < ordered_.size(); ++k)
+        {
+            auto &items = ordered_[k];
+            items.clear();
+            for (std::uint32_t slot = 0; slot < entries_.size(); ++slot)
+            {
+                if (entries_[slot].live && entries_[slot].keys[k])
+                    items.emplace_back(*entries_[slot].keys[k], slot);
+            }
+            std::sort(items.begin(), items.end());
+        }
+    }
+
+    state::state(sqlite3 *db_handle, std::string_view table_name, mirror_options const &options)
+        : db_handle(db_handle), table_name(table_name), ordered_paths(options.ordered), data(options.ordered.size()), options_(options)
+    {
+        // ?1 is the rowid of a single document, the paths follow
+        int param = 2;
+        std::string value = "body";
+        if (!options_.fields.empty())
+        {
+            value = "json_object(";
+            for (std::size_t i = 0; i < options_.fields.size(); ++i, param += 2)
+                value += std::format("{}?{}, json_extract(body, ?{})", i ? ", " : "", param, param + 1);
+            value += ")";
+        }
+
+        std::string keys;
+        for (std::size_t i = 0; i < options_.ordered.size(); ++i)
+            keys += std::format(", json_extract(body, ?{})", param++);
+
+        select_sql_ = std::format("SELECT rowid, docid, {}{} FROM [{}]", value, keys, table_name);
+
+        // subscribed first, so that no write is missed while the collection is read
+        subscribe(this);
+        try
+        {
+            reload();
+        }
+        catch (...)
+        {
+            unsubscribe(this);
+            throw;
+        }
+    }
+
+    state::~state()
+    {
+        unsubscribe(this);
+    }
+
+    void state::on_update(std::int64_t rowid)
+    {
+        std::lock_guard lock{pending_mutex_};
+        pending_.push_back(rowid);
+        has_pending_.store(true, std::memory_order_release);
+    }
+
+    void state::bind_paths(details::sqlite::statement &stmt) const
+    {
+        int param = 2;
+        for (auto const &field : options_.fields)
+        {
+            std::string_view name = field;
+            if (name.starts_with("$."))
+                name.remove_prefix(2);
+            stmt.bind(param++, name);
+            stmt.bind(param++, field);
+        }
+        for (auto const &path : options_.ordered)
+            stmt.bind(param++, path);
+    }
+
+    entry state::read_entry(details::sqlite::statement const &stmt) const
+    {
+        entry e;
+        e.rowid = stmt.get<std::int64_t>(0);
+        e.docid = stmt.get<std::string>(1);
+        e.value = stmt.get<std::string>(2);
+        e.keys.reserve(options_.ordered.size());
+        for (int i = 0; i < static_cast<int>(options_.ordered.size()); ++i)
+        {
+            switch (stmt.get_type(3 + i))
+            {
+            case json_type::integer:
+            case json_type::real:
+                e.keys.emplace_back(stmt.get<double>(3 + i));
+                break;
+            case json_type::string:
+                e.keys.emplace_back(stmt.get<std::string>(3 + i));
+                break;
+            default:
+                e.keys.emplace_back(std::nullopt);
+                break;
+            }
+        }
+        return e;
+    }
+
+    void state::reload_locked()
+    {
+        table fresh{options_.ordered.size()};
+        details::sqlite::statement stmt{db_handle, select_sql_};
+        bind_paths(stmt);
+        while (stmt.step().result_code() == SQLITE_ROW)
+            fresh.append(read_entry(stmt));
+
+        if (stmt.result_code() != SQLITE_DONE)
+        {
+            throw db_exception{db_handle, "Failed to load the mirror"};
+        }
+
+        fresh.build();
+        data = std::move(fresh);
+    }
+
+    void state::reload()
+    {
+        connection_lock connection{db_handle};
+        {
+            std::lock_guard lock{pending_mutex_};
+            pending_.clear();
+            has_pending_.store(false, std::memory_order_release);
+        }
+
+        std::unique_lock lock{mutex};
+        reload_locked();
+    }
+
+    void state::sync()
+    {
+        if (!has_pending_.load(std::memory_order_acquire))
+            return;
+
+        connection_lock connection{db_handle};
+        // the rows are read once committed: rolled back writes are never seen
+        if (!sqlite3_get_autocommit(db_handle))
+            return;
+
+        std::vector<std::int64_t> rowids;
+        {
+            std::lock_guard lock{pending_mutex_};
+            rowids.swap(pending_);
+            has_pending_.store(false, std::memory_order_release);
+        }
+        std::sort(rowids.begin(), rowids.end());
+        rowids.erase(std::unique(rowids.begin(), rowids.end()), rowids.end());
+
+        std::unique_lock lock{mutex};
+        try
+        {
+            // bulk writes are cheaper to read back in one scan
+            if (rowids.size() > data.size())
+            {
+                reload_locked();
+                return;
+            }
+
+            details::sqlite::statement stmt{db_handle, select_sql_ + " WHERE rowid=?1"};
+            for (auto rowid : rowids)
+            {
+                stmt.reset();
+                stmt.bind(1, rowid);
+                bind_paths(stmt);
+                stmt.step();
+
+                if (stmt.result_code() == SQLITE_ROW)
+                    data.upsert(read_entry(stmt));
+                else if (stmt.result_code() == SQLITE_DONE)
+                    data.erase_rowid(rowid);
+                else
+                    throw db_exception{db_handle, "Failed to refresh the mirror"};
+            }
+        }
+        catch (...)
+        {
+            // tried again on the next access
+            std::lock_guard pending_lock{pending_mutex_};
+            pending_.insert(pending_.end(), rowids.begin(), rowids.end());
+            has_pending_.store(true, std::memory_order_release);
+            throw;
+        }
+    }
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "docudb.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#ifndef DOCUDB_MIRROR_H
+#define DOCUDB_MIRROR_H
+
+namespace docudb::details::mirror
+{
+    /**
+     * @brief Key of an ordered index: numbers sort before strings, like in SQLite.
+     */
+    using key = std::variant<double, std::string>;
+
+    /**
+     * @brief A mirrored document: its rowid, ID, value (body or projection) and ordered keys.
+     */
+    struct entry
+    {
+        std::int64_t rowid{0};
+        std::string docid;
+        std::string value;
+        std::vector<std::optional<key>> keys;
+        bool live{false};
+    };
+
+    /**
+     * @brief The in-memory copy of a collection.
+     *
+     * Entries live in a slot array, found by docid through an open-addressing hash
+     * (linear probing, power-of-two capacity, hashes kept in the slots so that
+     * a probe compares strings only on a hash match), and by key through sorted
+     * arrays of (key, slot) pairs, one per ordered path.
+     */
+    struct table
+    {
+        explicit table(std::size_t ordered_count = 0);
+
+        std::size_t size() const noexcept { return size_; }
+
+        /**
+         * @returns The entry of a document, nullptr if not mirrored.
+         */
+        entry const *find(std::string_view docid) const;
+
+        /**
+         * @brief Adds or replaces a document, dropping any entry with the same rowid or docid.
+         */
+        void upsert(entry e);
+
+        /**
+         * @brief Drops the document stored at a rowid, if any.
+         */
+        void erase_rowid(std::int64_t rowid);
+
+        /**
+         * @brief Appends a document without indexing it, see build().
+         */
+        void append(entry e);
+
+        /**
+         * @brief Indexes the appended documents at once.
+         */
+        void build();
+
+        /**
+         * @brief Visits the documents with lower <= key <= upper of an ordered index, in key order,
+         *        until visit returns false.
+         */
+        template <typename Visitor>
+        void range(std::size_t index, std::optional<key> const &lower, std::optional<key> const &upper, Visitor &&visit) const
+        {
+            auto const &items = ordered_[index];
+            auto it = lower ? std::lower_bound(items.begin(), items.end(), *lower, [](auto const &item, key const &k)
+                                               { return item.first < k; })
+                            : items.begin();
+            for (; it != items.end(); ++it)
+            {
+                if (upper && *upper < it->first)
+                    break;
+                if (!visit(entries_[it->second]))
+                    break;
+            }
+        }
+
+    private:
+        static constexpr std::uint32_t empty_slot = 0xFFFFFFFF;
+        static constexpr std::uint32_t deleted_slot = 0xFFFFFFFE;
+
+        struct hash_slot
+        {
+            std::uint64_t hash{0};
+            std::uint32_t entry{empty_slot};
+        };
+
+        std::size_t probe(std::string_view docid, std::uint64_t hash) const;
+        void hash_insert(std::uint32_t slot);
+        void hash_erase(std::uint32_t slot);
+        void rehash(std::size_t capacity);
+        void erase_slot(std::uint32_t slot);
+        std::uint32_t allocate(entry e);
+
+        std::vector<entry> entries_;
+        std::vector<std::uint32_t> free_;
+        std::vector<hash_slot> hash_;
+        std::size_t hash_used_{0};
+        std::unordered_map<std::int64_t, std::uint32_t> rowids_;
+        std::vector<std::vector<std::pair<key, std::uint32_t>>> ordered_;
+        std::size_t size_{0};
+    };
+
+    /**
+     * @brief Mirror of a collection, kept current through the connection's update hook.
+     *
+     * The hook only records the rowids written; they are read back on the next access,
+     * once no transaction is open on the connection, so that rolled back changes,
+     * including ROLLBACK TO a savepoint, are never mirrored.
+     */
+    struct state
+    {
+        state(sqlite3 *db_handle, std::string_view table_name, mirror_options const &options);
+        ~state();
+
+        state(state const &) = delete;
+        state &operator=(state const &) = delete;
+
+        /**
+         * @brief Applies the pending changes, if any and if no transaction is open.
+         */
+        void sync();
+
+        /**
+         * @brief Reads the whole collection again.
+         */
+        void reload();
+
+        void on_update(std::int64_t rowid);
+
+        sqlite3 *db_handle;
+        std::string table_name;
+        std::vector<std::string> ordered_paths;
+        mutable std::shared_mutex mutex;
+        table data;
+
+    private:
+        void bind_paths(details::sqlite::statement &stmt) const;
+        entry read_entry(details::sqlite::statement const &stmt) const;
+        void reload_locked();
+
+        mirror_options options_;
+        std::string select_sql_;
+        std::mutex pending_mutex_;
+        std::vector<std::int64_t> pending_;
+        std::atomic<bool> has_pending_{false};
+    };
+}
+
+#endif // DOCUDB_MIRROR_H
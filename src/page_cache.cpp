@@ -0,0 +1,408 @@
+#include "page_cache.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace docudb::details::page_cache
+{
+    namespace
+    {
+        enum class queue
+        {
+            a1in,
+            am
+        };
+
+        struct cache;
+
+        // allocated with its buffer and extra space: [page][buffer][extra]
+        struct page
+        {
+            sqlite3_pcache_page base;
+            unsigned key;
+            cache *owner;
+            queue q;
+            bool pinned;
+            page *prev;
+            page *next;
+        };
+
+        struct page_list
+        {
+            page head{};
+            std::size_t bytes{0};
+
+            page_list()
+            {
+                head.prev = head.next = &head;
+            }
+
+            bool empty() const
+            {
+                return head.next == &head;
+            }
+
+            void push_front(page *p, std::size_t size)
+            {
+                p->prev = &head;
+                p->next = head.next;
+                head.next->prev = p;
+                head.next = p;
+                bytes += size;
+            }
+
+            void remove(page *p, std::size_t size)
+            {
+                p->prev->next = p->next;
+                p->next->prev = p->prev;
+                p->prev = p->next = nullptr;
+                bytes -= size;
+            }
+
+            page *back() const
+            {
+                return head.prev;
+            }
+        };
+
+        struct cache
+        {
+            std::uint64_t id;
+            std::size_t page_size;
+            std::size_t extra_size;
+            bool purgeable;
+            std::unordered_map<unsigned, page *> pages;
+
+            std::size_t block_size() const
+            {
+                return sizeof(page) + page_size + extra_size;
+            }
+        };
+
+        struct shared_state
+        {
+            page_cache_options options;
+            std::mutex mutex;
+            std::uint64_t next_id{1};
+            page_list a1in;
+            page_list am;
+            std::size_t bytes{0};
+            std::deque<std::uint64_t> ghosts;
+            std::unordered_set<std::uint64_t> ghost_keys;
+            page_cache_stats stats;
+        };
+
+        shared_state *shared = nullptr;
+
+        std::uint64_t ghost_key(cache const &c, unsigned key)
+        {
+            return (c.id << 32) | key;
+        }
+
+        page_list &list_of(page const *p)
+        {
+            return p->q == queue::a1in ? shared->a1in : shared->am;
+        }
+
+        // removes a page from its cache, and from its queue if released, the memory is not freed
+        void detach(page *p)
+        {
+            auto c = p->owner;
+            c->pages.erase(p->key);
+            if (!c->purgeable)
+                return;
+
+            if (!p->pinned)
+                list_of(p).remove(p, c->block_size());
+            shared->bytes -= c->block_size();
+        }
+
+        void discard(page *p)
+        {
+            detach(p);
+            std::free(p);
+        }
+
+        void remember(cache const &c, unsigned key)
+        {
+            // the ghost queue holds about half the budget worth of keys
+            auto capacity = std::max<std::size_t>(shared->options.max_bytes / c.block_size() / 2, 1);
+            auto k = ghost_key(c, key);
+            if (shared->ghost_keys.insert(k).second)
+                shared->ghosts.push_back(k);
+
+            while (shared->ghosts.size() > capacity)
+            {
+                shared->ghost_keys.erase(shared->ghosts.front());
+                shared->ghosts.pop_front();
+            }
+        }
+
+        // the FIFO queue is emptied first while above its share of the budget, so that
+        // pages read once, e.g. by a scan, leave before the pages read again
+        page *victim()
+        {
+            auto a1in_limit = static_cast<std::size_t>(static_cast<double>(shared->options.max_bytes) * shared->options.fifo_ratio);
+            if (!shared->a1in.empty() && (shared->a1in.bytes > a1in_limit || shared->am.empty()))
+                return shared->a1in.back();
+            if (!shared->am.empty())
+                return shared->am.back();
+            return nullptr;
+        }
+
+        // evicts released pages until size more bytes fit in the budget; a victim of the
+        // requested block size is handed back for reuse instead of being freed
+        page *make_room(std::size_t size)
+        {
+            page *reusable = nullptr;
+            while (shared->bytes + size > shared->options.max_bytes)
+            {
+                auto p = victim();
+                if (!p)
+                    break;
+
+                if (p->q == queue::a1in)
+                    remember(*p->owner, p->key);
+                shared->stats.evictions++;
+
+                detach(p);
+                if (!reusable && p->owner->block_size() == size)
+                {
+                    reusable = p;
+                }
+                else
+                {
+                    std::free(p);
+                }
+            }
+            return reusable;
+        }
+
+        int pcache_init(void *)
+        {
+            return SQLITE_OK;
+        }
+
+        void pcache_shutdown(void *)
+        {
+        }
+
+        sqlite3_pcache *pcache_create(int page_size, int extra_size, int purgeable)
+        {
+            std::lock_guard lock{shared->mutex};
+            auto c = new (std::nothrow) cache{shared->next_id++, static_cast<std::size_t>(page_size), static_cast<std::size_t>(extra_size), purgeable != 0, {}};
+            return reinterpret_cast<sqlite3_pcache *>(c);
+        }
+
+        void pcache_cachesize(sqlite3_pcache *, int)
+        {
+            // connections share the budget, their own cache_size is not enforced
+        }
+
+        int pcache_pagecount(sqlite3_pcache *pcache)
+        {
+            std::lock_guard lock{shared->mutex};
+            return static_cast<int>(reinterpret_cast<cache *>(pcache)->pages.size());
+        }
+
+        sqlite3_pcache_page *pcache_fetch(sqlite3_pcache *pcache, unsigned key, int create_flag)
+        {
+            auto c = reinterpret_cast<cache *>(pcache);
+            std::lock_guard lock{shared->mutex};
+
+            auto it = c->pages.find(key);
+            if (it != c->pages.end())
+            {
+                auto p = it->second;
+                if (c->purgeable)
+                {
+                    shared->stats.hits++;
+                    if (!p->pinned)
+                    {
+                        // fetched again after being released: the page is part of the working set
+                        list_of(p).remove(p, c->block_size());
+                        p->q = queue::am;
+                    }
+                }
+                p->pinned = true;
+                return &p->base;
+            }
+
+            if (create_flag == 0)
+                return nullptr;
+
+            page *p = nullptr;
+            auto q = queue::am;
+            if (c->purgeable)
+            {
+                shared->stats.misses++;
+                auto ghost = shared->options.scan_resistant ? shared->ghost_keys.find(ghost_key(*c, key)) : shared->ghost_keys.end();
+                if (ghost != shared->ghost_keys.end())
+                {
+                    // evicted too early, the page goes straight to the LRU queue
+                    shared->stats.ghost_hits++;
+                    shared->ghost_keys.erase(ghost);
+                }
+                else if (shared->options.scan_resistant)
+                {
+                    q = queue::a1in;
+                }
+
+                p = make_room(c->block_size());
+                // over budget with every page pinned: only grow when SQLite insists
+                if (!p && create_flag == 1 && shared->bytes + c->block_size() > shared->options.max_bytes)
+                    return nullptr;
+            }
+
+            if (!p)
+            {
+                p = static_cast<page *>(std::malloc(c->block_size()));
+                if (!p)
+                    return nullptr;
+            }
+
+            auto buffer = reinterpret_cast<unsigned char *>(p + 1);
+            p->base.pBuf = buffer;
+            p->base.pExtra = buffer + c->page_size;
+            // SQLite expects the extra space of a new page to start zeroed
+            std::memset(p->base.pExtra, 0, c->extra_size);
+            p->key = key;
+            p->owner = c;
+            p->q = q;
+            p->pinned = true;
+            p->prev = p->next = nullptr;
+
+            c->pages.emplace(key, p);
+            if (c->purgeable)
+                shared->bytes += c->block_size();
+            return &p->base;
+        }
+
+        void pcache_unpin(sqlite3_pcache *pcache, sqlite3_pcache_page *pcache_page, int discard_page)
+        {
+            auto c = reinterpret_cast<cache *>(pcache);
+            auto p = reinterpret_cast<page *>(pcache_page);
+            std::lock_guard lock{shared->mutex};
+
+            if (discard_page)
+            {
+                discard(p);
+                return;
+            }
+
+            p->pinned = false;
+            if (!c->purgeable)
+                return;
+
+            list_of(p).push_front(p, c->block_size());
+            // pages allocated while everything was pinned are given back now
+            if (shared->bytes > shared->options.max_bytes)
+                make_room(0);
+        }
+
+        void pcache_rekey(sqlite3_pcache *pcache, sqlite3_pcache_page *pcache_page, unsigned old_key, unsigned new_key)
+        {
+            auto c = reinterpret_cast<cache *>(pcache);
+            auto p = reinterpret_cast<page *>(pcache_page);
+            std::lock_guard lock{shared->mutex};
+
+            auto existing = c->pages.find(new_key);
+            if (existing != c->pages.end())
+                discard(existing->second);
+
+            c->pages.erase(old_key);
+            p->key = new_key;
+            c->pages.emplace(new_key, p);
+        }
+
+        void pcache_truncate(sqlite3_pcache *pcache, unsigned limit)
+        {
+            auto c = reinterpret_cast<cache *>(pcache);
+            std::lock_guard lock{shared->mutex};
+
+            std::vector<page *> dropped;
+            for (auto [key, p] : c->pages)
+            {
+                // pinned pages past the limit are implicitly released
+                if (key >= limit)
+                    dropped.push_back(p);
+            }
+            for (auto p : dropped)
+                discard(p);
+        }
+
+        void pcache_shrink(sqlite3_pcache *pcache)
+        {
+            auto c = reinterpret_cast<cache *>(pcache);
+            std::lock_guard lock{shared->mutex};
+            if (!c->purgeable)
+                return;
+
+            std::vector<page *> released;
+            for (auto [key, p] : c->pages)
+            {
+                if (!p->pinned)
+                    released.push_back(p);
+            }
+            for (auto p : released)
+                discard(p);
+        }
+
+        void pcache_destroy(sqlite3_pcache *pcache)
+        {
+            auto c = reinterpret_cast<cache *>(pcache);
+            {
+                std::lock_guard lock{shared->mutex};
+                std::vector<page *> pages;
+                for (auto [key, p] : c->pages)
+                    pages.push_back(p);
+                for (auto p : pages)
+                    discard(p);
+            }
+            delete c;
+        }
+    }
+
+    void install(page_cache_options const &options)
+    {
+        if (options.fifo_ratio < 0 || options.fifo_ratio > 1)
+        {
+            throw std::invalid_argument("fifo_ratio must be between 0 and 1");
+        }
+        if (shared)
+        {
+            throw std::logic_error("The shared page cache is already installed");
+        }
+
+        auto s = new shared_state{};
+        s->options = options;
+
+        static sqlite3_pcache_methods2 methods{
+            1, nullptr, pcache_init, pcache_shutdown, pcache_create, pcache_cachesize, pcache_pagecount,
+            pcache_fetch, pcache_unpin, pcache_rekey, pcache_truncate, pcache_destroy, pcache_shrink};
+        if (sqlite3_config(SQLITE_CONFIG_PCACHE2, &methods) != SQLITE_OK)
+        {
+            delete s;
+            throw std::logic_error("The page cache must be configured before any database is opened");
+        }
+        shared = s;
+    }
+
+    page_cache_stats stats()
+    {
+        if (!shared)
+            return {};
+
+        std::lock_guard lock{shared->mutex};
+        auto s = shared->stats;
+        s.bytes = shared->bytes;
+        return s;
+    }
+}
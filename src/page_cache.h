@@ -0,0 +1,28 @@
+#pragma once
+
+#include "docudb.hpp"
+
+#ifndef DOCUDB_PAGE_CACHE_H
+#define DOCUDB_PAGE_CACHE_H
+
+namespace docudb::details::page_cache
+{
+    /**
+     * @brief Installs the shared sqlite3_pcache_methods2, process-wide.
+     *
+     * Every connection still has its own cache, as SQLite requires, but their clean
+     * pages share one memory budget and one eviction order: a connection with a hot
+     * working set can hold more pages than an idle one. Eviction follows 2Q: pages
+     * enter a FIFO queue and move to an LRU queue when fetched again after being
+     * released, or when fetched again soon after being evicted (remembered by key in
+     * a ghost queue), so a scan only recycles its own pages. Pages of temporary and
+     * in-memory databases are never evicted and do not count against the budget.
+     *
+     * @throws std::logic_error if SQLite is already initialized.
+     */
+    void install(page_cache_options const &options);
+
+    page_cache_stats stats();
+}
+
+#endif // DOCUDB_PAGE_CACHE_H
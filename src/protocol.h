@@ -0,0 +1,102 @@
+#pragma once
+
+#include "docudb.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifndef DOCUDB_PROTOCOL_H
+#define DOCUDB_PROTOCOL_H
+
+namespace docudb::remote::details
+{
+    /**
+     * @brief Request codes.
+     */
+    enum class opcode : std::uint8_t
+    {
+        ping = 1,
+        collection,
+        insert,
+        put,
+        get,
+        remove,
+        count,
+        find
+    };
+
+    /**
+     * @brief Response codes.
+     */
+    enum class status : std::uint8_t
+    {
+        ok = 0,
+        not_found,
+        error
+    };
+
+    /**
+     * @brief Larger frames are rejected, protecting both ends from a corrupted size prefix.
+     */
+    constexpr std::uint32_t max_frame_size = 64 * 1024 * 1024;
+
+    /**
+     * @brief A request or a response, sent as [u32 size][u32 id][u8 code][payload]
+     *        where size counts the bytes that follow it. Integers are little-endian.
+     */
+    struct frame
+    {
+        std::uint32_t id{0};
+        std::uint8_t code{0};
+        std::string payload;
+    };
+
+    /**
+     * @brief Appends payload fields. Strings are prefixed by their u32 size,
+     *        values by a tag: 0 null, 1 i64, 2 f64, 3 text.
+     */
+    struct encoder
+    {
+        std::string buffer;
+
+        encoder &u8(std::uint8_t v);
+        encoder &u32(std::uint32_t v);
+        encoder &u64(std::uint64_t v);
+        encoder &str(std::string_view v);
+        encoder &value(db_value const &v);
+    };
+
+    /**
+     * @brief Reads payload fields.
+     * @throws std::invalid_argument if the payload is truncated or malformed.
+     */
+    struct decoder
+    {
+        std::string_view data;
+        std::size_t pos = 0;
+
+        std::uint8_t u8();
+        std::uint32_t u32();
+        std::uint64_t u64();
+        std::string_view str();
+        db_value value();
+
+    private:
+        std::string_view take(std::size_t n);
+    };
+
+    /**
+     * @brief Reads a frame from a socket.
+     * @returns false if the peer closed the connection between two frames.
+     * @throws std::system_error on socket errors, std::invalid_argument on malformed frames.
+     */
+    bool read_frame(int fd, frame &f);
+
+    /**
+     * @brief Writes a frame to a socket.
+     * @throws std::system_error on socket errors.
+     */
+    void write_frame(int fd, frame const &f);
+}
+
+#endif // DOCUDB_PROTOCOL_H
@@ -0,0 +1,378 @@
+#include "docudb.hpp"
+#include <algorithm>
+#include <optional>
+#include <unordered_map>
+
+namespace docudb::query
+{
+    namespace
+    {
+        expression constant(bool value)
+        {
+            expression e;
+            e.type = expression::kind::constant;
+            e.value = value;
+            return e;
+        }
+
+        bool is_constant(expression const &e, bool value)
+        {
+            return e.type == expression::kind::constant && e.value == value;
+        }
+
+        bool is_numeric(db_value const &v)
+        {
+            return !std::holds_alternative<std::string>(v) && !std::holds_alternative<std::nullptr_t>(v);
+        }
+
+        bool is_integral(db_value const &v)
+        {
+            return std::holds_alternative<std::int32_t>(v) || std::holds_alternative<std::int64_t>(v);
+        }
+
+        // compares two values as SQLite does, nothing when they are of different kinds
+        std::optional<int> compare(db_value const &a, db_value const &b)
+        {
+            auto sign = [](auto x, auto y)
+            { return x < y ? -1 : (y < x ? 1 : 0); };
+
+            if (std::holds_alternative<std::string>(a) && std::holds_alternative<std::string>(b))
+                return sign(std::get<std::string>(a), std::get<std::string>(b));
+
+            if (!is_numeric(a) || !is_numeric(b))
+                return std::nullopt;
+
+            auto as_integer = [](db_value const &v) -> std::int64_t
+            { return std::visit([](auto x) -> std::int64_t
+                                { if constexpr (std::is_arithmetic_v<decltype(x)>) return static_cast<std::int64_t>(x); else return 0; }, v); };
+            auto as_real = [](db_value const &v) -> long double
+            { return std::visit([](auto x) -> long double
+                                { if constexpr (std::is_arithmetic_v<decltype(x)>) return static_cast<long double>(x); else return 0; }, v); };
+
+            if (is_integral(a) && is_integral(b))
+                return sign(as_integer(a), as_integer(b));
+            return sign(as_real(a), as_real(b));
+        }
+
+        // whether value OP bound holds, nothing when the values cannot be compared
+        std::optional<bool> holds(std::string const &op, db_value const &value, db_value const &bound)
+        {
+            auto c = compare(value, bound);
+            if (!c)
+                return std::nullopt;
+            if (op == "=")
+                return *c == 0;
+            if (op == "!=")
+                return *c != 0;
+            if (op == "<")
+                return *c < 0;
+            if (op == "<=")
+                return *c <= 0;
+            if (op == ">")
+                return *c > 0;
+            return *c >= 0;
+        }
+
+        bool same_value(db_value const &a, db_value const &b)
+        {
+            return a.index() == b.index() && a == b;
+        }
+
+        bool same_predicate(expression const &a, expression const &b)
+        {
+            if (a.type != expression::kind::predicate || b.type != expression::kind::predicate || a.target.empty())
+                return false;
+            if (a.target != b.target || a.op != b.op || a.parameters.size() != b.parameters.size())
+                return false;
+            return std::equal(a.parameters.begin(), a.parameters.end(), b.parameters.begin(), [](auto const &x, auto const &y)
+                              { return same_value(x.second, y.second); });
+        }
+
+        // json values have no affinity, unlike columns such as docid which would convert the bound values
+        bool is_comparison(expression const &e)
+        {
+            static const std::vector<std::string> ops{"=", "!=", "<", "<=", ">", ">="};
+            return e.type == expression::kind::predicate && e.target.starts_with("json_extract(") && e.parameters.size() == 1 &&
+                   std::find(ops.begin(), ops.end(), e.op) != ops.end();
+        }
+
+        void add_unique(std::vector<expression> &out, expression &&e)
+        {
+            if (std::none_of(out.begin(), out.end(), [&](auto const &x)
+                             { return same_predicate(x, e); }))
+                out.push_back(std::move(e));
+        }
+
+        expression group(expression::kind type, std::vector<expression> &&children, bool empty_value)
+        {
+            if (children.empty())
+                return constant(empty_value);
+            if (children.size() == 1)
+                return std::move(children.front());
+
+            expression e;
+            e.type = type;
+            e.children = std::move(children);
+            return e;
+        }
+
+        // merges the comparisons of each field within an AND
+        expression simplify_all(std::vector<expression> &&children)
+        {
+            std::vector<expression> out;
+            for (auto &c : children)
+            {
+                if (is_constant(c, false))
+                    return constant(false);
+                if (!is_constant(c, true))
+                    add_unique(out, std::move(c));
+            }
+
+            std::vector<bool> removed(out.size(), false);
+            std::unordered_map<std::string, std::vector<std::size_t>> fields;
+            for (std::size_t i = 0; i < out.size(); ++i)
+            {
+                if (is_comparison(out[i]))
+                    fields[out[i].target].push_back(i);
+            }
+
+            for (auto const &[target, members] : fields)
+            {
+                if (members.size() < 2)
+                    continue;
+
+                auto value = [&](std::size_t i) -> db_value const &
+                { return out[i].parameters.front().second; };
+
+                // only values of one kind are comparable with each other
+                auto text = std::holds_alternative<std::string>(value(members.front()));
+                if (std::any_of(members.begin(), members.end(), [&](auto i)
+                                { return std::holds_alternative<std::string>(value(i)) != text || std::holds_alternative<std::nullptr_t>(value(i)); }))
+                    continue;
+
+                auto eq = std::find_if(members.begin(), members.end(), [&](auto i)
+                                       { return out[i].op == "="; });
+                if (eq != members.end())
+                {
+                    // the equality decides every other comparison
+                    for (auto i : members)
+                    {
+                        if (i == *eq)
+                            continue;
+                        if (!*holds(out[i].op, value(*eq), value(i)))
+                            return constant(false);
+                        removed[i] = true;
+                    }
+                    continue;
+                }
+
+                std::optional<std::size_t> lower;
+                std::optional<std::size_t> upper;
+                for (auto i : members)
+                {
+                    auto const &op = out[i].op;
+                    if (op == ">" || op == ">=")
+                    {
+                        if (lower)
+                        {
+                            // keep the tightest bound, exclusive when equal
+                            auto c = *compare(value(i), value(*lower));
+                            auto tighter = c > 0 || (c == 0 && op == ">");
+                            removed[tighter ? *lower : i] = true;
+                            if (!tighter)
+                                continue;
+                        }
+                        lower = i;
+                    }
+                    else if (op == "<" || op == "<=")
+                    {
+                        if (upper)
+                        {
+                            auto c = *compare(value(i), value(*upper));
+                            auto tighter = c < 0 || (c == 0 && op == "<");
+                            removed[tighter ? *upper : i] = true;
+                            if (!tighter)
+                                continue;
+                        }
+                        upper = i;
+                    }
+                }
+
+                if (lower && upper)
+                {
+                    auto c = *compare(value(*lower), value(*upper));
+                    if (c > 0 || (c == 0 && (out[*lower].op == ">" || out[*upper].op == "<")))
+                        return constant(false);
+                }
+
+                // inequalities outside of the bounds are implied by them
+                for (auto i : members)
+                {
+                    if (out[i].op != "!=")
+                        continue;
+                    if ((lower && !*holds(out[*lower].op, value(i), value(*lower))) ||
+                        (upper && !*holds(out[*upper].op, value(i), value(*upper))))
+                        removed[i] = true;
+                }
+
+                if (lower && upper && out[*lower].op == ">=" && out[*upper].op == "<=")
+                {
+                    auto &between = out[*lower];
+                    auto &high = out[*upper];
+                    between.op = "BETWEEN";
+                    between.sql = std::format("({} BETWEEN ?{} AND ?{})", target, between.parameters.front().first, high.parameters.front().first);
+                    between.parameters.push_back(std::move(high.parameters.front()));
+                    removed[*upper] = true;
+                }
+            }
+
+            std::vector<expression> kept;
+            for (std::size_t i = 0; i < out.size(); ++i)
+            {
+                if (!removed[i])
+                    kept.push_back(std::move(out[i]));
+            }
+            return group(expression::kind::all_of, std::move(kept), true);
+        }
+
+        // merges the equalities of each field within an OR
+        expression simplify_any(std::vector<expression> &&children)
+        {
+            std::vector<expression> out;
+            for (auto &c : children)
+            {
+                if (is_constant(c, true))
+                    return constant(true);
+                if (!is_constant(c, false))
+                    add_unique(out, std::move(c));
+            }
+
+            auto is_equality = [](expression const &e)
+            {
+                return e.type == expression::kind::predicate && !e.target.empty() && !e.parameters.empty() &&
+                       ((e.op == "=" && e.parameters.size() == 1) || e.op == "IN");
+            };
+
+            std::vector<expression> kept;
+            std::unordered_map<std::string, std::size_t> in_lists;
+            for (auto &c : out)
+            {
+                if (!is_equality(c))
+                {
+                    kept.push_back(std::move(c));
+                    continue;
+                }
+
+                auto it = in_lists.find(c.target);
+                if (it == in_lists.end())
+                {
+                    in_lists.emplace(c.target, kept.size());
+                    kept.push_back(std::move(c));
+                    continue;
+                }
+
+                auto &list = kept[it->second];
+                for (auto &parameter : c.parameters)
+                {
+                    if (std::none_of(list.parameters.begin(), list.parameters.end(), [&](auto const &p)
+                                     { return same_value(p.second, parameter.second); }))
+                        list.parameters.push_back(std::move(parameter));
+                }
+                list.op = "IN";
+            }
+
+            for (auto const &[target, index] : in_lists)
+            {
+                auto &list = kept[index];
+                if (list.op != "IN")
+                    continue;
+
+                std::string placeholders;
+                for (auto const &[i, v] : list.parameters)
+                    placeholders += std::format("{}?{}", placeholders.empty() ? "" : ", ", i);
+                list.sql = std::format("({} IN ({}))", target, placeholders);
+            }
+
+            return group(expression::kind::any_of, std::move(kept), false);
+        }
+    }
+
+    expression expression::opaque(std::string const &sql, binder const &b)
+    {
+        expression e;
+        e.type = kind::predicate;
+        e.sql = std::format("({})", sql);
+        for (auto const &[index, value] : b.get_parameters())
+            e.parameters.emplace_back(index, value);
+        return e;
+    }
+
+    std::string expression::to_query_string() const
+    {
+        switch (type)
+        {
+        case kind::predicate:
+            return sql;
+        case kind::constant:
+            return value ? "1" : "0";
+        default:
+        {
+            std::string out = "(";
+            for (std::size_t i = 0; i < children.size(); ++i)
+            {
+                if (i > 0)
+                    out += type == kind::all_of ? " AND " : " OR ";
+                out += children[i].to_query_string();
+            }
+            return out + ")";
+        }
+        }
+    }
+
+    binder expression::get_binder() const
+    {
+        binder b;
+        for (auto const &[index, value] : parameters)
+            b.add(index, db_value{value});
+        for (auto const &child : children)
+        {
+            auto child_binder = child.get_binder();
+            b.merge(child_binder);
+        }
+        return b;
+    }
+
+    expression optimize(expression e)
+    {
+        if (e.type != expression::kind::all_of && e.type != expression::kind::any_of)
+            return e;
+
+        // flatten nested gates of the same kind first, so that all their predicates are merged together
+        std::vector<expression> children;
+        auto flatten = [&](auto &self, std::vector<expression> &nodes) -> void
+        {
+            for (auto &child : nodes)
+            {
+                if (child.type == e.type)
+                {
+                    self(self, child.children);
+                    continue;
+                }
+
+                auto optimized = optimize(std::move(child));
+                if (optimized.type == e.type)
+                {
+                    for (auto &grandchild : optimized.children)
+                        children.push_back(std::move(grandchild));
+                }
+                else
+                {
+                    children.push_back(std::move(optimized));
+                }
+            }
+        };
+        flatten(flatten, e.children);
+
+        return e.type == expression::kind::all_of ? simplify_all(std::move(children)) : simplify_any(std::move(children));
+    }
+}
@@ -0,0 +1,1028 @@
+#include "docudb_remote.hpp"
+#include "protocol.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std::string_view_literals;
+
+namespace docudb::remote::details
+{
+    // ENCODING
+
+    encoder &encoder::u8(std::uint8_t v)
+    {
+        buffer += static_cast<char>(v);
+        return *this;
+    }
+
+    encoder &encoder::u32(std::uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+            buffer += static_cast<char>((v >> (8 * i)) & 0xff);
+        return *this;
+    }
+
+    encoder &encoder::u64(std::uint64_t v)
+    {
+        for (int i = 0; i < 8; ++i)
+            buffer += static_cast<char>((v >> (8 * i)) & 0xff);
+        return *this;
+    }
+
+    encoder &encoder::str(std::string_view v)
+    {
+        u32(static_cast<std::uint32_t>(v.size()));
+        buffer += v;
+        return *this;
+    }
+
+    encoder &encoder::value(db_value const &v)
+    {
+        std::visit([this](auto const &val)
+                   {
+            using T = std::decay_t<decltype(val)>;
+            if constexpr (std::is_same_v<T, std::nullptr_t>)
+                u8(0);
+            else if constexpr (std::is_same_v<T, std::int32_t> || std::is_same_v<T, std::int64_t>)
+                u8(1).u64(static_cast<std::uint64_t>(static_cast<std::int64_t>(val)));
+            else if constexpr (std::is_same_v<T, std::string>)
+                u8(3).str(val);
+            else
+            {
+                auto d = static_cast<double>(val);
+                std::uint64_t bits;
+                std::memcpy(&bits, &d, sizeof(bits));
+                u8(2).u64(bits);
+            } }, v);
+        return *this;
+    }
+
+    std::string_view decoder::take(std::size_t n)
+    {
+        if (data.size() - pos < n)
+            throw std::invalid_argument("Truncated payload");
+        auto r = data.substr(pos, n);
+        pos += n;
+        return r;
+    }
+
+    std::uint8_t decoder::u8()
+    {
+        return static_cast<std::uint8_t>(take(1)[0]);
+    }
+
+    std::uint32_t decoder::u32()
+    {
+        auto bytes = take(4);
+        std::uint32_t v = 0;
+        for (int i = 0; i < 4; ++i)
+            v |= static_cast<std::uint32_t>(static_cast<std::uint8_t>(bytes[i])) << (8 * i);
+        return v;
+    }
+
+    std::uint64_t decoder::u64()
+    {
+        auto bytes = take(8);
+        std::uint64_t v = 0;
+        for (int i = 0; i < 8; ++i)
+            v |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(bytes[i])) << (8 * i);
+        return v;
+    }
+
+    std::string_view decoder::str()
+    {
+        return take(u32());
+    }
+
+    db_value decoder::value()
+    {
+        switch (u8())
+        {
+        case 0:
+            return nullptr;
+        case 1:
+            return static_cast<std::int64_t>(u64());
+        case 2:
+        {
+            auto bits = u64();
+            double d;
+            std::memcpy(&d, &bits, sizeof(d));
+            return d;
+        }
+        case 3:
+            return std::string{str()};
+        default:
+            throw std::invalid_argument("Unknown value tag");
+        }
+    }
+
+    // FRAMING
+
+    namespace
+    {
+#ifdef MSG_NOSIGNAL
+        constexpr int send_flags = MSG_NOSIGNAL;
+#else
+        constexpr int send_flags = 0;
+#endif
+
+        // a peer that went away must not raise SIGPIPE
+        int configure_socket(int fd)
+        {
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            return fd;
+        }
+
+        // returns false on end of stream before the first byte
+        bool read_all(int fd, char *data, std::size_t size)
+        {
+            std::size_t done = 0;
+            while (done < size)
+            {
+                auto n = ::recv(fd, data + done, size - done, 0);
+                if (n == 0)
+                {
+                    if (done == 0)
+                        return false;
+                    throw std::invalid_argument("Truncated frame");
+                }
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::system_error{errno, std::system_category(), "recv"};
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            return true;
+        }
+
+        void write_all(int fd, char const *data, std::size_t size)
+        {
+            while (size > 0)
+            {
+                auto n = ::send(fd, data, size, send_flags);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::system_error{errno, std::system_category(), "send"};
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+            }
+        }
+    }
+
+    bool read_frame(int fd, frame &f)
+    {
+        char header[9];
+        if (!read_all(fd, header, 4))
+            return false;
+        if (!read_all(fd, header + 4, 5))
+            throw std::invalid_argument("Truncated frame");
+
+        decoder d{std::string_view{header, sizeof(header)}};
+        auto size = d.u32();
+        if (size < 5 || size > max_frame_size)
+            throw std::invalid_argument("Invalid frame size");
+        f.id = d.u32();
+        f.code = d.u8();
+
+        f.payload.resize(size - 5);
+        if (!f.payload.empty() && !read_all(fd, f.payload.data(), f.payload.size()))
+            throw std::invalid_argument("Truncated frame");
+        return true;
+    }
+
+    void write_frame(int fd, frame const &f)
+    {
+        encoder e;
+        e.buffer.reserve(9 + f.payload.size());
+        e.u32(static_cast<std::uint32_t>(5 + f.payload.size())).u32(f.id).u8(f.code);
+        e.buffer += f.payload;
+        write_all(fd, e.buffer.data(), e.buffer.size());
+    }
+
+    namespace
+    {
+        sockaddr_un socket_address(std::string const &path)
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+                throw std::system_error{ENAMETOOLONG, std::system_category(), "Socket path too long"};
+            std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+            return addr;
+        }
+
+        int connect_socket(std::string const &path)
+        {
+            auto addr = socket_address(path);
+            auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0)
+                throw std::system_error{errno, std::system_category(), "socket"};
+            configure_socket(fd);
+            if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+            {
+                auto err = errno;
+                ::close(fd);
+                throw std::system_error{err, std::system_category(), "connect"};
+            }
+            return fd;
+        }
+
+        bool is_write(opcode op)
+        {
+            return op == opcode::collection || op == opcode::insert || op == opcode::put || op == opcode::remove;
+        }
+
+        void bind_values(docudb::details::sqlite::statement &stmt, decoder &d)
+        {
+            auto count = d.u32();
+            for (std::uint32_t i = 0; i < count; ++i)
+            {
+                auto index = static_cast<int>(d.u32());
+                auto v = d.value();
+                std::visit([&](auto &&val)
+                           { stmt.bind(index, val); }, v);
+            }
+        }
+
+        // statements compiled from a client's where clause must not modify the database
+        void bind_query(docudb::details::sqlite::statement &stmt, decoder &d)
+        {
+            if (!sqlite3_stmt_readonly(stmt.data()))
+                throw std::invalid_argument("Query is not read-only");
+            bind_values(stmt, d);
+        }
+
+        std::string where_clause(std::string_view where)
+        {
+            return where.empty() ? std::string{} : std::format(" WHERE {}", where);
+        }
+
+        // names are spliced into [] identifiers, which a ] would close; names with $ are the side
+        // tables of a collection (history, attachments) and are not served
+        std::string_view collection_name(decoder &d)
+        {
+            auto name = d.str();
+            if (name.empty() || name.find_first_of("]$") != std::string_view::npos)
+                throw std::invalid_argument("Invalid collection name");
+            return name;
+        }
+
+        status execute(sqlite3 *db, frame const &request, encoder &out)
+        {
+            decoder d{request.payload};
+
+            switch (static_cast<opcode>(request.code))
+            {
+            case opcode::ping:
+                return status::ok;
+            case opcode::collection:
+                docudb::details::open_collection(db, collection_name(d));
+                return status::ok;
+            case opcode::insert:
+            {
+                auto table = collection_name(d);
+                auto body = d.str();
+                auto doc_id = docudb::details::uuid::generate_uuid_v4();
+
+                docudb::details::sqlite::statement stmt{db, std::format("INSERT INTO [{}] (body) VALUES (json_set(?1, '$.docid', ?2));", table)};
+                stmt.bind(1, body).bind(2, doc_id).step();
+                if (stmt.result_code() != SQLITE_DONE)
+                    throw db_exception{db, "Failed to insert document"};
+
+                out.str(doc_id);
+                return status::ok;
+            }
+            case opcode::put:
+            {
+                auto table = collection_name(d);
+                auto doc_id = d.str();
+                auto body = d.str();
+
+                {
+                    docudb::details::sqlite::statement stmt{db, std::format("UPDATE [{}] SET body=json_set(?1, '$.docid', ?2) WHERE docid=?2;", table)};
+                    stmt.bind(1, body).bind(2, doc_id).step();
+                    if (stmt.result_code() != SQLITE_DONE)
+                        throw db_exception{db, "Failed to update document"};
+                }
+
+                if (sqlite3_changes(db) == 0)
+                {
+                    docudb::details::sqlite::statement stmt{db, std::format("INSERT INTO [{}] (body) VALUES (json_set(?1, '$.docid', ?2));", table)};
+                    stmt.bind(1, body).bind(2, doc_id).step();
+                    if (stmt.result_code() != SQLITE_DONE)
+                        throw db_exception{db, "Failed to insert document"};
+                }
+                return status::ok;
+            }
+            case opcode::get:
+            {
+                auto table = collection_name(d);
+                auto doc_id = d.str();
+
+                docudb::details::sqlite::statement stmt{db, std::format("SELECT body FROM [{}] WHERE docid=?1;", table)};
+                stmt.bind(1, doc_id).step();
+                if (stmt.result_code() == SQLITE_DONE)
+                    return status::not_found;
+                if (stmt.result_code() != SQLITE_ROW)
+                    throw db_exception{db, "Failed to read document"};
+
+                out.str(stmt.get<std::string>(0));
+                return status::ok;
+            }
+            case opcode::remove:
+            {
+                auto table = collection_name(d);
+                auto doc_id = d.str();
+
+                docudb::details::sqlite::statement stmt{db, std::format("DELETE FROM [{}] WHERE docid=?1;", table)};
+                stmt.bind(1, doc_id).step();
+                if (stmt.result_code() != SQLITE_DONE)
+                    throw db_exception{db, "Failed to delete document"};
+                return status::ok;
+            }
+            case opcode::count:
+            {
+                auto table = collection_name(d);
+                auto where = d.str();
+
+                docudb::details::sqlite::statement stmt{db, std::format("SELECT COUNT(*) FROM [{}]{};", table, where_clause(where))};
+                bind_query(stmt, d);
+                stmt.step();
+                if (stmt.result_code() != SQLITE_ROW)
+                    throw db_exception{db, "Failed to count collection"};
+
+                out.u64(static_cast<std::uint64_t>(stmt.get<std::int64_t>(0)));
+                return status::ok;
+            }
+            case opcode::find:
+            {
+                auto table = collection_name(d);
+                auto where = d.str();
+                docudb::details::sqlite::statement stmt{db, std::format("SELECT docid, body FROM [{}]{} LIMIT ?;", table, where_clause(where))};
+                bind_query(stmt, d);
+                auto limit = static_cast<std::int64_t>(d.u64());
+                // the limit follows the query parameters
+                stmt.bind(sqlite3_bind_parameter_count(stmt.data()), limit);
+
+                encoder rows;
+                std::uint32_t count = 0;
+                do
+                {
+                    stmt.step();
+                    if (stmt.result_code() == SQLITE_ROW)
+                    {
+                        rows.str(stmt.get<std::string>(0)).str(stmt.get<std::string>(1));
+                        count++;
+                    }
+                    else if (stmt.result_code() != SQLITE_DONE)
+                    {
+                        throw db_exception{db, "Failed to search documents"};
+                    }
+                } while (stmt.result_code() == SQLITE_ROW);
+
+                out.u32(count);
+                out.buffer += rows.buffer;
+                return status::ok;
+            }
+            }
+
+            throw std::invalid_argument("Unknown request");
+        }
+
+        frame respond(sqlite3 *db, frame const &request)
+        {
+            encoder out;
+            status code;
+            try
+            {
+                code = execute(db, request, out);
+            }
+            catch (std::exception const &e)
+            {
+                out.buffer.clear();
+                out.str(e.what());
+                code = status::error;
+            }
+            return frame{request.id, static_cast<std::uint8_t>(code), std::move(out.buffer)};
+        }
+
+        sqlite3 *open_connection(std::string const &path, int flags)
+        {
+            sqlite3 *db;
+            auto rc = sqlite3_open_v2(path.c_str(), &db, flags | SQLITE_OPEN_NOMUTEX, nullptr);
+            if (rc != SQLITE_OK)
+            {
+                db_exception e{db, "Can't open database"};
+                sqlite3_close(db);
+                throw e;
+            }
+            sqlite3_busy_timeout(db, 5000);
+            docudb::details::load_extensions(db);
+            return db;
+        }
+
+        void exec(sqlite3 *db, char const *sql)
+        {
+            if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK)
+                throw db_exception{db, std::format("Failed to execute {}", sql)};
+        }
+    }
+
+    // SERVER
+
+    struct connection
+    {
+        int fd;
+        std::mutex write_mutex;
+        // writes dispatched and not answered yet, reads wait behind them to observe them
+        std::atomic<int> pending_writes{0};
+        std::atomic<bool> done{false};
+        std::thread thread;
+
+        explicit connection(int fd) : fd(fd) {}
+
+        ~connection()
+        {
+            ::close(fd);
+        }
+
+        void reply(frame const &f)
+        {
+            std::lock_guard lock{write_mutex};
+            try
+            {
+                write_frame(fd, f);
+            }
+            catch (std::system_error const &)
+            {
+                // the client went away, its connection thread cleans up
+            }
+        }
+    };
+
+    struct task
+    {
+        std::shared_ptr<connection> conn;
+        frame request;
+    };
+
+    struct task_queue
+    {
+        void push(task &&t)
+        {
+            {
+                std::lock_guard lock{mutex};
+                tasks.push_back(std::move(t));
+            }
+            cv.notify_one();
+        }
+
+        // waits for a task, then takes up to max tasks; returns false once closed and drained
+        bool pop(std::vector<task> &out, std::size_t max)
+        {
+            std::unique_lock lock{mutex};
+            cv.wait(lock, [this]
+                    { return closed || !tasks.empty(); });
+            if (tasks.empty())
+                return false;
+
+            while (!tasks.empty() && out.size() < max)
+            {
+                out.push_back(std::move(tasks.front()));
+                tasks.pop_front();
+            }
+            return true;
+        }
+
+        void close()
+        {
+            {
+                std::lock_guard lock{mutex};
+                closed = true;
+            }
+            cv.notify_all();
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<task> tasks;
+        bool closed = false;
+    };
+
+    struct server_state
+    {
+        server_options options;
+        sqlite3 *writer_db = nullptr;
+        std::vector<sqlite3 *> reader_dbs;
+        int listen_fd = -1;
+        int wake_pipe[2] = {-1, -1};
+
+        task_queue writes;
+        task_queue reads;
+
+        std::mutex connections_mutex;
+        std::vector<std::shared_ptr<connection>> connections;
+
+        mutable std::mutex stats_mutex;
+        server_stats stats;
+
+        ~server_state()
+        {
+            if (listen_fd >= 0)
+            {
+                ::close(listen_fd);
+                ::unlink(options.socket_path.c_str());
+            }
+            for (auto fd : wake_pipe)
+                if (fd >= 0)
+                    ::close(fd);
+            for (auto db : reader_dbs)
+                sqlite3_close(db);
+            sqlite3_close(writer_db);
+        }
+
+        void serve_connection(std::shared_ptr<connection> conn)
+        {
+            try
+            {
+                frame request;
+                while (read_frame(conn->fd, request))
+                {
+                    {
+                        std::lock_guard lock{stats_mutex};
+                        stats.requests++;
+                    }
+
+                    if (is_write(static_cast<opcode>(request.code)))
+                    {
+                        conn->pending_writes++;
+                        writes.push({conn, std::move(request)});
+                    }
+                    else if (conn->pending_writes > 0)
+                    {
+                        // read-your-writes: the writer runs it after the writes it follows
+                        writes.push({conn, std::move(request)});
+                    }
+                    else
+                    {
+                        reads.push({conn, std::move(request)});
+                    }
+                    request = frame{};
+                }
+            }
+            catch (std::exception const &)
+            {
+                // malformed frame or socket error, drop the client
+                ::shutdown(conn->fd, SHUT_RDWR);
+            }
+            conn->done = true;
+        }
+
+        void write_loop()
+        {
+            std::vector<task> batch;
+            std::vector<frame> responses;
+            while (writes.pop(batch, options.max_batch))
+            {
+                responses.clear();
+                try
+                {
+                    // each request gets a savepoint, so that a failed one does not roll back the batch
+                    exec(writer_db, "BEGIN IMMEDIATE;");
+                    for (auto const &t : batch)
+                    {
+                        exec(writer_db, "SAVEPOINT request;");
+                        responses.push_back(respond(writer_db, t.request));
+                        if (responses.back().code == static_cast<std::uint8_t>(status::error))
+                            exec(writer_db, "ROLLBACK TO request;");
+                        exec(writer_db, "RELEASE request;");
+                    }
+                    exec(writer_db, "COMMIT;");
+                }
+                catch (db_exception const &e)
+                {
+                    if (!sqlite3_get_autocommit(writer_db))
+                        sqlite3_exec(writer_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+
+                    encoder message;
+                    message.str(e.what());
+                    responses.clear();
+                    for (auto const &t : batch)
+                        responses.push_back(frame{t.request.id, static_cast<std::uint8_t>(status::error), message.buffer});
+                }
+
+                {
+                    std::lock_guard lock{stats_mutex};
+                    stats.batches++;
+                    stats.batched_requests += batch.size();
+                }
+
+                // answer once committed, then let the reads that follow through
+                for (std::size_t i = 0; i < batch.size(); ++i)
+                {
+                    batch[i].conn->reply(responses[i]);
+                    if (is_write(static_cast<opcode>(batch[i].request.code)))
+                        batch[i].conn->pending_writes--;
+                }
+                batch.clear();
+            }
+        }
+
+        void read_loop(sqlite3 *db)
+        {
+            std::vector<task> batch;
+            while (reads.pop(batch, 1))
+            {
+                batch.front().conn->reply(respond(db, batch.front().request));
+                batch.clear();
+            }
+        }
+
+        void reap_connections()
+        {
+            std::lock_guard lock{connections_mutex};
+            std::erase_if(connections, [](auto const &conn)
+                          {
+                if (!conn->done)
+                    return false;
+                conn->thread.join();
+                return true; });
+        }
+    };
+}
+
+namespace docudb::remote
+{
+    using details::decoder;
+    using details::encoder;
+    using details::frame;
+    using details::opcode;
+    using details::status;
+
+    // SERVER
+
+    server::server(server_options const &options) : state(std::make_unique<details::server_state>())
+    {
+        state->options = options;
+        if (state->options.readers < 1)
+            state->options.readers = 1;
+        if (state->options.max_batch < 1)
+            state->options.max_batch = 1;
+
+        state->writer_db = details::open_connection(options.database_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        details::exec(state->writer_db, "PRAGMA journal_mode=WAL;");
+        details::exec(state->writer_db, options.synchronous == synchronous_mode::normal ? "PRAGMA synchronous=NORMAL;" : "PRAGMA synchronous=FULL;");
+
+        for (int i = 0; i < state->options.readers; ++i)
+            state->reader_dbs.push_back(details::open_connection(options.database_path, SQLITE_OPEN_READONLY));
+
+        // a socket that accepts connections belongs to a running server, otherwise it is stale
+        try
+        {
+            ::close(details::connect_socket(options.socket_path));
+            throw std::system_error{EADDRINUSE, std::system_category(), "Socket in use by another server"};
+        }
+        catch (std::system_error const &e)
+        {
+            if (e.code().value() == EADDRINUSE)
+                throw;
+        }
+        ::unlink(options.socket_path.c_str());
+
+        auto addr = details::socket_address(options.socket_path);
+        auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw std::system_error{errno, std::system_category(), "socket"};
+        details::configure_socket(fd);
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            auto err = errno;
+            ::close(fd);
+            throw std::system_error{err, std::system_category(), "bind"};
+        }
+        state->listen_fd = fd;
+
+        // the socket is closed with the state
+        if (::chmod(options.socket_path.c_str(), S_IRUSR | S_IWUSR) < 0)
+            throw std::system_error{errno, std::system_category(), "chmod"};
+        if (::listen(fd, SOMAXCONN) < 0 || ::pipe(state->wake_pipe) < 0)
+            throw std::system_error{errno, std::system_category(), "listen"};
+    }
+
+    server::~server() = default;
+
+    void server::run()
+    {
+        std::thread writer{[this]
+                           { state->write_loop(); }};
+        std::vector<std::thread> readers;
+        for (auto db : state->reader_dbs)
+            readers.emplace_back([this, db]
+                                 { state->read_loop(db); });
+
+        pollfd fds[2] = {{state->listen_fd, POLLIN, 0}, {state->wake_pipe[0], POLLIN, 0}};
+        while (true)
+        {
+            if (::poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            if (fds[1].revents)
+                break;
+            if (!(fds[0].revents & POLLIN))
+                continue;
+
+            auto fd = ::accept(state->listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            details::configure_socket(fd);
+
+            state->reap_connections();
+
+            auto conn = std::make_shared<details::connection>(fd);
+            {
+                std::lock_guard lock{state->stats_mutex};
+                state->stats.connections++;
+            }
+            std::lock_guard lock{state->connections_mutex};
+            conn->thread = std::thread{[this, conn]
+                                       { state->serve_connection(conn); }};
+            state->connections.push_back(std::move(conn));
+        }
+
+        // stop reading requests, then drain the queues
+        {
+            std::lock_guard lock{state->connections_mutex};
+            for (auto &conn : state->connections)
+            {
+                ::shutdown(conn->fd, SHUT_RD);
+                conn->thread.join();
+            }
+        }
+
+        state->writes.close();
+        state->reads.close();
+        writer.join();
+        for (auto &t : readers)
+            t.join();
+
+        std::lock_guard lock{state->connections_mutex};
+        state->connections.clear();
+    }
+
+    void server::stop()
+    {
+        char c = 0;
+        [[maybe_unused]] auto n = ::write(state->wake_pipe[1], &c, 1);
+    }
+
+    server_stats server::statistics() const
+    {
+        std::lock_guard lock{state->stats_mutex};
+        return state->stats;
+    }
+}
+
+namespace docudb::remote::details
+{
+    // CLIENT
+
+    struct client_connection
+    {
+        int fd;
+        std::mutex write_mutex;
+        std::mutex pending_mutex;
+        std::unordered_map<std::uint32_t, std::promise<frame>> pending;
+        std::uint32_t next_id = 0;
+        bool closed = false;
+        std::thread receiver;
+
+        explicit client_connection(std::string const &socket_path) : fd(connect_socket(socket_path))
+        {
+            receiver = std::thread{[this]
+                                   { receive(); }};
+        }
+
+        ~client_connection()
+        {
+            ::shutdown(fd, SHUT_RDWR);
+            receiver.join();
+            ::close(fd);
+        }
+
+        std::future<frame> send(opcode op, std::string payload)
+        {
+            std::future<frame> result;
+            frame request{0, static_cast<std::uint8_t>(op), std::move(payload)};
+            {
+                std::lock_guard lock{pending_mutex};
+                if (closed)
+                    throw remote_exception{"Connection closed"};
+                request.id = next_id++;
+                result = pending[request.id].get_future();
+            }
+
+            std::lock_guard lock{write_mutex};
+            write_frame(fd, request);
+            return result;
+        }
+
+        void receive()
+        {
+            try
+            {
+                frame response;
+                while (read_frame(fd, response))
+                {
+                    std::lock_guard lock{pending_mutex};
+                    auto it = pending.find(response.id);
+                    if (it != pending.end())
+                    {
+                        it->second.set_value(std::move(response));
+                        pending.erase(it);
+                    }
+                    response = frame{};
+                }
+            }
+            catch (std::exception const &)
+            {
+            }
+
+            std::lock_guard lock{pending_mutex};
+            closed = true;
+            for (auto &[id, promise] : pending)
+                promise.set_exception(std::make_exception_ptr(remote_exception{"Connection closed"}));
+            pending.clear();
+        }
+    };
+
+    namespace
+    {
+        // waits for the response, throwing the error reported by the server
+        frame result(std::future<frame> &f)
+        {
+            auto response = f.get();
+            if (response.code == static_cast<std::uint8_t>(status::error))
+            {
+                decoder d{response.payload};
+                throw remote_exception{std::string{d.str()}};
+            }
+            return response;
+        }
+
+        template <typename F>
+        auto deferred(std::future<frame> f, F &&decode)
+        {
+            return std::async(std::launch::deferred, [f = std::move(f), decode = std::forward<F>(decode)]() mutable
+                              { return decode(result(f)); });
+        }
+
+        void encode_query(encoder &e, query::queryable_type_eraser const &q)
+        {
+            auto binder = q.get_binder();
+            auto const &parameters = binder.get_parameters();
+            e.str(q.to_query_string()).u32(static_cast<std::uint32_t>(parameters.size()));
+            for (auto const &[index, value] : parameters)
+                e.u32(static_cast<std::uint32_t>(index)).value(value);
+        }
+    }
+}
+
+namespace docudb::remote
+{
+    // CLIENT
+
+    client::client(std::string_view socket_path) : connection(std::make_unique<details::client_connection>(std::string{socket_path})) {}
+
+    client::~client() = default;
+
+    remote_collection client::collection(std::string_view name)
+    {
+        auto f = connection->send(opcode::collection, encoder{}.str(name).buffer);
+        details::result(f);
+        return remote_collection{name, connection.get()};
+    }
+
+    void client::ping()
+    {
+        auto f = connection->send(opcode::ping, {});
+        details::result(f);
+    }
+
+    // REMOTE COLLECTION
+
+    remote_collection::remote_collection(std::string_view name, details::client_connection *connection) : collection_name(name), connection(connection) {}
+
+    std::string remote_collection::name() const
+    {
+        return collection_name;
+    }
+
+    std::future<std::string> remote_collection::insert_async(std::string_view body)
+    {
+        auto f = connection->send(opcode::insert, encoder{}.str(collection_name).str(body).buffer);
+        return details::deferred(std::move(f), [](frame const &r)
+                                 { return std::string{decoder{r.payload}.str()}; });
+    }
+
+    std::string remote_collection::insert(std::string_view body)
+    {
+        return insert_async(body).get();
+    }
+
+    std::future<void> remote_collection::put_async(std::string_view doc_id, std::string_view body)
+    {
+        auto f = connection->send(opcode::put, encoder{}.str(collection_name).str(doc_id).str(body).buffer);
+        return details::deferred(std::move(f), [](frame const &) {});
+    }
+
+    void remote_collection::put(std::string_view doc_id, std::string_view body)
+    {
+        put_async(doc_id, body).get();
+    }
+
+    std::future<std::optional<std::string>> remote_collection::get_async(std::string_view doc_id)
+    {
+        auto f = connection->send(opcode::get, encoder{}.str(collection_name).str(doc_id).buffer);
+        return details::deferred(std::move(f), [](frame const &r) -> std::optional<std::string>
+                                 {
+            if (r.code == static_cast<std::uint8_t>(status::not_found))
+                return std::nullopt;
+            return std::string{decoder{r.payload}.str()}; });
+    }
+
+    std::optional<std::string> remote_collection::get(std::string_view doc_id)
+    {
+        return get_async(doc_id).get();
+    }
+
+    std::future<void> remote_collection::remove_async(std::string_view doc_id)
+    {
+        auto f = connection->send(opcode::remove, encoder{}.str(collection_name).str(doc_id).buffer);
+        return details::deferred(std::move(f), [](frame const &) {});
+    }
+
+    void remote_collection::remove(std::string_view doc_id)
+    {
+        remove_async(doc_id).get();
+    }
+
+    std::size_t remote_collection::count()
+    {
+        auto f = connection->send(opcode::count, encoder{}.str(collection_name).str("").u32(0).buffer);
+        return static_cast<std::size_t>(decoder{details::result(f).payload}.u64());
+    }
+
+    std::size_t remote_collection::count(query::queryable_type_eraser q)
+    {
+        encoder e;
+        e.str(collection_name);
+        details::encode_query(e, q);
+        auto f = connection->send(opcode::count, std::move(e.buffer));
+        return static_cast<std::size_t>(decoder{details::result(f).payload}.u64());
+    }
+
+    std::vector<remote_document> remote_collection::find(query::queryable_type_eraser q, std::optional<int> limit)
+    {
+        encoder e;
+        e.str(collection_name);
+        details::encode_query(e, q);
+        // a negative limit means no limit to SQLite
+        e.u64(static_cast<std::uint64_t>(static_cast<std::int64_t>(limit.value_or(-1))));
+        auto f = connection->send(opcode::find, std::move(e.buffer));
+
+        auto response = details::result(f);
+        decoder d{response.payload};
+        std::vector<remote_document> docs(d.u32());
+        for (auto &doc : docs)
+        {
+            doc.id = d.str();
+            doc.body = d.str();
+        }
+        return docs;
+    }
+}
@@ -0,0 +1,298 @@
+#include "sketch.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <numbers>
+#include <stdexcept>
+
+namespace docudb::details::sketch
+{
+    namespace
+    {
+        constexpr std::uint8_t version = 1;
+
+        void put_u32(std::string &out, std::uint32_t v)
+        {
+            for (int i = 0; i < 4; ++i)
+                out += static_cast<char>((v >> (8 * i)) & 0xff);
+        }
+
+        void put_f64(std::string &out, double v)
+        {
+            auto bits = std::bit_cast<std::uint64_t>(v);
+            for (int i = 0; i < 8; ++i)
+                out += static_cast<char>((bits >> (8 * i)) & 0xff);
+        }
+
+        struct reader
+        {
+            std::string_view data;
+            std::size_t pos = 0;
+
+            std::string_view take(std::size_t n)
+            {
+                if (data.size() - pos < n)
+                    throw std::invalid_argument("Truncated sketch");
+                auto out = data.substr(pos, n);
+                pos += n;
+                return out;
+            }
+
+            std::uint8_t u8()
+            {
+                return static_cast<std::uint8_t>(take(1)[0]);
+            }
+
+            std::uint32_t u32()
+            {
+                auto bytes = take(4);
+                std::uint32_t v = 0;
+                for (int i = 3; i >= 0; --i)
+                    v = (v << 8) | static_cast<std::uint8_t>(bytes[i]);
+                return v;
+            }
+
+            double f64()
+            {
+                auto bytes = take(8);
+                std::uint64_t v = 0;
+                for (int i = 7; i >= 0; --i)
+                    v = (v << 8) | static_cast<std::uint8_t>(bytes[i]);
+                return std::bit_cast<double>(v);
+            }
+        };
+    }
+
+    // HYPERLOGLOG
+
+    hyperloglog::hyperloglog() : registers_(std::size_t{1} << precision) {}
+
+    void hyperloglog::add_hash(std::uint64_t hash)
+    {
+        auto index = hash >> (64 - precision);
+        // the guard bit bounds the rank when the remaining bits are all zero
+        auto rest = (hash << precision) | (std::uint64_t{1} << (precision - 1));
+        auto rank = static_cast<std::uint8_t>(std::countl_zero(rest) + 1);
+        registers_[index] = std::max(registers_[index], rank);
+    }
+
+    void hyperloglog::merge(hyperloglog const &other)
+    {
+        for (std::size_t i = 0; i < registers_.size(); ++i)
+            registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+
+    double hyperloglog::estimate() const
+    {
+        auto m = static_cast<double>(registers_.size());
+        double sum = 0;
+        std::size_t zeros = 0;
+        for (auto r : registers_)
+        {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+
+        auto alpha = 0.7213 / (1 + 1.079 / m);
+        auto raw = alpha * m * m / sum;
+
+        // small cardinalities are better served by linear counting
+        if (raw <= 2.5 * m && zeros > 0)
+            return m * std::log(m / static_cast<double>(zeros));
+        return raw;
+    }
+
+    std::string hyperloglog::serialize() const
+    {
+        std::string out;
+        out.reserve(3 + registers_.size());
+        out += 'H';
+        out += static_cast<char>(version);
+        out += static_cast<char>(precision);
+        out.append(reinterpret_cast<const char *>(registers_.data()), registers_.size());
+        return out;
+    }
+
+    hyperloglog hyperloglog::deserialize(std::string_view data)
+    {
+        reader in{data};
+        if (in.u8() != 'H' || in.u8() != version || in.u8() != precision)
+            throw std::invalid_argument("Not a HyperLogLog sketch");
+
+        hyperloglog h;
+        auto registers = in.take(h.registers_.size());
+        if (in.pos != data.size())
+            throw std::invalid_argument("Not a HyperLogLog sketch");
+        std::copy(registers.begin(), registers.end(), h.registers_.begin());
+        return h;
+    }
+
+    // T-DIGEST
+
+    tdigest::tdigest(double compression)
+        : compression_(compression),
+          min_(std::numeric_limits<double>::infinity()),
+          max_(-std::numeric_limits<double>::infinity())
+    {
+    }
+
+    void tdigest::add(double value, double weight)
+    {
+        if (std::isnan(value) || !(weight > 0))
+            return;
+
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+        buffer_.push_back({value, weight});
+        if (buffer_.size() >= static_cast<std::size_t>(5 * compression_))
+            compress();
+    }
+
+    void tdigest::merge(tdigest const &other)
+    {
+        other.compress();
+        for (auto const &c : other.centroids_)
+            buffer_.push_back(c);
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+        compress();
+    }
+
+    void tdigest::compress() const
+    {
+        if (buffer_.empty())
+            return;
+
+        buffer_.insert(buffer_.end(), centroids_.begin(), centroids_.end());
+        std::sort(buffer_.begin(), buffer_.end(), [](auto const &a, auto const &b)
+                  { return a.mean < b.mean; });
+
+        double total = 0;
+        for (auto const &c : buffer_)
+            total += c.weight;
+
+        // k1 scale function: clusters are small near the tails and large around the median
+        auto k = [&](double q)
+        { return compression_ / (2 * std::numbers::pi) * std::asin(2 * q - 1); };
+        auto k_inverse = [&](double v)
+        { return (std::sin(std::clamp(v * 2 * std::numbers::pi / compression_, -std::numbers::pi / 2, std::numbers::pi / 2)) + 1) / 2; };
+
+        centroids_.clear();
+        auto current = buffer_.front();
+        double weight_so_far = 0;
+        auto limit = total * k_inverse(k(0) + 1);
+        for (std::size_t i = 1; i < buffer_.size(); ++i)
+        {
+            auto const &next = buffer_[i];
+            if (weight_so_far + current.weight + next.weight <= limit)
+            {
+                current.weight += next.weight;
+                current.mean += (next.mean - current.mean) * next.weight / current.weight;
+            }
+            else
+            {
+                weight_so_far += current.weight;
+                centroids_.push_back(current);
+                limit = total * k_inverse(k(std::min(weight_so_far / total, 1.0)) + 1);
+                current = next;
+            }
+        }
+        centroids_.push_back(current);
+        buffer_.clear();
+    }
+
+    double tdigest::count() const
+    {
+        double total = 0;
+        for (auto const &c : centroids_)
+            total += c.weight;
+        for (auto const &c : buffer_)
+            total += c.weight;
+        return total;
+    }
+
+    double tdigest::quantile(double q) const
+    {
+        compress();
+        if (centroids_.empty())
+            return std::numeric_limits<double>::quiet_NaN();
+        if (q <= 0)
+            return min_;
+        if (q >= 1)
+            return max_;
+        if (centroids_.size() == 1)
+            return centroids_.front().mean;
+
+        auto index = q * count();
+
+        // each centroid's weight is centered on its mean, the ends interpolate to min and max
+        auto const &first = centroids_.front();
+        if (index < first.weight / 2)
+            return min_ + (first.mean - min_) * index / (first.weight / 2);
+
+        auto weight_so_far = first.weight / 2;
+        for (std::size_t i = 0; i + 1 < centroids_.size(); ++i)
+        {
+            auto const &a = centroids_[i];
+            auto const &b = centroids_[i + 1];
+            auto step = (a.weight + b.weight) / 2;
+            if (weight_so_far + step > index)
+                return a.mean + (b.mean - a.mean) * (index - weight_so_far) / step;
+            weight_so_far += step;
+        }
+
+        auto const &last = centroids_.back();
+        auto t = std::min((index - weight_so_far) / (last.weight / 2), 1.0);
+        return last.mean + (max_ - last.mean) * t;
+    }
+
+    std::string tdigest::serialize() const
+    {
+        compress();
+
+        std::string out;
+        out.reserve(31 + centroids_.size() * 16);
+        out += 'T';
+        out += static_cast<char>(version);
+        put_f64(out, compression_);
+        put_f64(out, min_);
+        put_f64(out, max_);
+        put_u32(out, static_cast<std::uint32_t>(centroids_.size()));
+        for (auto const &c : centroids_)
+        {
+            put_f64(out, c.mean);
+            put_f64(out, c.weight);
+        }
+        return out;
+    }
+
+    tdigest tdigest::deserialize(std::string_view data)
+    {
+        reader in{data};
+        if (in.u8() != 'T' || in.u8() != version)
+            throw std::invalid_argument("Not a t-digest sketch");
+
+        auto compression = in.f64();
+        if (!(compression >= 10 && compression <= 10000))
+            throw std::invalid_argument("Not a t-digest sketch");
+
+        tdigest t{compression};
+        t.min_ = in.f64();
+        t.max_ = in.f64();
+        auto n = in.u32();
+        if (n > (data.size() - in.pos) / 16)
+            throw std::invalid_argument("Truncated sketch");
+
+        t.centroids_.reserve(n);
+        for (std::uint32_t i = 0; i < n; ++i)
+        {
+            auto mean = in.f64();
+            auto weight = in.f64();
+            t.centroids_.push_back({mean, weight});
+        }
+        if (in.pos != data.size())
+            throw std::invalid_argument("Not a t-digest sketch");
+        return t;
+    }
+}
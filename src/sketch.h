@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef DOCUDB_SKETCH_H
+#define DOCUDB_SKETCH_H
+
+namespace docudb::details::sketch
+{
+    /**
+     * @brief HyperLogLog distinct counter over 64-bit hashes, 2^14 one-byte registers
+     *        for a standard error of about 0.8%.
+     */
+    struct hyperloglog
+    {
+        static constexpr int precision = 14;
+
+        hyperloglog();
+
+        void add_hash(std::uint64_t hash);
+        void merge(hyperloglog const &other);
+        double estimate() const;
+
+        /**
+         * @brief Serializes the sketch as [u8 'H'][u8 version][u8 precision][registers].
+         */
+        std::string serialize() const;
+
+        /**
+         * @throws std::invalid_argument if the data is not a serialized hyperloglog.
+         */
+        static hyperloglog deserialize(std::string_view data);
+
+    private:
+        std::vector<std::uint8_t> registers_;
+    };
+
+    /**
+     * @brief Merging t-digest (Dunning), estimating quantiles with an error that shrinks
+     *        towards the tails. Values are buffered and merged into at most about
+     *        `compression` centroids.
+     */
+    struct tdigest
+    {
+        explicit tdigest(double compression = 100);
+
+        void add(double value, double weight = 1);
+        void merge(tdigest const &other);
+
+        /**
+         * @brief Estimates the value at rank q * count(), interpolating between centroids.
+         * @returns NaN if the digest is empty.
+         */
+        double quantile(double q) const;
+        double count() const;
+
+        /**
+         * @brief Serializes the digest as [u8 'T'][u8 version][f64 compression][f64 min][f64 max]
+         *        [u32 n][n * (f64 mean, f64 weight)], little-endian.
+         */
+        std::string serialize() const;
+
+        /**
+         * @throws std::invalid_argument if the data is not a serialized t-digest.
+         */
+        static tdigest deserialize(std::string_view data);
+
+    private:
+        struct centroid
+        {
+            double mean;
+            double weight;
+        };
+
+        void compress() const;
+
+        double compression_;
+        double min_;
+        double max_;
+        // merged lazily, so that reads stay const
+        mutable std::vector<centroid> centroids_;
+        mutable std::vector<centroid> buffer_;
+    };
+}
+
+#endif // DOCUDB_SKETCH_H
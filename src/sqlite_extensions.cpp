@@ -1,6 +1,19 @@
 #include "sqlite_extensions.h"
+#include "docudb.hpp"
+#include "json.h"
+#include "hash.h"
+#include "sketch.h"
 #include <regex>
 #include <string>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <new>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace std::string_literals;
 
@@ -54,4 +67,586 @@ void sqlite_regexp_func(sqlite3_context* context, int argc, sqlite3_value** argv
         std::string errorMsg = "REGEXP unexpected error: "s + e.what();
         sqlite3_result_error(context, errorMsg.c_str(), errorMsg.length());
     }
-}
\ No newline at end of file
+}
+// SUBSTRING SEARCH
+
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DOCUDB_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define DOCUDB_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+namespace
+{
+    using search_func = const char *(*)(const char *text, size_t n, const char *needle, size_t m, bool nocase);
+
+    inline int count_trailing_zeros(unsigned mask)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    inline unsigned char fold(unsigned char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    // compares text with a needle already folded to lower case when nocase is set
+    inline bool equal(const char *text, const char *needle, size_t n, bool nocase)
+    {
+        if (!nocase)
+            return std::memcmp(text, needle, n) == 0;
+        for (size_t i = 0; i < n; ++i)
+            if (fold(static_cast<unsigned char>(text[i])) != static_cast<unsigned char>(needle[i]))
+                return false;
+        return true;
+    }
+
+    const char *search_scalar(const char *text, size_t n, const char *needle, size_t m, bool nocase)
+    {
+        if (m == 0)
+            return text;
+        for (size_t i = 0; i + m <= n; ++i)
+            if (equal(text + i, needle, m, nocase))
+                return text + i;
+        return nullptr;
+    }
+
+#ifdef DOCUDB_SSE2
+    inline __m128i fold_sse2(__m128i x)
+    {
+        // signed compares: bytes >= 0x80 are negative and never in 'A'..'Z'
+        auto upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+        return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    }
+
+    // compares the first and last needle bytes at 16 positions at once, then verifies the candidates
+    const char *search_sse2(const char *text, size_t n, const char *needle, size_t m, bool nocase)
+    {
+        if (m < 2 || n < m + 15)
+            return search_scalar(text, n, needle, m, nocase);
+
+        auto first = _mm_set1_epi8(needle[0]);
+        auto last = _mm_set1_epi8(needle[m - 1]);
+
+        size_t i = 0;
+        for (; i + m + 15 <= n; i += 16)
+        {
+            auto block_first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+            auto block_last = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i + m - 1));
+            if (nocase)
+            {
+                block_first = fold_sse2(block_first);
+                block_last = fold_sse2(block_last);
+            }
+
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last))));
+            while (mask)
+            {
+                auto bit = count_trailing_zeros(mask);
+                if (equal(text + i + bit + 1, needle + 1, m - 2, nocase))
+                    return text + i + bit;
+                mask &= mask - 1;
+            }
+        }
+
+        return search_scalar(text + i, n - i, needle, m, nocase);
+    }
+#endif
+
+#ifdef DOCUDB_AVX2
+    __attribute__((target("avx2"))) inline __m256i fold_avx2(__m256i x)
+    {
+        auto upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+        return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+    }
+
+    __attribute__((target("avx2"))) const char *search_avx2(const char *text, size_t n, const char *needle, size_t m, bool nocase)
+    {
+        if (m < 2 || n < m + 31)
+            return search_sse2(text, n, needle, m, nocase);
+
+        auto first = _mm256_set1_epi8(needle[0]);
+        auto last = _mm256_set1_epi8(needle[m - 1]);
+
+        size_t i = 0;
+        for (; i + m + 31 <= n; i += 32)
+        {
+            auto block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+            auto block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i + m - 1));
+            if (nocase)
+            {
+                block_first = fold_avx2(block_first);
+                block_last = fold_avx2(block_last);
+            }
+
+            auto mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last))));
+            while (mask)
+            {
+                auto bit = count_trailing_zeros(mask);
+                if (equal(text + i + bit + 1, needle + 1, m - 2, nocase))
+                    return text + i + bit;
+                mask &= mask - 1;
+            }
+        }
+
+        return search_sse2(text + i, n - i, needle, m, nocase);
+    }
+#endif
+
+    search_func select_search()
+    {
+#if defined(DOCUDB_AVX2)
+        if (__builtin_cpu_supports("avx2"))
+            return search_avx2;
+#endif
+#if defined(DOCUDB_SSE2)
+        return search_sse2;
+#else
+        return search_scalar;
+#endif
+    }
+
+    const search_func search = select_search();
+
+    // LIKE
+
+    // above any code point
+    constexpr unsigned no_escape = 0xffffffff;
+
+    // decodes one UTF-8 character, leniently: invalid sequences are read byte by byte
+    unsigned next_char(const unsigned char *&p, const unsigned char *end)
+    {
+        unsigned c = *p++;
+        if (c < 0xc0)
+            return c;
+
+        int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+        c &= 0x3f >> extra;
+        while (extra-- > 0 && p < end && (*p & 0xc0) == 0x80)
+            c = (c << 6) | (*p++ & 0x3f);
+        return c;
+    }
+
+    inline unsigned fold_char(unsigned c)
+    {
+        return c < 0x80 ? fold(static_cast<unsigned char>(c)) : c;
+    }
+
+    // general matcher, for patterns with '_'; LIKE folds ASCII letters only
+    bool like_match(const unsigned char *p, const unsigned char *pend, const unsigned char *s, const unsigned char *send, unsigned escape)
+    {
+        while (p < pend)
+        {
+            auto c = next_char(p, pend);
+            if (c == escape)
+            {
+                if (p == pend)
+                    return false;
+                c = next_char(p, pend);
+            }
+            else if (c == '%')
+            {
+                // collapse runs of wildcards, each '_' still consumes a character
+                while (p < pend && (*p == '%' || *p == '_') && *p != escape)
+                {
+                    if (*p++ == '_')
+                    {
+                        if (s == send)
+                            return false;
+                        next_char(s, send);
+                    }
+                }
+                if (p == pend)
+                    return true;
+
+                while (true)
+                {
+                    if (like_match(p, pend, s, send, escape))
+                        return true;
+                    if (s == send)
+                        return false;
+                    next_char(s, send);
+                }
+            }
+            else if (c == '_')
+            {
+                if (s == send)
+                    return false;
+                next_char(s, send);
+                continue;
+            }
+
+            if (s == send || fold_char(c) != fold_char(next_char(s, send)))
+                return false;
+        }
+        return s == send;
+    }
+
+    // a pattern made of literals and '%', matched with the substring search
+    struct compiled_like
+    {
+        unsigned escape = no_escape;
+        bool simple = true;
+        bool anchored_start = true;
+        bool anchored_end = true;
+        std::vector<std::string> segments;
+    };
+
+    compiled_like *compile_like(const unsigned char *p, const unsigned char *pend, unsigned escape)
+    {
+        auto compiled = new compiled_like;
+        compiled->escape = escape;
+        compiled->segments.emplace_back();
+
+        bool wildcard_last = false;
+        while (p < pend)
+        {
+            auto start = p;
+            auto c = next_char(p, pend);
+            if (c == escape)
+            {
+                if (p == pend)
+                {
+                    compiled->simple = false;
+                    break;
+                }
+                start = p;
+                next_char(p, pend);
+            }
+            else if (c == '%')
+            {
+                if (compiled->segments.size() == 1 && compiled->segments.back().empty())
+                    compiled->anchored_start = false;
+                if (!compiled->segments.back().empty())
+                    compiled->segments.emplace_back();
+                wildcard_last = true;
+                continue;
+            }
+            else if (c == '_')
+            {
+                compiled->simple = false;
+                break;
+            }
+
+            for (auto q = start; q < p; ++q)
+                compiled->segments.back() += static_cast<char>(fold(*q));
+            wildcard_last = false;
+        }
+
+        if (wildcard_last)
+        {
+            compiled->anchored_end = false;
+            if (compiled->segments.back().empty())
+                compiled->segments.pop_back();
+        }
+        return compiled;
+    }
+
+    bool simple_match(compiled_like const &pattern, const char *text, size_t n)
+    {
+        auto const &segments = pattern.segments;
+        if (segments.empty())
+            return !pattern.anchored_start || n == 0;
+
+        size_t pos = 0;
+        size_t first = 0;
+        size_t last = segments.size();
+
+        if (pattern.anchored_start)
+        {
+            auto const &s = segments.front();
+            if (s.size() > n || !equal(text, s.data(), s.size(), true))
+                return false;
+            pos = s.size();
+            first = 1;
+            // no wildcard at all: the text is the literal
+            if (pattern.anchored_end && segments.size() == 1)
+                return pos == n;
+        }
+
+        if (pattern.anchored_end)
+            last--;
+
+        for (auto i = first; i < last; ++i)
+        {
+            auto const &s = segments[i];
+            auto found = search(text + pos, n - pos, s.data(), s.size(), true);
+            if (!found)
+                return false;
+            pos = static_cast<size_t>(found - text) + s.size();
+        }
+
+        if (pattern.anchored_end)
+        {
+            auto const &s = segments.back();
+            return s.size() <= n - pos && equal(text + n - s.size(), s.data(), s.size(), true);
+        }
+        return true;
+    }
+}
+
+void sqlite_like_func(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    unsigned escape = no_escape;
+    if (argc == 3) {
+        auto esc = sqlite3_value_text(argv[2]);
+        auto esc_bytes = sqlite3_value_bytes(argv[2]);
+        if (!esc)
+            return;
+        auto end = esc + esc_bytes;
+        auto p = esc;
+        if (p == end || (escape = next_char(p, end), p != end)) {
+            sqlite3_result_error(context, "ESCAPE expression must be a single character", -1);
+            return;
+        }
+    }
+
+    auto pattern = sqlite3_value_text(argv[0]);
+    auto pattern_bytes = sqlite3_value_bytes(argv[0]);
+    auto text = sqlite3_value_text(argv[1]);
+    auto text_bytes = sqlite3_value_bytes(argv[1]);
+    if (!pattern || !text)
+        return;
+
+    if (pattern_bytes > sqlite3_limit(sqlite3_context_db_handle(context), SQLITE_LIMIT_LIKE_PATTERN_LENGTH, -1)) {
+        sqlite3_result_error(context, "LIKE or GLOB pattern too complex", -1);
+        return;
+    }
+
+    // the pattern is usually constant, compile it once per statement
+    auto compiled = static_cast<compiled_like *>(sqlite3_get_auxdata(context, 0));
+    std::unique_ptr<compiled_like> owned;
+    if (!compiled || compiled->escape != escape) {
+        owned.reset(compile_like(pattern, pattern + pattern_bytes, escape));
+        compiled = owned.get();
+    }
+
+    bool match;
+    if (compiled->simple)
+        match = simple_match(*compiled, reinterpret_cast<const char *>(text), static_cast<size_t>(text_bytes));
+    else
+        match = like_match(pattern, pattern + pattern_bytes, text, text + text_bytes, escape);
+
+    // SQLite deletes the data right away when the pattern is not constant
+    if (owned)
+        sqlite3_set_auxdata(context, 0, owned.release(), [](void *p) { delete static_cast<compiled_like *>(p); });
+
+    sqlite3_result_int(context, match ? 1 : 0);
+}
+
+void sqlite_contains_func(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto text = sqlite3_value_text(argv[0]);
+    auto text_bytes = sqlite3_value_bytes(argv[0]);
+    auto needle = sqlite3_value_text(argv[1]);
+    auto needle_bytes = sqlite3_value_bytes(argv[1]);
+    if (!text || !needle)
+        return;
+
+    auto found = search(reinterpret_cast<const char *>(text), static_cast<size_t>(text_bytes), reinterpret_cast<const char *>(needle), static_cast<size_t>(needle_bytes), false);
+    sqlite3_result_int(context, found ? 1 : 0);
+}
+
+void sqlite_content_hash_func(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto body = sqlite3_value_text(argv[0]);
+    if (!body)
+        return;
+
+    try {
+        auto canonical = docudb::details::json::canonical_body({reinterpret_cast<const char *>(body), static_cast<size_t>(sqlite3_value_bytes(argv[0]))});
+        auto hash = docudb::details::hash::xxh64(canonical.data(), canonical.size());
+        sqlite3_result_int64(context, static_cast<sqlite3_int64>(hash));
+    } catch (std::invalid_argument const &) {
+        // not a document, no hash
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+void sqlite_json_diff_func(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto from = sqlite3_value_text(argv[0]);
+    auto to = sqlite3_value_text(argv[1]);
+    if (!from || !to)
+        return;
+
+    try {
+        auto patch = docudb::json_patch::to_string(docudb::json_patch::diff(
+            {reinterpret_cast<const char *>(from), static_cast<size_t>(sqlite3_value_bytes(argv[0]))},
+            {reinterpret_cast<const char *>(to), static_cast<size_t>(sqlite3_value_bytes(argv[1]))}));
+        sqlite3_result_text(context, patch.data(), static_cast<int>(patch.size()), SQLITE_TRANSIENT);
+    } catch (std::invalid_argument const &) {
+        // not json, no patch
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+namespace {
+
+// sketches live on the heap, the aggregate context only holds a pointer to them
+template <typename Sketch>
+Sketch* aggregate_sketch(sqlite3_context* context, bool create) {
+    auto slot = static_cast<Sketch**>(sqlite3_aggregate_context(context, create ? sizeof(Sketch*) : 0));
+    if (!slot)
+        return nullptr;
+    if (!*slot && create) {
+        // an exception must not cross SQLite's frames: the callers report nullptr as out of memory
+        try {
+            *slot = new Sketch{};
+        } catch (std::bad_alloc const &) {
+            return nullptr;
+        }
+    }
+    return *slot;
+}
+
+template <typename Sketch>
+void aggregate_final(sqlite3_context* context) {
+    auto slot = static_cast<Sketch**>(sqlite3_aggregate_context(context, 0));
+    std::unique_ptr<Sketch> sketch{slot ? *slot : nullptr};
+    try {
+        // no rows still give an empty sketch, so that rollups can merge it
+        auto data = sketch ? sketch->serialize() : Sketch{}.serialize();
+        sqlite3_result_blob(context, data.data(), static_cast<int>(data.size()), SQLITE_TRANSIENT);
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+std::string_view blob_arg(sqlite3_value* value) {
+    auto data = static_cast<const char *>(sqlite3_value_blob(value));
+    return {data ? data : "", static_cast<size_t>(sqlite3_value_bytes(value))};
+}
+
+// equal SQL values hash equal: integral reals hash as integers, like 1 = 1.0
+std::uint64_t value_hash(sqlite3_value* value) {
+    using docudb::details::hash::xxh64;
+    switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER: {
+        auto v = static_cast<std::int64_t>(sqlite3_value_int64(value));
+        return xxh64(&v, sizeof(v), SQLITE_INTEGER);
+    }
+    case SQLITE_FLOAT: {
+        auto d = sqlite3_value_double(value);
+        if (d == std::trunc(d) && d >= -9.2e18 && d <= 9.2e18) {
+            auto v = static_cast<std::int64_t>(d);
+            return xxh64(&v, sizeof(v), SQLITE_INTEGER);
+        }
+        return xxh64(&d, sizeof(d), SQLITE_FLOAT);
+    }
+    case SQLITE_TEXT:
+        return xxh64(sqlite3_value_text(value), static_cast<size_t>(sqlite3_value_bytes(value)), SQLITE_TEXT);
+    default:
+        return xxh64(sqlite3_value_blob(value), static_cast<size_t>(sqlite3_value_bytes(value)), SQLITE_BLOB);
+    }
+}
+
+}
+
+void sqlite_hll_step(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto sketch = aggregate_sketch<docudb::details::sketch::hyperloglog>(context, true);
+    if (!sketch) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL)
+        sketch->add_hash(value_hash(argv[0]));
+}
+
+void sqlite_hll_final(sqlite3_context* context) {
+    aggregate_final<docudb::details::sketch::hyperloglog>(context);
+}
+
+void sqlite_hll_merge_step(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto sketch = aggregate_sketch<docudb::details::sketch::hyperloglog>(context, true);
+    if (!sketch) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    try {
+        sketch->merge(docudb::details::sketch::hyperloglog::deserialize(blob_arg(argv[0])));
+    } catch (std::invalid_argument const &e) {
+        sqlite3_result_error(context, e.what(), -1);
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+void sqlite_hll_estimate_func(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    try {
+        auto estimate = docudb::details::sketch::hyperloglog::deserialize(blob_arg(argv[0])).estimate();
+        sqlite3_result_int64(context, static_cast<sqlite3_int64>(std::llround(estimate)));
+    } catch (std::invalid_argument const &e) {
+        sqlite3_result_error(context, e.what(), -1);
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+void sqlite_tdigest_step(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto sketch = aggregate_sketch<docudb::details::sketch::tdigest>(context, true);
+    if (!sketch) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    auto type = sqlite3_value_type(argv[0]);
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT)
+        return;
+
+    try {
+        sketch->add(sqlite3_value_double(argv[0]));
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+void sqlite_tdigest_final(sqlite3_context* context) {
+    aggregate_final<docudb::details::sketch::tdigest>(context);
+}
+
+void sqlite_tdigest_merge_step(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    auto sketch = aggregate_sketch<docudb::details::sketch::tdigest>(context, true);
+    if (!sketch) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    try {
+        sketch->merge(docudb::details::sketch::tdigest::deserialize(blob_arg(argv[0])));
+    } catch (std::invalid_argument const &e) {
+        sqlite3_result_error(context, e.what(), -1);
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
+
+void sqlite_tdigest_quantile_func(sqlite3_context* context, [[maybe_unused]] int argc, sqlite3_value** argv) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+        return;
+
+    try {
+        auto value = docudb::details::sketch::tdigest::deserialize(blob_arg(argv[0])).quantile(sqlite3_value_double(argv[1]));
+        if (!std::isnan(value))
+            sqlite3_result_double(context, value);
+    } catch (std::invalid_argument const &e) {
+        sqlite3_result_error(context, e.what(), -1);
+    } catch (std::bad_alloc const &) {
+        sqlite3_result_error_nomem(context);
+    }
+}
@@ -7,4 +7,61 @@
 
     void sqlite_regexp_func(sqlite3_context* context, int argc, sqlite3_value** argv);
 
-#endif //SQLITE_EXT_H
\ No newline at end of file
+    /**
+     * @brief Implements LIKE for SQLite, with a SIMD substring search for patterns made of
+     *        literals and '%'. Registered over the built-in like(pattern, text [, escape]).
+     */
+    void sqlite_like_func(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements contains(text, needle), a case-sensitive substring search.
+     */
+    void sqlite_contains_func(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements content_hash(body), the XXH64 hash of the canonical form of a json
+     *        document (see details::json::canonical_body) as an integer, NULL if the body is not an object.
+     */
+    void sqlite_content_hash_func(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements json_diff(from, to), the JSON Patch transforming a json document into
+     *        another (see json_patch::diff), NULL if either is not valid json.
+     */
+    void sqlite_json_diff_func(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements the hll(value) aggregate, returning a serialized HyperLogLog sketch of the
+     *        non-NULL values (see details::sketch::hyperloglog). Integral reals hash like integers.
+     */
+    void sqlite_hll_step(sqlite3_context* context, int argc, sqlite3_value** argv);
+    void sqlite_hll_final(sqlite3_context* context);
+
+    /**
+     * @brief Implements the hll_merge(sketch) aggregate, the union of serialized HyperLogLog sketches.
+     */
+    void sqlite_hll_merge_step(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements hll_estimate(sketch), the estimated number of distinct values of a sketch.
+     */
+    void sqlite_hll_estimate_func(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements the tdigest(value) aggregate, returning a serialized t-digest of the
+     *        numeric values (see details::sketch::tdigest).
+     */
+    void sqlite_tdigest_step(sqlite3_context* context, int argc, sqlite3_value** argv);
+    void sqlite_tdigest_final(sqlite3_context* context);
+
+    /**
+     * @brief Implements the tdigest_merge(sketch) aggregate, merging serialized t-digests.
+     */
+    void sqlite_tdigest_merge_step(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+    /**
+     * @brief Implements tdigest_quantile(sketch, q), the estimated q-quantile of a t-digest, NULL if it is empty.
+     */
+    void sqlite_tdigest_quantile_func(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+#endif //SQLITE_EXT_H
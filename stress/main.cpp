@@ -0,0 +1,503 @@
+#include <docudb.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std::string_literals;
+
+namespace
+{
+    void usage()
+    {
+        std::cerr << "usage: docudb_stress <database> [--duration S] [--interval S] [--threads N]\n"
+                     "                     [--mix insert=W,update=W,remove=W,get=W,find=W]\n"
+                     "                     [--preload N] [--payload BYTES] [--checkpoints] [--report FILE]\n";
+    }
+
+    enum op : std::size_t
+    {
+        op_insert,
+        op_update,
+        op_remove,
+        op_get,
+        op_find,
+        op_count
+    };
+
+    constexpr std::array<std::string_view, op_count> op_names{"insert", "update", "remove", "get", "find"};
+
+    struct options
+    {
+        std::string database_path;
+        std::chrono::seconds duration{60};
+        std::chrono::seconds interval{1};
+        int threads{4};
+        std::array<unsigned, op_count> mix{20, 30, 5, 35, 10};
+        std::size_t preload{10000};
+        std::size_t payload{256};
+        bool checkpoints{false};
+        std::string report_path;
+    };
+
+    /**
+     * @brief Log-linear latency histogram in nanoseconds: 16 buckets per power of two,
+     *        so percentiles are within about 6% whatever the run length.
+     */
+    struct histogram
+    {
+        static constexpr std::size_t sub_buckets = 16;
+
+        std::array<std::uint64_t, 1024> buckets{};
+        std::uint64_t count{0};
+        std::uint64_t max{0};
+
+        static std::size_t bucket(std::uint64_t v)
+        {
+            if (v < sub_buckets)
+                return v;
+            auto msb = static_cast<std::size_t>(std::bit_width(v)) - 1;
+            return (msb - 3) * sub_buckets + ((v >> (msb - 4)) & (sub_buckets - 1));
+        }
+
+        static std::uint64_t lower_bound(std::size_t b)
+        {
+            if (b < sub_buckets)
+                return b;
+            auto msb = b / sub_buckets + 3;
+            return (sub_buckets + b % sub_buckets) << (msb - 4);
+        }
+
+        void record(std::uint64_t ns)
+        {
+            ++buckets[bucket(ns)];
+            ++count;
+            max = std::max(max, ns);
+        }
+
+        void merge(histogram const &other)
+        {
+            for (std::size_t i = 0; i < buckets.size(); ++i)
+                buckets[i] += other.buckets[i];
+            count += other.count;
+            max = std::max(max, other.max);
+        }
+
+        std::uint64_t percentile(double p) const
+        {
+            if (count == 0)
+                return 0;
+            auto rank = static_cast<std::uint64_t>(p * static_cast<double>(count - 1)) + 1;
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < buckets.size(); ++i)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return std::min(lower_bound(i), max);
+            }
+            return max;
+        }
+    };
+
+    struct op_stats
+    {
+        histogram latency;
+        std::uint64_t errors{0};
+    };
+
+    using interval_stats = std::array<op_stats, op_count>;
+
+    // filled by one worker, swapped out by the reporter at every interval
+    struct worker_stats
+    {
+        std::mutex mutex;
+        interval_stats current;
+    };
+
+    // the ids of the live documents, shared by the workers
+    struct id_pool
+    {
+        std::mutex mutex;
+        std::vector<std::string> ids;
+
+        void add(std::string id)
+        {
+            std::lock_guard lock{mutex};
+            ids.push_back(std::move(id));
+        }
+
+        std::optional<std::string> pick(std::mt19937_64 &rng)
+        {
+            std::lock_guard lock{mutex};
+            if (ids.empty())
+                return std::nullopt;
+            return ids[rng() % ids.size()];
+        }
+
+        std::optional<std::string> take(std::mt19937_64 &rng)
+        {
+            std::lock_guard lock{mutex};
+            if (ids.empty())
+                return std::nullopt;
+            auto i = rng() % ids.size();
+            std::swap(ids[i], ids.back());
+            auto id = std::move(ids.back());
+            ids.pop_back();
+            return id;
+        }
+
+        std::size_t size()
+        {
+            std::lock_guard lock{mutex};
+            return ids.size();
+        }
+    };
+
+    struct stress_item
+    {
+        std::string name;
+        std::int64_t quantity{0};
+        double price{0};
+        std::string payload;
+    };
+
+    volatile std::sig_atomic_t interrupted = 0;
+
+    void on_signal(int)
+    {
+        interrupted = 1;
+    }
+
+    bool parse_mix(std::string_view arg, std::array<unsigned, op_count> &mix)
+    {
+        mix.fill(0);
+        while (!arg.empty())
+        {
+            auto comma = arg.find(',');
+            auto item = arg.substr(0, comma);
+            arg = comma == std::string_view::npos ? std::string_view{} : arg.substr(comma + 1);
+
+            auto eq = item.find('=');
+            if (eq == std::string_view::npos)
+                return false;
+            auto name = item.substr(0, eq);
+            auto it = std::find(op_names.begin(), op_names.end(), name);
+            if (it == op_names.end())
+                return false;
+            mix[static_cast<std::size_t>(it - op_names.begin())] = static_cast<unsigned>(std::stoul(std::string{item.substr(eq + 1)}));
+        }
+        return std::any_of(mix.begin(), mix.end(), [](auto w)
+                           { return w > 0; });
+    }
+
+    std::uint64_t file_size(std::string const &path)
+    {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        return ec ? 0 : size;
+    }
+
+    // resident set size, only available on Linux
+    std::uint64_t resident_memory()
+    {
+        std::ifstream statm{"/proc/self/statm"};
+        std::uint64_t pages = 0;
+        std::uint64_t resident = 0;
+        if (!(statm >> pages >> resident))
+            return 0;
+        return resident * 4096;
+    }
+}
+
+template <>
+struct docudb::mapping<stress_item>
+{
+    static constexpr auto fields = std::make_tuple(
+        DOCUDB_FIELD(stress_item, name),
+        DOCUDB_FIELD(stress_item, quantity),
+        DOCUDB_FIELD(stress_item, price),
+        DOCUDB_FIELD(stress_item, payload));
+};
+
+namespace
+{
+    stress_item make_item(std::mt19937_64 &rng, std::size_t payload)
+    {
+        auto n = static_cast<std::int64_t>(rng() % 1000000);
+        return stress_item{"item " + std::to_string(n), n, static_cast<double>(n) * 0.5, std::string(payload, 'x')};
+    }
+
+    // writes share one serialized connection, as an application would, reads use the worker's own
+    void run_worker(options const &opts, docudb::database &writer, id_pool &pool, worker_stats &stats, std::atomic<bool> const &stop, unsigned seed)
+    {
+        docudb::database reader{opts.database_path, docudb::open_mode::read_write, docudb::threading_mode::multi_thread};
+        auto writes = writer.collection("stress");
+        auto reads = reader.collection("stress");
+
+        std::mt19937_64 rng{seed};
+        std::discrete_distribution<std::size_t> pick_op{opts.mix.begin(), opts.mix.end()};
+
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            auto kind = pick_op(rng);
+            auto start = std::chrono::steady_clock::now();
+            bool failed = false;
+
+            try
+            {
+                switch (kind)
+                {
+                case op_insert:
+                    pool.add(writes.insert(make_item(rng, opts.payload)).id());
+                    break;
+                case op_update:
+                    if (auto id = pool.pick(rng))
+                        writes.doc(*id).set("$.quantity", static_cast<std::int64_t>(rng() % 1000000));
+                    break;
+                case op_remove:
+                    if (auto id = pool.take(rng))
+                        writes.remove(*id);
+                    break;
+                case op_get:
+                    if (auto id = pool.pick(rng))
+                        reads.doc(*id).body();
+                    break;
+                case op_find:
+                    reads.find(docudb::query::gte("$.quantity", static_cast<std::int64_t>(rng() % 1000000)), std::nullopt, 20);
+                    break;
+                }
+            }
+            catch (std::exception const &)
+            {
+                // e.g. a document removed between picking and reading it
+                failed = true;
+            }
+
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard lock{stats.mutex};
+            auto &s = stats.current[kind];
+            s.latency.record(static_cast<std::uint64_t>(ns));
+            if (failed)
+                ++s.errors;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    options opts;
+    opts.database_path = argv[1];
+
+    try
+    {
+        for (int i = 2; i < argc; ++i)
+        {
+            std::string_view arg = argv[i];
+            if (arg == "--checkpoints")
+            {
+                opts.checkpoints = true;
+                continue;
+            }
+            if (i + 1 >= argc)
+            {
+                usage();
+                return 1;
+            }
+            if (arg == "--duration")
+                opts.duration = std::chrono::seconds{std::stol(argv[++i])};
+            else if (arg == "--interval")
+                opts.interval = std::chrono::seconds{std::stol(argv[++i])};
+            else if (arg == "--threads")
+                opts.threads = std::stoi(argv[++i]);
+            else if (arg == "--mix")
+            {
+                if (!parse_mix(argv[++i], opts.mix))
+                {
+                    usage();
+                    return 1;
+                }
+            }
+            else if (arg == "--preload")
+                opts.preload = std::stoul(argv[++i]);
+            else if (arg == "--payload")
+                opts.payload = std::stoul(argv[++i]);
+            else if (arg == "--report")
+                opts.report_path = argv[++i];
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+    catch (std::exception const &)
+    {
+        usage();
+        return 1;
+    }
+
+    if (opts.threads < 1 || opts.interval.count() < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    try
+    {
+        if (!opts.checkpoints)
+        {
+            // readers must not wait for the writer, SQLite keeps checkpointing the WAL itself
+            sqlite3 *db = nullptr;
+            auto ret = sqlite3_open(opts.database_path.c_str(), &db);
+            if (ret == SQLITE_OK)
+                ret = sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+            sqlite3_close(db);
+            if (ret != SQLITE_OK)
+                throw std::runtime_error{"cannot switch " + opts.database_path + " to WAL mode"};
+        }
+
+        docudb::database writer{opts.database_path, docudb::open_mode::read_write_create, docudb::threading_mode::serialized};
+        if (opts.checkpoints)
+            writer.start_checkpoints();
+
+        auto collection = writer.collection("stress");
+        collection.index("quantity", "$.quantity");
+
+        id_pool pool;
+        for (auto &&ref : collection.docs())
+            pool.add(ref.id());
+
+        std::mt19937_64 rng{std::random_device{}()};
+        for (std::size_t batch = 1000; pool.size() < opts.preload;)
+        {
+            std::vector<std::string> bodies;
+            for (std::size_t i = 0; i < batch && pool.size() + bodies.size() < opts.preload; ++i)
+            {
+                auto item = make_item(rng, opts.payload);
+                bodies.push_back(std::format(R"({{"name":"{}","quantity":{},"price":{},"payload":"{}"}})", item.name, item.quantity, item.price, item.payload));
+            }
+            for (auto &id : collection.insert_many(bodies))
+                pool.add(std::move(id));
+        }
+
+        std::ofstream report_file;
+        if (!opts.report_path.empty())
+        {
+            report_file.open(opts.report_path);
+            if (!report_file)
+                throw std::runtime_error{"cannot write " + opts.report_path};
+        }
+        std::ostream &report = opts.report_path.empty() ? std::cout : report_file;
+        report << "elapsed_s,op,ops,ops_per_s,errors,p50_us,p95_us,p99_us,max_us,db_bytes,wal_bytes,rss_bytes,sqlite_heap_bytes,documents\n";
+
+        std::cerr << "docudb_stress: " << opts.threads << " threads for " << opts.duration.count() << "s on "
+                  << opts.database_path << ", " << pool.size() << " documents\n";
+
+        std::atomic<bool> stop{false};
+        std::vector<std::unique_ptr<worker_stats>> stats;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < opts.threads; ++i)
+        {
+            stats.push_back(std::make_unique<worker_stats>());
+            workers.emplace_back(run_worker, std::cref(opts), std::ref(writer), std::ref(pool), std::ref(*stats.back()), std::cref(stop), static_cast<unsigned>(rng()));
+        }
+
+        interval_stats total;
+        auto wal_path = writer.filename_wal();
+        auto begin = std::chrono::steady_clock::now();
+        auto next = begin;
+        auto end = begin + opts.duration;
+
+        while (next < end && !interrupted)
+        {
+            next = std::min(next + opts.interval, end);
+            while (std::chrono::steady_clock::now() < next && !interrupted)
+                std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(next - std::chrono::steady_clock::now(), std::chrono::milliseconds{100}));
+
+            interval_stats interval;
+            for (auto &s : stats)
+            {
+                interval_stats taken;
+                {
+                    std::lock_guard lock{s->mutex};
+                    std::swap(taken, s->current);
+                }
+                for (std::size_t k = 0; k < op_count; ++k)
+                {
+                    interval[k].latency.merge(taken[k].latency);
+                    interval[k].errors += taken[k].errors;
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto elapsed = std::chrono::duration<double>(now - begin).count();
+            auto seconds = std::chrono::duration<double>(opts.interval).count();
+            auto db_bytes = file_size(opts.database_path);
+            auto wal_bytes = file_size(wal_path);
+            auto rss = resident_memory();
+            auto heap = static_cast<std::uint64_t>(sqlite3_memory_used());
+            auto documents = pool.size();
+
+            std::uint64_t ops = 0;
+            for (std::size_t k = 0; k < op_count; ++k)
+            {
+                auto const &s = interval[k];
+                total[k].latency.merge(s.latency);
+                total[k].errors += s.errors;
+                ops += s.latency.count;
+                if (opts.mix[k] == 0)
+                    continue;
+
+                report << std::format("{:.1f},{},{},{:.0f},{},{:.1f},{:.1f},{:.1f},{:.1f},{},{},{},{},{}\n",
+                                      elapsed, op_names[k], s.latency.count, static_cast<double>(s.latency.count) / seconds, s.errors,
+                                      s.latency.percentile(0.50) / 1000.0, s.latency.percentile(0.95) / 1000.0,
+                                      s.latency.percentile(0.99) / 1000.0, s.latency.max / 1000.0,
+                                      db_bytes, wal_bytes, rss, heap, documents);
+            }
+            report.flush();
+
+            std::cerr << std::format("[{:7.1f}s] {:8.0f} ops/s  db {} MiB  wal {} MiB  rss {} MiB  {} documents\n",
+                                     elapsed, static_cast<double>(ops) / seconds, db_bytes >> 20, wal_bytes >> 20, rss >> 20, documents);
+        }
+
+        stop = true;
+        for (auto &w : workers)
+            w.join();
+
+        for (std::size_t k = 0; k < op_count; ++k)
+        {
+            auto const &s = total[k].latency;
+            if (opts.mix[k] == 0)
+                continue;
+            std::cerr << std::format("docudb_stress: {:6} {:10} ops {:6} errors  p50 {:.1f}us  p99 {:.1f}us  max {:.1f}us\n",
+                                     op_names[k], s.count, total[k].errors, s.percentile(0.50) / 1000.0, s.percentile(0.99) / 1000.0, s.max / 1000.0);
+        }
+    }
+    catch (std::exception const &e)
+    {
+        std::cerr << "docudb_stress: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}